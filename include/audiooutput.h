@@ -1,12 +1,21 @@
 #pragma once
 
+#include <atomic>
+#include <memory>
+#include <stop_token>
+#include <thread>
+
 #include <SDL2/SDL.h>
 #include <ffmpeg/avcodec>
 #include <ffmpeg/avformat>
 #include <ffmpeg/swresample>
 
+#include "audiotempo.h"
 #include "avframequeue.h"
 #include "avsync.h"
+#include "bytering.h"
+#include "memorybudget.h"
+#include "metrics.h"
 
 struct AudioParams
 {
@@ -25,11 +34,17 @@ struct AudioParams
   }
 };
 
+// 音频输出分为两个线程：
+// - 渲染线程从帧队列取帧、重采样，把交错的PCM写入无锁字节环形缓冲
+// - SDL音频回调只从环形缓冲memcpy，数据不足时补静音，并更新时钟
+// 倍速播放时渲染线程先用atempo变速不变调，超过MAX_TEMPO时静音（丢弃音频帧）
 class AudioOutput
 {
  private:
   /* data */
  public:
+  static constexpr double MAX_TEMPO = 2.0;
+
   AudioOutput(std::shared_ptr<AVFrameQueue> queue,
               std::shared_ptr<AVSync> avsync);
   ~AudioOutput();
@@ -37,17 +52,63 @@ class AudioOutput
   int init(const AVCodecParameters& params, AVRational time_base);
   void deinit();
 
+  // 任意线程调用，由渲染线程在下一帧生效：环形缓冲中按旧速率播放的数据被丢弃，
+  // 从新速率的数据重新开始计时，时钟不会因为速率切换而跳变
+  void set_rate(double rate);
+
+  // 视频输出线程调用：暂停/恢复声音设备。暂停期间音频时钟停在当前位置，
+  // 渲染线程写满环形缓冲后停止取帧，播放管线停在满队列上
+  void set_paused(bool paused);
+
+  // 任意线程调用：解码已经结束、帧队列已经取空，并且环形缓冲中的PCM都已交给设备
+  bool drained() const;
+
+ private:
+  void run(std::stop_token token);
+  // 重采样后写入环形缓冲，并以这一帧的pts更新字节流的pts基准
+  bool render(std::stop_token token, const AVFrame& frame);
+  // 速率变化：重建变速滤镜并丢弃环形缓冲中的旧数据
+  void apply_rate(double rate);
+  // 把frame转换为输出格式，返回字节数，data指向转换后的PCM
+  int resample(const AVFrame& frame, const uint8_t** data);
+  void write_pcm(std::stop_token token, const uint8_t* data, size_t size);
+  // 帧队列已经flush到新的代数（seek）：丢弃环形缓冲中的旧PCM
+  void flush();
+
  public:
   std::shared_ptr<AVFrameQueue> m_queue;
   std::shared_ptr<AVSync> m_avsync;
   AVRational m_time_base;
   AudioParams m_params;
+  int m_bytes_per_sec{};
+  int64_t m_latency_bytes{};
+  Histogram* m_callback_time{};
+  Counter* m_underruns{};
+  MemoryBudget::Account* m_memory{};  // 重采样缓冲和PCM环形缓冲
 
  public:
+  std::unique_ptr<ByteRing> m_pcm_ring;
+  // 字节流位置0对应的pts（纳秒），位置p的pts为base + p * rate / m_bytes_per_sec
+  std::atomic<int64_t> m_pts_base_ns{};
+  std::atomic<double> m_pts_rate{1.0};
+  std::atomic<bool> m_pts_valid{};
+  // 第一次有声音数据送入设备后可被听到的时刻（steady_clock纳秒），0表示尚未开始。
+  // 回调中只写这个原子变量，由渲染线程记录到启动时间线
+  std::atomic<int64_t> m_first_audible_ns{};
+
+ private:
+  std::jthread m_thread;
   SwrContext* m_swr_ctx{};
-  uint8_t* m_audio_buf{};
-  uint32_t m_audio_buf_size{};
-  uint32_t m_audio_buf_index{};
+  // m_swr_ctx的输入格式
+  int m_swr_src_format{AV_SAMPLE_FMT_NONE};
+  int m_swr_src_rate{};
+  AVChannelLayout m_swr_src_layout{};
   uint8_t* m_audio_buf1{};
   uint32_t m_audio_buf1_size{};
+  uint64_t m_generation{0};
+  bool m_first_audible_marked{false};
+  std::atomic<double> m_rate{1.0};
+  double m_applied_rate{1.0};  // 渲染线程当前使用的速率
+  bool m_paused{false};
+  AudioTempo m_tempo;
 };
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+
+#include <ffmpeg/avfilter>
+#include <ffmpeg/avutil>
+
+// 音频变速不变调：abuffer -> atempo -> abuffersink。
+// 单个atempo的系数范围是[0.5, 100]，低于0.5倍速时串联多个。
+// atempo输出的第k个样本对应输入起点之后k * tempo个样本，
+// 输出帧的pts按此换算回输入的时间基，时钟仍然是媒体时间
+class AudioTempo
+{
+ public:
+  AudioTempo();
+  ~AudioTempo();
+
+  AudioTempo(const AudioTempo &) = delete;
+  AudioTempo &operator=(const AudioTempo &) = delete;
+
+  // frame是第一帧输入，用于确定采样格式/采样率/声道布局；time_base是输入pts的时间基
+  int init(const AVFrame &frame, AVRational time_base, double tempo);
+  // 释放滤镜图，滤镜中缓存的样本一并丢弃
+  void reset();
+  // 已经按tempo和frame的格式建立了滤镜图
+  bool configured(const AVFrame &frame, double tempo) const;
+
+  int send(const AVFrame &frame);
+  // 取出一帧变速后的数据，需要更多输入或出错时返回nullptr；
+  // 返回的帧在下一次调用之前有效
+  const AVFrame *receive();
+
+ private:
+  AVFilterGraph *m_graph{};
+  AVFilterContext *m_src{};
+  AVFilterContext *m_sink{};
+  AVFrame *m_frame{};
+  AVRational m_time_base{};
+  double m_tempo{1.0};
+  int m_format{-1};
+  int m_sample_rate{};
+  AVChannelLayout m_ch_layout{};
+
+  int64_t m_anchor_pts{AV_NOPTS_VALUE};  // 滤镜图建立后第一帧输入的pts
+  int64_t m_out_samples{};               // 此后输出的样本数
+};
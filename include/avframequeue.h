@@ -1,9 +1,51 @@
 #pragma once
 
-#include <memory>
-
 #include <ffmpeg/avformat>
 
-#include "lockedqueue.h"
+#include "avpool.h"
+#include "spscqueue.h"
+
+template <>
+struct SpscQueueTraits<AVFramePtr>
+{
+  static size_t bytes(const AVFramePtr &frame)
+  {
+    if (!frame)
+    {
+      return 0;
+    }
+
+    size_t size = 0;
+    for (const auto buf : frame->buf)
+    {
+      if (buf)
+      {
+        size += buf->size;
+      }
+    }
+    for (int i = 0; i < frame->nb_extended_buf; i++)
+    {
+      size += frame->extended_buf[i]->size;
+    }
+    return size;
+  }
+
+  static std::optional<int64_t> timestamp(const AVFramePtr &frame)
+  {
+    if (!frame)
+    {
+      return std::nullopt;
+    }
+    if (frame->best_effort_timestamp != AV_NOPTS_VALUE)
+    {
+      return frame->best_effort_timestamp;
+    }
+    if (frame->pts != AV_NOPTS_VALUE)
+    {
+      return frame->pts;
+    }
+    return std::nullopt;
+  }
+};
 
-using AVFrameQueue = LockedQueue<std::shared_ptr<AVFrame>>;
+using AVFrameQueue = SpscQueue<AVFramePtr>;
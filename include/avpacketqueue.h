@@ -1,9 +1,35 @@
 #pragma once
 
-#include <memory>
-
 #include <ffmpeg/avformat>
 
-#include "lockedqueue.h"
+#include "avpool.h"
+#include "spscqueue.h"
+
+template <>
+struct SpscQueueTraits<AVPacketPtr>
+{
+  static size_t bytes(const AVPacketPtr &pkt)
+  {
+    return pkt ? pkt->size : 0;
+  }
+
+  // 包按解码顺序入队，dts单调递增，比pts更适合计算缓存时长
+  static std::optional<int64_t> timestamp(const AVPacketPtr &pkt)
+  {
+    if (!pkt)
+    {
+      return std::nullopt;
+    }
+    if (pkt->dts != AV_NOPTS_VALUE)
+    {
+      return pkt->dts;
+    }
+    if (pkt->pts != AV_NOPTS_VALUE)
+    {
+      return pkt->pts;
+    }
+    return std::nullopt;
+  }
+};
 
-using AVPacketQueue = LockedQueue<std::shared_ptr<AVPacket>>;
+using AVPacketQueue = SpscQueue<AVPacketPtr>;
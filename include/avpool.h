@@ -0,0 +1,129 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <ffmpeg/avcodec>
+
+template <typename T>
+struct AVPoolTraits;
+
+template <>
+struct AVPoolTraits<AVPacket>
+{
+  static AVPacket *alloc() { return av_packet_alloc(); }
+  static void free(AVPacket *pkt) { av_packet_free(&pkt); }
+  static void unref(AVPacket *pkt) { av_packet_unref(pkt); }
+};
+
+template <>
+struct AVPoolTraits<AVFrame>
+{
+  static AVFrame *alloc() { return av_frame_alloc(); }
+  static void free(AVFrame *frame) { av_frame_free(&frame); }
+  static void unref(AVFrame *frame) { av_frame_unref(frame); }
+};
+
+// AVPacket/AVFrame外壳的回收池，必须由std::shared_ptr持有。
+// acquire()返回只能移动的句柄，句柄析构时unref并放回空闲链表，
+// 稳态下不再调用av_packet_alloc/av_frame_alloc。
+// 句柄持有池的引用，池的生命周期覆盖所有在外的句柄。
+template <typename T>
+class AVPool : public std::enable_shared_from_this<AVPool<T>>
+{
+  using lock_type = std::mutex;
+  using lock_guard = std::lock_guard<lock_type>;
+
+ public:
+  struct Releaser
+  {
+    std::shared_ptr<AVPool> pool;
+    void operator()(T *obj) const { pool->release(obj); }
+  };
+  using Handle = std::unique_ptr<T, Releaser>;
+
+  struct Stats
+  {
+    uint64_t allocations{};   // 实际分配外壳的次数
+    uint64_t acquisitions{};  // acquire()的次数
+    uint64_t releases{};      // 放回池的次数
+    size_t free{};            // 当前空闲的外壳数
+  };
+
+  explicit AVPool(size_t reserve = 0) { m_free.reserve(reserve); }
+
+  ~AVPool()
+  {
+    for (auto obj : m_free)
+    {
+      AVPoolTraits<T>::free(obj);
+    }
+  }
+
+  AVPool(const AVPool &) = delete;
+  AVPool &operator=(const AVPool &) = delete;
+
+  Handle acquire()
+  {
+    T *obj{};
+    {
+      lock_guard locker(m_lock);
+      if (!m_free.empty())
+      {
+        obj = m_free.back();
+        m_free.pop_back();
+      }
+    }
+
+    if (!obj)
+    {
+      obj = AVPoolTraits<T>::alloc();
+      if (!obj)
+      {
+        return Handle(nullptr, Releaser{});
+      }
+      m_allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    m_acquisitions.fetch_add(1, std::memory_order_relaxed);
+    return Handle(obj, Releaser{this->shared_from_this()});
+  }
+
+  Stats stats() const
+  {
+    Stats s;
+    s.allocations = m_allocations.load(std::memory_order_relaxed);
+    s.acquisitions = m_acquisitions.load(std::memory_order_relaxed);
+    s.releases = m_releases.load(std::memory_order_relaxed);
+    {
+      lock_guard locker(m_lock);
+      s.free = m_free.size();
+    }
+    return s;
+  }
+
+ private:
+  void release(T *obj)
+  {
+    AVPoolTraits<T>::unref(obj);
+    m_releases.fetch_add(1, std::memory_order_relaxed);
+
+    lock_guard locker(m_lock);
+    m_free.push_back(obj);
+  }
+
+ private:
+  mutable lock_type m_lock;
+  std::vector<T *> m_free;
+  std::atomic<uint64_t> m_allocations{0};
+  std::atomic<uint64_t> m_acquisitions{0};
+  std::atomic<uint64_t> m_releases{0};
+};
+
+using AVPacketPool = AVPool<AVPacket>;
+using AVFramePool = AVPool<AVFrame>;
+using AVPacketPtr = AVPacketPool::Handle;
+using AVFramePtr = AVFramePool::Handle;
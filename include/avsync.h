@@ -1,56 +1,187 @@
 #pragma once
 
+#include <atomic>
 #include <chrono>
 #include <cmath>
+#include <cstdint>
+#include <initializer_list>
+#include <limits>
+#include <optional>
 
-// class AVSync
-// {
-//  public:
-//   void init_clock() { set_clock(NAN); }
-
-//   std::chrono::microseconds get_us()
-//   {
-//     auto ms = std::chrono::steady_clock::now().time_since_epoch();
-//     return std::chrono::duration_cast<std::chrono::microseconds>(now);
-//   }
-
-//   double get_clock()
-//   {
-//     double time = get_us() / 1000000.0;
-//     return m_pts_drift + time;
-//   }
-
-//   void set_clock_at(double pts, double time)
-//   {
-//     m_pts = pts;
-//     m_pts_drift = pts - time;
-//   }
-
-//   void set_clock(double pts)
-//   {
-//     double time = get_us().count() / 1000000.0;
-//     set_clock_at(pts, time);
-//   }
-
-//  private:
-//   double m_pts{};
-//   double m_pts_drift{};
-// };
+#include <ffmpeg/avutil>
 
-class AVSync
+// 单个时钟：记录pts在某一时刻被播放，读取时按播放速率外推到当前时间。
+// pts和时刻用序号锁（seqlock）发布：每个时钟只有一个线程写（如音频回调），
+// 写方不等待、不加锁，读方遇到写入中途时重试。
+// 每次设置同时记录数据所属的代数（seek次数），与pts在同一次发布中写入，
+// 读取方可以只接受同一代的时钟。
+class Clock
 {
  public:
   using clock = std::chrono::steady_clock;
-  using duration = clock::duration;
+  using duration = std::chrono::nanoseconds;
   using time_point = clock::time_point;
+
+  void set(duration pts, uint64_t generation = 0)
+  {
+    set_at(pts, clock::now(), generation);
+  }
+
+  // pts在时刻t被播放
+  void set_at(duration pts, time_point t, uint64_t generation = 0)
+  {
+    publish(pts.count(), t.time_since_epoch().count(), generation);
+  }
+
+  std::optional<duration> get() const { return load(std::nullopt); }
+
+  // 时钟属于其它代（seek之前/之后）时返回std::nullopt
+  std::optional<duration> get(uint64_t generation) const
+  {
+    return load(generation);
+  }
+
+  uint64_t generation() const
+  {
+    return m_generation.load(std::memory_order_acquire);
+  }
+
+  // 外推时每秒前进的媒体时间。只改变此后的外推，不重新定基：
+  // 写方会很快重新设置的时钟（音频回调）直接调用；其它时钟由写方先按当前值重新设置
+  void set_rate(double rate) { m_rate.store(rate, std::memory_order_relaxed); }
+
+  bool valid() const
+  {
+    return m_pts.load(std::memory_order_relaxed) != INVALID;
+  }
+
+  void reset()
+  {
+    publish(INVALID, 0, m_generation.load(std::memory_order_relaxed));
+  }
+
+ private:
+  void publish(int64_t pts, int64_t time, uint64_t generation)
+  {
+    const auto seq = m_seq.load(std::memory_order_relaxed);
+    m_seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    m_pts.store(pts, std::memory_order_relaxed);
+    m_time.store(time, std::memory_order_relaxed);
+    m_generation.store(generation, std::memory_order_relaxed);
+    m_seq.store(seq + 2, std::memory_order_release);
+  }
+
+  // 在同一次读取中取得pts、时刻和代数，generation为空时不检查代数
+  std::optional<duration> load(std::optional<uint64_t> generation) const
+  {
+    int64_t pts{};
+    int64_t time{};
+    uint64_t gen{};
+    uint64_t seq{};
+    do
+    {
+      seq = m_seq.load(std::memory_order_acquire);
+      pts = m_pts.load(std::memory_order_relaxed);
+      time = m_time.load(std::memory_order_relaxed);
+      gen = m_generation.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((seq & 1) || seq != m_seq.load(std::memory_order_relaxed));
+
+    if (pts == INVALID || (generation && gen != *generation))
+    {
+      return std::nullopt;
+    }
+    const auto elapsed = clock::now().time_since_epoch().count() - time;
+    const auto rate = m_rate.load(std::memory_order_relaxed);
+    return duration(
+        pts + (rate == 1.0 ? elapsed : std::llround(rate * elapsed)));
+  }
+
+ private:
+  static constexpr int64_t INVALID = std::numeric_limits<int64_t>::min();
+  std::atomic<uint64_t> m_seq{0};  // 奇数表示写入中
+  std::atomic<int64_t> m_pts{INVALID};
+  std::atomic<int64_t> m_time{0};  // steady_clock纳秒
+  std::atomic<double> m_rate{1.0};
+  std::atomic<uint64_t> m_generation{0};
+};
+
+// 音视频同步：维护音频、视频、外部三个时钟，由主时钟决定播放进度
+class AVSync
+{
+ public:
+  using clock = Clock::clock;
+  using duration = Clock::duration;
+  using time_point = Clock::time_point;
   using period = duration::period;
 
-  duration get_clock() const { return clock::now() - m_base_time; }
+  enum class Master
+  {
+    Audio,     // 以声卡实际播放的位置为准，视频追赶音频
+    Video,     // 以最后显示的视频帧为准
+    External,  // 以单调时钟为准，从第一帧的pts开始走
+  };
+
+  explicit AVSync(Master master = Master::Audio)
+      : m_master(master)
+  {
+  }
+
+  Master master() const { return m_master.load(std::memory_order_relaxed); }
+  void set_master(Master master)
+  {
+    m_master.store(master, std::memory_order_relaxed);
+  }
+
+  double rate() const { return m_rate.load(std::memory_order_relaxed); }
+  // 播放速率，1为正常速度，三个时钟都按速率外推。
+  // 视频/外部时钟在这里按当前值重新定基，需要在写这两个时钟的线程（视频输出）调用；
+  // 音频时钟由下一次音频回调重新设置
+  void set_rate(double rate)
+  {
+    for (auto *clock : {&m_video_clock, &m_external_clock})
+    {
+      const auto now = clock->get();
+      clock->set_rate(rate);
+      if (now)
+      {
+        clock->set(*now, clock->generation());
+      }
+    }
+    m_audio_clock.set_rate(rate);
+    m_rate.store(rate, std::memory_order_relaxed);
+  }
+
+  Clock &audio_clock() { return m_audio_clock; }
+  Clock &video_clock() { return m_video_clock; }
+  Clock &external_clock() { return m_external_clock; }
+
+  Clock &master_clock()
+  {
+    switch (master())
+    {
+    case Master::Video:
+      return m_video_clock;
+    case Master::External:
+      return m_external_clock;
+    case Master::Audio:
+    default:
+      return m_audio_clock;
+    }
+  }
+
+  // 主时钟当前的pts，主时钟尚未开始时返回std::nullopt
+  std::optional<duration> get_clock() { return master_clock().get(); }
+  std::optional<duration> get_clock(uint64_t generation)
+  {
+    return master_clock().get(generation);
+  }
 
-  void set_clock(duration d)
+  // pts（time_base为单位）转换为纳秒，用av_rescale_q避免截断和溢出
+  static duration to_duration(int64_t pts, AVRational time_base)
   {
-    m_base_time = clock::now() - d;
-    m_duration = d;
+    return duration(av_rescale_q(pts, time_base, AVRational{1, 1000000000}));
   }
 
   static duration to_duration(double s)
@@ -64,6 +195,9 @@ class AVSync
   }
 
  private:
-  time_point m_base_time;
-  duration m_duration;
+  std::atomic<Master> m_master;
+  std::atomic<double> m_rate{1.0};
+  Clock m_audio_clock;
+  Clock m_video_clock;
+  Clock m_external_clock;
 };
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "stagestats.h"
+
+// 无界面模式的吞吐报告，速率均按整个运行的墙上时间计算
+struct BenchmarkReport
+{
+  struct Stage
+  {
+    std::string name;
+    uint64_t packets{};
+    uint64_t frames{};
+    uint64_t bytes{};
+    std::chrono::nanoseconds cpu{};  // 阶段线程的CPU时间，见StageStats::cpu_ns
+  };
+
+  struct Queue
+  {
+    std::string name;
+    size_t peak{};
+    size_t capacity{};
+  };
+
+  void add_stage(std::string name, const StageStats &stats);
+
+  template <typename Q>
+  void add_queue(std::string name, const Q &queue)
+  {
+    queues.push_back({std::move(name), queue.peak_size(), queue.capacity()});
+  }
+
+  // 人类可读的多行文本
+  void log() const;
+  // 单行JSON
+  std::string to_json() const;
+
+  std::chrono::nanoseconds elapsed{};
+  // 运行期间整个进程的CPU时间，包括解码器内部的工作线程
+  std::chrono::nanoseconds process_cpu{};
+  uint64_t end_to_end_frames{};
+  // 处理的媒体时长，非0时另外报告速度倍数（媒体时长/墙上时间）
+  std::chrono::nanoseconds media_duration{};
+  std::vector<Stage> stages;
+  std::vector<Queue> queues;
+};
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+// 单生产者/单消费者字节环形缓冲
+// read()不加锁、不分配内存、不阻塞，可以在SDL音频回调这类实时线程中调用；
+// 生产者空间不足时通过std::atomic::wait休眠，消费者每次读取后notify。
+// 生产者可以flush()作废已写入的数据，消费者在下一次read()时跳过。
+class ByteRing
+{
+  static constexpr size_t CACHE_LINE = 64;
+
+ public:
+  explicit ByteRing(size_t capacity)
+      : m_capacity(std::bit_ceil(std::max<size_t>(capacity, 2)))
+      , m_mask(m_capacity - 1)
+      , m_buf(std::make_unique<uint8_t[]>(m_capacity))
+  {
+  }
+
+  ByteRing(const ByteRing &) = delete;
+  ByteRing &operator=(const ByteRing &) = delete;
+
+  // 生产者调用，返回实际写入的字节数
+  size_t write(const uint8_t *data, size_t len)
+  {
+    const auto tail = m_tail.load(std::memory_order_relaxed);
+    const auto head = m_head.load(std::memory_order_acquire);
+    const auto n = std::min(len, m_capacity - (tail - head));
+
+    const auto offset = tail & m_mask;
+    const auto first = std::min(n, m_capacity - offset);
+    memcpy(m_buf.get() + offset, data, first);
+    memcpy(m_buf.get(), data + first, n - first);
+
+    m_tail.store(tail + n, std::memory_order_release);
+    return n;
+  }
+
+  // 生产者调用，作废此前写入的全部数据，之后写入的数据属于generation。
+  // generation可以与当前相同（只丢弃数据，不开始新的一代）
+  void flush(uint64_t generation)
+  {
+    m_flush_tail.store(m_tail.load(std::memory_order_relaxed),
+                       std::memory_order_relaxed);
+    m_flush_generation.store(generation, std::memory_order_relaxed);
+    m_flushes.fetch_add(1, std::memory_order_release);
+  }
+
+  // 消费者调用，返回实际读出的字节数
+  size_t read(uint8_t *data, size_t len)
+  {
+    auto head = m_head.load(std::memory_order_relaxed);
+    auto tail = m_tail.load(std::memory_order_acquire);
+    if (const auto flushes = m_flushes.load(std::memory_order_acquire);
+        flushes != m_flushes_seen)
+    {  // 先读tail再读flush次数，新数据一定在flush之后
+      m_flushes_seen = flushes;
+      m_generation = m_flush_generation.load(std::memory_order_relaxed);
+      const auto flush_tail = m_flush_tail.load(std::memory_order_relaxed);
+      if (flush_tail > head)
+      {
+        head = flush_tail;
+        tail = std::max(tail, m_tail.load(std::memory_order_acquire));
+        m_head.store(head, std::memory_order_release);
+        m_epoch.fetch_add(1, std::memory_order_release);
+        m_epoch.notify_one();
+      }
+    }
+    const auto n = std::min(len, tail - head);
+
+    const auto offset = head & m_mask;
+    const auto first = std::min(n, m_capacity - offset);
+    memcpy(data, m_buf.get() + offset, first);
+    memcpy(data + first, m_buf.get(), n - first);
+
+    if (n > 0)
+    {
+      m_head.store(head + n, std::memory_order_release);
+      m_epoch.fetch_add(1, std::memory_order_release);
+      m_epoch.notify_one();
+    }
+    return n;
+  }
+
+  // 生产者调用，等待可写空间不少于len（len会被截断到容量），或者被interrupt()唤醒
+  void wait_for_space(size_t len)
+  {
+    len = std::min(len, m_capacity);
+    const auto epoch = m_epoch.load(std::memory_order_acquire);
+    if (free_space() >= len)
+    {
+      return;
+    }
+    m_epoch.wait(epoch, std::memory_order_acquire);
+  }
+
+  // 唤醒在wait_for_space()中休眠的生产者，用于停止
+  void interrupt()
+  {
+    m_epoch.fetch_add(1, std::memory_order_release);
+    m_epoch.notify_all();
+  }
+
+  size_t size() const
+  {
+    return m_tail.load(std::memory_order_acquire) -
+           m_head.load(std::memory_order_acquire);
+  }
+
+  size_t free_space() const { return m_capacity - size(); }
+  size_t capacity() const { return m_capacity; }
+
+  // 累计读出的字节数，即消费者在整个字节流中的位置
+  uint64_t read_position() const
+  {
+    return m_head.load(std::memory_order_acquire);
+  }
+
+  // 累计写入的字节数
+  uint64_t write_position() const
+  {
+    return m_tail.load(std::memory_order_acquire);
+  }
+
+  // 消费者调用，最近一次read()读出的数据所属的代数
+  uint64_t generation() const { return m_generation; }
+
+ private:
+  const size_t m_capacity;
+  const size_t m_mask;
+  std::unique_ptr<uint8_t[]> m_buf;
+
+  alignas(CACHE_LINE) std::atomic<uint64_t> m_head{0};
+  std::atomic<uint32_t> m_epoch{0};
+  uint64_t m_generation{0};
+  uint64_t m_flushes_seen{0};
+
+  alignas(CACHE_LINE) std::atomic<uint64_t> m_tail{0};
+  std::atomic<uint64_t> m_flush_tail{0};
+  std::atomic<uint64_t> m_flush_generation{0};
+  std::atomic<uint64_t> m_flushes{0};
+};
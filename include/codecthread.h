@@ -1,12 +1,43 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <thread>
 
 #include <ffmpeg/avcodec>
 
 #include "avframequeue.h"
 #include "avpacketqueue.h"
+#include "avpool.h"
+#include "executor.h"
+#include "metrics.h"
+#include "stagestats.h"
+
+struct DecodeThreading
+{
+  enum class Type
+  {
+    Auto,   // 帧级+片级，由解码器选择
+    Frame,  // 帧级多线程，吞吐高但每个线程增加一帧延迟
+    Slice,  // 片级多线程，无额外延迟，依赖码流的slice划分
+  };
+
+  int count{};  // 0表示自动，按CPU核数
+  Type type{Type::Auto};
+};
+
+// 以画质换取解码速度的选项，对应AVCodecContext::skip_*，DEFAULT表示不跳过
+struct DecodeSkip
+{
+  AVDiscard loop_filter{AVDISCARD_DEFAULT};  // 跳过环路滤波（去块效应）
+  AVDiscard idct{AVDISCARD_DEFAULT};         // 跳过反变换
+  AVDiscard frame{AVDISCARD_DEFAULT};        // 跳过整帧
+};
 
 class CodecThread
 {
@@ -17,19 +48,75 @@ class CodecThread
               std::shared_ptr<AVFrameQueue> frame_queue);
   ~CodecThread();
 
-  int init(const AVCodecParameters *params);
+  int init(const AVCodecParameters *params,
+           const DecodeThreading &threading = {});
 
   void start();
+  // 不创建线程，作为任务跑在共享的执行器上；deadline见Executor::submit()
+  void start(Executor &executor,
+             std::function<Executor::clock::time_point()> deadline);
   void stop();
 
   void deinit();
 
+  // 任意线程调用，设置解码器跳过的帧（AVCodecContext::skip_frame），
+  // 从下一个送入的包开始生效。倍速播放时跳过非参考帧或者只解关键帧
+  void set_skip_frame(AVDiscard discard);
+  // 任意线程调用，CPU不足时降低解码质量，下一个包生效。
+  // skip.frame与set_skip_frame()取两者中丢弃更多的一个
+  void set_degradation(const DecodeSkip &skip);
+
+  // 任意线程调用（切换音视频流时）：包队列flush到generation时按params重新打开解码器，
+  // 之后的包都来自新的流。params在解复用器关闭之前一直有效
+  void set_codec_params(const AVCodecParameters *params, uint64_t generation);
+
+  const StageStats &stats() const;
+  // stop()之后调用：解码中遇到的第一个错误，没有错误时为0
+  int error() const { return m_error; }
+
  private:
   void run(std::stop_token token);
+  // 解码的一步：送出积压的帧、从解码器取一帧或者送入一个包，队列空/满时至多等待wait
+  Executor::Status step(std::chrono::milliseconds wait);
+  Executor::Status receive_frame(std::chrono::milliseconds wait);
+  // 包队列已经flush到新的代数：冲刷解码器，并把帧队列flush到同一代
+  void flush();
+  void finish();
+  // 记录第一个错误，结束这一阶段
+  Executor::Status fail(int error);
+  int reopen(const AVCodecParameters *params);
 
  private:
   AVCodecContext *m_codec_ctx{};
+  DecodeThreading m_threading;
   std::jthread m_thread;
+  Executor *m_executor{};
+  Executor::JobPtr m_job;
   std::shared_ptr<AVPacketQueue> m_packet_queue;
   std::shared_ptr<AVFrameQueue> m_frame_queue;
+  std::shared_ptr<AVFramePool> m_frame_pool;
+  StageStats m_stats;
+  int m_error{0};
+  Histogram *m_decode_time{};
+
+  uint64_t m_generation{0};
+  std::optional<int64_t> m_resume_ts;  // seek目标，早于它的帧直接丢弃
+  bool m_drained{false};
+  bool m_receiving{false};  // 已送入包，解码器中可能还有帧
+  AVFramePtr m_frame;       // 接收用的帧，EAGAIN时保留复用
+  AVFramePtr m_pending;     // 已解出但帧队列满、尚未送出的帧
+  AVRational m_time_base{};  // 最近送入的包的time_base，标在解出的帧上
+  std::chrono::nanoseconds m_decode_elapsed{};
+  std::atomic<int> m_skip_frame{AVDISCARD_DEFAULT};
+  std::atomic<int> m_degrade_loop_filter{AVDISCARD_DEFAULT};
+  std::atomic<int> m_degrade_idct{AVDISCARD_DEFAULT};
+  std::atomic<int> m_degrade_frame{AVDISCARD_DEFAULT};
+
+  // set_codec_params()的请求
+  std::mutex m_params_lock;
+  const AVCodecParameters *m_next_params{};
+  uint64_t m_next_params_generation{};
+  std::atomic<bool> m_params_changed{false};
+  // 切换到的流打不开解码器：保留旧的解码器，丢弃新的流的包，直到再次切换成功
+  bool m_unsupported{false};
 };
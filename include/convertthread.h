@@ -0,0 +1,78 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+
+#include <ffmpeg/avutil>
+#include <ffmpeg/swrescale>
+
+#include "avframequeue.h"
+#include "avpool.h"
+#include "executor.h"
+#include "metrics.h"
+#include "stagestats.h"
+
+// 解码与渲染之间的像素格式转换/缩放阶段。
+// 使用swscale内置的片级多线程，把任意输入格式转换为渲染需要的格式和尺寸，
+// 目标缓冲区来自AVBufferPool，按64字节对齐并循环复用。
+// 输入已经是目标格式和尺寸时直接转发，不做拷贝。
+class ConvertThread
+{
+ public:
+  ConvertThread(std::shared_ptr<AVFrameQueue> in_queue,
+                std::shared_ptr<AVFrameQueue> out_queue);
+  ~ConvertThread();
+
+  // threads: swscale的线程数，0表示按CPU核数
+  int init(int width, int height, AVPixelFormat format, int threads);
+
+  void start();
+  // 不创建线程，作为任务跑在共享的执行器上；deadline见Executor::submit()
+  void start(Executor &executor,
+             std::function<Executor::clock::time_point()> deadline);
+  void stop();
+
+  void deinit();
+
+  const StageStats &stats() const;
+  // stop()之后调用：转换中遇到的第一个错误，没有错误时为0
+  int error() const { return m_error; }
+
+ private:
+  void run(std::stop_token token);
+  // 转换一帧，输入空/输出满时至多等待wait
+  Executor::Status step(std::chrono::milliseconds wait);
+  void finish();
+  // 记录第一个错误，结束这一阶段
+  Executor::Status fail(int error);
+  int update_context(const AVFrame &src);
+  int convert(const AVFrame &src, AVFrame &dst);
+
+ private:
+  std::shared_ptr<AVFrameQueue> m_in_queue;
+  std::shared_ptr<AVFrameQueue> m_out_queue;
+  std::shared_ptr<AVFramePool> m_frame_pool;
+  AVBufferPool *m_buffer_pool{};
+  SwsContext *m_sws_ctx{};
+  int m_width{};
+  int m_height{};
+  AVPixelFormat m_format{AV_PIX_FMT_NONE};
+  int m_threads{};
+  // m_sws_ctx当前对应的输入参数，输入变化时重建
+  int m_src_width{};
+  int m_src_height{};
+  AVPixelFormat m_src_format{AV_PIX_FMT_NONE};
+  std::jthread m_thread;
+  Executor *m_executor{};
+  Executor::JobPtr m_job;
+  StageStats m_stats;
+  int m_error{0};
+  Histogram *m_convert_time{};
+  uint64_t m_generation{0};
+  bool m_finished{false};  // 已经向输出队列转发了结束
+  AVFramePtr m_pending;    // 输出队列满、尚未送出的帧
+  int m_converted{};
+};
@@ -1,46 +1,196 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <string>
 #include <string_view>
 #include <thread>
+#include <vector>
 
 #include <ffmpeg/avcodec>
 #include <ffmpeg/avformat>
 #include <ffmpeg/avutil>
 
 #include "avpacketqueue.h"
+#include "avpool.h"
+#include "executor.h"
+#include "fileio.h"
+#include "memorybudget.h"
+#include "metrics.h"
+#include "probecache.h"
+#include "stagestats.h"
 
 class Demuxthread
 {
  private:
   /* data */
  public:
+  // select_stream()切换到同类型的下一条流
+  static constexpr int NEXT_STREAM = -1;
+
+  // audio_packet_queue为空时只解复用视频，video_packet_queue为空时只解复用音频；
+  // 文件中没有的类型在init()时放弃对应的队列，见has_audio()/has_video()
   Demuxthread(std::shared_ptr<AVPacketQueue> audio_packet_queue,
               std::shared_ptr<AVPacketQueue> video_packet_queue);
   ~Demuxthread();
 
+  // 在init()之前调用：命中缓存时跳过格式探测和avformat_find_stream_info，
+  // 并预先载入关键帧索引；未命中或索引增长时写回缓存
+  void set_probe_cache(std::shared_ptr<ProbeCache> cache);
+
+  // 在init()之前调用：限制探测读取的字节数和时长，0表示FFmpeg默认值。
+  // 本地文件的默认值（5MB/5s）远大于确定流参数所需，调小可以缩短起播时间
+  void set_probe_limits(int64_t probesize,
+                        std::chrono::microseconds analyze_duration);
+
+  // 在init()之前调用：本地文件改用自定义AVIOContext读取，非本地文件不受影响
+  void set_io_options(const FileIO::Options &opts);
+
   int init(std::string_view url);
 
   void start();
+  // 不创建线程，作为任务跑在共享的执行器上；deadline见Executor::submit()
+  void start(Executor &executor,
+             std::function<Executor::clock::time_point()> deadline);
   void stop();
 
   void deinit();
 
+  // 任意线程调用，请求跳转到target（纳秒），由解复用线程异步执行。
+  // 成功后两个包队列以新的代数flush，下游逐级flush并丢弃target之前的帧；
+  // accurate为false时不丢弃，从target之前最近的关键帧开始输出（按GOP解码用）
+  void seek(std::chrono::nanoseconds target, bool accurate = true);
+
+  // 任意线程调用，倍速播放时在解复用阶段提前丢包，省去解码。
+  // audio为AVDISCARD_ALL时丢弃全部音频包；video为AVDISCARD_NONREF时丢弃
+  // 标记为可丢弃（AV_PKT_FLAG_DISPOSABLE）的包，AVDISCARD_NONKEY时只保留关键帧。
+  // 同时设置到AVStream::discard，支持的解复用器连数据都不读。
+  // 视频降低丢弃级别时继续丢到下一个关键帧，解码器不会拿到缺少参考帧的包
+  void set_discard(AVDiscard audio, AVDiscard video);
+
+  // 任意线程调用，把音频/视频切换到index指定的流，由解复用线程异步执行：
+  // 旧的流标记为AVDISCARD_ALL，新的流恢复读取，不重新打开文件；
+  // 同时seek到position，两个包队列以新的代数flush，切换之前的包全部作废
+  void select_stream(AVMediaType type,
+                     int index,
+                     std::chrono::nanoseconds position);
+
+  // 在start()之前调用：切换流之后、包队列flush到generation之前在解复用线程回调，
+  // 下游据此在同一代换用新流的解码参数（见CodecThread::set_codec_params()）。
+  // 各条流的time_base可以不同（如MP4），新一代的时间戳以新流的time_base为单位；
+  // 送出的包和解出的帧都带有所属流的time_base（AVPacket/AVFrame::time_base）
+  void set_stream_change_handler(
+      std::function<void(AVMediaType, const AVStream *, uint64_t)> handler);
+
+  // type类型的全部流的索引
+  std::vector<int> streams(AVMediaType type) const;
+
+  // init()之后调用，是否选中了音频/视频流
+  bool has_audio() const { return m_audio_stream_idx.has_value(); }
+  bool has_video() const { return m_video_stream_idx.has_value(); }
+  // init()之后、start()之前调用，当前的视频流的索引
+  std::optional<int> video_stream() const { return m_video_stream_idx; }
+
   const AVCodecParameters *audio_codec_params() const;
   const AVCodecParameters *video_codec_params() const;
 
   AVRational audio_stream_time_base() const;
   AVRational video_stream_time_base() const;
+  // 视频流的帧率，未知时为{0, 1}
+  AVRational video_frame_rate() const;
+
+  const StageStats &stats() const;
+  // stop()之后调用：读包中遇到的第一个错误，没有错误时为0
+  int error() const { return m_error; }
 
  private:
   void run(std::stop_token token);
+  // 处理seek请求、送出积压的包或者读一个包，队列满时至多等待wait；
+  // token可以停止时读到文件尾后阻塞等待seek
+  Executor::Status step(std::stop_token token, std::chrono::milliseconds wait);
+  void finish();
+  // 记录第一个错误，结束这一阶段
+  Executor::Status fail(int error);
+  int open_input(const ProbeCache::Entry *cached);
+  // 有包队列时选择type类型的最佳流，文件中没有这一类型时index保持为空
+  int find_stream(AVMediaType type,
+                  const AVPacketQueue *queue,
+                  std::optional<int> &index);
+  // 没有选中的流标记为AVDISCARD_ALL，解复用器不再读取和解析它们的数据
+  void discard_unused_streams();
+  // 执行select_stream()的请求，有流切换了返回true
+  bool switch_streams();
+  bool switch_stream(AVMediaType type, int index, std::optional<int> &current);
+  // 以新的代数作废两个包队列中的旧包，ts为各自的起始时间戳
+  void flush_queues(std::optional<int64_t> audio_ts,
+                    std::optional<int64_t> video_ts);
+  // 输入读取的字节数中交给下游、读到后丢弃和解复用器跳过的各有多少
+  void log_byte_stats();
+  int do_seek(std::chrono::nanoseconds target, bool accurate);
+  void index_keyframe(const AVPacket &pkt);
+  // 按当前的丢弃级别判断是否丢弃pkt；全局内存达到上限时另外丢弃可丢弃的视频包
+  bool discard(const AVPacket &pkt, bool video);
+  // 把积压的包送入m_pending_queue，队列满时至多等待wait
+  bool push_pending(std::chrono::milliseconds wait);
+  void apply_discard();
+  // 索引中不晚于ts的最近关键帧(pts, 字节位置)，索引未覆盖ts时返回std::nullopt
+  std::optional<std::pair<int64_t, int64_t>> find_keyframe(int64_t ts) const;
 
  private:
   AVFormatContext *m_format_ctx{};
+  std::string m_url;
+  std::shared_ptr<ProbeCache> m_probe_cache;
+  size_t m_cached_keyframes{};  // 缓存中已有的关键帧数
+  FileIO::Options m_io_options;
+  std::unique_ptr<FileIO> m_io;  // 为空时由FFmpeg的file协议读取
+  int64_t m_probesize{};
+  std::chrono::microseconds m_analyze_duration{};
   std::optional<int> m_audio_stream_idx{};
   std::optional<int> m_video_stream_idx{};
   std::jthread m_thread;
+  Executor *m_executor{};
+  Executor::JobPtr m_job;
   std::shared_ptr<AVPacketQueue> m_audio_packet_queue;
   std::shared_ptr<AVPacketQueue> m_video_packet_queue;
+  std::shared_ptr<AVPacketPool> m_packet_pool;
+  StageStats m_stats;
+  int m_error{0};
+  int m_audio_packets{};
+  int m_video_packets{};
+  bool m_eof{false};
+  AVPacketPtr m_pending;  // 队列满、尚未送出的包
+  AVPacketQueue *m_pending_queue{};
+
+  // 读包时建立的视频关键帧索引：pts -> 字节位置，只在解复用线程访问
+  std::map<int64_t, int64_t> m_keyframes;
+  std::mutex m_seek_lock;
+  std::condition_variable_any m_seek_cond;
+  std::atomic<bool> m_seek_requested{false};
+  std::atomic<int64_t> m_seek_target{0};
+  std::atomic<bool> m_seek_accurate{true};
+  uint64_t m_generation{0};
+  // select_stream()的请求，受m_seek_lock保护，随seek请求一起执行
+  std::optional<int> m_select_audio;
+  std::optional<int> m_select_video;
+  std::function<void(AVMediaType, const AVStream *, uint64_t)>
+      m_stream_change_handler;
+  Histogram *m_seek_time{};
+  Histogram *m_read_time{};
+
+  std::atomic<int> m_audio_discard{AVDISCARD_DEFAULT};
+  std::atomic<int> m_video_discard{AVDISCARD_DEFAULT};
+  std::atomic<bool> m_discard_changed{false};
+  AVDiscard m_applied_video_discard{AVDISCARD_DEFAULT};  // 解复用线程实际使用的
+  Counter *m_audio_discarded{};
+  Counter *m_video_discarded{};
+  uint64_t m_dropped_bytes{};  // 解复用器交出、但没有送往下游的包的字节数
+  Counter *m_bytes_dropped{};
+  Counter *m_memory_shed{};
+  Counter *m_memory_overcommit{};
 };
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <ffmpeg/avcodec>
+#include <ffmpeg/avutil>
+#include <ffmpeg/swresample>
+
+#include "avframequeue.h"
+#include "avpacketqueue.h"
+#include "avpool.h"
+#include "executor.h"
+#include "metrics.h"
+#include "stagestats.h"
+
+struct EncodeOptions
+{
+  std::string encoder;  // 编码器名称，如libx264、aac
+  int64_t bit_rate{};   // 0表示编码器默认值
+  int threads{};        // 帧级多线程的线程数，0表示按CPU核数
+};
+
+// 导出用的编码阶段：从帧队列取解码后的帧，编码后送入包队列交给MuxThread。
+// 使用帧级多线程，吞吐优先，不考虑延迟。
+// 视频帧需要已经是编码器的像素格式（见pixel_format()，由ConvertThread转换）；
+// 音频帧在这里转换为编码器的采样格式，并按编码器要求的frame_size重新分帧。
+// 包的时间戳以codec_context()->time_base为单位
+class EncodeThread
+{
+ public:
+  EncodeThread(std::shared_ptr<AVFrameQueue> frame_queue,
+               std::shared_ptr<AVPacketQueue> packet_queue);
+  ~EncodeThread();
+
+  // params/time_base为源流的参数，帧的时间戳以time_base为单位；
+  // global_header为true时把参数集放在extradata中（由封装格式决定）；
+  // 视频的frame_rate用于码率控制，未知时传{0, 1}
+  int init(const AVCodecParameters *params,
+           AVRational time_base,
+           AVRational frame_rate,
+           const EncodeOptions &opts,
+           bool global_header);
+
+  void start();
+  void stop();
+
+  void deinit();
+
+  const AVCodecContext *codec_context() const { return m_codec_ctx; }
+  AVPixelFormat pixel_format() const { return m_codec_ctx->pix_fmt; }
+
+  const StageStats &stats() const;
+  // stop()之后调用：编码中遇到的第一个错误，没有错误时为0
+  int error() const { return m_error; }
+
+ private:
+  void run(std::stop_token token);
+  // 编码的一步：送出积压的包、从编码器取一个包或者送入一帧，队列空/满时至多等待wait
+  Executor::Status step(std::chrono::milliseconds wait);
+  Executor::Status receive_packet(std::chrono::milliseconds wait);
+  int send_frame(AVFrame *frame);
+  // 音频帧转换为编码器的采样格式后写入FIFO
+  int write_samples(const AVFrame &frame);
+  // 输入结束时取出重采样器中缓存的采样写入FIFO
+  int flush_samples();
+  // FIFO中够一帧（输入结束后不足一帧也算）时取出送入编码器
+  bool samples_ready() const;
+  int send_samples();
+  void finish();
+  // 记录第一个错误，结束编码
+  Executor::Status fail(int error);
+
+ private:
+  AVCodecContext *m_codec_ctx{};
+  std::shared_ptr<AVFrameQueue> m_frame_queue;
+  std::shared_ptr<AVPacketQueue> m_packet_queue;
+  std::shared_ptr<AVFramePool> m_frame_pool;
+  std::shared_ptr<AVPacketPool> m_packet_pool;
+  AVRational m_src_time_base{};
+  std::jthread m_thread;
+  StageStats m_stats;
+  Histogram *m_encode_time{};
+  int m_error{0};
+
+  bool m_input_done{false};  // 帧队列已结束
+  bool m_flushing{false};    // 已经送入空帧冲刷编码器
+  bool m_receiving{false};   // 已送入帧，编码器中可能有包
+  AVPacketPtr m_packet;      // 接收用的包，EAGAIN时保留复用
+  AVPacketPtr m_pending;     // 已编码但包队列满、尚未送出的包
+
+  // 音频：采样格式转换和按frame_size分帧
+  SwrContext *m_swr_ctx{};
+  AVAudioFifo *m_fifo{};
+  int64_t m_next_pts{AV_NOPTS_VALUE};  // 下一帧的pts，以1/sample_rate为单位
+};
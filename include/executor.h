@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+
+// 进程内共享的工作窃取执行器，多路播放时所有流的解复用/解码/转换都作为任务跑在
+// 固定数目的工作线程上，线程数不随流数增长。
+// 任务是可以反复执行的一步（step），每步做有限的工作并且不阻塞：
+// - Progress：有进展，在时间片内继续执行，用完时间片后按截止时间重新排队
+// - Idle：没有输入或者下游已满，退避一段时间后再试；输入队列来了数据时
+//   由生产者调用wake()提前移回就绪队列，不必等退避到期
+// - Done：任务结束，不再调度（出错时由任务自己结束下游队列）
+// 每个工作线程有自己的就绪队列，总是先执行截止时间最早的任务（即输出队列最快见底的流），
+// 自己的队列为空时从其它线程的队列中窃取最紧急的任务。
+// 同一个任务同一时刻只在一个线程上执行，相邻两步之间由任务锁建立happens-before，
+// 所以任务内部可以继续使用单生产者/单消费者队列。
+class Executor
+{
+ public:
+  using clock = std::chrono::steady_clock;
+
+  enum class Status
+  {
+    Progress,
+    Idle,
+    Done,
+  };
+
+  class Job
+  {
+   public:
+    const std::string &name() const { return m_name; }
+    // 各个时间片中执行线程消耗的CPU时间之和
+    std::chrono::nanoseconds cpu_time() const
+    {
+      return std::chrono::nanoseconds(
+          m_cpu_ns.load(std::memory_order_relaxed));
+    }
+    // 某一步返回了Done；cancel()之后读取
+    bool done() const { return m_done.load(std::memory_order_relaxed); }
+
+   private:
+    friend class Executor;
+
+    std::string m_name;
+    std::function<Status()> m_step;
+    std::function<clock::time_point()> m_deadline;
+    std::mutex m_run_lock;  // 执行一步期间持有，cancel()据此等待
+    std::atomic<bool> m_cancelled{false};
+    std::atomic<bool> m_done{false};
+    std::atomic<int64_t> m_cpu_ns{0};
+    // wake()的请求：执行期间来了新数据时，Idle之后不退避
+    std::atomic<bool> m_wake_pending{false};
+    // 在m_worker的sleeping中，两者都在该Worker的锁内修改
+    std::atomic<bool> m_asleep{false};
+    std::atomic<size_t> m_worker{0};
+    clock::time_point m_priority{};  // 入队时的截止时间，越早越先执行
+    clock::time_point m_wake_at{};
+    std::chrono::microseconds m_backoff{};
+  };
+  using JobPtr = std::shared_ptr<Job>;
+
+  // threads为0时按CPU核数
+  explicit Executor(int threads = 0);
+  ~Executor();
+
+  Executor(const Executor &) = delete;
+  Executor &operator=(const Executor &) = delete;
+
+  // deadline返回任务的输出最迟需要在什么时刻补充，在每次入队时求值，可以在任意线程调用
+  JobPtr submit(std::string name,
+                std::function<Status()> step,
+                std::function<clock::time_point()> deadline);
+
+  // 等待正在执行的一步结束，返回之后任务不会再被执行
+  void cancel(const JobPtr &job);
+
+  // 任意线程调用（输入队列的生产者）：任务有了新的输入，
+  // 退避中的任务立即移回就绪队列，正在执行的任务这一步Idle之后不再退避
+  void wake(const JobPtr &job);
+
+  size_t thread_count() const { return m_workers.size(); }
+
+ private:
+  struct Worker
+  {
+    std::mutex lock;
+    std::vector<JobPtr> ready;
+    std::vector<JobPtr> sleeping;  // Idle退避中的任务，到期后移回ready
+    std::jthread thread;
+  };
+
+  void run(size_t index, std::stop_token token);
+  // 取出本线程最紧急的任务，没有时窃取；next_wake返回本线程最早的退避到期时刻
+  JobPtr take(size_t index, clock::time_point &next_wake);
+  static JobPtr pop_most_urgent(std::vector<JobPtr> &jobs);
+  void make_ready(size_t index, JobPtr job);
+  void execute(size_t index, JobPtr job);
+
+ private:
+  std::vector<std::unique_ptr<Worker>> m_workers;
+  std::atomic<size_t> m_next_worker{0};
+
+  std::mutex m_idle_lock;
+  std::condition_variable_any m_idle_cond;
+  std::atomic<size_t> m_idle_workers{0};
+  std::atomic<uint64_t> m_ready_epoch{0};  // 每次有任务就绪时加一
+
+  Counter *m_steps{};
+  Counter *m_steals{};
+  Counter *m_idle_polls{};
+  Histogram *m_slice_time{};
+  Histogram *m_lateness{};
+};
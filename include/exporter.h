@@ -0,0 +1,59 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "avframequeue.h"
+#include "avpacketqueue.h"
+#include "codecthread.h"
+#include "convertthread.h"
+#include "demuxthread.h"
+#include "encodethread.h"
+#include "muxthread.h"
+#include "options.h"
+
+// 导出：复用播放的解复用/解码/转换阶段，后面接编码和封装阶段，
+// 阶段之间同样通过有界队列连接。不按时钟节奏，全速处理完整个文件，
+// 结束时打印各阶段的吞吐和速度倍数（媒体时长/墙上时间）。
+// 视频先转换为编码器的像素格式，格式相同时ConvertThread直接转发
+class Exporter
+{
+ public:
+  explicit Exporter(const PlayerOptions &opts);
+  ~Exporter();
+
+  int init();
+  // 运行到所有包写入文件，打印吞吐报告；编码或封装失败时返回第一个错误
+  int run();
+  void deinit();
+
+ private:
+  // 一路音频或视频：解码 -> (转换) -> 编码
+  struct Branch
+  {
+    std::string name;  // "audio"或"video"
+    std::shared_ptr<AVPacketQueue> packets;
+    std::shared_ptr<AVFrameQueue> decoded;
+    std::shared_ptr<AVFrameQueue> frames;  // 转换后的帧，只有视频
+    std::shared_ptr<AVPacketQueue> encoded;
+    std::shared_ptr<CodecThread> decode;
+    std::shared_ptr<ConvertThread> convert;
+    std::shared_ptr<EncodeThread> encode;
+  };
+
+  int open_branch(Branch &branch,
+                  const AVCodecParameters *params,
+                  AVRational time_base,
+                  AVRational frame_rate,
+                  const DecodeThreading &threading,
+                  const EncodeOptions &encode);
+  void start();
+  void stop();
+
+ private:
+  PlayerOptions m_opts;
+  std::shared_ptr<Demuxthread> m_demux;
+  std::shared_ptr<MuxThread> m_mux;
+  Branch m_audio{.name = "audio"};
+  Branch m_video{.name = "video"};
+};
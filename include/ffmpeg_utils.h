@@ -1,5 +1,6 @@
 #pragma once
 
+#include <chrono>
 #include <string>
 
 #include <ffmpeg/avutil>
@@ -12,4 +13,10 @@ class Utils
     char estr[AV_ERROR_MAX_STRING_SIZE]{};
     return av_make_error_string(estr, AV_ERROR_MAX_STRING_SIZE, error);
   }
+
+  static int64_t to_time_base(std::chrono::milliseconds ms,
+                              AVRational time_base)
+  {
+    return av_rescale_q(ms.count(), AVRational{1, 1000}, time_base);
+  }
 };
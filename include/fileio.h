@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <ffmpeg/avformat>
+
+#include "metrics.h"
+
+// 本地文件的自定义I/O层：以自定义AVIOContext替换FFmpeg的file协议。
+// 读取由一串Reader完成（后端、限速模拟、预读线程可以互相包装），
+// 缓冲、seek的whence处理和统计由FileIO完成
+class FileIO
+{
+ public:
+  enum class Backend
+  {
+    Default,   // 不接管，由FFmpeg的file协议读取
+    Mmap,      // 整个文件只读映射，按顺序读的提示并预取读位置之后的页
+    Buffered,  // 按大块同步读取，一次系统调用读满一块
+  };
+
+  struct Options
+  {
+    Backend backend{Backend::Default};
+    size_t block_size{4 * 1024 * 1024};  // 每次读取（或预取）的字节数
+    // 预读缓冲的字节数，非0时由独立的I/O线程提前读到缓冲中，解复用线程只做拷贝
+    size_t read_ahead{};
+    // 测试用：模拟慢速存储，每次读取增加固定延迟并限制带宽（字节/秒），0表示不限制
+    std::chrono::microseconds simulated_latency{};
+    uint64_t simulated_bandwidth{};
+  };
+
+  // 按绝对位置读取的数据源
+  class Reader
+  {
+   public:
+    virtual ~Reader() = default;
+    virtual std::string name() const = 0;
+    virtual int64_t size() const = 0;
+    // 从pos开始读取最多size字节，返回读到的字节数，0表示文件尾，负数为AVERROR
+    virtual int read_at(int64_t pos, uint8_t *buf, int size) = 0;
+    // 读位置跳转到pos，可以据此调整预取
+    virtual void on_seek(int64_t pos) {}
+  };
+
+  FileIO(std::unique_ptr<Reader> reader, size_t buffer_size);
+  ~FileIO();
+
+  // url不是本地文件、不需要接管或者打开失败时返回nullptr，由FFmpeg自行打开
+  static std::unique_ptr<FileIO> open(const std::string &url,
+                                      const Options &opts);
+
+  // 赋给AVFormatContext::pb，生命周期由FileIO管理，须晚于avformat_close_input释放
+  AVIOContext *avio() const { return m_avio; }
+  int64_t size() const { return m_reader->size(); }
+  std::string name() const { return m_reader->name(); }
+
+  // 累计读取的字节数和耗时
+  uint64_t bytes_read() const;
+  std::chrono::nanoseconds read_time() const;
+
+ private:
+  static int read_packet(void *opaque, uint8_t *buf, int size);
+  static int64_t seek(void *opaque, int64_t offset, int whence);
+
+ private:
+  std::unique_ptr<Reader> m_reader;
+  AVIOContext *m_avio{};
+  int64_t m_pos{};
+  std::atomic<uint64_t> m_bytes_read{};
+  std::atomic<int64_t> m_read_ns{};
+
+  Counter *m_bytes{};
+  Counter *m_seeks{};
+  Histogram *m_read_time{};
+  Gauge *m_throughput{};
+};
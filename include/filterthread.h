@@ -0,0 +1,114 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <ffmpeg/avfilter>
+#include <ffmpeg/avutil>
+
+#include "avframequeue.h"
+#include "avpool.h"
+#include "executor.h"
+#include "metrics.h"
+#include "stagestats.h"
+
+// 解码与输出之间可选的滤镜阶段，按libavfilter的滤镜图描述处理一路音频或视频，
+// 如"yadif"、"crop=1280:720,scale=960:540"。
+// 帧以引用计数的AVFrame进出滤镜图，只转移引用不拷贝数据。
+// 逗号串联的简单滤镜链按滤镜拆成多段，每段一个滤镜图，段与段之间同样只传引用，
+// 以此分别统计每个滤镜的耗时（指标{type}_filter_{i}_{name}_ns）；
+// 带标签或分号的复杂滤镜图不拆分，只统计整体耗时。
+// 输出帧的时间戳换算回输入的时间基，下游不需要知道滤镜改变了时间基（如逐场去隔行）。
+// seek或者输入格式、time_base变化（切换流）时重建滤镜图，
+// 滤镜中缓存的旧帧一并丢弃
+class FilterThread
+{
+ public:
+  FilterThread(std::shared_ptr<AVFrameQueue> in_queue,
+               std::shared_ptr<AVFrameQueue> out_queue);
+  ~FilterThread();
+
+  // 按解码参数先建立一次滤镜图，得到输出的尺寸；帧的格式与参数不同时再重建。
+  // time_base为输入帧的时间基（帧上带有time_base时以帧为准），
+  // threads为每个滤镜图的线程数（nb_threads），0表示自动
+  int init(const std::string &description,
+           const AVCodecParameters *params,
+           AVRational time_base,
+           int threads);
+
+  void start();
+  // 不创建线程，作为任务跑在共享的执行器上；deadline见Executor::submit()
+  void start(Executor &executor,
+             std::function<Executor::clock::time_point()> deadline);
+  void stop();
+
+  void deinit();
+
+  // init()之后调用，滤镜图输出的视频尺寸
+  int width() const { return m_out_width; }
+  int height() const { return m_out_height; }
+
+  const StageStats &stats() const;
+
+ private:
+  // 滤镜链中的一段
+  struct Segment
+  {
+    std::string description;
+    AVFilterGraph *graph{};
+    AVFilterContext *src{};
+    AVFilterContext *sink{};
+    Histogram *time{};
+    std::chrono::nanoseconds elapsed{};
+    uint64_t frames{};
+    std::vector<AVFramePtr> outputs;  // 一次送入产生的帧
+  };
+
+  void run(std::stop_token token);
+  // 过滤一帧，输入空/输出满时至多等待wait
+  Executor::Status step(std::chrono::milliseconds wait);
+  void finish();
+  // 按src的格式建立各段的滤镜图
+  int configure(const AVFrame &src);
+  bool configured(const AVFrame &frame) const;
+  void reset();
+  // 把frame（为空表示输入结束）送入第index段，产生的帧逐段向后传递，
+  // 最后一段的输出放入m_ready
+  int filter(size_t index, AVFrame *frame);
+
+ private:
+  std::shared_ptr<AVFrameQueue> m_in_queue;
+  std::shared_ptr<AVFrameQueue> m_out_queue;
+  std::shared_ptr<AVFramePool> m_frame_pool;
+  std::vector<Segment> m_segments;
+  AVMediaType m_type{AVMEDIA_TYPE_UNKNOWN};
+  AVRational m_time_base{};
+  AVRational m_out_time_base{};
+  int m_threads{};
+  bool m_configured{false};
+  // 滤镜图当前对应的输入格式，输入变化时重建
+  int m_src_width{};
+  int m_src_height{};
+  int m_src_format{-1};
+  int m_src_sample_rate{};
+  AVChannelLayout m_src_layout{};
+  int m_out_width{};
+  int m_out_height{};
+
+  std::jthread m_thread;
+  Executor *m_executor{};
+  Executor::JobPtr m_job;
+  StageStats m_stats;
+  Histogram *m_filter_time{};
+  uint64_t m_generation{0};
+  bool m_eof_sent{false};  // 已经向滤镜图送入结束
+  bool m_finished{false};  // 已经向输出队列转发了结束
+  std::deque<AVFramePtr> m_ready;  // 滤镜输出、尚未送往输出队列的帧
+  AVFramePtr m_pending;            // 输出队列满、尚未送出的帧
+};
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include <ffmpeg/avutil>
+
+#include "avpool.h"
+#include "memorybudget.h"
+#include "metrics.h"
+
+// 已解码帧的LRU缓存，按(流, pts)索引，总字节数超过预算时淘汰最久未用的帧。
+// 缓存的是对帧数据缓冲的引用（av_frame_ref），存取都不拷贝像素，
+// 取出的帧与缓存、与解码管线中的同一帧共享缓冲。
+// VideoOutput把显示过的帧放入缓存，暂停时反复拖动同一段直接从缓存取帧，不再解码。
+class FrameCache
+{
+ public:
+  explicit FrameCache(size_t max_bytes);
+  ~FrameCache();
+
+  // frame的pts为best_effort_timestamp，duration为0时只能按pts精确命中
+  void insert(int stream, const AVFrame &frame);
+
+  // 显示时刻覆盖ts的帧（pts <= ts < pts + duration），未命中返回nullptr
+  AVFramePtr find(int stream, int64_t ts);
+
+  // 丢弃全部缓存的帧，如切换视频流之后旧流的帧不能再显示
+  void clear();
+
+  size_t bytes() const;
+
+ private:
+  using Key = std::pair<int, int64_t>;
+  struct Entry
+  {
+    Key key;
+    AVFramePtr frame;
+    int64_t duration{};
+    size_t bytes{};
+  };
+  using List = std::list<Entry>;
+
+  AVFramePtr ref(const AVFrame &frame);
+  void evict();
+
+ private:
+  const size_t m_max_bytes;
+  mutable std::mutex m_lock;
+  List m_lru;  // 队首为最近使用
+  std::map<Key, List::iterator> m_index;
+  size_t m_bytes{};
+  std::shared_ptr<AVFramePool> m_frame_pool;
+
+  Counter *m_hits{};
+  Counter *m_misses{};
+  Counter *m_evictions{};
+  Gauge *m_cached_bytes{};
+  MemoryBudget::Account *m_memory{};
+};
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <ffmpeg/avutil>
+
+#include "avframequeue.h"
+#include "avpacketqueue.h"
+#include "avpool.h"
+#include "codecthread.h"
+#include "convertthread.h"
+#include "demuxthread.h"
+#include "fileio.h"
+#include "memorybudget.h"
+#include "metrics.h"
+#include "probecache.h"
+
+// 逐帧步进和倒放用的GOP解码缓存。
+// 与播放管线分开，另外打开同一个文件（私有的Demuxthread/CodecThread/ConvertThread，
+// 只解视频），第一次请求时才打开。每次解码一整个GOP：以不丢帧的方式seek到关键帧，
+// 解到下一个关键帧为止，帧按pts排序缓存，之后可以向任意方向逐帧取出。
+// 向某个方向取帧时在后台预取该方向的下一个GOP，倒放时不必每一帧都重新seek和解码。
+// 缓存按字节限制，超出时先淘汰离当前位置最远的GOP；
+// 一个GOP就超出上限时只缓存请求位置附近的一段，其余部分用到时再解码。
+class GopCache
+{
+ public:
+  explicit GopCache(size_t max_bytes);
+  ~GopCache();
+
+  // 在init()之前调用，与播放管线使用相同的探测缓存和读取方式
+  void set_probe_cache(std::shared_ptr<ProbeCache> cache);
+  void set_io_options(const FileIO::Options &opts);
+
+  // 输出帧的尺寸与播放时相同，格式为YUV420P；time_base是视频流的时间基
+  void init(std::string_view url, int width, int height, AVRational time_base);
+  void deinit();
+
+  // 任意线程调用（播放管线切换视频流时）：丢弃已缓存的GOP，
+  // 之后按index指定的流和它的time_base解码
+  void select_stream(int index, AVRational time_base);
+
+  // 后台解码完成一个前台请求时在工作线程调用，用于唤醒等待帧的渲染循环
+  void set_ready_callback(std::function<void()> callback);
+
+  // pts为time_base单位（best_effort_timestamp）。
+  // 返回pts之前/之后紧邻的一帧，不阻塞：缓存未命中时请求后台解码并返回nullptr，
+  // 此时pending()为true，解码完成后调用ready callback，调用者再重新获取。
+  // 到达文件头/尾或者解码失败时返回nullptr并且pending()为false，
+  // 解码失败过的位置不再重新请求（切换流之后才重试）。
+  // 返回的帧与缓存共享数据缓冲
+  AVFramePtr frame_before(int64_t pts);
+  AVFramePtr frame_after(int64_t pts);
+  // 有前台请求在后台解码中
+  bool pending() const;
+
+ private:
+  struct Gop
+  {
+    int64_t begin{};  // 关键帧的pts，只缓存了一段时为第一帧的pts
+    int64_t end{};    // 下一个关键帧的pts，最后一个GOP为INT64_MAX；
+                      // 只缓存了一段时为其后第一帧的pts
+    std::vector<AVFramePtr> frames;  // 按pts升序
+    size_t bytes{};
+  };
+
+  void run(std::stop_token token);
+  int open();
+  void close();
+  // 从ts之前最近的关键帧开始解码，直到覆盖ts的GOP完整为止
+  std::vector<Gop> decode(int64_t ts, std::stop_token token);
+  // 覆盖ts的GOP，调用时持有m_lock
+  const Gop *find(int64_t ts) const;
+  // 取得覆盖ts的GOP，未命中时请求后台解码并返回nullptr，调用时持有m_lock
+  const Gop *acquire(int64_t ts);
+  void prefetch(int64_t ts);
+  void evict();
+  AVFramePtr ref(const AVFrame &frame);
+
+ private:
+  const size_t m_max_bytes;
+  std::string m_url;
+  int m_width{};
+  int m_height{};
+  AVRational m_time_base{};
+  std::shared_ptr<ProbeCache> m_probe_cache;
+  FileIO::Options m_io_options;
+
+  // 私有的解码管线，只在工作线程中打开和消费
+  std::shared_ptr<AVPacketQueue> m_packets;
+  std::shared_ptr<AVFrameQueue> m_decoded;
+  std::shared_ptr<AVFrameQueue> m_frames;
+  std::unique_ptr<Demuxthread> m_demux;
+  std::unique_ptr<CodecThread> m_decode;
+  std::unique_ptr<ConvertThread> m_convert;
+  bool m_opened{false};
+  bool m_open_failed{false};
+  std::optional<int> m_stream;  // 切换到的视频流，下一次解码时重新打开并选择
+  std::shared_ptr<AVFramePool> m_frame_pool;
+
+  mutable std::mutex m_lock;
+  std::condition_variable_any m_cond;
+  std::map<int64_t, Gop> m_gops;  // begin -> GOP
+  size_t m_bytes{};
+  int64_t m_position{};  // 最近一次请求的位置，淘汰时保留离它近的GOP
+  std::optional<int64_t> m_request;   // 前台的请求，解码完成后清除
+  std::optional<int64_t> m_prefetch;  // 后台预取
+  std::function<void()> m_ready_callback;
+  std::optional<int64_t> m_stream_begin;  // 已知的第一个关键帧
+  std::set<int64_t> m_failed;  // 解码失败的请求位置，不再重复请求
+  // select_stream()的请求，由工作线程在下一次解码之前执行
+  std::optional<int> m_next_stream;
+  AVRational m_next_time_base{};
+  uint64_t m_epoch{0};  // 每次切换流加一，切换之前开始解码的GOP不再缓存
+  std::jthread m_thread;
+
+  Counter *m_hits{};
+  Counter *m_misses{};
+  Counter *m_prefetches{};
+  Histogram *m_decode_time{};
+  Gauge *m_cached_bytes{};
+  MemoryBudget::Account *m_memory{};
+};
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "metrics.h"
+
+// 进程内的内存记账：包/帧等缓存按(流, 类别)记到各自的账户上，同时汇总为全局用量。
+// 设置了全局上限时，挂了账户的队列在全局用量达到上限后视为已满，生产者阻塞
+// （见SpscQueue::set_memory_account()），解复用另外丢弃可丢弃的视频包。
+// 自带淘汰上限的缓存（帧缓存、GOP缓存）用不计入上限的账户，只记账和报告，
+// 否则缓存占满上限之后播放队列只能各留一个元素。
+// 各账户和全局的当前/峰值字节数可以通过snapshot()取得，也会导出为指标并定期打印，
+// 内存吃紧时据此找出占用最多的流。
+class MemoryBudget
+{
+  using lock_type = std::mutex;
+  using lock_guard = std::lock_guard<lock_type>;
+
+ public:
+  // 一个(流, 类别)的记账，注册后地址不变；charge()/release()可在任意线程调用
+  class Account
+  {
+   public:
+    Account(MemoryBudget &budget,
+            std::string stream,
+            std::string category,
+            bool capped,
+            Gauge *gauge);
+
+    void charge(size_t bytes);
+    void release(size_t bytes);
+
+    size_t current() const { return m_current.load(std::memory_order_relaxed); }
+    size_t peak() const { return m_peak.load(std::memory_order_relaxed); }
+    const std::string &stream() const { return m_stream; }
+    const std::string &category() const { return m_category; }
+    bool capped() const { return m_capped; }
+
+    // 全局用量是否已达上限
+    bool over_cap() const { return m_budget.over_cap(); }
+
+   private:
+    MemoryBudget &m_budget;
+    const std::string m_stream;
+    const std::string m_category;
+    const bool m_capped;
+    Gauge *m_gauge{};
+    std::atomic<size_t> m_current{};
+    std::atomic<size_t> m_peak{};
+  };
+
+  struct Usage
+  {
+    std::string stream;
+    std::string category;
+    size_t current{};
+    size_t peak{};
+    bool capped{};
+  };
+
+  struct Snapshot
+  {
+    size_t current{};
+    size_t peak{};
+    size_t capped{};  // 计入上限的当前字节数
+    size_t cap{};     // 0表示不限制
+    std::vector<Usage> accounts;
+    std::map<std::string, size_t> categories;  // 各类别的当前字节数之和
+  };
+
+  static MemoryBudget &instance();
+
+  // stream如"audio"、"video"、"stream0"，category如"packets"、"frames"。
+  // capped为false时账户只计入用量，不计入全局上限；以第一次注册时为准
+  Account &account(const std::string &stream,
+                   const std::string &category,
+                   bool capped = true);
+
+  // 全局上限，0表示不限制
+  void set_cap(size_t bytes);
+  size_t cap() const { return m_cap.load(std::memory_order_relaxed); }
+  size_t current() const { return m_current.load(std::memory_order_relaxed); }
+  size_t peak() const { return m_peak.load(std::memory_order_relaxed); }
+  // 计入上限的账户的用量之和
+  size_t capped() const { return m_capped.load(std::memory_order_relaxed); }
+  bool over_cap() const
+  {
+    const auto cap = m_cap.load(std::memory_order_relaxed);
+    return cap && m_capped.load(std::memory_order_relaxed) >= cap;
+  }
+
+  Snapshot snapshot() const;
+  void log() const;
+
+  // 启动后台线程，每隔interval打印一次用量
+  void start_log(std::chrono::milliseconds interval);
+  void stop_log();
+
+ private:
+  MemoryBudget();
+  ~MemoryBudget();
+
+  void charge(size_t bytes, bool capped);
+  void release(size_t bytes, bool capped);
+
+ private:
+  mutable lock_type m_lock;
+  std::map<std::pair<std::string, std::string>, std::unique_ptr<Account>>
+      m_accounts;
+  std::atomic<size_t> m_current{};
+  std::atomic<size_t> m_peak{};
+  std::atomic<size_t> m_capped{};
+  std::atomic<size_t> m_cap{};
+  Gauge *m_current_gauge{};
+  Gauge *m_peak_gauge{};
+  std::jthread m_log_thread;
+};
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+class Counter
+{
+ public:
+  void add(uint64_t n = 1) { m_value.fetch_add(n, std::memory_order_relaxed); }
+  uint64_t value() const { return m_value.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<uint64_t> m_value{};
+};
+
+class Gauge
+{
+ public:
+  void set(int64_t v) { m_value.store(v, std::memory_order_relaxed); }
+  int64_t value() const { return m_value.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<int64_t> m_value{};
+};
+
+// HDR风格的对数-线性直方图：每个2的幂区间再等分为SUB_COUNT档，
+// 相对误差不超过1/SUB_COUNT。record()只有几次原子加，可在实时线程中调用。
+class Histogram
+{
+ public:
+  static constexpr int SUB_BITS = 4;
+  static constexpr size_t SUB_COUNT = size_t{1} << SUB_BITS;
+  static constexpr size_t BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT;
+
+  struct Snapshot
+  {
+    uint64_t count{};
+    uint64_t sum{};
+    uint64_t max{};
+    uint64_t p50{};
+    uint64_t p90{};
+    uint64_t p99{};
+    uint64_t p999{};
+  };
+
+  void record(uint64_t v);
+
+  template <typename Rep, typename Period>
+  void record(std::chrono::duration<Rep, Period> d)
+  {
+    const auto ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+    record(static_cast<uint64_t>(ns > 0 ? ns : 0));
+  }
+
+  Snapshot snapshot() const;
+
+ private:
+  static size_t bucket_index(uint64_t v);
+  static uint64_t bucket_value(size_t index);
+
+ private:
+  std::array<std::atomic<uint64_t>, BUCKETS> m_buckets{};
+  std::atomic<uint64_t> m_count{};
+  std::atomic<uint64_t> m_sum{};
+  std::atomic<uint64_t> m_max{};
+};
+
+// 进程内的指标注册表。指标按名字注册一次后地址不变，
+// 调用方在初始化时取得引用并缓存，热路径上不再查表。
+class Metrics
+{
+  using lock_type = std::mutex;
+  using lock_guard = std::lock_guard<lock_type>;
+
+ public:
+  enum class Format
+  {
+    Prometheus,
+    Json,
+  };
+
+  static Metrics &instance();
+
+  Counter &counter(const std::string &name);
+  Gauge &gauge(const std::string &name);
+  Histogram &histogram(const std::string &name);
+
+  std::string to_prometheus() const;
+  std::string to_json() const;
+
+  // 启动后台线程，每隔interval把全部指标整体写入path（先写临时文件再改名）
+  void start_dump(std::string path,
+                  Format format,
+                  std::chrono::milliseconds interval);
+  void stop_dump();
+
+ private:
+  Metrics() = default;
+  ~Metrics();
+
+  void dump(const std::string &path, Format format) const;
+
+ private:
+  mutable lock_type m_lock;
+  std::map<std::string, std::unique_ptr<Counter>> m_counters;
+  std::map<std::string, std::unique_ptr<Gauge>> m_gauges;
+  std::map<std::string, std::unique_ptr<Histogram>> m_histograms;
+  std::jthread m_dump_thread;
+};
+
+// 作用域计时，析构时把耗时记录到直方图
+class ScopedTimer
+{
+ public:
+  explicit ScopedTimer(Histogram &histogram)
+      : m_histogram(histogram)
+      , m_begin(std::chrono::steady_clock::now())
+  {
+  }
+
+  ~ScopedTimer()
+  {
+    m_histogram.record(std::chrono::steady_clock::now() - m_begin);
+  }
+
+  ScopedTimer(const ScopedTimer &) = delete;
+  ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+ private:
+  Histogram &m_histogram;
+  std::chrono::steady_clock::time_point m_begin;
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "avframequeue.h"
+#include "avpacketqueue.h"
+#include "avsync.h"
+#include "codecthread.h"
+#include "convertthread.h"
+#include "demuxthread.h"
+#include "executor.h"
+#include "nulloutput.h"
+#include "options.h"
+#include "videooutput.h"
+
+// 多路播放：每一路一组解复用/解码/转换阶段，全部作为任务跑在同一个Executor上，
+// 线程数由--workers决定而不随路数增长。各路只播放视频，用各自的外部时钟，
+// 画面在同一个VideoOutput窗口中按网格排列，每一路先缩放到格子的尺寸。
+class MultiView
+{
+ public:
+  explicit MultiView(const PlayerOptions &opts);
+  ~MultiView();
+
+  int init();
+  // 有界面时运行渲染循环直到退出；无界面时排空所有流并打印吞吐报告
+  int run();
+  void deinit();
+
+ private:
+  struct Stream
+  {
+    std::string url;
+    std::shared_ptr<AVPacketQueue> video_packets;
+    std::shared_ptr<AVFrameQueue> video_decoded;
+    std::shared_ptr<AVFrameQueue> video_frames;
+    std::shared_ptr<AVSync> avsync;
+    std::shared_ptr<Demuxthread> demux;
+    std::shared_ptr<CodecThread> decode;
+    std::shared_ptr<ConvertThread> convert;
+    AVRational time_base{};
+    int width{};  // 缩放后的尺寸
+    int height{};
+  };
+
+  int open_stream(Stream &stream);
+  // 输出队列中缓存的数据还能播放到什么时刻，越早越需要优先解码
+  static Executor::clock::time_point deadline(const Stream &stream);
+  void start();
+  void stop();
+  int run_headless();
+
+ private:
+  PlayerOptions m_opts;
+  std::vector<std::unique_ptr<Stream>> m_streams;
+  std::unique_ptr<Executor> m_executor;
+  std::unique_ptr<VideoOutput> m_video_output;
+};
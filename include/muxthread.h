@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <ffmpeg/avcodec>
+#include <ffmpeg/avformat>
+
+#include "avpacketqueue.h"
+#include "executor.h"
+#include "stagestats.h"
+
+// 导出的封装阶段：从各路编码器的包队列取包写入输出文件。
+// 各队列都有包时先写dts最早的，只有一路有包时直接写，
+// 交给av_interleaved_write_frame()交织，一路慢时不会卡住另一路的编码。
+// 所有队列结束并排空后写入文件尾
+class MuxThread
+{
+ public:
+  MuxThread();
+  ~MuxThread();
+
+  // 按文件扩展名选择封装格式
+  int init(const std::string &path);
+
+  // 在open()之前调用，编码器需要据此决定是否设置AV_CODEC_FLAG_GLOBAL_HEADER
+  bool global_header() const;
+
+  // 在open()之前调用，按已打开的编码器添加一路输出流，queue中的包来自该编码器
+  int add_stream(std::shared_ptr<AVPacketQueue> queue,
+                 const AVCodecContext *encoder);
+
+  // 打开输出文件并写入文件头
+  int open();
+
+  void start();
+  // 等待所有队列结束并写完文件尾
+  void wait();
+  void stop();
+
+  void deinit();
+
+  // 已写入的媒体时长（各路最后一个包的结束时刻中最晚的）
+  std::chrono::nanoseconds duration() const;
+
+  const StageStats &stats() const;
+  // wait()之后调用：写包或者写文件尾时遇到的第一个错误，没有错误时为0
+  int error() const { return m_error; }
+
+ private:
+  struct Input
+  {
+    std::shared_ptr<AVPacketQueue> queue;
+    AVStream *stream{};
+    AVRational time_base{};  // 编码器的时间基
+    // 第一个包的pts和最后一个包的结束时刻，以time_base为单位
+    int64_t start{AV_NOPTS_VALUE};
+    int64_t end{AV_NOPTS_VALUE};
+  };
+
+  void run(std::stop_token token);
+  // 写一个包，所有队列都空时至多等待wait
+  Executor::Status step(std::chrono::milliseconds wait);
+  int write(Input &input, AVPacketPtr pkt);
+  void finish();
+
+ private:
+  AVFormatContext *m_format_ctx{};
+  std::string m_path;
+  std::vector<Input> m_inputs;
+  bool m_header_written{false};
+  bool m_trailer_written{false};
+  std::jthread m_thread;
+  StageStats m_stats;
+  std::atomic<int64_t> m_duration_ns{};
+  int m_error{0};
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <memory>
+#include <thread>
+
+#include <ffmpeg/avutil>
+
+#include "avframequeue.h"
+#include "avsync.h"
+#include "stagestats.h"
+
+// 无界面输出：丢弃解码后的帧，用于吞吐测试和没有显示设备的机器
+// realtime为false时尽快排空队列，为true时按帧的pts以墙上时钟节奏消费
+class NullOutput
+{
+ public:
+  NullOutput(std::shared_ptr<AVFrameQueue> queue,
+             std::shared_ptr<AVSync> avsync);
+  ~NullOutput();
+
+  int init(AVRational time_base, bool realtime);
+
+  void start();
+  // 等待帧队列的生产者结束并且队列排空
+  void wait();
+  void stop();
+
+  const StageStats &stats() const;
+
+ private:
+  void run(std::stop_token token);
+
+ private:
+  std::shared_ptr<AVFrameQueue> m_queue;
+  std::shared_ptr<AVSync> m_avsync;
+  AVRational m_time_base{};
+  bool m_realtime{};
+  std::jthread m_thread;
+  StageStats m_stats;
+};
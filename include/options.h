@@ -0,0 +1,50 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "avsync.h"
+#include "codecthread.h"
+#include "encodethread.h"
+#include "fileio.h"
+#include "metrics.h"
+
+struct PlayerOptions
+{
+  std::vector<std::string> urls;  // 多于一个时按网格同时播放，只播放视频
+  int workers{};  // 多路播放时共享执行器的线程数，0表示按CPU核数
+  DecodeThreading audio_threading{.count = 1};
+  DecodeThreading video_threading{};
+  int convert_threads{};  // 像素格式转换的线程数，0表示按CPU核数
+  std::string video_filter;  // libavfilter滤镜图，如"yadif"，为空时不加滤镜阶段
+  std::string audio_filter;
+  int filter_threads{};  // 每个滤镜图的线程数，0表示自动
+  AVSync::Master sync_master{AVSync::Master::Audio};
+  std::chrono::milliseconds drop_threshold{40};  // 0表示不丢帧
+  bool headless{};  // 不创建SDL窗口和音频设备，用空输出排空帧队列并打印吞吐报告
+  bool realtime{};  // 无界面模式下按pts实时节奏消费，而不是尽快排空
+  std::string metrics_file;  // 为空时不输出指标文件
+  Metrics::Format metrics_format{Metrics::Format::Prometheus};
+  std::chrono::milliseconds metrics_interval{1000};
+  std::string probe_cache;  // 探测结果缓存目录，为空时不缓存
+  int64_t probesize{};  // 探测读取的最大字节数，0表示FFmpeg默认值
+  std::chrono::milliseconds analyze_duration{};  // 探测的最大时长，0表示默认
+  FileIO::Options io;  // 本地文件的读取方式
+  // 步进/倒放用的GOP缓存字节数，0表示关闭；有视频滤镜时不使用
+  size_t gop_cache{256 * 1024 * 1024};
+  size_t frame_cache{};  // 已显示帧的LRU缓存字节数，0表示关闭
+  double rate{1.0};      // 起播的播放速率，0.25~16
+  bool adaptive_quality{true};  // 解码跟不上时自动降低解码质量
+  size_t memory_limit{};  // 包/帧队列的全局字节上限（不含缓存），0表示不限制
+  std::chrono::milliseconds memory_log_interval{10000};  // 0表示不打印
+  std::string export_path;  // 非空时不播放，解码后重新编码写入该文件
+  EncodeOptions video_encode{.encoder = "libx264"};
+  EncodeOptions audio_encode{.encoder = "aac", .threads = 1};
+
+  // 解析命令行：player [options] <url> [url...]，出错时打印用法并返回std::nullopt
+  static std::optional<PlayerOptions> parse(int ac, char **av);
+  static void print_usage(const char *prog);
+};
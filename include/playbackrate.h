@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+#include "audiooutput.h"
+#include "avsync.h"
+#include "codecthread.h"
+#include "demuxthread.h"
+#include "metrics.h"
+
+// 播放速率控制（0.25x~16x），把速率分发到管线的各个阶段：
+// - 时钟按速率外推，视频按pts追赶时钟，自然按倍速显示
+// - 不超过AudioOutput::MAX_TEMPO时音频用atempo变速不变调，音视频仍以音频为准；
+//   超过时丢弃音频包，主时钟从音频切换到外部时钟，降回来时seek到当前位置重新对齐
+// - 超过NONREF_RATE时解复用丢弃可丢弃的包、解码器跳过非参考帧；
+//   达到KEYFRAME_RATE时只解关键帧，解码量不随速率线性增长
+class PlaybackRate
+{
+ public:
+  static constexpr double MIN_RATE = 0.25;
+  static constexpr double MAX_RATE = 16.0;
+  static constexpr double NONREF_RATE = 2.0;
+  static constexpr double KEYFRAME_RATE = 8.0;
+
+  // audio_output为空时（无界面模式或没有音频）只丢弃音频包，不切换主时钟；
+  // video_decoder为空时（没有视频）不丢弃视频帧
+  PlaybackRate(std::shared_ptr<AVSync> avsync,
+               std::shared_ptr<Demuxthread> demux,
+               std::shared_ptr<CodecThread> video_decoder,
+               std::shared_ptr<AudioOutput> audio_output);
+
+  double rate() const { return m_rate; }
+
+  // 在视频输出线程（或管线启动之前）调用，rate限制在[MIN_RATE, MAX_RATE]
+  void set(double rate);
+  // 按档位加速/减速
+  void faster();
+  void slower();
+
+  // 当前速率下解复用和解码丢弃的视频帧占读到的视频帧的比例
+  double discard_ratio() const;
+  // 把丢帧比例写到指标上，由视频输出线程每帧调用
+  void update_metrics();
+  // 打印并更新当前速率下的丢帧比例
+  void log();
+
+ private:
+  static AVDiscard video_discard(double rate);
+  bool audible(double rate) const;
+
+ private:
+  std::shared_ptr<AVSync> m_avsync;
+  std::shared_ptr<Demuxthread> m_demux;
+  std::shared_ptr<CodecThread> m_video_decoder;
+  std::shared_ptr<AudioOutput> m_audio_output;
+  const AVSync::Master m_master;  // 用户选择的主时钟，静音结束后恢复
+  double m_rate{1.0};
+
+  // 切换到当前速率时的计数，丢帧比例只统计当前速率的这一段
+  uint64_t m_base_discarded{};
+  uint64_t m_base_packets{};
+  uint64_t m_base_frames{};
+
+  Counter *m_demux_discarded{};
+  Gauge *m_rate_gauge{};
+  Gauge *m_discard_gauge{};
+};
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+
+#include <ffmpeg/avformat>
+
+// 探测结果的磁盘缓存：流参数、codec extradata和关键帧索引。
+// 以文件的绝对路径为键，校验文件大小、修改时间和文件头的哈希，任一变化即失效。
+// 缓存文件是定长记录的紧凑二进制格式，加载时整体mmap，不做反序列化。
+class ProbeCache
+{
+ public:
+  // 一个已经映射到内存并校验过的缓存文件
+  class Entry
+  {
+   public:
+    // 探测到的输入格式名，用于跳过格式探测
+    std::string format_name() const;
+
+    // 把缓存的流参数写入刚打开的ctx，流的个数或codec不一致时返回false且不修改ctx
+    bool apply(AVFormatContext *ctx) const;
+
+    // 缓存的关键帧索引：pts -> 字节位置
+    std::map<int64_t, int64_t> keyframes(int stream_index) const;
+    size_t keyframe_count() const;
+
+   private:
+    friend class ProbeCache;
+    explicit Entry(std::shared_ptr<const uint8_t> data);
+
+    template <typename T>
+    const T *at(uint64_t offset) const
+    {
+      return reinterpret_cast<const T *>(m_data.get() + offset);
+    }
+
+   private:
+    std::shared_ptr<const uint8_t> m_data;  // 析构时解除映射
+  };
+
+  explicit ProbeCache(std::filesystem::path dir);
+
+  // 非本地文件、缓存不存在或者已经失效时返回std::nullopt
+  std::optional<Entry> load(const std::string &url) const;
+
+  // 写入（覆盖）url的缓存，先写临时文件再改名，并发的读者不会看到写了一半的文件
+  bool store(const std::string &url,
+             const AVFormatContext &ctx,
+             int keyframe_stream,
+             const std::map<int64_t, int64_t> &keyframes) const;
+
+ private:
+  struct Key
+  {
+    std::filesystem::path path;
+    uint64_t file_size{};
+    int64_t mtime{};
+    uint64_t header_hash{};
+  };
+
+  static std::optional<Key> make_key(const std::string &url);
+  std::filesystem::path cache_path(const Key &key) const;
+
+ private:
+  std::filesystem::path m_dir;
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+
+#include "codecthread.h"
+#include "metrics.h"
+
+// 解码质量的反馈控制：CPU不足时逐级降低解码质量，余量恢复后逐级恢复。
+// VideoOutput每显示/丢弃一帧调用一次record()，按窗口统计迟到的帧和帧队列深度：
+// - 迟到的帧多并且帧队列见底，说明解码跟不上，降一级
+// - 连续几个窗口没有迟到的帧并且帧队列有余量，升一级
+// 降级只需一个窗口，升级要连续多个窗口满足条件，两个方向的条件也不重叠，
+// 负载在阈值附近波动时不会来回切换。
+// 帧队列满而帧仍然迟到时瓶颈不在解码（如渲染），不降级
+class QualityController
+{
+ public:
+  explicit QualityController(std::shared_ptr<CodecThread> decoder);
+
+  // 在视频输出线程调用：lateness为帧相对于目标显示时刻的延迟，
+  // dropped表示该帧因为太晚被丢弃，depth为取出该帧之前帧队列中的帧数
+  void record(std::chrono::nanoseconds lateness, bool dropped, size_t depth);
+
+  int level() const { return m_level; }
+
+ private:
+  // 一个窗口结束，决定是否切换级别
+  void evaluate();
+  void set_level(int level, const char *reason);
+
+ private:
+  std::shared_ptr<CodecThread> m_decoder;
+  int m_level{0};  // 0为完整质量
+
+  std::chrono::steady_clock::time_point m_window_begin;
+  size_t m_frames{};
+  size_t m_late{};
+  size_t m_depth_sum{};
+  int m_good_windows{};  // 连续有余量的窗口数
+
+  Counter *m_transitions{};
+  Gauge *m_level_gauge{};
+};
@@ -0,0 +1,480 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+
+#include "memorybudget.h"
+#include "metrics.h"
+
+// 队列的水位限制，任意一项达到即视为队列已满，0表示该项不限制
+struct QueueLimits
+{
+  size_t max_count{};
+  size_t max_bytes{};
+  int64_t max_duration{};  // 以元素时间戳的time_base为单位
+};
+
+// 元素的字节数和时间戳，用于按字节/时长限制队列，按需特化
+template <typename T>
+struct SpscQueueTraits
+{
+  static size_t bytes(const T &) { return 0; }
+  static std::optional<int64_t> timestamp(const T &) { return std::nullopt; }
+};
+
+// 单生产者/单消费者有界环形队列
+// - push/try_push 只能在生产者线程调用
+// - pop/try_pop/peek 只能在消费者线程调用
+// 快路径无锁且wait-free，只有在队列空/满并且调用者愿意等待时，才会休眠在条件变量上，
+// 对端只有在发现有人休眠时才会去加锁唤醒。
+// 除了环形缓冲的容量，还可以通过set_limits()按个数/字节/时长限制队列，
+// 生产者在超出限制时休眠，消费者取走元素后立即唤醒。
+// 挂上内存账户后，队列中元素的字节数计入全局的内存记账，全局用量达到上限时
+// 队列同样视为已满；其它队列释放内存不会唤醒本队列，生产者靠push()的超时重试。
+// 生产者可以通过flush()整体作废已入队的元素（seek），消费者在下一次
+// try_pop/peek时丢弃它们，并通过generation()得知新的代数。
+template <typename T, typename Traits = SpscQueueTraits<T>>
+class SpscQueue
+{
+  using lock_type = std::mutex;
+  using unique_lock = std::unique_lock<lock_type>;
+  using lock_guard = std::lock_guard<lock_type>;
+
+  static constexpr size_t CACHE_LINE = 64;
+  static constexpr int64_t NO_TIMESTAMP = std::numeric_limits<int64_t>::min();
+
+ public:
+  explicit SpscQueue(size_t capacity = 256)
+      : m_capacity(std::bit_ceil(std::max<size_t>(capacity, 2)))
+      , m_mask(m_capacity - 1)
+      , m_slots(std::make_unique<T[]>(m_capacity))
+  {
+  }
+
+  ~SpscQueue()
+  {
+    if (m_account)
+    {
+      m_account->release(bytes());
+    }
+  }
+
+  SpscQueue(const SpscQueue &) = delete;
+  SpscQueue &operator=(const SpscQueue &) = delete;
+
+  // 在生产者/消费者启动之前调用；超过环形缓冲容量的个数限制会被截断
+  void set_limits(const QueueLimits &limits)
+  {
+    m_max_count.store(limits.max_count ? std::min(limits.max_count, m_capacity)
+                                       : m_capacity,
+                      std::memory_order_relaxed);
+    m_max_bytes.store(limits.max_bytes, std::memory_order_relaxed);
+    m_max_duration.store(limits.max_duration, std::memory_order_relaxed);
+  }
+
+  // 任意线程调用，只改时长限制：切换到time_base不同的流时重新换算
+  void set_max_duration(int64_t max_duration)
+  {
+    m_max_duration.store(max_duration, std::memory_order_relaxed);
+  }
+
+  // 记录生产者/消费者在push/pop中等待的时长，传nullptr表示不记录
+  void set_wait_histograms(Histogram *push_wait, Histogram *pop_wait)
+  {
+    m_push_wait = push_wait;
+    m_pop_wait = pop_wait;
+  }
+
+  // 在生产者/消费者启动之前调用，把入队元素的字节数记到account上，传nullptr表示不记
+  void set_memory_account(MemoryBudget::Account *account)
+  {
+    m_account = account;
+  }
+
+  // 队列由空变为非空、flush()或者finish()时在生产者线程回调，供不阻塞在pop()上的
+  // 消费者（等待SDL事件的渲染线程、执行器上的任务）得知有新元素；
+  // 回调内只能调用本队列的只读接口
+  void set_not_empty_callback(std::function<void()> callback)
+  {
+    m_not_empty_callback = std::move(callback);
+  }
+
+  // budget为false时不受全局内存上限的限制，只用于避免其它队列饿死
+  bool try_push(T &val, bool budget = true)
+  {
+    if (full(budget))
+    {
+      return false;
+    }
+
+    const auto tail = m_tail.load(std::memory_order_relaxed);
+    if (tail - m_head_cache == m_capacity)
+    {
+      m_head_cache = m_head.load(std::memory_order_acquire);
+      if (tail - m_head_cache == m_capacity)
+      {
+        return false;
+      }
+    }
+
+    const auto bytes = Traits::bytes(val);
+    m_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    if (m_account)
+    {
+      m_account->charge(bytes);
+    }
+    if (const auto ts = Traits::timestamp(val))
+    {
+      auto expected = NO_TIMESTAMP;
+      m_head_ts.compare_exchange_strong(
+          expected, *ts, std::memory_order_relaxed);
+      m_tail_ts.store(*ts, std::memory_order_relaxed);
+    }
+
+    m_slots[tail & m_mask] = std::move(val);
+    m_tail.store(tail + 1, std::memory_order_release);
+    wake(m_not_empty);
+
+    const auto depth = tail + 1 - m_head.load(std::memory_order_relaxed);
+    if (depth > m_peak.load(std::memory_order_relaxed))
+    {
+      m_peak.store(depth, std::memory_order_relaxed);
+    }
+    if (depth == 1 && m_not_empty_callback)
+    {
+      m_not_empty_callback();
+    }
+    return true;
+  }
+
+  // 生产者调用，作废此前入队的全部元素，之后入队的元素属于generation。
+  // resume_ts是新一代数据的起始时间戳（time_base单位），消费者可以据此丢弃
+  // 目标之前的数据；同时撤销finish()，生产者可以继续入队
+  void flush(uint64_t generation,
+             std::optional<int64_t> resume_ts = std::nullopt)
+  {
+    m_head_ts.store(NO_TIMESTAMP, std::memory_order_relaxed);
+    m_tail_ts.store(NO_TIMESTAMP, std::memory_order_relaxed);
+    m_finished.store(false, std::memory_order_relaxed);
+    m_flush_resume.store(resume_ts.value_or(NO_TIMESTAMP),
+                         std::memory_order_relaxed);
+    m_flush_tail.store(m_tail.load(std::memory_order_relaxed),
+                       std::memory_order_relaxed);
+    m_flush_generation.store(generation, std::memory_order_release);
+    wake(m_not_empty);
+    if (m_not_empty_callback)
+    {
+      m_not_empty_callback();
+    }
+  }
+
+  // 生产者调用，表示不会再有新元素，唤醒等待中的消费者
+  void finish()
+  {
+    m_finished.store(true, std::memory_order_release);
+    wake(m_not_empty);
+    if (m_not_empty_callback)
+    {
+      m_not_empty_callback();
+    }
+  }
+
+  // 生产者已结束并且队列已排空
+  bool finished() const
+  {
+    return m_finished.load(std::memory_order_acquire) && empty();
+  }
+
+  // 队列满时至多等待ms，超时返回false，val保持不变
+  bool push(T &val, std::chrono::milliseconds ms = std::chrono::milliseconds(0))
+  {
+    if (try_push(val))
+    {
+      record_wait(m_push_wait, {});
+      return true;
+    }
+
+    const auto begin = std::chrono::steady_clock::now();
+    const auto ok =
+        park(m_not_full, ms, [this]() { return !full(); }) && try_push(val);
+    record_wait(m_push_wait, std::chrono::steady_clock::now() - begin);
+    return ok;
+  }
+
+  std::optional<T> try_pop()
+  {
+    // peek()之后的第一次出队一定取出peek()看到的元素，不受其间flush()的影响
+    const auto head =
+        m_peeked ? m_head.load(std::memory_order_relaxed) : consumer_head();
+    m_peeked = false;
+    if (head == m_tail_cache)
+    {
+      return std::nullopt;
+    }
+
+    auto &slot = m_slots[head & m_mask];
+    auto v = std::move(slot);
+    slot = T{};
+
+    const auto bytes = Traits::bytes(v);
+    m_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+    if (m_account)
+    {
+      m_account->release(bytes);
+    }
+    if (const auto ts = Traits::timestamp(v))
+    {
+      m_head_ts.store(*ts, std::memory_order_relaxed);
+    }
+
+    m_head.store(head + 1, std::memory_order_release);
+    wake(m_not_full);
+    return v;
+  }
+
+  // 队列空时至多等待ms，超时或生产者已结束时返回std::nullopt
+  std::optional<T> pop(
+      std::chrono::milliseconds ms = std::chrono::milliseconds(0))
+  {
+    if (auto v = try_pop())
+    {
+      record_wait(m_pop_wait, {});
+      return v;
+    }
+
+    const auto begin = std::chrono::steady_clock::now();
+    std::optional<T> v;
+    if (park(m_not_empty,
+             ms,
+             [this]()
+             {
+               return !empty() || m_finished.load(std::memory_order_acquire);
+             }))
+    {
+      v = try_pop();
+    }
+    record_wait(m_pop_wait, std::chrono::steady_clock::now() - begin);
+    return v;
+  }
+
+  // 查看队首元素，不出队；返回的指针在消费者下一次pop之前有效，
+  // 紧接着的pop取出的就是这个元素
+  T *peek()
+  {
+    const auto head = consumer_head();
+    m_peeked = head != m_tail_cache;
+    if (!m_peeked)
+    {
+      return nullptr;
+    }
+    return &m_slots[head & m_mask];
+  }
+
+  // 以下只能在消费者线程调用
+  // 最近一次已生效的flush()的代数，初始为0
+  uint64_t generation() const { return m_generation; }
+
+  // 最近一次已生效的flush()携带的起始时间戳
+  std::optional<int64_t> resume_timestamp() const
+  {
+    if (m_resume_ts == NO_TIMESTAMP)
+    {
+      return std::nullopt;
+    }
+    return m_resume_ts;
+  }
+
+  // 生产者已经flush()，但消费者还没有取走/丢弃旧元素；
+  // 消费者在阻塞写下游之前检查，尽快放弃过时的数据
+  bool flush_pending() const
+  {
+    return m_flush_generation.load(std::memory_order_acquire) != m_generation;
+  }
+
+  size_t size() const
+  {
+    const auto head = m_head.load(std::memory_order_acquire);
+    const auto tail = m_tail.load(std::memory_order_acquire);
+    return tail - head;
+  }
+
+  size_t bytes() const { return m_bytes.load(std::memory_order_relaxed); }
+
+  // 队列中缓存的媒体时长（time_base单位），即最后入队与最后出队元素的时间戳之差
+  int64_t duration() const
+  {
+    const auto head_ts = m_head_ts.load(std::memory_order_relaxed);
+    const auto tail_ts = m_tail_ts.load(std::memory_order_relaxed);
+    if (empty() || head_ts == NO_TIMESTAMP || tail_ts == NO_TIMESTAMP)
+    {
+      return 0;
+    }
+    return std::max<int64_t>(tail_ts - head_ts, 0);
+  }
+
+  bool empty() const { return size() == 0; }
+
+  // 达到任意一项限制即为满；单个超大元素在队列为空时仍允许入队，避免死锁。
+  // budget为true时全局内存用量达到上限也算满
+  bool full(bool budget = true) const
+  {
+    const auto count = size();
+    if (count >= m_max_count.load(std::memory_order_relaxed))
+    {
+      return true;
+    }
+    if (count == 0)
+    {
+      return false;
+    }
+
+    const auto max_bytes = m_max_bytes.load(std::memory_order_relaxed);
+    if (max_bytes && bytes() >= max_bytes)
+    {
+      return true;
+    }
+
+    const auto max_duration = m_max_duration.load(std::memory_order_relaxed);
+    if (max_duration && duration() >= max_duration)
+    {
+      return true;
+    }
+    return budget && m_account && m_account->over_cap();
+  }
+
+  size_t capacity() const { return m_capacity; }
+  size_t peak_size() const { return m_peak.load(std::memory_order_relaxed); }
+
+ private:
+  struct alignas(CACHE_LINE) Waiter
+  {
+    std::atomic<bool> waiting{false};
+    lock_type lock;
+    std::condition_variable condvar;
+  };
+
+  // 消费者取得队首位置：必要时刷新tail缓存，再应用生产者的flush()。
+  // 先读tail再读代数，保证看到的新元素一定已经看到了它之前的flush
+  size_t consumer_head()
+  {
+    auto head = m_head.load(std::memory_order_relaxed);
+    if (head == m_tail_cache)
+    {
+      m_tail_cache = m_tail.load(std::memory_order_acquire);
+    }
+
+    const auto generation = m_flush_generation.load(std::memory_order_acquire);
+    if (generation == m_generation)
+    {
+      return head;
+    }
+
+    m_generation = generation;
+    m_resume_ts = m_flush_resume.load(std::memory_order_relaxed);
+    const auto flush_tail = m_flush_tail.load(std::memory_order_relaxed);
+    if (flush_tail > m_tail_cache)
+    {
+      m_tail_cache = m_tail.load(std::memory_order_acquire);
+    }
+    if (head >= flush_tail)
+    {
+      return head;
+    }
+
+    for (; head < flush_tail; head++)
+    {
+      auto &slot = m_slots[head & m_mask];
+      const auto bytes = Traits::bytes(slot);
+      m_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+      if (m_account)
+      {
+        m_account->release(bytes);
+      }
+      slot = T{};
+    }
+    m_head.store(head, std::memory_order_release);
+    wake(m_not_full);
+    return head;
+  }
+
+  template <typename Pred>
+  static bool park(Waiter &waiter, std::chrono::milliseconds ms, Pred pred)
+  {
+    if (ms.count() <= 0)
+    {
+      return pred();
+    }
+
+    unique_lock locker(waiter.lock);
+    waiter.waiting.store(true, std::memory_order_relaxed);
+    // 与wake()中的fence配对：要么对端看到waiting，要么pred看到对端的更新
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const auto ok = waiter.condvar.wait_for(locker, ms, pred);
+    waiter.waiting.store(false, std::memory_order_relaxed);
+    return ok;
+  }
+
+  static void record_wait(Histogram *histogram,
+                          std::chrono::steady_clock::duration d)
+  {
+    if (histogram)
+    {
+      histogram->record(d);
+    }
+  }
+
+  static void wake(Waiter &waiter)
+  {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiter.waiting.load(std::memory_order_relaxed))
+    {
+      lock_guard locker(waiter.lock);
+      waiter.condvar.notify_one();
+    }
+  }
+
+ private:
+  const size_t m_capacity;
+  const size_t m_mask;
+  std::unique_ptr<T[]> m_slots;
+
+  // 消费者独占的缓存行
+  alignas(CACHE_LINE) std::atomic<size_t> m_head{0};
+  size_t m_tail_cache{0};
+  uint64_t m_generation{0};
+  int64_t m_resume_ts{NO_TIMESTAMP};
+  bool m_peeked{false};
+
+  // 生产者独占的缓存行
+  alignas(CACHE_LINE) std::atomic<size_t> m_tail{0};
+  size_t m_head_cache{0};
+  std::atomic<size_t> m_peak{0};
+  std::atomic<bool> m_finished{false};
+  std::atomic<size_t> m_flush_tail{0};
+  std::atomic<int64_t> m_flush_resume{NO_TIMESTAMP};
+  std::atomic<uint64_t> m_flush_generation{0};
+
+  alignas(CACHE_LINE) std::atomic<size_t> m_bytes{0};
+  std::atomic<int64_t> m_head_ts{NO_TIMESTAMP};
+  std::atomic<int64_t> m_tail_ts{NO_TIMESTAMP};
+  std::atomic<size_t> m_max_count{m_capacity};
+  std::atomic<size_t> m_max_bytes{0};
+  std::atomic<int64_t> m_max_duration{0};
+  Histogram *m_push_wait{};
+  Histogram *m_pop_wait{};
+  MemoryBudget::Account *m_account{};
+  std::function<void()> m_not_empty_callback;
+
+  Waiter m_not_empty;
+  Waiter m_not_full;
+};
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// 流水线单个阶段的吞吐统计，由阶段线程更新，其他线程只读
+struct StageStats
+{
+  std::atomic<uint64_t> packets{};
+  std::atomic<uint64_t> frames{};
+  std::atomic<uint64_t> bytes{};
+  // 阶段线程（调度解码器等的线程）消耗的CPU时间，线程退出时写入；
+  // 跑在执行器上时为各个时间片之和，stop()时写入。
+  // 不包括libavcodec等库内部的工作线程，多线程解码时大部分时间在那些线程上
+  std::atomic<int64_t> cpu_ns{};
+
+  // 调用线程自启动以来消耗的CPU时间（用户态+内核态）
+  static std::chrono::nanoseconds thread_cpu_time();
+  // 整个进程消耗的CPU时间，包括库内部的工作线程
+  static std::chrono::nanoseconds process_cpu_time();
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// 启动过程的时间线：各阶段第一次完成的时刻相对于进程启动的耗时。
+// 每个阶段记录一次，同时写入指标startup_<phase>_us，便于跟踪回归。
+// mark()会加锁，调用方自己保证只在阶段第一次完成时调用，不要放在热路径上。
+class StartupTimeline
+{
+  using lock_type = std::mutex;
+  using lock_guard = std::lock_guard<lock_type>;
+
+ public:
+  using clock = std::chrono::steady_clock;
+
+  static StartupTimeline &instance();
+
+  // 记录起点，在main()的开头调用
+  void start(clock::time_point begin = clock::now());
+
+  // 阶段phase在时刻t完成，重复记录的阶段忽略
+  void mark(const std::string &phase, clock::time_point t = clock::now());
+
+  // 按完成先后输出各阶段的耗时
+  void log() const;
+
+ private:
+  StartupTimeline() = default;
+
+ private:
+  mutable lock_type m_lock;
+  clock::time_point m_begin{clock::now()};
+  std::vector<std::pair<std::string, std::chrono::nanoseconds>> m_phases;
+};
@@ -1,14 +1,23 @@
 #pragma once
 
 #include <chrono>
+#include <cstdint>
+#include <functional>
 #include <memory>
 #include <optional>
+#include <utility>
+#include <vector>
 
 #include <SDL2/SDL.h>
 #include <ffmpeg/avutil>
 
 #include "avframequeue.h"
 #include "avsync.h"
+#include "framecache.h"
+#include "gopcache.h"
+#include "metrics.h"
+#include "playbackrate.h"
+#include "qualitycontroller.h"
 
 class VideoOutput
 {
@@ -16,29 +25,157 @@ class VideoOutput
   VideoOutput(std::shared_ptr<AVFrameQueue> queue,
               std::shared_ptr<AVSync> avsync);
 
+  // 在init()之前调用：再增加一路视频。多路视频在同一个窗口中按网格排列，
+  // 每一路按自己的时钟显示，同一时刻到期的几路合并为一次present。
+  // seek按键同时作用于所有视频，各自交给自己的seek_handler
+  void add_stream(std::shared_ptr<AVFrameQueue> queue,
+                  std::shared_ptr<AVSync> avsync,
+                  int width,
+                  int height,
+                  AVRational time_base,
+                  std::function<void(std::chrono::nanoseconds)> seek_handler);
+
+  // 多路时每一格的尺寸，按格子缩放后的帧上传纹理时不再需要GPU缩放
+  static std::pair<int, int> grid_cell_size(size_t count);
+
+  // width/height/time_base是构造时传入的第一路视频的参数
   int init(int width, int height, AVRational time_base);
   void deinit();
   void main_loop();
 
+  // 落后主时钟超过threshold的帧在上传纹理之前丢弃，0表示不丢帧
+  void set_drop_threshold(std::chrono::milliseconds threshold);
+
+  // 跳转到target（纳秒）。实际的跳转由handler完成（通常是Demuxthread::seek），
+  // 这里负责计时：从请求到新位置第一帧显示的耗时
+  void set_seek_handler(std::function<void(std::chrono::nanoseconds)> handler);
+  void seek(std::chrono::nanoseconds target);
+
+  // 在main_loop()之前调用，启用逐帧步进和倒放（只支持单路）：
+  // 空格暂停/恢复，「.」「,」前进/后退一帧并暂停，「r」倒放/暂停。
+  // 暂停时方向键只移动画面（拖动），空格回到正常播放。
+  // 步进、倒放和拖动的帧来自GOP缓存，期间播放管线停在满队列上，恢复时从当前帧seek。
+  // GOP缓存未命中时不阻塞事件循环，后台解码完成后唤醒再显示
+  void set_gop_cache(std::shared_ptr<GopCache> cache);
+
+  // 在main_loop()之前调用：显示过的帧放入缓存，步进和拖动时先查缓存，未命中才解码
+  void set_frame_cache(std::shared_ptr<FrameCache> cache);
+
+  // 在main_loop()之前调用，启用变速播放（只支持单路）：
+  // 「]」「[」按档位加速/减速，退格键恢复正常速度
+  void set_playback_rate(std::shared_ptr<PlaybackRate> rate);
+
+  // 在main_loop()之前调用：把第一路每一帧的延迟和帧队列深度反馈给解码质量控制
+  void set_quality_controller(std::shared_ptr<QualityController> controller);
+
+  // 在main_loop()之前调用，启用音轨/视频轨切换（只支持单路）：
+  // 「a」「v」切换到下一条音频/视频流，handler收到流的类型和当前播放位置
+  void set_track_handler(
+      std::function<void(AVMediaType, std::chrono::nanoseconds)> handler);
+
+  // 在main_loop()之前调用：进入步进/倒放时handler收到true（暂停声音和音频时钟），
+  // 回到正常播放时收到false
+  void set_pause_handler(std::function<void(bool)> handler);
+
  private:
-  std::optional<SDL_Event> pop_user_event();
-  bool handle_user_event(const SDL_Event &event) const;
-  std::optional<std::chrono::milliseconds> get_next_refresh_duration() const;
-  void refresh_video();
+  enum class Mode
+  {
+    Play,     // 正常播放
+    Step,     // 暂停在步进到的帧上
+    Reverse,  // 倒放
+  };
+
+  // 窗口中的一路视频
+  struct Tile
+  {
+    std::shared_ptr<AVFrameQueue> queue;
+    std::shared_ptr<AVSync> avsync;
+    AVRational time_base{};
+    int width{};
+    int height{};
+    SDL_Texture *texture{};
+    SDL_Rect rect{};         // 在窗口中的位置
+    bool has_frame{false};  // 纹理中已经有画面
+    bool updated{false};    // 本轮刷新上传了新帧，尚未present
+
+    // 当前显示的数据所属的代数，帧队列flush后更新
+    uint64_t generation{0};
+    AVSync::duration last_pts{};
+    int64_t last_ts{AV_NOPTS_VALUE};  // 当前帧的best_effort_timestamp
+    int64_t last_duration{};          // 当前帧的时长，time_base单位
+    std::function<void(std::chrono::nanoseconds)> seek_handler;
+    std::optional<std::chrono::steady_clock::time_point> seek_begin;
+    uint64_t seek_generation{0};
+    // 切换了视频流：新的一代开始时再清空一次已解码帧缓存，
+    // 去掉切换生效之前显示并放入缓存的旧流的帧
+    bool track_switched{false};
+  };
+
+  // 处理所有已到达的事件，返回true表示退出
+  bool handle_pending_events();
+  // 等到deadline或者有事件/新帧到达，返回true表示退出
+  bool wait_until(std::chrono::steady_clock::time_point deadline);
+  bool handle_user_event(const SDL_Event &event);
+  void seek(Tile &tile, std::chrono::nanoseconds target);
+  void seek_relative(std::chrono::nanoseconds offset);
+  // 按网格计算窗口尺寸和每一路的位置
+  void layout(int &window_width, int &window_height);
+  std::optional<std::chrono::nanoseconds> get_next_refresh_duration(
+      Tile &tile);
+  bool should_drop(const Tile &tile, std::chrono::nanoseconds lateness) const;
+  // 取出tile的下一帧上传到纹理，不present
+  void refresh_video(Tile &tile);
+  void upload(Tile &tile, const AVFrame &frame);
+  void present();
+  // 从GOP缓存取当前帧之后/之前的一帧并显示，没有或者还在解码时返回false
+  bool show_cached(Tile &tile, bool forward);
+  void step(bool forward);
+  void toggle_reverse();
+  // 倒放到期时显示前一帧，返回下一次刷新的时刻
+  std::chrono::steady_clock::time_point refresh_reverse();
+  void toggle_pause();
+  // 播放时seek，暂停时从缓存取目标位置的帧显示（拖动）
+  void seek_or_scrub(std::chrono::nanoseconds offset);
+  // direction为正/负时加速/减速，为0时恢复正常速度
+  void change_rate(int direction);
+  void switch_track(AVMediaType type);
+  // 切换模式，离开/回到正常播放时通知m_pause_handler
+  void set_mode(Mode mode);
+  int index(const Tile &tile) const
+  {
+    return static_cast<int>(&tile - m_tiles.data());
+  }
 
  private:
-  std::shared_ptr<AVFrameQueue> m_queue;
-  std::shared_ptr<AVSync> m_avsync;
-  AVRational m_time_base;
-  SDL_Event m_event;
-  SDL_Rect m_rect;
+  std::vector<Tile> m_tiles;
   SDL_Window *m_window{};
   SDL_Renderer *m_renderer{};
-  SDL_Texture *m_texture{};
-  int m_width{};
-  int m_height{};
 
-  uint8_t *m_yuv_buf{};
-  int m_yuv_buf_size{};
   SDL_mutex *m_mutex{};
-};
\ No newline at end of file
+
+  Histogram *m_render_time{};
+  Gauge *m_av_offset{};
+  Counter *m_frames{};
+  Counter *m_dropped{};
+  Histogram *m_present_error{};
+  Gauge *m_present_offset{};
+  std::chrono::milliseconds m_drop_threshold{};
+  Histogram *m_seek_time{};
+  bool m_presented{false};
+
+  std::shared_ptr<GopCache> m_gop_cache;
+  std::shared_ptr<FrameCache> m_frame_cache;
+  std::shared_ptr<PlaybackRate> m_playback_rate;
+  std::shared_ptr<QualityController> m_quality;
+  std::function<void(AVMediaType, std::chrono::nanoseconds)> m_track_handler;
+  std::function<void(bool)> m_pause_handler;
+  std::function<void()> m_wakeup;  // 投递事件唤醒渲染循环
+  // 等待GOP缓存后台解码的步进/拖动，解码完成唤醒后重做；
+  // 重做期间m_retry_begin为第一次请求的时刻，计时从这里开始
+  std::function<void()> m_retry;
+  std::optional<std::chrono::steady_clock::time_point> m_retry_begin;
+  Mode m_mode{Mode::Play};
+  std::chrono::steady_clock::time_point m_reverse_next;
+  Histogram *m_step_time{};
+  Histogram *m_scrub_time{};
+};
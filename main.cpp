@@ -1,7 +1,10 @@
 #include <chrono>
 #include <format>
+#include <future>
 #include <memory>
+#include <thread>
 
+#include <spdlog/fmt/fmt.h>
 #include <spdlog/fmt/std.h>
 #include <spdlog/sinks/basic_file_sink.h>
 #include <spdlog/sinks/stdout_color_sinks.h>
@@ -11,10 +14,25 @@
 #include "ffmpeg/avutil"
 
 #include "audiooutput.h"
+#include "benchmark.h"
 #include "codecthread.h"
+#include "convertthread.h"
 #include "demuxthread.h"
+#include "exporter.h"
 #include "ffmpeg_utils.h"
-#include "lockedqueue.h"
+#include "filterthread.h"
+#include "framecache.h"
+#include "gopcache.h"
+#include "memorybudget.h"
+#include "metrics.h"
+#include "multiview.h"
+#include "nulloutput.h"
+#include "options.h"
+#include "playbackrate.h"
+#include "probecache.h"
+#include "qualitycontroller.h"
+#include "spscqueue.h"
+#include "startup.h"
 #include "videooutput.h"
 
 #undef main
@@ -38,135 +56,817 @@ void init_logging()
   spdlog::flush_every(std::chrono::seconds(1));
   spdlog::set_pattern("[%Y-%m-%d %H:%M:%S.%e] [%^%l%$] [%s:%#] [%!] [%t] %v");
 }
+
+// 按队列所在的边（如video_packets）注册push/pop等待时长直方图
+template <typename Q>
+void bind_queue_metrics(Q& queue, const std::string& edge)
+{
+  auto& metrics = Metrics::instance();
+  queue.set_wait_histograms(&metrics.histogram(edge + "_push_wait_ns"),
+                            &metrics.histogram(edge + "_pop_wait_ns"));
+}
+
+// 队列中缓存的包/帧按流和类别记入全局内存账
+template <typename Q>
+void bind_queue_memory(Q& queue,
+                       const std::string& stream,
+                       const std::string& category)
+{
+  queue.set_memory_account(
+      &MemoryBudget::instance().account(stream, category));
+}
+
+// 只有音频时没有窗口和事件循环，等到播放完毕或者收到SDL_QUIT（如Ctrl+C）
+void wait_audio(const AudioOutput& audio_output)
+{
+  SDL_Event event;
+  while (!audio_output.drained())
+  {
+    if (SDL_WaitEventTimeout(&event, 100) && event.type == SDL_QUIT)
+    {
+      SPDLOG_INFO("SDL_QUIT");
+      return;
+    }
+  }
+}
 }  // namespace
 
 namespace test
 {
-void locked_queue_test()
+struct Item
+{
+  uint64_t generation{};
+  int64_t pts{-1};
+  size_t size{};
+};
+
+struct ItemTraits
 {
-  LockedQueue<int> q;
-  std::jthread producers[1];
-  std::jthread consumers[3];
+  static size_t bytes(const Item& item) { return item.size; }
+  static std::optional<int64_t> timestamp(const Item& item)
+  {
+    if (item.pts < 0)
+    {
+      return std::nullopt;
+    }
+    return item.pts;
+  }
+};
 
+using ItemQueue = SpscQueue<Item, ItemTraits>;
+
+// 覆盖flush代数、peek后flush、flush撤销finish、字节/时长限制，
+// 最后用生产者/消费者两个线程交替flush压测；失败时打印原因并返回false
+bool spsc_queue_test()
+{
   using namespace std::chrono_literals;
 
-  for (int n = 0; auto& producer : producers)
+  bool ok = true;
+  const auto check = [&ok](bool cond, const char* what)
   {
-    producer = std::jthread(
-        [n, &q]()
-        {
-          for (int v = 0; v < 10; v++)
-          {
-            SPDLOG_INFO("producer {} push: {}", n, v);
-            q.push(v);
-            std::this_thread::sleep_for(1s);
-          }
-        });
-    n++;
+    if (!cond)
+    {
+      SPDLOG_ERROR("spsc_queue_test: {}", what);
+      ok = false;
+    }
+  };
+  const auto push = [](ItemQueue& q, Item item) { return q.try_push(item); };
+
+  // flush()之前入队的元素被消费者丢弃，并得知新的代数和起始时间戳
+  {
+    ItemQueue q(8);
+    for (int64_t pts = 0; pts < 3; pts++)
+    {
+      push(q, {0, pts, 10});
+    }
+    q.flush(1, 100);
+    push(q, {1, 100, 10});
+    const auto v = q.try_pop();
+    check(v && v->generation == 1, "flush: stale item not discarded");
+    check(q.generation() == 1, "flush: generation not updated");
+    check(q.resume_timestamp() == 100, "flush: resume timestamp lost");
+    check(q.empty() && q.bytes() == 0, "flush: bytes not released");
+  }
+
+  // peek()之后的flush()不影响紧接着的出队，下一次出队才应用新代数
+  {
+    ItemQueue q(8);
+    push(q, {0, 0, 0});
+    const auto peeked = q.peek();
+    check(peeked && peeked->pts == 0, "peek: front item not visible");
+    q.flush(1);
+    push(q, {1, 1, 0});
+    auto v = q.try_pop();
+    check(v && v->pts == 0 && q.generation() == 0,
+          "peek: peeked item not popped");
+    v = q.try_pop();
+    check(v && v->pts == 1 && q.generation() == 1,
+          "peek: flush not applied after the peeked item");
+  }
+
+  // finish()之后flush()，生产者可以继续入队
+  {
+    ItemQueue q(8);
+    q.finish();
+    check(!q.pop(10ms) && q.finished(), "finish: queue not finished");
+    q.flush(1);
+    check(!q.finished(), "finish: not undone by flush");
+    check(push(q, {1, 0, 0}), "finish: push after flush rejected");
+    const auto v = q.pop(10ms);
+    check(v && v->generation == 1, "finish: item after flush lost");
   }
 
-  for (int n = 0; auto& consumer : consumers)
+  // 按字节/时长限制，单个超大元素在队列为空时仍可入队
   {
-    consumer = std::jthread(
-        [n, &q]()
+    ItemQueue q(8);
+    q.set_limits({.max_bytes = 100, .max_duration = 10});
+    check(push(q, {0, 0, 60}) && push(q, {0, 5, 60}), "limits: push");
+    check(q.full() && !push(q, {0, 6, 0}), "limits: byte limit ignored");
+    q.try_pop();
+    check(!q.full() && q.duration() == 5, "limits: pop not accounted");
+    push(q, {0, 20, 0});
+    check(q.full(), "limits: duration limit ignored");
+    q.flush(1);
+    q.try_pop();
+    check(q.empty() && q.duration() == 0, "limits: flush not accounted");
+    check(push(q, {1, 30, 1000}), "limits: oversized item rejected");
+  }
+
+  // 生产者每入队一段就flush一次，消费者只能看到当前代数内递增的元素
+  {
+    constexpr int64_t count = 100000;
+    constexpr int64_t flush_every = 997;
+    ItemQueue q(64);
+
+    std::jthread producer(
+        [&q, &push]()
         {
-          while (true)
+          uint64_t generation = 0;
+          for (int64_t pts = 0; pts < count; pts++)
           {
-            SPDLOG_INFO("consumer {} pop: {}", n, q.pop());
+            if (pts && pts % flush_every == 0)
+            {
+              q.flush(++generation, pts);
+            }
+            Item item{generation, pts, 1};
+            while (!q.push(item, 10ms))
+            {
+            }
           }
+          q.finish();
         });
-    n++;
+
+    int64_t last = -1;
+    uint64_t generation = 0;
+    bool ordered = true;
+    while (!q.finished())
+    {
+      // 隔几次先peek()，让生产者有机会在peek与pop之间flush
+      if (last % 3 == 0)
+      {
+        q.peek();
+      }
+      const auto v = q.pop(10ms);
+      if (!v)
+      {
+        continue;
+      }
+      ordered = ordered && v->generation == q.generation() &&
+                v->generation >= generation && v->pts > last;
+      if (const auto resume = q.resume_timestamp())
+      {
+        ordered = ordered && v->pts >= *resume;
+      }
+      generation = v->generation;
+      last = v->pts;
+    }
+    producer.join();
+
+    check(ordered, "threads: stale or out-of-order item");
+    check(last == count - 1, "threads: last item lost");
+    check(q.bytes() == 0, "threads: bytes leaked");
   }
+
+  return ok;
 }
 }  // namespace test
 
 int main(int ac, char** av)
 {
+  StartupTimeline::instance().start();
   init_logging();
 
   SPDLOG_INFO("ffmpeg avutil verion: {}", avutil_version());
   SPDLOG_INFO("ffmpeg avformat verion: {}", avformat_version());
   SPDLOG_INFO("ffmpeg avcodec verion: {}", avcodec_version());
 
-  if (ac != 2)
+  const auto opts = PlayerOptions::parse(ac, av);
+  if (!opts)
   {
-    SPDLOG_ERROR("please input a video, such as: {} time.mp4", av[0]);
     return -1;
   }
 
-  auto audio_packet_queue = std::make_shared<AVPacketQueue>();
-  auto video_packet_queue = std::make_shared<AVPacketQueue>();
-  auto audio_frame_queue = std::make_shared<AVFrameQueue>();
-  auto video_frame_queue = std::make_shared<AVFrameQueue>();
-  auto avsync = std::make_shared<AVSync>();
+  MemoryBudget::instance().set_cap(opts->memory_limit);
+  if (opts->memory_log_interval.count() > 0)
+  {
+    MemoryBudget::instance().start_log(opts->memory_log_interval);
+  }
+
+  if (!opts->export_path.empty())
+  {  // 导出：不播放，全速解码、重新编码并写入文件
+    Exporter exporter(*opts);
+    auto ret = exporter.init();
+    if (ret >= 0)
+    {
+      ret = exporter.run();
+    }
+    exporter.deinit();
+    return ret;
+  }
+
+  if (opts->urls.size() > 1)
+  {  // 多路：所有流共享一个执行器，画面按网格显示
+    MultiView multiview(*opts);
+    auto ret = multiview.init();
+    if (ret >= 0)
+    {
+      ret = multiview.run();
+    }
+    multiview.deinit();
+    return ret;
+  }
+
+  // 先按两路创建包队列，解复用器打开文件后放弃文件中没有的一路
+  auto audio_packet_queue = std::make_shared<AVPacketQueue>(256);
+  auto video_packet_queue = std::make_shared<AVPacketQueue>(256);
+  bind_queue_metrics(*audio_packet_queue, "audio_packets");
+  bind_queue_metrics(*video_packet_queue, "video_packets");
+  bind_queue_memory(*audio_packet_queue, "audio", "packets");
+  bind_queue_memory(*video_packet_queue, "video", "packets");
+  if (!opts->metrics_file.empty())
+  {
+    Metrics::instance().start_dump(
+        opts->metrics_file, opts->metrics_format, opts->metrics_interval);
+  }
 
   auto demux_thread =
       std::make_shared<Demuxthread>(audio_packet_queue, video_packet_queue);
-  auto audio_decode_thread =
-      std::make_shared<CodecThread>(audio_packet_queue, audio_frame_queue);
-  auto video_decode_thread =
-      std::make_shared<CodecThread>(video_packet_queue, video_frame_queue);
-  auto audio_output = std::make_shared<AudioOutput>(audio_frame_queue, avsync);
-  auto video_output = std::make_shared<VideoOutput>(video_frame_queue, avsync);
 
-  if (const auto ret = demux_thread->init(av[1]); ret < 0)
+  std::shared_ptr<ProbeCache> probe_cache;
+  if (!opts->probe_cache.empty())
+  {
+    probe_cache = std::make_shared<ProbeCache>(opts->probe_cache);
+    demux_thread->set_probe_cache(probe_cache);
+  }
+  demux_thread->set_probe_limits(opts->probesize, opts->analyze_duration);
+  demux_thread->set_io_options(opts->io);
+
+  // 探测输入的同时初始化SDL的音视频子系统，两者互不依赖；
+  // 子系统只是加载后端，音频设备和窗口要等知道有哪几路流之后才创建
+  auto demux_init = std::async(std::launch::async,
+                               [&]() { return demux_thread->init(opts->urls.front()); });
+  if (!opts->headless)
+  {
+    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0)
+    {
+      SPDLOG_ERROR("SDL_Init error: {}", SDL_GetError());
+      return -1;
+    }
+    StartupTimeline::instance().mark("sdl_init");
+  }
+  if (const auto ret = demux_init.get(); ret < 0)
   {
     SPDLOG_ERROR("demux_thread init error: {}", Utils::error_stringify(ret));
     return ret;
   }
+  StartupTimeline::instance().mark("demux_open");
+
+  // 只搭建文件中实际存在的分支，没有的一路不创建队列、解码线程和输出
+  const auto has_audio = demux_thread->has_audio();
+  const auto has_video = demux_thread->has_video();
+  if (!has_audio)
+  {
+    audio_packet_queue.reset();
+  }
+  if (!has_video)
+  {
+    video_packet_queue.reset();
+  }
 
-  if (const auto ret =
-          audio_decode_thread->init(demux_thread->audio_codec_params());
-      ret < 0)
+  // 缺少主时钟所在的一路时：只有视频按外部时钟播放，只有音频以音频为准
+  auto sync_master = opts->sync_master;
+  if (!has_audio && sync_master == AVSync::Master::Audio)
+  {
+    sync_master = AVSync::Master::External;
+  }
+  else if (!has_video && sync_master != AVSync::Master::Audio)
+  {
+    sync_master = AVSync::Master::Audio;
+  }
+  SPDLOG_INFO("audio {}, video {}, master clock {}",
+              has_audio ? "on" : "off",
+              has_video ? "on" : "off",
+              static_cast<int>(sync_master));
+  auto avsync = std::make_shared<AVSync>(sync_master);
+
+  std::shared_ptr<AVFrameQueue> audio_decoded_queue;
+  std::shared_ptr<AVFrameQueue> audio_frame_queue;
+  std::shared_ptr<AVFrameQueue> video_decoded_queue;
+  std::shared_ptr<AVFrameQueue> video_filtered_queue;
+  std::shared_ptr<AVFrameQueue> video_frame_queue;
+  std::shared_ptr<CodecThread> audio_decode_thread;
+  std::shared_ptr<CodecThread> video_decode_thread;
+  std::shared_ptr<FilterThread> audio_filter_thread;
+  std::shared_ptr<FilterThread> video_filter_thread;
+  std::shared_ptr<ConvertThread> video_convert_thread;
+
+  // 每路流的内存上限：包队列按字节和缓存时长，帧队列按帧数和缓存时长
+  constexpr auto packet_buffer = std::chrono::seconds(3);
+  constexpr auto frame_buffer = std::chrono::seconds(1);
+  const auto audio_tb = demux_thread->audio_stream_time_base();
+  const auto video_tb = demux_thread->video_stream_time_base();
+  if (has_audio)
+  {
+    audio_frame_queue = std::make_shared<AVFrameQueue>(64);
+    bind_queue_metrics(*audio_frame_queue, "audio_frames");
+    bind_queue_memory(*audio_frame_queue, "audio", "frames");
+    audio_packet_queue->set_limits(
+        {.max_bytes = 4 * 1024 * 1024,
+         .max_duration = Utils::to_time_base(packet_buffer, audio_tb)});
+    audio_frame_queue->set_limits(
+        {.max_count = 64,
+         .max_duration = Utils::to_time_base(frame_buffer, audio_tb)});
+    audio_decoded_queue = audio_frame_queue;
+    if (!opts->audio_filter.empty())
+    {  // 解码 -> audio_decoded -> 滤镜 -> audio_frames
+      audio_decoded_queue = std::make_shared<AVFrameQueue>(64);
+      bind_queue_metrics(*audio_decoded_queue, "audio_decoded");
+      bind_queue_memory(*audio_decoded_queue, "audio", "decoded_frames");
+      audio_decoded_queue->set_limits(
+          {.max_count = 16,
+           .max_duration = Utils::to_time_base(frame_buffer, audio_tb)});
+      audio_filter_thread = std::make_shared<FilterThread>(audio_decoded_queue,
+                                                           audio_frame_queue);
+    }
+    audio_decode_thread =
+        std::make_shared<CodecThread>(audio_packet_queue, audio_decoded_queue);
+  }
+  if (has_video)
+  {
+    video_decoded_queue = std::make_shared<AVFrameQueue>(16);
+    video_frame_queue = std::make_shared<AVFrameQueue>(16);
+    bind_queue_metrics(*video_decoded_queue, "video_decoded");
+    bind_queue_metrics(*video_frame_queue, "video_frames");
+    bind_queue_memory(*video_decoded_queue, "video", "decoded_frames");
+    bind_queue_memory(*video_frame_queue, "video", "frames");
+    video_packet_queue->set_limits(
+        {.max_bytes = 32 * 1024 * 1024,
+         .max_duration = Utils::to_time_base(packet_buffer, video_tb)});
+    video_decoded_queue->set_limits(
+        {.max_count = 4,
+         .max_bytes = 128 * 1024 * 1024,
+         .max_duration = Utils::to_time_base(frame_buffer, video_tb)});
+    video_frame_queue->set_limits(
+        {.max_count = 8,
+         .max_bytes = 256 * 1024 * 1024,
+         .max_duration = Utils::to_time_base(frame_buffer, video_tb)});
+    video_decode_thread =
+        std::make_shared<CodecThread>(video_packet_queue, video_decoded_queue);
+    video_filtered_queue = video_decoded_queue;
+    if (!opts->video_filter.empty())
+    {  // 解码 -> video_decoded -> 滤镜 -> video_filtered -> 转换
+      video_filtered_queue = std::make_shared<AVFrameQueue>(16);
+      bind_queue_metrics(*video_filtered_queue, "video_filtered");
+      bind_queue_memory(*video_filtered_queue, "video", "filtered_frames");
+      video_filtered_queue->set_limits(
+          {.max_count = 4,
+           .max_bytes = 128 * 1024 * 1024,
+           .max_duration = Utils::to_time_base(frame_buffer, video_tb)});
+      video_filter_thread = std::make_shared<FilterThread>(
+          video_decoded_queue, video_filtered_queue);
+    }
+    video_convert_thread = std::make_shared<ConvertThread>(
+        video_filtered_queue, video_frame_queue);
+  }
+
+  // 两个解码器并行打开，视频解码器（多线程时需要创建线程池）通常更慢
+  auto audio_decoder_init = std::async(
+      std::launch::async,
+      [&]()
+      {
+        if (!audio_decode_thread)
+        {
+          return 0;
+        }
+        const auto ret = audio_decode_thread->init(
+            demux_thread->audio_codec_params(), opts->audio_threading);
+        if (ret >= 0)
+        {
+          StartupTimeline::instance().mark("audio_decoder_open");
+        }
+        return ret;
+      });
+  int video_decoder_ret = 0;
+  if (video_decode_thread)
+  {
+    video_decoder_ret = video_decode_thread->init(
+        demux_thread->video_codec_params(), opts->video_threading);
+    if (video_decoder_ret >= 0)
+    {
+      StartupTimeline::instance().mark("video_decoder_open");
+    }
+  }
+
+  if (const auto ret = audio_decoder_init.get(); ret < 0)
   {
     SPDLOG_ERROR("audio_decode_thread init error: {}",
                  Utils::error_stringify(ret));
     return ret;
   }
 
-  if (const auto ret =
-          video_decode_thread->init(demux_thread->video_codec_params());
-      ret < 0)
+  if (const auto ret = video_decoder_ret; ret < 0)
   {
     SPDLOG_ERROR("video_decode_thread init error: {}",
                  Utils::error_stringify(ret));
     return ret;
   }
 
-  if (const auto ret =
-          audio_output->init(*demux_thread->audio_codec_params(),
-                             demux_thread->audio_stream_time_base());
-      ret < 0)
+  if (audio_filter_thread)
   {
-    SPDLOG_ERROR("audio_output init error");
-    return ret;
+    if (const auto ret =
+            audio_filter_thread->init(opts->audio_filter,
+                                      demux_thread->audio_codec_params(),
+                                      audio_tb,
+                                      opts->filter_threads);
+        ret < 0)
+    {
+      SPDLOG_ERROR("audio_filter_thread init error: {}",
+                   Utils::error_stringify(ret));
+      return ret;
+    }
   }
 
-  if (const auto ret =
-          video_output->init(demux_thread->video_codec_params()->width,
-                             demux_thread->video_codec_params()->height,
-                             demux_thread->video_stream_time_base());
-      ret < 0)
+  // 输出的画面尺寸，滤镜（裁剪/缩放）可能改变解码的尺寸
+  int video_width = 0;
+  int video_height = 0;
+  if (video_filter_thread)
   {
-    SPDLOG_ERROR("video_output init error");
-    return ret;
+    if (const auto ret =
+            video_filter_thread->init(opts->video_filter,
+                                      demux_thread->video_codec_params(),
+                                      video_tb,
+                                      opts->filter_threads);
+        ret < 0)
+    {
+      SPDLOG_ERROR("video_filter_thread init error: {}",
+                   Utils::error_stringify(ret));
+      return ret;
+    }
+    video_width = video_filter_thread->width();
+    video_height = video_filter_thread->height();
+  }
+  else if (has_video)
+  {
+    video_width = demux_thread->video_codec_params()->width;
+    video_height = demux_thread->video_codec_params()->height;
+  }
+
+  if (video_convert_thread)
+  {
+    if (const auto ret = video_convert_thread->init(
+            video_width,
+            video_height,
+            AV_PIX_FMT_YUV420P,
+            opts->convert_threads);
+        ret < 0)
+    {
+      SPDLOG_ERROR("video_convert_thread init error: {}",
+                   Utils::error_stringify(ret));
+      return ret;
+    }
+  }
+
+  // 步进/倒放用的GOP缓存在第一次使用时才打开文件，不影响起播。
+  // 它的私有管线不经过滤镜，有视频滤镜时取出的帧与播放的画面不同（未裁剪、
+  // 未去隔行，yadif=1时连pts都对不上），这时不用GOP缓存，只用已解码帧缓存
+  std::shared_ptr<GopCache> gop_cache;
+  if (!opts->headless && has_video && opts->gop_cache > 0 &&
+      !opts->video_filter.empty())
+  {
+    SPDLOG_INFO("gop cache disabled with video filter \"{}\"",
+                opts->video_filter);
+  }
+  else if (!opts->headless && has_video && opts->gop_cache > 0)
+  {
+    gop_cache = std::make_shared<GopCache>(opts->gop_cache);
+    gop_cache->set_probe_cache(probe_cache);
+    gop_cache->set_io_options(opts->io);
+  }
+
+  // 切换音视频流时，解码器在同一代换用新流的参数。新流的time_base可能不同：
+  // 帧上带有time_base，队列的时长上限按新的time_base重新换算，GOP缓存也换到新流
+  demux_thread->set_stream_change_handler(
+      [=](AVMediaType type, const AVStream* stream, uint64_t generation)
+      {
+        const auto to_time_base = [stream](std::chrono::seconds duration)
+        { return Utils::to_time_base(duration, stream->time_base); };
+        if (type == AVMEDIA_TYPE_AUDIO)
+        {
+          audio_decode_thread->set_codec_params(stream->codecpar, generation);
+          audio_packet_queue->set_max_duration(to_time_base(packet_buffer));
+          audio_decoded_queue->set_max_duration(to_time_base(frame_buffer));
+          audio_frame_queue->set_max_duration(to_time_base(frame_buffer));
+          return;
+        }
+        video_decode_thread->set_codec_params(stream->codecpar, generation);
+        video_packet_queue->set_max_duration(to_time_base(packet_buffer));
+        for (const auto& queue :
+             {video_decoded_queue, video_filtered_queue, video_frame_queue})
+        {
+          queue->set_max_duration(to_time_base(frame_buffer));
+        }
+        if (gop_cache)
+        {
+          gop_cache->select_stream(stream->index, stream->time_base);
+        }
+      });
+
+  // 按依赖顺序启动/停止存在的阶段
+  const auto start_pipeline = [&]()
+  {
+    demux_thread->start();
+    if (audio_decode_thread)
+    {
+      audio_decode_thread->start();
+    }
+    if (video_decode_thread)
+    {
+      video_decode_thread->start();
+      video_convert_thread->start();
+    }
+    for (const auto& filter : {audio_filter_thread, video_filter_thread})
+    {
+      if (filter)
+      {
+        filter->start();
+      }
+    }
+  };
+  const auto stop_pipeline = [&]()
+  {
+    for (const auto& filter : {audio_filter_thread, video_filter_thread})
+    {
+      if (filter)
+      {
+        filter->stop();
+      }
+    }
+    if (video_decode_thread)
+    {
+      video_convert_thread->stop();
+      video_decode_thread->stop();
+    }
+    if (audio_decode_thread)
+    {
+      audio_decode_thread->stop();
+    }
+    demux_thread->stop();
+  };
+  const auto deinit_pipeline = [&]()
+  {
+    for (const auto& filter : {audio_filter_thread, video_filter_thread})
+    {
+      if (filter)
+      {
+        filter->deinit();
+      }
+    }
+    if (video_decode_thread)
+    {
+      video_convert_thread->deinit();
+      video_decode_thread->deinit();
+    }
+    if (audio_decode_thread)
+    {
+      audio_decode_thread->deinit();
+    }
+    demux_thread->deinit();
+  };
+
+  if (opts->headless)
+  {
+    std::shared_ptr<NullOutput> audio_sink;
+    std::shared_ptr<NullOutput> video_sink;
+    if (has_audio)
+    {
+      audio_sink = std::make_shared<NullOutput>(audio_frame_queue, avsync);
+      audio_sink->init(audio_tb, opts->realtime);
+    }
+    if (has_video)
+    {
+      video_sink = std::make_shared<NullOutput>(video_frame_queue, avsync);
+      video_sink->init(video_tb, opts->realtime);
+    }
+
+    const auto begin = std::chrono::steady_clock::now();
+    const auto cpu_begin = StageStats::process_cpu_time();
+    avsync->set_master(AVSync::Master::External);
+    avsync->external_clock().set(AVSync::duration::zero());
+    // 没有音频设备，倍速时只丢弃音频包；配合--realtime测量倍速播放的解码开销
+    PlaybackRate playback_rate(
+        avsync, demux_thread, video_decode_thread, nullptr);
+    playback_rate.set(opts->rate);
+    start_pipeline();
+    for (const auto& sink : {audio_sink, video_sink})
+    {
+      if (sink)
+      {
+        sink->start();
+      }
+    }
+
+    for (const auto& sink : {audio_sink, video_sink})
+    {
+      if (sink)
+      {
+        sink->wait();
+      }
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - begin;
+    playback_rate.log();
+    stop_pipeline();
+
+    BenchmarkReport report;
+    report.elapsed = elapsed;
+    report.process_cpu = StageStats::process_cpu_time() - cpu_begin;
+    report.end_to_end_frames =
+        (video_sink ? video_sink : audio_sink)
+            ->stats()
+            .frames.load(std::memory_order_relaxed);
+    report.add_stage("demux", demux_thread->stats());
+    if (has_audio)
+    {
+      report.add_stage("audio_decode", audio_decode_thread->stats());
+      if (audio_filter_thread)
+      {
+        report.add_stage("audio_filter", audio_filter_thread->stats());
+      }
+      report.add_stage("audio_output", audio_sink->stats());
+      report.add_queue("audio_packets", *audio_packet_queue);
+      if (audio_filter_thread)
+      {
+        report.add_queue("audio_decoded", *audio_decoded_queue);
+      }
+      report.add_queue("audio_frames", *audio_frame_queue);
+    }
+    if (has_video)
+    {
+      report.add_stage("video_decode", video_decode_thread->stats());
+      if (video_filter_thread)
+      {
+        report.add_stage("video_filter", video_filter_thread->stats());
+      }
+      report.add_stage("video_convert", video_convert_thread->stats());
+      report.add_stage("video_output", video_sink->stats());
+      report.add_queue("video_packets", *video_packet_queue);
+      report.add_queue("video_decoded", *video_decoded_queue);
+      if (video_filter_thread)
+      {
+        report.add_queue("video_filtered", *video_filtered_queue);
+      }
+      report.add_queue("video_frames", *video_frame_queue);
+    }
+    report.log();
+    MemoryBudget::instance().log();
+    fmt::print("{}\n", report.to_json());
+
+    deinit_pipeline();
+    return 0;
+  }
+
+  // 先启动解复用和解码，输出设备创建期间首帧已经在队列中等待
+  start_pipeline();
+
+  // 打开音频设备与创建窗口并行，窗口和渲染器必须在主线程创建
+  std::shared_ptr<AudioOutput> audio_output;
+  std::shared_ptr<VideoOutput> video_output;
+  if (has_audio)
+  {
+    audio_output = std::make_shared<AudioOutput>(audio_frame_queue, avsync);
+  }
+  auto audio_output_init = std::async(
+      std::launch::async,
+      [&]()
+      {
+        if (!audio_output)
+        {
+          return 0;
+        }
+        const auto ret =
+            audio_output->init(*demux_thread->audio_codec_params(),
+                               demux_thread->audio_stream_time_base());
+        if (ret >= 0)
+        {
+          StartupTimeline::instance().mark("audio_output_open");
+        }
+        return ret;
+      });
+
+  int video_output_ret = 0;
+  if (has_video)
+  {
+    video_output = std::make_shared<VideoOutput>(video_frame_queue, avsync);
+    video_output->set_drop_threshold(opts->drop_threshold);
+    video_output->set_seek_handler(
+        [demux_thread](std::chrono::nanoseconds target)
+        { demux_thread->seek(target); });
+    video_output->set_track_handler(
+        [demux_thread](AVMediaType type, std::chrono::nanoseconds position)
+        {
+          demux_thread->select_stream(
+              type, Demuxthread::NEXT_STREAM, position);
+        });
+    if (audio_output)
+    {
+      video_output->set_pause_handler([audio_output](bool paused)
+                                      { audio_output->set_paused(paused); });
+    }
+    video_output_ret =
+        video_output->init(video_width,
+                           video_height,
+                           demux_thread->video_stream_time_base());
+    if (video_output_ret >= 0)
+    {
+      StartupTimeline::instance().mark("video_output_open");
+    }
+  }
+
+  const auto audio_output_ret = audio_output_init.get();
+  if (audio_output_ret < 0 || video_output_ret < 0)
+  {
+    SPDLOG_ERROR("{} init error",
+                 audio_output_ret < 0 ? "audio_output" : "video_output");
+    stop_pipeline();
+    if (audio_output && audio_output_ret >= 0)
+    {
+      audio_output->deinit();
+    }
+    return audio_output_ret < 0 ? audio_output_ret : video_output_ret;
+  }
+
+  auto playback_rate = std::make_shared<PlaybackRate>(
+      avsync, demux_thread, video_decode_thread, audio_output);
+  playback_rate->set(opts->rate);
+
+  if (!video_output)
+  {  // 只有音频：没有窗口，播放到结尾或者收到退出信号
+    wait_audio(*audio_output);
+    playback_rate->log();
+    MemoryBudget::instance().log();
+    stop_pipeline();
+    audio_output->deinit();
+    deinit_pipeline();
+    return 0;
+  }
+
+  if (gop_cache)
+  {
+    gop_cache->init(opts->urls.front(),
+                    video_width,
+                    video_height,
+                    demux_thread->video_stream_time_base());
+    video_output->set_gop_cache(gop_cache);
+  }
+
+  if (opts->frame_cache > 0)
+  {
+    video_output->set_frame_cache(
+        std::make_shared<FrameCache>(opts->frame_cache));
   }
 
-  demux_thread->start();
-  audio_decode_thread->start();
-  video_decode_thread->start();
+  video_output->set_playback_rate(playback_rate);
+  if (opts->adaptive_quality)
+  {
+    video_output->set_quality_controller(
+        std::make_shared<QualityController>(video_decode_thread));
+  }
 
   video_output->main_loop();
+  playback_rate->log();
+  MemoryBudget::instance().log();
 
-  video_decode_thread->stop();
-  audio_decode_thread->stop();
-  demux_thread->stop();
+  stop_pipeline();
+  if (gop_cache)
+  {
+    gop_cache->deinit();
+  }
 
   video_output->deinit();
-  audio_output->deinit();
-  video_decode_thread->deinit();
-  audio_decode_thread->deinit();
-  demux_thread->deinit();
+  if (audio_output)
+  {
+    audio_output->deinit();
+  }
+  deinit_pipeline();
 
   return 0;
 }
@@ -1,175 +1,61 @@
 #include "audiooutput.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
 #include <spdlog/fmt/std.h>
 #include <spdlog/spdlog.h>
 
 #include "ffmpeg_utils.h"
+#include "startup.h"
 
 namespace
 {
-constexpr auto MS_PER_S = std::chrono::milliseconds::period::den /
-                          std::chrono::milliseconds::period::num;
+constexpr int64_t NS_PER_S = 1000000000;
+constexpr auto RING_DURATION = std::chrono::milliseconds(200);
 }  // namespace
 
 void fill_audio_pcm(void* userdata, uint8_t* stream, int len)
 {
-  // 从frame queue读取解码后的PCM的数据，填充到stream，最大填充len长度到stream。
-  // 假设len:4000B, 一个frame有6000B, 一次读取了4000B, 这个frame胜了2000B
+  // 运行在SDL的实时音频线程：只做有界的memcpy/memset和时钟更新，
+  // 不等待、不加锁、不分配内存
   AudioOutput* is = reinterpret_cast<AudioOutput*>(userdata);
-  int len1{};
-  int audio_size{};
-  std::optional<int64_t> opt_pts;
+  ScopedTimer timer(*is->m_callback_time);
+  const auto now = AVSync::clock::now();
 
-  while (len > 0)
-  {
-    SPDLOG_TRACE("while len: {} > 0", len);
-    if (is->m_audio_buf_index == is->m_audio_buf_size)
+  const auto n = is->m_pcm_ring->read(stream, len);
+  const auto playing = is->m_pts_valid.load(std::memory_order_acquire);
+  if (n < static_cast<size_t>(len))
+  {  // 解码跟不上，剩余部分补静音
+    memset(stream + n, 0, len - n);
+    if (playing)
     {
-      is->m_audio_buf_index = 0;
-      SPDLOG_TRACE("audio frame queue size: {}", is->m_queue->size());
-      auto opt = is->m_queue->pop(std::chrono::milliseconds(10));
-      if (opt)
-      {
-        auto frame = opt.value().get();
-
-        SPDLOG_TRACE("  frame: ");
-        SPDLOG_TRACE("   - format({}) ", frame->format);
-        SPDLOG_TRACE("   - sample_rate({}) ", frame->sample_rate);
-        SPDLOG_TRACE("   - channels({}) ", frame->ch_layout.nb_channels);
-
-        opt_pts = frame->pts;
-
-        // 怎么判断是否重采样
-        // 1. PCM数据格式和输出格式不一样
-        // 2. PCM数据采样率和输出不一样
-        // 3. channel layout?
-        // 4. 每次运行只支持一种采样器
-        if (((frame->format != is->m_params.format) ||
-             (frame->sample_rate != is->m_params.freq) ||
-             av_channel_layout_compare(&frame->ch_layout,
-                                       &is->m_params.channel_layout)) &&
-            (!is->m_swr_ctx))
-        {
-          SPDLOG_TRACE("    alloc SwrContext");
-
-          if (const auto ret =
-                  swr_alloc_set_opts2(&is->m_swr_ctx,
-                                      &is->m_params.channel_layout,
-                                      is->m_params.format,
-                                      is->m_params.freq,
-                                      &frame->ch_layout,
-                                      (AVSampleFormat)frame->format,
-                                      frame->sample_rate,
-                                      0,
-                                      nullptr);
-              ret < 0)
-          {
-            SPDLOG_ERROR("swr_alloc_set_opts error");
-            return;
-          }
-          if (const auto ret = swr_init(is->m_swr_ctx); ret < 0)
-          {
-            SPDLOG_ERROR("swr_init error: {}", Utils::error_stringify(ret));
-            swr_free(&is->m_swr_ctx);
-            return;
-          }
-        }
-
-        if (is->m_swr_ctx)
-        {  // 重采样
-          SPDLOG_TRACE("    resampleing");
-          const uint8_t** in = (const uint8_t**)frame->extended_data;
-          uint8_t** out = &is->m_audio_buf1;
-          int out_samples =
-              frame->nb_samples * is->m_params.freq / frame->sample_rate + 256;
-          int out_bytes = av_samples_get_buffer_size(
-              nullptr,
-              is->m_params.channel_layout.nb_channels,
-              out_samples,
-              is->m_params.format,
-              0);
-          if (out_bytes < 0)
-          {
-            SPDLOG_ERROR("av_samples_get_buffer_size error: {}",
-                         Utils::error_stringify(out_bytes));
-            return;
-          }
-          SPDLOG_TRACE(
-              "      out_samples: {}, out_bytes: {}", out_samples, out_bytes);
-
-          av_fast_malloc(&is->m_audio_buf1, &is->m_audio_buf1_size, out_bytes);
-          SPDLOG_TRACE(
-              "      malloc: {} -> {}", out_bytes, is->m_audio_buf1_size);
-
-          const auto len2 = swr_convert(
-              is->m_swr_ctx, out, out_samples, in, frame->nb_samples);
-          if (len2 < 0)
-          {
-            SPDLOG_ERROR("swr_convert error: {}", Utils::error_stringify(len2));
-            return;
-          }
-          is->m_audio_buf = is->m_audio_buf1;
-          is->m_audio_buf_size = av_samples_get_buffer_size(
-              nullptr,
-              is->m_params.channel_layout.nb_channels,
-              len2,
-              is->m_params.format,
-              1);
-          SPDLOG_TRACE("      get sample buffer: {}", is->m_audio_buf_size);
-        }
-        else
-        {  // 不重采样
-          SPDLOG_TRACE("    none resampleing");
-          audio_size = av_samples_get_buffer_size(nullptr,
-                                                  frame->ch_layout.nb_channels,
-                                                  frame->nb_samples,
-                                                  (AVSampleFormat)frame->format,
-                                                  1);
-          SPDLOG_TRACE("    get sample buffer: {}", audio_size);
-
-          av_fast_malloc(&is->m_audio_buf1, &is->m_audio_buf1_size, audio_size);
-          is->m_audio_buf = is->m_audio_buf1;
-          is->m_audio_buf_size = audio_size;
-          SPDLOG_TRACE(
-              "    malloc: {} -> {}", audio_size, is->m_audio_buf1_size);
-
-          memcpy(is->m_audio_buf, frame->data[0], audio_size);
-        }
-      }
-      else
-      {
-        is->m_audio_buf = nullptr;
-        is->m_audio_buf_size = 512;
-        SPDLOG_TRACE("    pop 0 frame packet");
-      }
+      is->m_underruns->add();
     }
+  }
 
-    len1 = is->m_audio_buf_size - is->m_audio_buf_index;
-    if (len1 > len)
-    {
-      len1 = len;
-    }
+  if (n > 0 && playing)
+  {  // 本次写入的数据要等设备缓冲中已有的数据播完才能听到
+    // seek时read()会跳过旧数据，这里的位置要用跳过之后的
+    const auto begin = is->m_pcm_ring->read_position() - n;
+    const auto audible = static_cast<int64_t>(begin) - is->m_latency_bytes;
+    const auto rate = is->m_pts_rate.load(std::memory_order_relaxed);
+    const auto pts = AVSync::duration(
+        is->m_pts_base_ns.load(std::memory_order_relaxed) +
+        std::llround(rate *
+                     av_rescale(audible, NS_PER_S, is->m_bytes_per_sec)));
+    is->m_avsync->audio_clock().set_at(
+        pts, now, is->m_pcm_ring->generation());
 
-    if (!is->m_audio_buf)
-    {
-      memset(stream, 0, len1);
-    }
-    else
+    if (is->m_first_audible_ns.load(std::memory_order_relaxed) == 0)
     {
-      memcpy(stream, is->m_audio_buf + is->m_audio_buf_index, len1);
+      const auto audible_at =
+          now + std::chrono::nanoseconds(av_rescale(
+                    is->m_latency_bytes, NS_PER_S, is->m_bytes_per_sec));
+      is->m_first_audible_ns.store(audible_at.time_since_epoch().count(),
+                                   std::memory_order_relaxed);
     }
-
-    len -= len1;
-    stream += len1;
-    is->m_audio_buf_index += len1;
-  }
-
-  if (opt_pts)
-  {
-    auto pts = std::chrono::milliseconds(
-        MS_PER_S * opt_pts.value() * is->m_time_base.num / is->m_time_base.den);
-    is->m_avsync->set_clock(pts);
-    SPDLOG_DEBUG("audio pts: {}", pts);
   }
 }
 
@@ -177,6 +63,9 @@ AudioOutput::AudioOutput(std::shared_ptr<AVFrameQueue> queue,
                          std::shared_ptr<AVSync> avsync)
     : m_queue(queue)
     , m_avsync(avsync)
+    , m_callback_time(&Metrics::instance().histogram("audio_callback_ns"))
+    , m_underruns(&Metrics::instance().counter("audio_underruns"))
+    , m_memory(&MemoryBudget::instance().account("audio", "output_buffers"))
 {
 }
 
@@ -186,7 +75,11 @@ int AudioOutput::init(const AVCodecParameters& params, AVRational time_base)
 {
   m_time_base = time_base;
 
-  if (const auto ret = SDL_Init(SDL_INIT_AUDIO); ret < 0)
+  // 音频子系统可能已经由main()提前初始化，SDL_WasInit只读不改状态，
+  // 可以和主线程创建窗口并发执行
+  if (const auto ret =
+          SDL_WasInit(SDL_INIT_AUDIO) ? 0 : SDL_Init(SDL_INIT_AUDIO);
+      ret < 0)
   {
     SPDLOG_ERROR("SDL_Init(SDL_INIT_AUDIO) error: {}", SDL_GetError());
     return ret;
@@ -215,6 +108,19 @@ int AudioOutput::init(const AVCodecParameters& params, AVRational time_base)
   }
 
   m_params = spec;
+  m_bytes_per_sec = m_params.freq * m_params.channel_layout.nb_channels *
+                    av_get_bytes_per_sample(m_params.format);
+  // SDL设备内部缓冲一个回调周期的数据
+  m_latency_bytes = spec.size;
+
+  // 环形缓冲至少容纳RING_DURATION的PCM，以及若干次回调的数据量
+  const auto ring_size = std::max<size_t>(
+      av_rescale(m_bytes_per_sec, RING_DURATION.count(), 1000),
+      4 * spec.samples * m_params.channel_layout.nb_channels *
+          av_get_bytes_per_sample(m_params.format));
+  m_pcm_ring = std::make_unique<ByteRing>(ring_size);
+  m_memory->charge(m_pcm_ring->capacity());
+  m_thread = std::jthread([=](std::stop_token token) { run(token); });
 
   SDL_PauseAudio(0);
 
@@ -222,12 +128,330 @@ int AudioOutput::init(const AVCodecParameters& params, AVRational time_base)
   SPDLOG_TRACE(" - format({}) ", static_cast<int>(m_params.format));
   SPDLOG_TRACE(" - sample_rate({}) ", m_params.freq);
   SPDLOG_TRACE(" - channels({}) ", m_params.channel_layout.nb_channels);
+  SPDLOG_INFO("pcm ring: {} bytes, device latency: {} bytes",
+              m_pcm_ring->capacity(),
+              m_latency_bytes);
 
   return 0;
 }
 
 void AudioOutput::deinit()
 {
+  if (m_thread.joinable())
+  {
+    m_thread.request_stop();
+    m_pcm_ring->interrupt();
+    m_thread.join();
+  }
+
   SDL_PauseAudio(1);
   SDL_CloseAudio();
+
+  swr_free(&m_swr_ctx);
+  av_channel_layout_uninit(&m_swr_src_layout);
+  av_freep(&m_audio_buf1);
+  m_memory->release(m_audio_buf1_size);
+  m_audio_buf1_size = 0;
+  if (m_pcm_ring)
+  {
+    m_memory->release(m_pcm_ring->capacity());
+    m_pcm_ring.reset();
+  }
+}
+
+void AudioOutput::run(std::stop_token token)
+{
+  while (!token.stop_requested())
+  {
+    auto opt = m_queue->pop(std::chrono::milliseconds(10));
+    if (m_queue->generation() != m_generation)
+    {
+      flush();
+    }
+
+    if (!m_first_audible_marked)
+    {
+      if (const auto ns = m_first_audible_ns.load(std::memory_order_relaxed))
+      {
+        StartupTimeline::instance().mark(
+            "first_audio_play",
+            StartupTimeline::clock::time_point(std::chrono::nanoseconds(ns)));
+        m_first_audible_marked = true;
+      }
+    }
+
+    if (!opt)
+    {
+      if (m_queue->finished())
+      {  // 播放到结尾，等待seek或者停止
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      continue;
+    }
+
+    auto frame = std::move(*opt);
+    if (frame->time_base.num)
+    {  // 切换音轨之后新一代的帧按新流的time_base
+      m_time_base = frame->time_base;
+    }
+    SPDLOG_TRACE("  frame: ");
+    SPDLOG_TRACE("   - format({}) ", frame->format);
+    SPDLOG_TRACE("   - sample_rate({}) ", frame->sample_rate);
+    SPDLOG_TRACE("   - channels({}) ", frame->ch_layout.nb_channels);
+
+    if (const auto rate = m_rate.load(std::memory_order_relaxed);
+        rate != m_applied_rate)
+    {
+      apply_rate(rate);
+    }
+    if (m_applied_rate > MAX_TEMPO)
+    {  // 速率太高，不播放声音
+      continue;
+    }
+    if (m_applied_rate == 1.0)
+    {
+      if (!render(token, *frame))
+      {
+        break;
+      }
+      continue;
+    }
+
+    // 变速：送入atempo，取出所有已经就绪的输出
+    if (!m_tempo.configured(*frame, m_applied_rate) &&
+        m_tempo.init(*frame, m_time_base, m_applied_rate) < 0)
+    {
+      break;
+    }
+    if (m_tempo.send(*frame) < 0)
+    {
+      break;
+    }
+    bool ok = true;
+    while (const auto out = m_tempo.receive())
+    {
+      if (!(ok = render(token, *out)))
+      {
+        break;
+      }
+    }
+    if (!ok)
+    {
+      break;
+    }
+  }
+  SPDLOG_INFO("audio render thread exit, {} underruns", m_underruns->value());
+}
+
+void AudioOutput::set_rate(double rate)
+{
+  m_rate.store(rate, std::memory_order_relaxed);
+}
+
+void AudioOutput::set_paused(bool paused)
+{
+  if (paused == m_paused)
+  {
+    return;
+  }
+  m_paused = paused;
+  if (paused)
+  {  // 返回之后回调不再运行，这里可以代替回调写音频时钟
+    SDL_PauseAudio(1);
+  }
+
+  // 按当前值重新定基，暂停时不再外推；恢复后由下一次回调按实际播放位置设置
+  auto& clock = m_avsync->audio_clock();
+  const auto pts = clock.get();
+  clock.set_rate(paused ? 0.0 : m_avsync->rate());
+  if (pts)
+  {
+    clock.set(*pts, clock.generation());
+  }
+  SPDLOG_INFO("audio {}", paused ? "paused" : "resumed");
+
+  if (!paused)
+  {
+    SDL_PauseAudio(0);
+  }
+}
+
+bool AudioOutput::drained() const
+{
+  return m_queue->finished() && m_pcm_ring && m_pcm_ring->size() == 0;
+}
+
+void AudioOutput::apply_rate(double rate)
+{
+  SPDLOG_INFO("audio rate {} -> {}{}",
+              m_applied_rate,
+              rate,
+              rate > MAX_TEMPO ? ", muted" : "");
+  m_applied_rate = rate;
+  m_tempo.reset();
+  // 环形缓冲中的数据按旧速率换算pts，丢弃后从新速率的第一帧重新设置基准；
+  // 代数不变，时钟仍属于当前这一代
+  m_pts_valid.store(false, std::memory_order_release);
+  m_pcm_ring->flush(m_generation);
+}
+
+bool AudioOutput::render(std::stop_token token, const AVFrame& frame)
+{
+  const uint8_t* data{};
+  const auto size = resample(frame, &data);
+  if (size < 0)
+  {
+    return false;
+  }
+
+  if (frame.pts != AV_NOPTS_VALUE)
+  {  // 这一帧从字节流的write_position开始
+    const auto pts_ns = AVSync::to_duration(frame.pts, m_time_base).count();
+    const auto written =
+        av_rescale(m_pcm_ring->write_position(), NS_PER_S, m_bytes_per_sec);
+    m_pts_rate.store(m_applied_rate, std::memory_order_relaxed);
+    m_pts_base_ns.store(pts_ns - std::llround(m_applied_rate * written),
+                        std::memory_order_relaxed);
+    m_pts_valid.store(true, std::memory_order_release);
+  }
+
+  write_pcm(token, data, size);
+  return true;
+}
+
+void AudioOutput::flush()
+{
+  m_generation = m_queue->generation();
+  // 新数据的pts基准由下一帧重新设置，在此之前回调不更新时钟
+  m_pts_valid.store(false, std::memory_order_release);
+  m_pcm_ring->flush(m_generation);
+  if (m_swr_ctx)
+  {  // 丢弃重采样器中缓存的旧样本
+    swr_init(m_swr_ctx);
+  }
+  m_tempo.reset();
+  SPDLOG_INFO("audio output flushed, generation {}", m_generation);
+}
+
+void AudioOutput::write_pcm(std::stop_token token,
+                            const uint8_t* data,
+                            size_t size)
+{
+  // 环形缓冲满时等待回调消费，期间出现新的seek则放弃剩余数据
+  while (size > 0 && !token.stop_requested() && !m_queue->flush_pending())
+  {
+    const auto n = m_pcm_ring->write(data, size);
+    data += n;
+    size -= n;
+    if (size > 0)
+    {
+      m_pcm_ring->wait_for_space(size);
+    }
+  }
+}
+
+int AudioOutput::resample(const AVFrame& frame, const uint8_t** data)
+{
+  // 怎么判断是否重采样
+  // 1. PCM数据格式和输出格式不一样
+  // 2. PCM数据采样率和输出不一样
+  // 3. channel layout?
+  // 4. 输入格式变化（切换音轨）时重建采样器
+  if (m_swr_ctx &&
+      (frame.format != m_swr_src_format ||
+       frame.sample_rate != m_swr_src_rate ||
+       av_channel_layout_compare(&frame.ch_layout, &m_swr_src_layout)))
+  {
+    SPDLOG_INFO("audio input format changed, rebuild SwrContext");
+    swr_free(&m_swr_ctx);
+  }
+
+  if (((frame.format != m_params.format) ||
+       (frame.sample_rate != m_params.freq) ||
+       av_channel_layout_compare(&frame.ch_layout, &m_params.channel_layout)) &&
+      (!m_swr_ctx))
+  {
+    SPDLOG_TRACE("    alloc SwrContext");
+
+    if (const auto ret = swr_alloc_set_opts2(&m_swr_ctx,
+                                             &m_params.channel_layout,
+                                             m_params.format,
+                                             m_params.freq,
+                                             &frame.ch_layout,
+                                             (AVSampleFormat)frame.format,
+                                             frame.sample_rate,
+                                             0,
+                                             nullptr);
+        ret < 0)
+    {
+      SPDLOG_ERROR("swr_alloc_set_opts error");
+      return ret;
+    }
+    if (const auto ret = swr_init(m_swr_ctx); ret < 0)
+    {
+      SPDLOG_ERROR("swr_init error: {}", Utils::error_stringify(ret));
+      swr_free(&m_swr_ctx);
+      return ret;
+    }
+    m_swr_src_format = frame.format;
+    m_swr_src_rate = frame.sample_rate;
+    av_channel_layout_uninit(&m_swr_src_layout);
+    av_channel_layout_copy(&m_swr_src_layout, &frame.ch_layout);
+  }
+
+  if (!m_swr_ctx)
+  {  // 不重采样，直接写入帧的数据
+    SPDLOG_TRACE("    none resampleing");
+    *data = frame.data[0];
+    return av_samples_get_buffer_size(nullptr,
+                                      frame.ch_layout.nb_channels,
+                                      frame.nb_samples,
+                                      (AVSampleFormat)frame.format,
+                                      1);
+  }
+
+  // 重采样
+  SPDLOG_TRACE("    resampleing");
+  const uint8_t** in = (const uint8_t**)frame.extended_data;
+  int out_samples = frame.nb_samples * m_params.freq / frame.sample_rate + 256;
+  int out_bytes =
+      av_samples_get_buffer_size(nullptr,
+                                 m_params.channel_layout.nb_channels,
+                                 out_samples,
+                                 m_params.format,
+                                 0);
+  if (out_bytes < 0)
+  {
+    SPDLOG_ERROR("av_samples_get_buffer_size error: {}",
+                 Utils::error_stringify(out_bytes));
+    return out_bytes;
+  }
+  SPDLOG_TRACE("      out_samples: {}, out_bytes: {}", out_samples, out_bytes);
+
+  const auto old_size = m_audio_buf1_size;
+  av_fast_malloc(&m_audio_buf1, &m_audio_buf1_size, out_bytes);
+  if (m_audio_buf1_size != old_size)
+  {
+    m_memory->release(old_size);
+    m_memory->charge(m_audio_buf1_size);
+  }
+  if (!m_audio_buf1)
+  {
+    return AVERROR(ENOMEM);
+  }
+
+  const auto len2 =
+      swr_convert(m_swr_ctx, &m_audio_buf1, out_samples, in, frame.nb_samples);
+  if (len2 < 0)
+  {
+    SPDLOG_ERROR("swr_convert error: {}", Utils::error_stringify(len2));
+    return len2;
+  }
+
+  *data = m_audio_buf1;
+  return av_samples_get_buffer_size(nullptr,
+                                    m_params.channel_layout.nb_channels,
+                                    len2,
+                                    m_params.format,
+                                    1);
 }
@@ -0,0 +1,189 @@
+#include "audiotempo.h"
+
+#include <cmath>
+#include <format>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include "ffmpeg_utils.h"
+
+namespace
+{
+// 单个atempo支持的最小系数
+constexpr double MIN_ATEMPO = 0.5;
+
+// 把tempo拆成若干个atempo系数
+std::vector<double> atempo_factors(double tempo)
+{
+  std::vector<double> factors;
+  while (tempo < MIN_ATEMPO)
+  {
+    factors.push_back(MIN_ATEMPO);
+    tempo /= MIN_ATEMPO;
+  }
+  factors.push_back(tempo);
+  return factors;
+}
+}  // namespace
+
+AudioTempo::AudioTempo()
+    : m_frame(av_frame_alloc())
+{
+}
+
+AudioTempo::~AudioTempo()
+{
+  reset();
+  av_frame_free(&m_frame);
+}
+
+int AudioTempo::init(const AVFrame &frame, AVRational time_base, double tempo)
+{
+  reset();
+  m_graph = avfilter_graph_alloc();
+  if (!m_graph || !m_frame)
+  {
+    return AVERROR(ENOMEM);
+  }
+
+  char layout[64]{};
+  av_channel_layout_describe(&frame.ch_layout, layout, sizeof(layout));
+  const auto args = std::format(
+      "time_base={}/{}:sample_rate={}:sample_fmt={}:channel_layout={}",
+      time_base.num,
+      time_base.den,
+      frame.sample_rate,
+      av_get_sample_fmt_name(static_cast<AVSampleFormat>(frame.format)),
+      layout);
+  if (const auto ret =
+          avfilter_graph_create_filter(&m_src,
+                                       avfilter_get_by_name("abuffer"),
+                                       "in",
+                                       args.c_str(),
+                                       nullptr,
+                                       m_graph);
+      ret < 0)
+  {
+    SPDLOG_ERROR("create abuffer({}) error: {}",
+                 args,
+                 Utils::error_stringify(ret));
+    reset();
+    return ret;
+  }
+  if (const auto ret =
+          avfilter_graph_create_filter(&m_sink,
+                                       avfilter_get_by_name("abuffersink"),
+                                       "out",
+                                       nullptr,
+                                       nullptr,
+                                       m_graph);
+      ret < 0)
+  {
+    SPDLOG_ERROR("create abuffersink error: {}", Utils::error_stringify(ret));
+    reset();
+    return ret;
+  }
+
+  auto *prev = m_src;
+  for (const auto factor : atempo_factors(tempo))
+  {
+    AVFilterContext *atempo{};
+    auto ret =
+        avfilter_graph_create_filter(&atempo,
+                                     avfilter_get_by_name("atempo"),
+                                     nullptr,
+                                     std::format("tempo={}", factor).c_str(),
+                                     nullptr,
+                                     m_graph);
+    if (ret < 0 || (ret = avfilter_link(prev, 0, atempo, 0)) < 0)
+    {
+      SPDLOG_ERROR("create atempo={} error: {}",
+                   factor,
+                   Utils::error_stringify(ret));
+      reset();
+      return ret;
+    }
+    prev = atempo;
+  }
+  if (auto ret = avfilter_link(prev, 0, m_sink, 0);
+      ret < 0 || (ret = avfilter_graph_config(m_graph, nullptr)) < 0)
+  {
+    SPDLOG_ERROR("configure atempo graph error: {}",
+                 Utils::error_stringify(ret));
+    reset();
+    return ret;
+  }
+
+  m_time_base = time_base;
+  m_tempo = tempo;
+  m_format = frame.format;
+  m_sample_rate = frame.sample_rate;
+  av_channel_layout_copy(&m_ch_layout, &frame.ch_layout);
+  m_anchor_pts = AV_NOPTS_VALUE;
+  m_out_samples = 0;
+  SPDLOG_INFO("audio tempo {}: {}", tempo, args);
+  return 0;
+}
+
+void AudioTempo::reset()
+{
+  avfilter_graph_free(&m_graph);
+  m_src = nullptr;
+  m_sink = nullptr;
+  m_format = -1;
+  av_channel_layout_uninit(&m_ch_layout);
+  if (m_frame)
+  {
+    av_frame_unref(m_frame);
+  }
+}
+
+bool AudioTempo::configured(const AVFrame &frame, double tempo) const
+{
+  return m_graph && m_tempo == tempo && m_format == frame.format &&
+         m_sample_rate == frame.sample_rate &&
+         !av_channel_layout_compare(&m_ch_layout, &frame.ch_layout);
+}
+
+int AudioTempo::send(const AVFrame &frame)
+{
+  if (m_anchor_pts == AV_NOPTS_VALUE)
+  {
+    m_anchor_pts = frame.pts;
+  }
+  // KEEP_REF：滤镜只增加引用，调用者的帧不变
+  const auto ret = av_buffersrc_add_frame_flags(
+      m_src, const_cast<AVFrame *>(&frame), AV_BUFFERSRC_FLAG_KEEP_REF);
+  if (ret < 0)
+  {
+    SPDLOG_ERROR("av_buffersrc_add_frame error: {}",
+                 Utils::error_stringify(ret));
+  }
+  return ret;
+}
+
+const AVFrame *AudioTempo::receive()
+{
+  av_frame_unref(m_frame);
+  if (const auto ret = av_buffersink_get_frame(m_sink, m_frame); ret < 0)
+  {
+    if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+    {
+      SPDLOG_ERROR("av_buffersink_get_frame error: {}",
+                   Utils::error_stringify(ret));
+    }
+    return nullptr;
+  }
+
+  // 输出样本数乘以tempo即消耗的输入样本数
+  m_frame->pts =
+      m_anchor_pts == AV_NOPTS_VALUE
+          ? AV_NOPTS_VALUE
+          : m_anchor_pts +
+                av_rescale_q(std::llround(m_out_samples * m_tempo),
+                             AVRational{1, m_sample_rate},
+                             m_time_base);
+  m_out_samples += m_frame->nb_samples;
+  return m_frame;
+}
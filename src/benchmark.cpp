@@ -0,0 +1,119 @@
+#include "benchmark.h"
+
+#include <spdlog/fmt/fmt.h>
+#include <spdlog/spdlog.h>
+
+namespace
+{
+double per_second(uint64_t count, std::chrono::nanoseconds elapsed)
+{
+  const auto seconds = std::chrono::duration<double>(elapsed).count();
+  return seconds > 0 ? count / seconds : 0.0;
+}
+
+double to_mb(double bytes) { return bytes / (1024.0 * 1024.0); }
+
+double to_ms(std::chrono::nanoseconds ns)
+{
+  return std::chrono::duration<double, std::milli>(ns).count();
+}
+
+double speed(std::chrono::nanoseconds media, std::chrono::nanoseconds elapsed)
+{
+  return elapsed.count() > 0 ? 1.0 * media.count() / elapsed.count() : 0.0;
+}
+}  // namespace
+
+void BenchmarkReport::add_stage(std::string name, const StageStats &stats)
+{
+  stages.push_back({std::move(name),
+                    stats.packets.load(std::memory_order_relaxed),
+                    stats.frames.load(std::memory_order_relaxed),
+                    stats.bytes.load(std::memory_order_relaxed),
+                    std::chrono::nanoseconds(
+                        stats.cpu_ns.load(std::memory_order_relaxed))});
+}
+
+void BenchmarkReport::log() const
+{
+  SPDLOG_INFO("benchmark: elapsed {:.1f} ms, end-to-end {} frames, {:.1f} fps",
+              to_ms(elapsed),
+              end_to_end_frames,
+              per_second(end_to_end_frames, elapsed));
+  SPDLOG_INFO("  process cpu {:.1f} ms, {:.2f} cores",
+              to_ms(process_cpu),
+              speed(process_cpu, elapsed));
+  if (media_duration.count() > 0)
+  {
+    SPDLOG_INFO("  media {:.1f} ms, speed {:.2f}x",
+                to_ms(media_duration),
+                speed(media_duration, elapsed));
+  }
+  for (const auto &stage : stages)
+  {
+    SPDLOG_INFO(
+        "  {:<14} {:>8} pkts {:>10.1f} pkt/s {:>8} frames {:>10.1f} fps "
+        "{:>10.1f} MB/s  thread cpu {:>10.1f} ms",
+        stage.name,
+        stage.packets,
+        per_second(stage.packets, elapsed),
+        stage.frames,
+        per_second(stage.frames, elapsed),
+        to_mb(per_second(stage.bytes, elapsed)),
+        to_ms(stage.cpu));
+  }
+  for (const auto &queue : queues)
+  {
+    SPDLOG_INFO("  {:<14} peak depth {} / {}",
+                queue.name,
+                queue.peak,
+                queue.capacity);
+  }
+}
+
+std::string BenchmarkReport::to_json() const
+{
+  std::string out = fmt::format(
+      R"({{"elapsed_ms":{:.3f},"end_to_end_frames":{},"end_to_end_fps":{:.3f},)"
+      R"("process_cpu_ms":{:.3f},)",
+      to_ms(elapsed),
+      end_to_end_frames,
+      per_second(end_to_end_frames, elapsed),
+      to_ms(process_cpu));
+  if (media_duration.count() > 0)
+  {
+    out += fmt::format(R"("media_ms":{:.3f},"speed":{:.3f},)",
+                       to_ms(media_duration),
+                       speed(media_duration, elapsed));
+  }
+  out += R"("stages":[)";
+  for (size_t i = 0; i < stages.size(); i++)
+  {
+    const auto &stage = stages[i];
+    out += fmt::format(
+        R"({}{{"name":"{}","packets":{},"packets_per_s":{:.3f},"frames":{},)"
+        R"("frames_per_s":{:.3f},"bytes":{},"mb_per_s":{:.3f},)"
+        R"("thread_cpu_ms":{:.3f}}})",
+        i ? "," : "",
+        stage.name,
+        stage.packets,
+        per_second(stage.packets, elapsed),
+        stage.frames,
+        per_second(stage.frames, elapsed),
+        stage.bytes,
+        to_mb(per_second(stage.bytes, elapsed)),
+        to_ms(stage.cpu));
+  }
+  out += R"(],"queues":[)";
+  for (size_t i = 0; i < queues.size(); i++)
+  {
+    const auto &queue = queues[i];
+    out += fmt::format(R"({}{{"name":"{}","peak":{},"capacity":{}}})",
+                       i ? "," : "",
+                       queue.name,
+                       queue.peak,
+                       queue.capacity);
+  }
+  out += "]}";
+  return out;
+}
@@ -1,18 +1,59 @@
 #include "codecthread.h"
 
+#include <algorithm>
+#include <format>
+#include <thread>
+#include <utility>
+
+#include <spdlog/fmt/std.h>
+#include <spdlog/spdlog.h>
+
 #include "ffmpeg_utils.h"
+#include "startup.h"
+
+namespace
+{
+int to_thread_type(DecodeThreading::Type type)
+{
+  switch (type)
+  {
+  case DecodeThreading::Type::Frame:
+    return FF_THREAD_FRAME;
+  case DecodeThreading::Type::Slice:
+    return FF_THREAD_SLICE;
+  case DecodeThreading::Type::Auto:
+  default:
+    return FF_THREAD_FRAME | FF_THREAD_SLICE;
+  }
+}
+
+const char *thread_type_name(int thread_type)
+{
+  if (thread_type & FF_THREAD_FRAME)
+  {
+    return "frame";
+  }
+  if (thread_type & FF_THREAD_SLICE)
+  {
+    return "slice";
+  }
+  return "none";
+}
+}  // namespace
 
 CodecThread::CodecThread(std::shared_ptr<AVPacketQueue> packet_queue,
                          std::shared_ptr<AVFrameQueue> frame_queue)
     : m_codec_ctx(avcodec_alloc_context3(nullptr))
     , m_packet_queue(packet_queue)
     , m_frame_queue(frame_queue)
+    , m_frame_pool(std::make_shared<AVFramePool>())
 {
 }
 
 CodecThread::~CodecThread() { avcodec_free_context(&m_codec_ctx); }
 
-int CodecThread::init(const AVCodecParameters *params)
+int CodecThread::init(const AVCodecParameters *params,
+                      const DecodeThreading &threading)
 {
   assert(params);
   if (const auto ret = avcodec_parameters_to_context(m_codec_ctx, params);
@@ -27,11 +68,33 @@ int CodecThread::init(const AVCodecParameters *params)
     return AVERROR_DECODER_NOT_FOUND;
   }
 
+  m_threading = threading;
+  m_codec_ctx->thread_count = threading.count;
+  m_codec_ctx->thread_type = to_thread_type(threading.type);
+
   if (const auto ret = avcodec_open2(m_codec_ctx, decoder, nullptr); ret < 0)
   {
     return ret;
   }
 
+  m_decode_time = &Metrics::instance().histogram(std::format(
+      "{}_decode_ns", av_get_media_type_string(m_codec_ctx->codec_type)));
+
+  // 帧级多线程时，每个额外的线程都会让输出推迟一帧
+  const auto thread_delay = (m_codec_ctx->active_thread_type & FF_THREAD_FRAME)
+                                ? m_codec_ctx->thread_count - 1
+                                : 0;
+  SPDLOG_INFO(
+      "decoder {}: {} threads ({} requested), {} threading, delay {} frames "
+      "(threading {}, reorder {})",
+      decoder->name,
+      m_codec_ctx->thread_count,
+      threading.count,
+      thread_type_name(m_codec_ctx->active_thread_type),
+      thread_delay + m_codec_ctx->has_b_frames,
+      thread_delay,
+      m_codec_ctx->has_b_frames);
+
   return 0;
 }
 
@@ -40,56 +103,293 @@ void CodecThread::start()
   m_thread = std::jthread([=](std::stop_token token) { run(token); });
 }
 
+void CodecThread::start(Executor &executor,
+                        std::function<Executor::clock::time_point()> deadline)
+{
+  m_executor = &executor;
+  m_job = executor.submit(
+      std::format("{}_decode",
+                  av_get_media_type_string(m_codec_ctx->codec_type)),
+      [this]()
+      {
+        const auto status = step(std::chrono::milliseconds(0));
+        if (status == Executor::Status::Done)
+        {  // 与线程模式的run()相同，出错时结束下游队列
+          finish();
+        }
+        return status;
+      },
+      std::move(deadline));
+  // 输入队列来了数据时唤醒任务，不等退避到期；任务取消之后不再唤醒
+  m_packet_queue->set_not_empty_callback(
+      [&executor, job = std::weak_ptr(m_job)]()
+      {
+        if (const auto locked = job.lock())
+        {
+          executor.wake(locked);
+        }
+      });
+}
+
 void CodecThread::stop()
 {
+  if (m_job)
+  {
+    m_executor->cancel(m_job);
+    m_stats.cpu_ns.store(m_job->cpu_time().count(),
+                         std::memory_order_relaxed);
+    if (!m_job->done())
+    {
+      finish();
+    }
+    m_job.reset();
+    return;
+  }
   m_thread.request_stop();
   m_thread.join();
 }
 
 void CodecThread::deinit() { avcodec_close(m_codec_ctx); }
 
+void CodecThread::set_skip_frame(AVDiscard discard)
+{
+  m_skip_frame.store(discard, std::memory_order_relaxed);
+}
+
+void CodecThread::set_degradation(const DecodeSkip &skip)
+{
+  m_degrade_loop_filter.store(skip.loop_filter, std::memory_order_relaxed);
+  m_degrade_idct.store(skip.idct, std::memory_order_relaxed);
+  m_degrade_frame.store(skip.frame, std::memory_order_relaxed);
+}
+
+void CodecThread::set_codec_params(const AVCodecParameters *params,
+                                   uint64_t generation)
+{
+  std::lock_guard locker(m_params_lock);
+  m_next_params = params;
+  m_next_params_generation = generation;
+  m_params_changed.store(true, std::memory_order_release);
+}
+
+const StageStats &CodecThread::stats() const { return m_stats; }
+
 void CodecThread::run(std::stop_token token)
 {
-  int packets = 0;
-  int frames = 0;
-  while (!token.stop_requested())
+  while (!token.stop_requested() &&
+         step(std::chrono::milliseconds(10)) != Executor::Status::Done)
   {
-    auto opt = m_packet_queue->pop(std::chrono::milliseconds(10));
-    if (!opt)
-    {
-      continue;
-    }
+  }
+  m_stats.cpu_ns.store(StageStats::thread_cpu_time().count(),
+                       std::memory_order_relaxed);
+  finish();
+}
+
+void CodecThread::finish()
+{
+  m_frame_queue->finish();
+  SPDLOG_INFO("decode {} packets -> {} frames",
+              m_stats.packets.load(std::memory_order_relaxed),
+              m_stats.frames.load(std::memory_order_relaxed));
+
+  const auto stats = m_frame_pool->stats();
+  SPDLOG_INFO("frame pool: {} acquisitions, {} allocations, {} free",
+              stats.acquisitions,
+              stats.allocations,
+              stats.free);
+}
+
+Executor::Status CodecThread::fail(int error)
+{
+  if (!m_error)
+  {
+    m_error = error;
+  }
+  return Executor::Status::Done;
+}
+
+Executor::Status CodecThread::step(std::chrono::milliseconds wait)
+{
+  if (m_packet_queue->flush_pending())
+  {  // 出现了新的seek：积压的帧和解码器中剩下的帧都已过时，直接去取新一代的包
+    m_pending.reset();
+    m_receiving = false;
+  }
+
+  // 上一步解出但帧队列已满、没能送出的帧
+  if (m_pending && !m_frame_queue->push(m_pending, wait))
+  {
+    return Executor::Status::Idle;
+  }
+
+  if (m_receiving)
+  {
+    return receive_frame(wait);
+  }
+
+  auto opt = m_packet_queue->pop(wait);
+  if (m_packet_queue->generation() != m_generation)
+  {
+    flush();
+  }
 
-    auto pkt = *opt;
-    if (const auto ret = avcodec_send_packet(m_codec_ctx, pkt.get()); ret < 0)
+  if (!opt && !m_packet_queue->finished())
+  {
+    return Executor::Status::Idle;
+  }
+
+  if (!opt && m_drained)
+  {  // 已经冲刷完毕，等待seek或者停止
+    if (wait.count() > 0)
     {
-      SPDLOG_ERROR("avcodec_send_packet error: {}", Utils::error_stringify(ret));
-      return;
+      std::this_thread::sleep_for(wait);
     }
+    return Executor::Status::Idle;
+  }
+
+  // 输入结束后送入空包，冲刷解码器中缓存的帧
+  auto pkt = opt ? std::move(*opt) : AVPacketPtr{};
+  if (pkt && m_unsupported)
+  {  // 旧的解码器解不了新的流的包，丢弃
+    return Executor::Status::Progress;
+  }
+  m_codec_ctx->skip_frame = static_cast<AVDiscard>(
+      std::max(m_skip_frame.load(std::memory_order_relaxed),
+               m_degrade_frame.load(std::memory_order_relaxed)));
+  m_codec_ctx->skip_loop_filter = static_cast<AVDiscard>(
+      m_degrade_loop_filter.load(std::memory_order_relaxed));
+  m_codec_ctx->skip_idct =
+      static_cast<AVDiscard>(m_degrade_idct.load(std::memory_order_relaxed));
+  const auto send_begin = std::chrono::steady_clock::now();
+  const auto send_ret = avcodec_send_packet(m_codec_ctx, pkt.get());
+  m_decode_elapsed = std::chrono::steady_clock::now() - send_begin;
+  if (const auto ret = send_ret; ret < 0)
+  {
+    SPDLOG_ERROR("avcodec_send_packet error: {}", Utils::error_stringify(ret));
+    return fail(ret);
+  }
 
-    packets++;
+  if (pkt)
+  {
+    m_stats.packets.fetch_add(1, std::memory_order_relaxed);
+    m_time_base = pkt->time_base;
+  }
+  m_receiving = true;
+  return Executor::Status::Progress;
+}
 
-    while (!token.stop_requested())
+void CodecThread::flush()
+{
+  m_generation = m_packet_queue->generation();
+  m_resume_ts = m_packet_queue->resume_timestamp();
+  m_drained = false;
+  m_receiving = false;
+  m_pending.reset();
+  m_frame.reset();
+  avcodec_flush_buffers(m_codec_ctx);
+  if (m_params_changed.load(std::memory_order_acquire))
+  {  // 新一代的包来自切换后的流
+    std::lock_guard locker(m_params_lock);
+    if (m_generation >= m_next_params_generation)
     {
-      auto frame = std::shared_ptr<AVFrame>(
-          av_frame_alloc(), [](AVFrame *f) { av_frame_free(&f); });
-      if (const auto ret = avcodec_receive_frame(m_codec_ctx, frame.get());
-          ret == 0)
-      {
-        m_frame_queue->push(frame);
-        frames++;
-        continue;
-      }
-      else if (ret == AVERROR(EAGAIN))
+      m_params_changed.store(false, std::memory_order_relaxed);
+      const auto ret = reopen(m_next_params);
+      if (ret < 0)
       {
-        break;
-      }
-      else
-      {
-        SPDLOG_ERROR("avcodec_receive_frame error: {}", Utils::error_stringify(ret));
-        return;
+        SPDLOG_ERROR("reopen decoder error: {}", Utils::error_stringify(ret));
       }
+      m_unsupported = ret < 0;
     }
   }
-  SPDLOG_INFO("decode {} packets -> {} frames", packets, frames);
+  m_frame_queue->flush(m_generation, m_resume_ts);
+  SPDLOG_INFO("{} decoder flushed, generation {}, resume at {}",
+              av_get_media_type_string(m_codec_ctx->codec_type),
+              m_generation,
+              m_resume_ts);
+}
+
+int CodecThread::reopen(const AVCodecParameters *params)
+{
+  // 新的解码器打开成功之后才替换，失败时保留旧的解码器
+  auto old = std::exchange(m_codec_ctx, avcodec_alloc_context3(nullptr));
+  if (!m_codec_ctx)
+  {
+    m_codec_ctx = old;
+    return AVERROR(ENOMEM);
+  }
+  if (const auto ret = init(params, m_threading); ret < 0)
+  {
+    avcodec_free_context(&m_codec_ctx);
+    m_codec_ctx = old;
+    return ret;
+  }
+  avcodec_free_context(&old);
+  return 0;
+}
+
+// 每次取出一帧；m_decode_elapsed只累加解码器调用的耗时，不包括帧队列满时的等待，
+// 一个包的帧全部取完时记录
+Executor::Status CodecThread::receive_frame(std::chrono::milliseconds wait)
+{
+  // EAGAIN时保留当前frame，下次接收复用，不再每次都分配
+  if (!m_frame)
+  {
+    m_frame = m_frame_pool->acquire();
+    if (!m_frame)
+    {
+      SPDLOG_ERROR("acquire frame error: {}",
+                   Utils::error_stringify(AVERROR(ENOMEM)));
+      return fail(AVERROR(ENOMEM));
+    }
+  }
+
+  const auto begin = std::chrono::steady_clock::now();
+  const auto ret = avcodec_receive_frame(m_codec_ctx, m_frame.get());
+  m_decode_elapsed += std::chrono::steady_clock::now() - begin;
+  if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+  {
+    m_receiving = false;
+    m_decode_time->record(m_decode_elapsed);
+    if (ret == AVERROR_EOF)
+    {
+      SPDLOG_INFO("decoder drained");
+      m_frame_queue->finish();
+      m_drained = true;
+    }
+    return Executor::Status::Progress;
+  }
+  if (ret < 0)
+  {
+    SPDLOG_ERROR("avcodec_receive_frame error: {}",
+                 Utils::error_stringify(ret));
+    return fail(ret);
+  }
+
+  if (m_resume_ts)
+  {  // seek时从目标之前的关键帧开始解码，目标之前的帧不送往下游
+    const auto ts = SpscQueueTraits<AVFramePtr>::timestamp(m_frame);
+    if (ts && *ts < *m_resume_ts)
+    {
+      av_frame_unref(m_frame.get());
+      return Executor::Status::Progress;
+    }
+    m_resume_ts.reset();
+  }
+
+  if (m_stats.frames.fetch_add(1, std::memory_order_relaxed) == 0)
+  {
+    StartupTimeline::instance().mark(std::format(
+        "first_{}_frame", av_get_media_type_string(m_codec_ctx->codec_type)));
+  }
+  m_stats.bytes.fetch_add(SpscQueueTraits<AVFramePtr>::bytes(m_frame),
+                          std::memory_order_relaxed);
+  // 帧的时间戳与包相同，以流的time_base为单位，下游据此换算
+  m_frame->time_base = m_time_base;
+  // 帧队列满时留到下一步再送，期间出现新的seek则放弃这一帧
+  m_pending = std::move(m_frame);
+  if (!m_frame_queue->push(m_pending, wait))
+  {
+    return Executor::Status::Idle;
+  }
+  return Executor::Status::Progress;
 }
@@ -0,0 +1,290 @@
+#include "convertthread.h"
+
+#include <spdlog/spdlog.h>
+
+#include "ffmpeg_utils.h"
+
+namespace
+{
+constexpr int BUFFER_ALIGN = 64;
+}  // namespace
+
+ConvertThread::ConvertThread(std::shared_ptr<AVFrameQueue> in_queue,
+                             std::shared_ptr<AVFrameQueue> out_queue)
+    : m_in_queue(in_queue)
+    , m_out_queue(out_queue)
+    , m_frame_pool(std::make_shared<AVFramePool>())
+{
+}
+
+ConvertThread::~ConvertThread() { deinit(); }
+
+int ConvertThread::init(int width, int height, AVPixelFormat format, int threads)
+{
+  m_width = width;
+  m_height = height;
+  m_format = format;
+  m_threads = threads;
+  m_convert_time = &Metrics::instance().histogram("video_convert_ns");
+
+  const auto size =
+      av_image_get_buffer_size(m_format, m_width, m_height, BUFFER_ALIGN);
+  if (size < 0)
+  {
+    return size;
+  }
+
+  m_buffer_pool = av_buffer_pool_init(size, av_buffer_allocz);
+  if (!m_buffer_pool)
+  {
+    return AVERROR(ENOMEM);
+  }
+
+  SPDLOG_INFO("convert to {} {}x{}, {} threads",
+              av_get_pix_fmt_name(m_format),
+              m_width,
+              m_height,
+              m_threads);
+  return 0;
+}
+
+void ConvertThread::start()
+{
+  m_thread = std::jthread([=](std::stop_token token) { run(token); });
+}
+
+void ConvertThread::start(Executor &executor,
+                          std::function<Executor::clock::time_point()> deadline)
+{
+  m_executor = &executor;
+  m_job = executor.submit(
+      "video_convert",
+      [this]()
+      {
+        const auto status = step(std::chrono::milliseconds(0));
+        if (status == Executor::Status::Done)
+        {  // 与线程模式的run()相同，出错时结束下游队列
+          finish();
+        }
+        return status;
+      },
+      std::move(deadline));
+  // 输入队列来了数据时唤醒任务，不等退避到期；任务取消之后不再唤醒
+  m_in_queue->set_not_empty_callback(
+      [&executor, job = std::weak_ptr(m_job)]()
+      {
+        if (const auto locked = job.lock())
+        {
+          executor.wake(locked);
+        }
+      });
+}
+
+void ConvertThread::stop()
+{
+  if (m_job)
+  {
+    m_executor->cancel(m_job);
+    m_stats.cpu_ns.store(m_job->cpu_time().count(),
+                         std::memory_order_relaxed);
+    if (!m_job->done())
+    {
+      finish();
+    }
+    m_job.reset();
+    return;
+  }
+  m_thread.request_stop();
+  m_thread.join();
+}
+
+void ConvertThread::deinit()
+{
+  sws_freeContext(m_sws_ctx);
+  m_sws_ctx = nullptr;
+  av_buffer_pool_uninit(&m_buffer_pool);
+}
+
+const StageStats &ConvertThread::stats() const { return m_stats; }
+
+void ConvertThread::run(std::stop_token token)
+{
+  while (!token.stop_requested() &&
+         step(std::chrono::milliseconds(10)) != Executor::Status::Done)
+  {
+  }
+  m_stats.cpu_ns.store(StageStats::thread_cpu_time().count(),
+                       std::memory_order_relaxed);
+  finish();
+}
+
+void ConvertThread::finish()
+{
+  m_out_queue->finish();
+  SPDLOG_INFO("converted {} of {} frames",
+              m_converted,
+              m_stats.frames.load(std::memory_order_relaxed));
+}
+
+Executor::Status ConvertThread::fail(int error)
+{
+  if (!m_error)
+  {
+    m_error = error;
+  }
+  return Executor::Status::Done;
+}
+
+Executor::Status ConvertThread::step(std::chrono::milliseconds wait)
+{
+  if (m_in_queue->flush_pending())
+  {  // 出现了新的seek，积压的帧已经过时
+    m_pending.reset();
+  }
+  if (m_pending && !m_out_queue->push(m_pending, wait))
+  {
+    return Executor::Status::Idle;
+  }
+
+  auto opt = m_in_queue->pop(wait);
+  if (m_in_queue->generation() != m_generation)
+  {  // seek：把输出队列flush到同一代
+    m_generation = m_in_queue->generation();
+    m_out_queue->flush(m_generation, m_in_queue->resume_timestamp());
+    m_finished = false;
+  }
+
+  if (!opt)
+  {
+    if (m_in_queue->finished() && !m_finished)
+    {
+      m_out_queue->finish();
+      m_finished = true;
+    }
+    else if (m_finished && wait.count() > 0)
+    {  // 输入已结束，等待seek或者停止
+      std::this_thread::sleep_for(wait);
+    }
+    return Executor::Status::Idle;
+  }
+
+  auto frame = std::move(*opt);
+  if (frame->format != m_format || frame->width != m_width ||
+      frame->height != m_height)
+  {
+    auto dst = m_frame_pool->acquire();
+    if (!dst)
+    {
+      SPDLOG_ERROR("acquire frame error: {}",
+                   Utils::error_stringify(AVERROR(ENOMEM)));
+      return fail(AVERROR(ENOMEM));
+    }
+
+    const auto begin = std::chrono::steady_clock::now();
+    const auto ret = convert(*frame, *dst);
+    const auto elapsed = std::chrono::steady_clock::now() - begin;
+    if (ret < 0)
+    {
+      SPDLOG_ERROR("convert error: {}", Utils::error_stringify(ret));
+      return fail(ret);
+    }
+    m_convert_time->record(elapsed);
+    SPDLOG_TRACE(
+        "convert {} -> {}: {} us",
+        av_get_pix_fmt_name((AVPixelFormat)frame->format),
+        av_get_pix_fmt_name(m_format),
+        std::chrono::duration_cast<std::chrono::microseconds>(elapsed)
+            .count());
+    frame = std::move(dst);
+    m_converted++;
+  }
+
+  m_stats.frames.fetch_add(1, std::memory_order_relaxed);
+  m_stats.bytes.fetch_add(SpscQueueTraits<AVFramePtr>::bytes(frame),
+                          std::memory_order_relaxed);
+  // 输出队列满时留到下一步再送
+  m_pending = std::move(frame);
+  if (!m_out_queue->push(m_pending, wait))
+  {
+    return Executor::Status::Idle;
+  }
+  return Executor::Status::Progress;
+}
+
+int ConvertThread::update_context(const AVFrame &src)
+{
+  if (m_sws_ctx && src.width == m_src_width && src.height == m_src_height &&
+      src.format == m_src_format)
+  {
+    return 0;
+  }
+
+  sws_freeContext(m_sws_ctx);
+  m_sws_ctx = sws_alloc_context();
+  if (!m_sws_ctx)
+  {
+    return AVERROR(ENOMEM);
+  }
+
+  av_opt_set_int(m_sws_ctx, "srcw", src.width, 0);
+  av_opt_set_int(m_sws_ctx, "srch", src.height, 0);
+  av_opt_set_int(m_sws_ctx, "src_format", src.format, 0);
+  av_opt_set_int(m_sws_ctx, "dstw", m_width, 0);
+  av_opt_set_int(m_sws_ctx, "dsth", m_height, 0);
+  av_opt_set_int(m_sws_ctx, "dst_format", m_format, 0);
+  av_opt_set_int(m_sws_ctx, "sws_flags", SWS_BILINEAR, 0);
+  av_opt_set_int(m_sws_ctx, "threads", m_threads, 0);
+  if (const auto ret = sws_init_context(m_sws_ctx, nullptr, nullptr); ret < 0)
+  {
+    sws_freeContext(m_sws_ctx);
+    m_sws_ctx = nullptr;
+    return ret;
+  }
+
+  m_src_width = src.width;
+  m_src_height = src.height;
+  m_src_format = static_cast<AVPixelFormat>(src.format);
+  SPDLOG_INFO("sws context: {} {}x{} -> {} {}x{}",
+              av_get_pix_fmt_name(m_src_format),
+              m_src_width,
+              m_src_height,
+              av_get_pix_fmt_name(m_format),
+              m_width,
+              m_height);
+  return 0;
+}
+
+int ConvertThread::convert(const AVFrame &src, AVFrame &dst)
+{
+  if (const auto ret = update_context(src); ret < 0)
+  {
+    return ret;
+  }
+
+  dst.buf[0] = av_buffer_pool_get(m_buffer_pool);
+  if (!dst.buf[0])
+  {
+    return AVERROR(ENOMEM);
+  }
+  dst.format = m_format;
+  dst.width = m_width;
+  dst.height = m_height;
+  if (const auto ret = av_image_fill_arrays(dst.data,
+                                            dst.linesize,
+                                            dst.buf[0]->data,
+                                            m_format,
+                                            m_width,
+                                            m_height,
+                                            BUFFER_ALIGN);
+      ret < 0)
+  {
+    return ret;
+  }
+
+  if (const auto ret = av_frame_copy_props(&dst, &src); ret < 0)
+  {
+    return ret;
+  }
+
+  return sws_scale_frame(m_sws_ctx, &dst, &src);
+}
@@ -1,78 +1,331 @@
 #include "demuxthread.h"
 
+#include <algorithm>
+#include <climits>
+#include <iterator>
+#include <utility>
+
 #include <libavformat/avformat.h>
+#include <spdlog/fmt/chrono.h>
 #include <spdlog/fmt/std.h>
 #include <spdlog/spdlog.h>
 
 #include "avpacketqueue.h"
 #include "ffmpeg_utils.h"
+#include "metrics.h"
+#include "startup.h"
 
 Demuxthread::Demuxthread(std::shared_ptr<AVPacketQueue> audio_packet_queue,
                          std::shared_ptr<AVPacketQueue> video_packet_queue)
     : m_format_ctx(avformat_alloc_context())
     , m_audio_packet_queue(audio_packet_queue)
     , m_video_packet_queue(video_packet_queue)
+    , m_packet_pool(std::make_shared<AVPacketPool>())
+    , m_seek_time(&Metrics::instance().histogram("demux_seek_ns"))
+    , m_read_time(&Metrics::instance().histogram("demux_read_ns"))
+    , m_audio_discarded(&Metrics::instance().counter("audio_packets_discarded"))
+    , m_video_discarded(&Metrics::instance().counter("video_packets_discarded"))
+    , m_bytes_dropped(&Metrics::instance().counter("demux_bytes_dropped"))
+    , m_memory_shed(&Metrics::instance().counter("memory_packets_shed"))
+    , m_memory_overcommit(
+          &Metrics::instance().counter("memory_packets_overcommitted"))
 {
 }
 
 Demuxthread::~Demuxthread() { avformat_free_context(m_format_ctx); }
 
+void Demuxthread::set_probe_cache(std::shared_ptr<ProbeCache> cache)
+{
+  m_probe_cache = std::move(cache);
+}
+
+void Demuxthread::set_probe_limits(int64_t probesize,
+                                   std::chrono::microseconds analyze_duration)
+{
+  m_probesize = probesize;
+  m_analyze_duration = analyze_duration;
+}
+
+void Demuxthread::set_io_options(const FileIO::Options &opts)
+{
+  m_io_options = opts;
+}
+
 int Demuxthread::init(std::string_view url)
 {
-  if (const auto ret =
-          avformat_open_input(&m_format_ctx, url.data(), nullptr, nullptr);
-      ret < 0)
+  m_url = url;
+  m_io = FileIO::open(m_url, m_io_options);
+  const auto probe_begin = std::chrono::steady_clock::now();
+  std::optional<ProbeCache::Entry> cached;
+  if (m_probe_cache)
   {
-    return ret;
+    cached = m_probe_cache->load(m_url);
   }
 
-  if (const auto ret = avformat_find_stream_info(m_format_ctx, nullptr);
-      ret < 0)
+  if (const auto ret = open_input(cached ? &*cached : nullptr);
+      ret < 0 && cached)
+  {  // 缓存的格式打不开文件，按未命中处理
+    SPDLOG_WARN("open {} with cached format error: {}",
+                m_url,
+                Utils::error_stringify(ret));
+    cached.reset();
+    m_format_ctx = avformat_alloc_context();
+    if (const auto ret = open_input(nullptr); ret < 0)
+    {
+      return ret;
+    }
+  }
+  else if (ret < 0)
   {
     return ret;
   }
 
+  // 命中缓存时流参数来自缓存，不再读取和解码数据来探测
+  const auto hit = cached && cached->apply(m_format_ctx);
+  if (!hit)
+  {
+    if (const auto ret = avformat_find_stream_info(m_format_ctx, nullptr);
+        ret < 0)
+    {
+      return ret;
+    }
+  }
+
+  const auto probe_time = std::chrono::steady_clock::now() - probe_begin;
+  Metrics::instance().histogram("demux_probe_ns").record(probe_time);
+  Metrics::instance()
+      .counter(hit ? "probe_cache_hits" : "probe_cache_misses")
+      .add();
+  SPDLOG_INFO(
+      "probe {}: {}, cache {}",
+      m_url,
+      std::chrono::duration_cast<std::chrono::microseconds>(probe_time),
+      !m_probe_cache ? "disabled"
+      : hit          ? "hit"
+                     : "miss");
+
   av_dump_format(m_format_ctx, 0, url.data(), 0);
 
-  if (const auto ret = av_find_best_stream(
-          m_format_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+  // 只有音频或者只有视频的文件只选择其中一路，两者都没有才算错误
+  if (const auto ret = find_stream(
+          AVMEDIA_TYPE_AUDIO, m_audio_packet_queue.get(), m_audio_stream_idx);
       ret < 0)
   {
     return ret;
   }
-  else
+  if (const auto ret = find_stream(
+          AVMEDIA_TYPE_VIDEO, m_video_packet_queue.get(), m_video_stream_idx);
+      ret < 0)
+  {
+    return ret;
+  }
+  SPDLOG_INFO("audio stream index: {}, video stream index: {}",
+              m_audio_stream_idx,
+              m_video_stream_idx);
+  if (!m_audio_stream_idx && !m_video_stream_idx)
+  {
+    return AVERROR_STREAM_NOT_FOUND;
+  }
+  // 不存在的流不再需要包队列，也不会被flush/finish
+  if (!m_audio_stream_idx)
   {
-    m_audio_stream_idx = ret;
+    m_audio_packet_queue.reset();
   }
-  SPDLOG_INFO("audio stream index: {}", m_audio_stream_idx);
+  if (!m_video_stream_idx)
+  {
+    m_video_packet_queue.reset();
+  }
+  discard_unused_streams();
 
-  if (const auto ret = av_find_best_stream(
-          m_format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
-      ret < 0)
+  // 关键帧索引和探测缓存都以视频流为准，只有音频时不建立
+  if (!m_video_stream_idx)
   {
-    return ret;
+    return 0;
   }
-  else
+  if (hit)
+  {
+    m_keyframes = cached->keyframes(*m_video_stream_idx);
+    m_cached_keyframes = m_keyframes.size();
+    SPDLOG_INFO("keyframe index: {} entries from cache", m_cached_keyframes);
+  }
+  else if (m_probe_cache)
   {
-    m_video_stream_idx = ret;
+    m_probe_cache->store(
+        m_url, *m_format_ctx, *m_video_stream_idx, m_keyframes);
   }
-  SPDLOG_INFO("video stream index: {}", m_video_stream_idx);
 
   return 0;
 }
 
+int Demuxthread::find_stream(AVMediaType type,
+                             const AVPacketQueue *queue,
+                             std::optional<int> &index)
+{
+  if (!queue)
+  {  // 没有包队列时不选择这一类型的流，它的包直接丢弃
+    return 0;
+  }
+  const auto ret = av_find_best_stream(m_format_ctx, type, -1, -1, nullptr, 0);
+  if (ret == AVERROR_STREAM_NOT_FOUND)
+  {
+    SPDLOG_INFO("no {} stream in {}", av_get_media_type_string(type), m_url);
+    return 0;
+  }
+  if (ret < 0)
+  {
+    return ret;
+  }
+  index = ret;
+  return 0;
+}
+
+int Demuxthread::open_input(const ProbeCache::Entry *cached)
+{
+  // 缓存命中时直接指定输入格式，跳过格式探测
+  const AVInputFormat *format{};
+  if (cached)
+  {
+    format = av_find_input_format(cached->format_name().c_str());
+  }
+
+  // 格式探测和avformat_find_stream_info都受这两个上限约束
+  if (!m_format_ctx)
+  {
+    m_format_ctx = avformat_alloc_context();
+  }
+  if (m_probesize > 0)
+  {
+    m_format_ctx->probesize = m_probesize;
+    m_format_ctx->format_probesize =
+        static_cast<int>(std::min<int64_t>(m_probesize, INT_MAX));
+  }
+  if (m_analyze_duration.count() > 0)
+  {
+    m_format_ctx->max_analyze_duration = m_analyze_duration.count();
+  }
+  if (m_io)
+  {  // 重试时从头开始探测
+    avio_seek(m_io->avio(), 0, SEEK_SET);
+    m_format_ctx->pb = m_io->avio();
+  }
+  return avformat_open_input(&m_format_ctx, m_url.c_str(), format, nullptr);
+}
+
 void Demuxthread::start()
 {
   m_thread = std::jthread([=](std::stop_token token) { run(token); });
 }
 
+void Demuxthread::start(Executor &executor,
+                        std::function<Executor::clock::time_point()> deadline)
+{
+  m_executor = &executor;
+  m_job = executor.submit(
+      "demux",
+      [this]()
+      {
+        const auto status = step({}, std::chrono::milliseconds(0));
+        if (status == Executor::Status::Done)
+        {  // 与线程模式的run()相同，出错时结束下游队列
+          finish();
+        }
+        return status;
+      },
+      std::move(deadline));
+}
+
 void Demuxthread::stop()
 {
+  if (m_job)
+  {
+    m_executor->cancel(m_job);
+    m_stats.cpu_ns.store(m_job->cpu_time().count(),
+                         std::memory_order_relaxed);
+    if (!m_job->done())
+    {
+      finish();
+    }
+    m_job.reset();
+    return;
+  }
   m_thread.request_stop();
   m_thread.join();
 }
 
-void Demuxthread::deinit() { avformat_close_input(&m_format_ctx); }
+void Demuxthread::deinit()
+{
+  // 播放过程中索引增长了，写回缓存供下次打开使用
+  if (m_probe_cache && m_format_ctx && m_video_stream_idx &&
+      m_keyframes.size() > m_cached_keyframes)
+  {
+    m_probe_cache->store(
+        m_url, *m_format_ctx, *m_video_stream_idx, m_keyframes);
+    m_cached_keyframes = m_keyframes.size();
+  }
+  log_byte_stats();
+  avformat_close_input(&m_format_ctx);
+  if (m_io)
+  {
+    const auto read_time = m_io->read_time();
+    SPDLOG_INFO("io {}: {} bytes read in {}, {} MB/s",
+                m_io->name(),
+                m_io->bytes_read(),
+                std::chrono::duration_cast<std::chrono::milliseconds>(read_time),
+                read_time.count() > 0
+                    ? m_io->bytes_read() * 1000 / read_time.count()
+                    : 0);
+    m_io.reset();
+  }
+}
+
+void Demuxthread::seek(std::chrono::nanoseconds target, bool accurate)
+{
+  m_seek_target.store(target.count(), std::memory_order_relaxed);
+  m_seek_accurate.store(accurate, std::memory_order_relaxed);
+  {
+    std::lock_guard locker(m_seek_lock);
+    m_seek_requested.store(true, std::memory_order_release);
+  }
+  m_seek_cond.notify_one();
+}
+
+void Demuxthread::select_stream(AVMediaType type,
+                                int index,
+                                std::chrono::nanoseconds position)
+{
+  {
+    std::lock_guard locker(m_seek_lock);
+    (type == AVMEDIA_TYPE_AUDIO ? m_select_audio : m_select_video) = index;
+  }
+  // 切换和seek在解复用线程的同一步中执行，新的流的包一定属于新的一代
+  seek(position);
+}
+
+void Demuxthread::set_stream_change_handler(
+    std::function<void(AVMediaType, const AVStream *, uint64_t)> handler)
+{
+  m_stream_change_handler = std::move(handler);
+}
+
+std::vector<int> Demuxthread::streams(AVMediaType type) const
+{
+  std::vector<int> indexes;
+  for (unsigned i = 0; i < m_format_ctx->nb_streams; i++)
+  {
+    if (m_format_ctx->streams[i]->codecpar->codec_type == type)
+    {
+      indexes.push_back(static_cast<int>(i));
+    }
+  }
+  return indexes;
+}
+
+void Demuxthread::set_discard(AVDiscard audio, AVDiscard video)
+{
+  m_audio_discard.store(audio, std::memory_order_relaxed);
+  m_video_discard.store(video, std::memory_order_relaxed);
+  m_discard_changed.store(true, std::memory_order_release);
+}
 
 const AVCodecParameters *Demuxthread::audio_codec_params() const
 {
@@ -110,50 +363,481 @@ AVRational Demuxthread::video_stream_time_base() const
   return av_make_q(0, 0);
 }
 
+AVRational Demuxthread::video_frame_rate() const
+{
+  if (m_video_stream_idx)
+  {
+    return av_guess_frame_rate(
+        m_format_ctx, m_format_ctx->streams[*m_video_stream_idx], nullptr);
+  }
+  return av_make_q(0, 1);
+}
+
+const StageStats &Demuxthread::stats() const { return m_stats; }
+
 void Demuxthread::run(std::stop_token token)
 {
-  int audio_packets = 0;
-  int video_packets = 0;
-  while (!token.stop_requested())
+  while (!token.stop_requested() &&
+         step(token, std::chrono::milliseconds(10)) != Executor::Status::Done)
+  {
+  }
+  m_stats.cpu_ns.store(StageStats::thread_cpu_time().count(),
+                       std::memory_order_relaxed);
+  finish();
+}
+
+void Demuxthread::finish()
+{
+  for (const auto &queue : {m_audio_packet_queue, m_video_packet_queue})
   {
-    if (m_audio_packet_queue->size() > 200 ||
-        m_video_packet_queue->size() > 200)
-    {  // 等待包被消费解码
-      std::this_thread::sleep_for(std::chrono::milliseconds(10));
-      continue;
+    if (queue)
+    {
+      queue->finish();
     }
+  }
+
+  SPDLOG_INFO("demuxed {} audio packets", m_audio_packets);
+  SPDLOG_INFO("demuxed {} video packets", m_video_packets);
+  SPDLOG_INFO("keyframe index: {} entries", m_keyframes.size());
+
+  const auto stats = m_packet_pool->stats();
+  SPDLOG_INFO("packet pool: {} acquisitions, {} allocations, {} free",
+              stats.acquisitions,
+              stats.allocations,
+              stats.free);
+}
 
-    auto pkt = std::shared_ptr<AVPacket>(
-        av_packet_alloc(), [](AVPacket *pkt) { av_packet_free(&pkt); });
-    if (const auto ret = av_read_frame(m_format_ctx, pkt.get()); ret < 0)
+Executor::Status Demuxthread::fail(int error)
+{
+  if (!m_error)
+  {
+    m_error = error;
+  }
+  return Executor::Status::Done;
+}
+
+Executor::Status Demuxthread::step(std::stop_token token,
+                                   std::chrono::milliseconds wait)
+{
+  if (m_seek_requested.exchange(false, std::memory_order_acq_rel))
+  {  // 积压的包属于旧位置，直接丢弃
+    m_pending.reset();
+    const auto switched = switch_streams();
+    const auto target =
+        std::chrono::nanoseconds(m_seek_target.load(std::memory_order_relaxed));
+    const auto accurate = m_seek_accurate.load(std::memory_order_relaxed);
+    if (do_seek(target, accurate) >= 0)
     {
-      if (ret == AVERROR_EOF)
-      {
-        SPDLOG_INFO("read finished");
-        break;
-      }
-      else
+      m_eof = false;
+    }
+    else if (switched)
+    {  // seek失败也要让下游换到新的流，从当前读到的位置继续
+      flush_queues(std::nullopt, std::nullopt);
+      m_eof = false;
+    }
+  }
+
+  if (m_discard_changed.exchange(false, std::memory_order_acq_rel))
+  {
+    apply_discard();
+  }
+
+  // 队列达到水位限制时留到下一步再送，消费者取走包后立即被唤醒
+  if (m_pending && !push_pending(wait))
+  {
+    return Executor::Status::Idle;
+  }
+
+  if (m_eof)
+  {  // 读到文件尾后不退出，等待seek或者停止；跑在执行器上时不阻塞
+    if (token.stop_possible())
+    {
+      std::unique_lock locker(m_seek_lock);
+      m_seek_cond.wait(locker,
+                       token,
+                       [this]()
+                       {
+                         return m_seek_requested.load(
+                             std::memory_order_acquire);
+                       });
+    }
+    return Executor::Status::Idle;
+  }
+
+  auto pkt = m_packet_pool->acquire();
+  if (!pkt)
+  {
+    SPDLOG_ERROR("acquire packet error: {}",
+                 Utils::error_stringify(AVERROR(ENOMEM)));
+    return fail(AVERROR(ENOMEM));
+  }
+
+  const auto read_begin = std::chrono::steady_clock::now();
+  const auto read_ret = av_read_frame(m_format_ctx, pkt.get());
+  m_read_time->record(std::chrono::steady_clock::now() - read_begin);
+  if (const auto ret = read_ret; ret < 0)
+  {
+    if (ret == AVERROR_EOF)
+    {
+      SPDLOG_INFO("read finished");
+      for (const auto &queue : {m_audio_packet_queue, m_video_packet_queue})
       {
-        SPDLOG_ERROR("av_read_frame error: {}", Utils::error_stringify(ret));
-        break;
+        if (queue)
+        {
+          queue->finish();
+        }
       }
+      m_eof = true;
+      return Executor::Status::Progress;
     }
+    SPDLOG_ERROR("av_read_frame error: {}", Utils::error_stringify(ret));
+    return fail(ret);
+  }
+
+  AVPacketQueue *queue{};
+  if (m_audio_stream_idx && pkt->stream_index == *m_audio_stream_idx)
+  {
+    queue = m_audio_packet_queue.get();
+    m_audio_packets++;
+  }
+  else if (m_video_stream_idx && pkt->stream_index == *m_video_stream_idx)
+  {
+    queue = m_video_packet_queue.get();
+    m_video_packets++;
+    index_keyframe(*pkt);
+  }
+  else
+  {  // 未选中的流（解复用器不支持AVDISCARD_ALL时），句柄析构时unref并放回池中
+    m_dropped_bytes += pkt->size;
+    m_bytes_dropped->add(pkt->size);
+    return Executor::Status::Progress;
+  }
+  if (discard(*pkt, queue == m_video_packet_queue.get()))
+  {
+    m_dropped_bytes += pkt->size;
+    m_bytes_dropped->add(pkt->size);
+    return Executor::Status::Progress;
+  }
+
+  if (m_stats.packets.fetch_add(1, std::memory_order_relaxed) == 0)
+  {
+    StartupTimeline::instance().mark("first_packet");
+  }
+  // 切换流之后time_base可能不同，下游按包/帧上的time_base换算时间戳
+  pkt->time_base = m_format_ctx->streams[pkt->stream_index]->time_base;
+  m_stats.bytes.fetch_add(pkt->size, std::memory_order_relaxed);
 
-    if (m_audio_stream_idx && pkt->stream_index == *m_audio_stream_idx)
+  m_pending = std::move(pkt);
+  m_pending_queue = queue;
+  if (!push_pending(wait))
+  {
+    return Executor::Status::Idle;
+  }
+  return Executor::Status::Progress;
+}
+
+int Demuxthread::do_seek(std::chrono::nanoseconds target, bool accurate)
+{
+  const auto begin = std::chrono::steady_clock::now();
+  // 有视频时按视频流定位，只有音频时按音频流
+  const auto stream_idx =
+      m_video_stream_idx ? *m_video_stream_idx : *m_audio_stream_idx;
+  const auto stream_ts =
+      av_rescale_q(target.count(),
+                   AVRational{1, 1000000000},
+                   m_format_ctx->streams[stream_idx]->time_base);
+
+  // 索引命中时直接定位到目标之前最近的关键帧：
+  // 时间戳不连续的格式（如MPEG-TS）按字节定位，省去按时间戳二分查找；
+  // 其它格式用关键帧的精确pts定位
+  const char *method = "demuxer";
+  int ret = 0;
+  if (const auto keyframe = find_keyframe(stream_ts))
+  {
+    const auto [pts, pos] = *keyframe;
+    const auto flags = m_format_ctx->iformat->flags;
+    if ((flags & AVFMT_TS_DISCONT) && !(flags & AVFMT_NO_BYTE_SEEK) &&
+        pos >= 0)
+    {
+      method = "index(byte)";
+      ret =
+          avformat_seek_file(m_format_ctx, -1, pos, pos, pos, AVSEEK_FLAG_BYTE);
+    }
+    else
     {
-      m_audio_packet_queue->push(pkt);
-      audio_packets++;
+      method = "index(pts)";
+      ret = avformat_seek_file(m_format_ctx, stream_idx, pts, pts, pts, 0);
+    }
+  }
+  else
+  {
+    ret = avformat_seek_file(
+        m_format_ctx, stream_idx, INT64_MIN, stream_ts, stream_ts, 0);
+  }
+
+  if (ret < 0)
+  {
+    SPDLOG_ERROR("seek to {} via {} error: {}",
+                 target,
+                 method,
+                 Utils::error_stringify(ret));
+    return ret;
+  }
+
+  // 以新的代数作废队列中的旧包，下游据此冲刷解码器并丢弃target之前的帧
+  const auto to_ts = [&](AVRational time_base) -> std::optional<int64_t>
+  {
+    if (!accurate || time_base.den == 0)
+    {  // 不存在的流的time_base为0/0
+      return std::nullopt;
     }
-    else if (m_video_stream_idx && pkt->stream_index == *m_video_stream_idx)
+    return av_rescale_q(target.count(), AVRational{1, 1000000000}, time_base);
+  };
+  flush_queues(to_ts(audio_stream_time_base()),
+               to_ts(video_stream_time_base()));
+
+  const auto elapsed = std::chrono::steady_clock::now() - begin;
+  m_seek_time->record(elapsed);
+  SPDLOG_INFO("seek #{} to {} via {}: {}",
+              m_generation,
+              target,
+              method,
+              std::chrono::duration_cast<std::chrono::microseconds>(elapsed));
+  return 0;
+}
+
+void Demuxthread::flush_queues(std::optional<int64_t> audio_ts,
+                               std::optional<int64_t> video_ts)
+{
+  m_generation++;
+  if (m_audio_packet_queue)
+  {
+    m_audio_packet_queue->flush(m_generation, audio_ts);
+  }
+  if (m_video_packet_queue)
+  {
+    m_video_packet_queue->flush(m_generation, video_ts);
+  }
+}
+
+void Demuxthread::discard_unused_streams()
+{
+  int discarded = 0;
+  for (unsigned i = 0; i < m_format_ctx->nb_streams; i++)
+  {
+    const auto index = static_cast<int>(i);
+    if (index != m_audio_stream_idx && index != m_video_stream_idx)
     {
-      m_video_packet_queue->push(pkt);
-      video_packets++;
+      m_format_ctx->streams[i]->discard = AVDISCARD_ALL;
+      discarded++;
     }
-    else
+  }
+  SPDLOG_INFO(
+      "{} of {} streams discarded", discarded, m_format_ctx->nb_streams);
+}
+
+bool Demuxthread::switch_streams()
+{
+  std::optional<int> audio;
+  std::optional<int> video;
+  {
+    std::lock_guard locker(m_seek_lock);
+    audio = std::exchange(m_select_audio, std::nullopt);
+    video = std::exchange(m_select_video, std::nullopt);
+  }
+
+  bool switched = false;
+  if (audio && m_audio_stream_idx)
+  {
+    switched |= switch_stream(AVMEDIA_TYPE_AUDIO, *audio, m_audio_stream_idx);
+  }
+  if (video && m_video_stream_idx)
+  {
+    switched |= switch_stream(AVMEDIA_TYPE_VIDEO, *video, m_video_stream_idx);
+  }
+  return switched;
+}
+
+bool Demuxthread::switch_stream(AVMediaType type,
+                                int index,
+                                std::optional<int> &current)
+{
+  const auto candidates = streams(type);
+  const auto it = std::find(candidates.begin(), candidates.end(), *current);
+  if (index == NEXT_STREAM && it != candidates.end())
+  {
+    index = std::next(it) != candidates.end() ? *std::next(it)
+                                              : candidates.front();
+  }
+  if (index == *current ||
+      std::find(candidates.begin(), candidates.end(), index) ==
+          candidates.end())
+  {
+    SPDLOG_WARN("{} stream {} not switchable, {} streams available",
+                av_get_media_type_string(type),
+                index,
+                candidates.size());
+    return false;
+  }
+
+  if (!avcodec_find_decoder(m_format_ctx->streams[index]->codecpar->codec_id))
+  {  // 切换过去之后解码器打不开，这一路就停了
+    SPDLOG_WARN("{} stream {} has no decoder, not switching",
+                av_get_media_type_string(type),
+                index);
+    return false;
+  }
+
+  // 新的流沿用当前的丢弃级别（倍速播放）
+  const auto video = type == AVMEDIA_TYPE_VIDEO;
+  m_format_ctx->streams[*current]->discard = AVDISCARD_ALL;
+  m_format_ctx->streams[index]->discard = static_cast<AVDiscard>(
+      (video ? m_video_discard : m_audio_discard)
+          .load(std::memory_order_relaxed));
+  SPDLOG_INFO("switch {} stream {} -> {}",
+              av_get_media_type_string(type),
+              *current,
+              index);
+  current = index;
+  if (video)
+  {  // 关键帧索引属于旧的流
+    m_keyframes.clear();
+    m_cached_keyframes = 0;
+  }
+
+  if (m_stream_change_handler)
+  {
+    m_stream_change_handler(
+        type, m_format_ctx->streams[index], m_generation + 1);
+  }
+  return true;
+}
+
+void Demuxthread::log_byte_stats()
+{
+  if (!m_format_ctx || !m_format_ctx->pb)
+  {
+    return;
+  }
+  // 读取的字节数包括容器本身的开销，跳过的部分是估算
+  const auto read = static_cast<uint64_t>(m_format_ctx->pb->bytes_read);
+  const auto delivered = m_stats.bytes.load(std::memory_order_relaxed);
+  const auto dropped = m_dropped_bytes;
+  const auto skipped = read > delivered + dropped ? read - delivered - dropped
+                                                  : 0;
+  Metrics::instance().gauge("demux_bytes_read").set(
+      static_cast<int64_t>(read));
+  Metrics::instance().gauge("demux_bytes_skipped").set(
+      static_cast<int64_t>(skipped));
+  SPDLOG_INFO("demux {} bytes read: {} delivered, {} dropped after reading, "
+              "{} skipped or container overhead",
+              read,
+              delivered,
+              dropped,
+              skipped);
+}
+
+void Demuxthread::index_keyframe(const AVPacket &pkt)
+{
+  if ((pkt.flags & AV_PKT_FLAG_KEY) && pkt.pts != AV_NOPTS_VALUE)
+  {
+    m_keyframes.emplace(pkt.pts, pkt.pos);
+  }
+}
+
+void Demuxthread::apply_discard()
+{
+  const auto audio =
+      static_cast<AVDiscard>(m_audio_discard.load(std::memory_order_relaxed));
+  const auto video =
+      static_cast<AVDiscard>(m_video_discard.load(std::memory_order_relaxed));
+  if (m_audio_stream_idx)
+  {
+    m_format_ctx->streams[*m_audio_stream_idx]->discard = audio;
+  }
+  // 提高丢弃级别立即生效；降低时解复用器马上交出所有包，由discard()丢到关键帧
+  if (m_video_stream_idx)
+  {
+    m_format_ctx->streams[*m_video_stream_idx]->discard = video;
+  }
+  if (video > m_applied_video_discard)
+  {
+    m_applied_video_discard = video;
+  }
+  SPDLOG_INFO("discard audio {}, video {}",
+              static_cast<int>(audio),
+              static_cast<int>(video));
+}
+
+bool Demuxthread::discard(const AVPacket &pkt, bool video)
+{
+  if (!video)
+  {
+    if (m_audio_discard.load(std::memory_order_relaxed) >= AVDISCARD_ALL)
     {
-      av_packet_unref(pkt.get());
+      m_audio_discarded->add();
+      return true;
     }
+    return false;
+  }
+
+  if ((pkt.flags & AV_PKT_FLAG_DISPOSABLE) &&
+      MemoryBudget::instance().over_cap())
+  {  // 没有帧参考可丢弃的包，丢掉它不影响后续解码
+    m_memory_shed->add();
+    return true;
+  }
+
+  if (pkt.flags & AV_PKT_FLAG_KEY)
+  {  // 从关键帧开始解码不依赖之前的帧，降低的丢弃级别从这里生效
+    m_applied_video_discard = static_cast<AVDiscard>(
+        m_video_discard.load(std::memory_order_relaxed));
+  }
+  const auto level = m_applied_video_discard;
+  const auto drop = level >= AVDISCARD_ALL ||
+                    (level >= AVDISCARD_NONKEY &&
+                     !(pkt.flags & AV_PKT_FLAG_KEY)) ||
+                    (level >= AVDISCARD_NONREF &&
+                     (pkt.flags & AV_PKT_FLAG_DISPOSABLE));
+  if (drop)
+  {
+    m_video_discarded->add();
+  }
+  return drop;
+}
+
+bool Demuxthread::push_pending(std::chrono::milliseconds wait)
+{
+  if (m_pending_queue->push(m_pending, wait))
+  {
+    return true;
+  }
+
+  // 全局内存达到上限时，如果另一路的包队列已经取空，超出上限也要入队：
+  // 否则另一路的解码和输出停下来（音频为主时钟时画面也跟着停），
+  // 占着内存的这一路取不走，两边互相等待。队列自身的限制仍然有效
+  const auto video = m_pending_queue == m_video_packet_queue.get();
+  const auto other = video ? m_audio_packet_queue.get()
+                           : m_video_packet_queue.get();
+  const auto other_open = video ? m_audio_stream_idx.has_value()
+                                : m_video_stream_idx.has_value();
+  if (other && other_open && other->empty() &&
+      m_pending_queue->try_push(m_pending, false))
+  {
+    m_memory_overcommit->add();
+    return true;
+  }
+  return false;
+}
+
+std::optional<std::pair<int64_t, int64_t>> Demuxthread::find_keyframe(
+    int64_t ts) const
+{
+  // 只有ts之后也有已索引的关键帧，才能确定前一个就是最近的关键帧
+  const auto it = m_keyframes.upper_bound(ts);
+  if (it == m_keyframes.begin() || it == m_keyframes.end())
+  {
+    return std::nullopt;
   }
-  SPDLOG_INFO("demuxed {} audio packets", audio_packets);
-  SPDLOG_INFO("demuxed {} video packets", video_packets);
+  return *std::prev(it);
 }
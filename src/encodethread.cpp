@@ -0,0 +1,511 @@
+#include "encodethread.h"
+
+#include <algorithm>
+#include <format>
+
+#include <spdlog/spdlog.h>
+
+#include "ffmpeg_utils.h"
+
+namespace
+{
+// 编码器支持源格式时沿用，省去一次转换；否则取编码器的首选格式
+AVPixelFormat choose_pixel_format(const AVCodec *encoder, int src)
+{
+  if (!encoder->pix_fmts)
+  {
+    return src == AV_PIX_FMT_NONE ? AV_PIX_FMT_YUV420P
+                                  : static_cast<AVPixelFormat>(src);
+  }
+  for (auto p = encoder->pix_fmts; *p != AV_PIX_FMT_NONE; p++)
+  {
+    if (*p == src)
+    {
+      return *p;
+    }
+  }
+  return encoder->pix_fmts[0];
+}
+
+AVSampleFormat choose_sample_format(const AVCodec *encoder, int src)
+{
+  if (!encoder->sample_fmts)
+  {
+    return static_cast<AVSampleFormat>(src);
+  }
+  for (auto p = encoder->sample_fmts; *p != AV_SAMPLE_FMT_NONE; p++)
+  {
+    if (*p == src)
+    {
+      return *p;
+    }
+  }
+  return encoder->sample_fmts[0];
+}
+}  // namespace
+
+EncodeThread::EncodeThread(std::shared_ptr<AVFrameQueue> frame_queue,
+                           std::shared_ptr<AVPacketQueue> packet_queue)
+    : m_frame_queue(frame_queue)
+    , m_packet_queue(packet_queue)
+    , m_frame_pool(std::make_shared<AVFramePool>())
+    , m_packet_pool(std::make_shared<AVPacketPool>())
+{
+}
+
+EncodeThread::~EncodeThread() { deinit(); }
+
+int EncodeThread::init(const AVCodecParameters *params,
+                       AVRational time_base,
+                       AVRational frame_rate,
+                       const EncodeOptions &opts,
+                       bool global_header)
+{
+  assert(params);
+  const auto encoder = avcodec_find_encoder_by_name(opts.encoder.c_str());
+  if (!encoder)
+  {
+    return AVERROR_ENCODER_NOT_FOUND;
+  }
+  if (encoder->type != params->codec_type)
+  {
+    return AVERROR(EINVAL);
+  }
+
+  m_codec_ctx = avcodec_alloc_context3(encoder);
+  if (!m_codec_ctx)
+  {
+    return AVERROR(ENOMEM);
+  }
+
+  m_src_time_base = time_base;
+  if (params->codec_type == AVMEDIA_TYPE_VIDEO)
+  {
+    m_codec_ctx->width = params->width;
+    m_codec_ctx->height = params->height;
+    m_codec_ctx->sample_aspect_ratio = params->sample_aspect_ratio;
+    m_codec_ctx->pix_fmt = choose_pixel_format(encoder, params->format);
+    // 沿用源流的时间基，帧的时间戳不需要换算
+    m_codec_ctx->time_base = time_base;
+    m_codec_ctx->framerate = frame_rate;
+  }
+  else
+  {
+    m_codec_ctx->sample_rate = params->sample_rate;
+    m_codec_ctx->sample_fmt = choose_sample_format(encoder, params->format);
+    m_codec_ctx->time_base = av_make_q(1, params->sample_rate);
+    if (const auto ret =
+            av_channel_layout_copy(&m_codec_ctx->ch_layout, &params->ch_layout);
+        ret < 0)
+    {
+      return ret;
+    }
+  }
+
+  if (opts.bit_rate > 0)
+  {
+    m_codec_ctx->bit_rate = opts.bit_rate;
+  }
+  // 导出不关心延迟，帧级多线程的吞吐最高
+  m_codec_ctx->thread_count = opts.threads;
+  m_codec_ctx->thread_type = FF_THREAD_FRAME;
+  if (global_header)
+  {
+    m_codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  }
+
+  if (const auto ret = avcodec_open2(m_codec_ctx, encoder, nullptr); ret < 0)
+  {
+    return ret;
+  }
+
+  if (params->codec_type == AVMEDIA_TYPE_AUDIO)
+  {
+    m_fifo = av_audio_fifo_alloc(m_codec_ctx->sample_fmt,
+                                 m_codec_ctx->ch_layout.nb_channels,
+                                 std::max(m_codec_ctx->frame_size, 1024));
+    if (!m_fifo)
+    {
+      return AVERROR(ENOMEM);
+    }
+  }
+
+  const auto type = av_get_media_type_string(params->codec_type);
+  m_encode_time =
+      &Metrics::instance().histogram(std::format("{}_encode_ns", type));
+  if (params->codec_type == AVMEDIA_TYPE_VIDEO)
+  {
+    SPDLOG_INFO("encoder {}: {} {}x{}, {} threads ({} requested), bitrate {}",
+                encoder->name,
+                av_get_pix_fmt_name(m_codec_ctx->pix_fmt),
+                m_codec_ctx->width,
+                m_codec_ctx->height,
+                m_codec_ctx->thread_count,
+                opts.threads,
+                m_codec_ctx->bit_rate);
+  }
+  else
+  {
+    SPDLOG_INFO("encoder {}: {} {} Hz, {} channels, frame size {}, bitrate {}",
+                encoder->name,
+                av_get_sample_fmt_name(m_codec_ctx->sample_fmt),
+                m_codec_ctx->sample_rate,
+                m_codec_ctx->ch_layout.nb_channels,
+                m_codec_ctx->frame_size,
+                m_codec_ctx->bit_rate);
+  }
+  return 0;
+}
+
+void EncodeThread::start()
+{
+  m_thread = std::jthread([=](std::stop_token token) { run(token); });
+}
+
+void EncodeThread::stop()
+{
+  m_thread.request_stop();
+  if (m_thread.joinable())
+  {
+    m_thread.join();
+  }
+}
+
+void EncodeThread::deinit()
+{
+  avcodec_free_context(&m_codec_ctx);
+  swr_free(&m_swr_ctx);
+  av_audio_fifo_free(m_fifo);
+  m_fifo = nullptr;
+}
+
+const StageStats &EncodeThread::stats() const { return m_stats; }
+
+void EncodeThread::run(std::stop_token token)
+{
+  while (!token.stop_requested() &&
+         step(std::chrono::milliseconds(10)) != Executor::Status::Done)
+  {
+  }
+  m_stats.cpu_ns.store(StageStats::thread_cpu_time().count(),
+                       std::memory_order_relaxed);
+  finish();
+}
+
+void EncodeThread::finish()
+{
+  m_packet_queue->finish();
+  SPDLOG_INFO("encode {} frames -> {} packets",
+              m_stats.frames.load(std::memory_order_relaxed),
+              m_stats.packets.load(std::memory_order_relaxed));
+}
+
+Executor::Status EncodeThread::fail(int error)
+{
+  if (!m_error)
+  {
+    m_error = error;
+  }
+  return Executor::Status::Done;
+}
+
+Executor::Status EncodeThread::step(std::chrono::milliseconds wait)
+{
+  // 上一步取出但包队列已满、没能送出的包
+  if (m_pending && !m_packet_queue->push(m_pending, wait))
+  {
+    return Executor::Status::Idle;
+  }
+
+  if (m_receiving)
+  {
+    return receive_packet(wait);
+  }
+
+  if (samples_ready())
+  {
+    if (const auto ret = send_samples(); ret < 0)
+    {
+      SPDLOG_ERROR("send samples error: {}", Utils::error_stringify(ret));
+      return fail(ret);
+    }
+    return Executor::Status::Progress;
+  }
+
+  if (m_flushing)
+  {
+    return Executor::Status::Done;
+  }
+
+  auto opt = m_frame_queue->pop(wait);
+  if (!opt)
+  {
+    if (!m_frame_queue->finished())
+    {
+      return Executor::Status::Idle;
+    }
+    if (!m_input_done)
+    {  // 重采样器和FIFO中剩下的采样先送出，再冲刷编码器
+      if (const auto ret = flush_samples(); ret < 0)
+      {
+        SPDLOG_ERROR("flush resampler error: {}", Utils::error_stringify(ret));
+        return fail(ret);
+      }
+      m_input_done = true;
+      return Executor::Status::Progress;
+    }
+    if (const auto ret = send_frame(nullptr); ret < 0)
+    {
+      SPDLOG_ERROR("flush encoder error: {}", Utils::error_stringify(ret));
+      return fail(ret);
+    }
+    m_flushing = true;
+    return Executor::Status::Progress;
+  }
+
+  auto frame = std::move(*opt);
+  m_stats.frames.fetch_add(1, std::memory_order_relaxed);
+  if (m_fifo)
+  {
+    if (const auto ret = write_samples(*frame); ret < 0)
+    {
+      SPDLOG_ERROR("write samples error: {}", Utils::error_stringify(ret));
+      return fail(ret);
+    }
+    return Executor::Status::Progress;
+  }
+
+  // 解码器给出的帧类型只是参考，由编码器自己决定
+  const auto ts = SpscQueueTraits<AVFramePtr>::timestamp(frame);
+  frame->pts = ts.value_or(AV_NOPTS_VALUE);
+  frame->pict_type = AV_PICTURE_TYPE_NONE;
+  if (const auto ret = send_frame(frame.get()); ret < 0)
+  {
+    SPDLOG_ERROR("avcodec_send_frame error: {}", Utils::error_stringify(ret));
+    return fail(ret);
+  }
+  return Executor::Status::Progress;
+}
+
+int EncodeThread::send_frame(AVFrame *frame)
+{
+  const auto begin = std::chrono::steady_clock::now();
+  const auto ret = avcodec_send_frame(m_codec_ctx, frame);
+  m_encode_time->record(std::chrono::steady_clock::now() - begin);
+  if (ret >= 0)
+  {
+    m_receiving = true;
+  }
+  return ret;
+}
+
+Executor::Status EncodeThread::receive_packet(std::chrono::milliseconds wait)
+{
+  if (!m_packet)
+  {
+    m_packet = m_packet_pool->acquire();
+    if (!m_packet)
+    {
+      SPDLOG_ERROR("acquire packet error: {}",
+                   Utils::error_stringify(AVERROR(ENOMEM)));
+      return fail(AVERROR(ENOMEM));
+    }
+  }
+
+  const auto ret = avcodec_receive_packet(m_codec_ctx, m_packet.get());
+  if (ret == AVERROR(EAGAIN))
+  {
+    m_receiving = false;
+    return Executor::Status::Progress;
+  }
+  if (ret == AVERROR_EOF)
+  {
+    SPDLOG_INFO("{} encoder drained",
+                av_get_media_type_string(m_codec_ctx->codec_type));
+    return Executor::Status::Done;
+  }
+  if (ret < 0)
+  {
+    SPDLOG_ERROR("avcodec_receive_packet error: {}",
+                 Utils::error_stringify(ret));
+    return fail(ret);
+  }
+
+  m_stats.packets.fetch_add(1, std::memory_order_relaxed);
+  m_stats.bytes.fetch_add(m_packet->size, std::memory_order_relaxed);
+  // 包队列满时留到下一步再送
+  m_pending = std::move(m_packet);
+  if (!m_packet_queue->push(m_pending, wait))
+  {
+    return Executor::Status::Idle;
+  }
+  return Executor::Status::Progress;
+}
+
+int EncodeThread::write_samples(const AVFrame &frame)
+{
+  if (m_next_pts == AV_NOPTS_VALUE)
+  {  // 以第一帧的时间戳为起点，之后按采样数累加
+    const auto ts = frame.best_effort_timestamp != AV_NOPTS_VALUE
+                        ? frame.best_effort_timestamp
+                        : frame.pts;
+    m_next_pts =
+        ts == AV_NOPTS_VALUE
+            ? 0
+            : av_rescale_q(ts, m_src_time_base, m_codec_ctx->time_base);
+  }
+
+  if (frame.format == m_codec_ctx->sample_fmt &&
+      frame.sample_rate == m_codec_ctx->sample_rate &&
+      !av_channel_layout_compare(&frame.ch_layout, &m_codec_ctx->ch_layout))
+  {
+    const auto ret =
+        av_audio_fifo_write(m_fifo,
+                            reinterpret_cast<void **>(frame.extended_data),
+                            frame.nb_samples);
+    return ret < 0 ? ret : 0;
+  }
+
+  if (!m_swr_ctx)
+  {
+    if (const auto ret =
+            swr_alloc_set_opts2(&m_swr_ctx,
+                                &m_codec_ctx->ch_layout,
+                                m_codec_ctx->sample_fmt,
+                                m_codec_ctx->sample_rate,
+                                &frame.ch_layout,
+                                static_cast<AVSampleFormat>(frame.format),
+                                frame.sample_rate,
+                                0,
+                                nullptr);
+        ret < 0)
+    {
+      return ret;
+    }
+    if (const auto ret = swr_init(m_swr_ctx); ret < 0)
+    {
+      swr_free(&m_swr_ctx);
+      return ret;
+    }
+    SPDLOG_INFO(
+        "resample {} -> {}",
+        av_get_sample_fmt_name(static_cast<AVSampleFormat>(frame.format)),
+        av_get_sample_fmt_name(m_codec_ctx->sample_fmt));
+  }
+
+  auto out = m_frame_pool->acquire();
+  if (!out)
+  {
+    return AVERROR(ENOMEM);
+  }
+  out->format = m_codec_ctx->sample_fmt;
+  out->sample_rate = m_codec_ctx->sample_rate;
+  if (const auto ret =
+          av_channel_layout_copy(&out->ch_layout, &m_codec_ctx->ch_layout);
+      ret < 0)
+  {
+    return ret;
+  }
+  if (const auto ret = swr_convert_frame(m_swr_ctx, out.get(), &frame); ret < 0)
+  {
+    return ret;
+  }
+  const auto ret = av_audio_fifo_write(
+      m_fifo, reinterpret_cast<void **>(out->extended_data), out->nb_samples);
+  return ret < 0 ? ret : 0;
+}
+
+int EncodeThread::flush_samples()
+{
+  if (!m_swr_ctx)
+  {
+    return 0;
+  }
+  const auto nb_samples = swr_get_out_samples(m_swr_ctx, 0);
+  if (nb_samples <= 0)
+  {
+    return nb_samples;
+  }
+
+  auto out = m_frame_pool->acquire();
+  if (!out)
+  {
+    return AVERROR(ENOMEM);
+  }
+  out->nb_samples = nb_samples;
+  out->format = m_codec_ctx->sample_fmt;
+  out->sample_rate = m_codec_ctx->sample_rate;
+  if (const auto ret =
+          av_channel_layout_copy(&out->ch_layout, &m_codec_ctx->ch_layout);
+      ret < 0)
+  {
+    return ret;
+  }
+  if (const auto ret = av_frame_get_buffer(out.get(), 0); ret < 0)
+  {
+    return ret;
+  }
+  // 没有输入时swr_convert()输出缓存的采样（采样率转换的滤波延迟）
+  const auto converted =
+      swr_convert(m_swr_ctx, out->extended_data, nb_samples, nullptr, 0);
+  if (converted <= 0)
+  {
+    return converted;
+  }
+  SPDLOG_DEBUG("flushed {} samples from resampler", converted);
+  const auto ret = av_audio_fifo_write(
+      m_fifo, reinterpret_cast<void **>(out->extended_data), converted);
+  return ret < 0 ? ret : 0;
+}
+
+bool EncodeThread::samples_ready() const
+{
+  if (!m_fifo)
+  {
+    return false;
+  }
+  const auto size = av_audio_fifo_size(m_fifo);
+  if (m_codec_ctx->frame_size <= 0 ||
+      (m_codec_ctx->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE))
+  {
+    return size > 0;
+  }
+  return size >= m_codec_ctx->frame_size || (m_input_done && size > 0);
+}
+
+int EncodeThread::send_samples()
+{
+  const auto size = av_audio_fifo_size(m_fifo);
+  const auto nb_samples = m_codec_ctx->frame_size > 0
+                              ? std::min(m_codec_ctx->frame_size, size)
+                              : size;
+
+  auto frame = m_frame_pool->acquire();
+  if (!frame)
+  {
+    return AVERROR(ENOMEM);
+  }
+  frame->nb_samples = nb_samples;
+  frame->format = m_codec_ctx->sample_fmt;
+  frame->sample_rate = m_codec_ctx->sample_rate;
+  if (const auto ret =
+          av_channel_layout_copy(&frame->ch_layout, &m_codec_ctx->ch_layout);
+      ret < 0)
+  {
+    return ret;
+  }
+  if (const auto ret = av_frame_get_buffer(frame.get(), 0); ret < 0)
+  {
+    return ret;
+  }
+  if (const auto ret = av_audio_fifo_read(
+          m_fifo, reinterpret_cast<void **>(frame->extended_data), nb_samples);
+      ret < 0)
+  {
+    return ret;
+  }
+
+  frame->pts = m_next_pts;
+  m_next_pts += nb_samples;
+  return send_frame(frame.get());
+}
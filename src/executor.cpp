@@ -0,0 +1,297 @@
+#include "executor.h"
+
+#include <algorithm>
+
+#include <spdlog/spdlog.h>
+
+#include "stagestats.h"
+
+namespace
+{
+// 一个任务连续执行的最长时间，之后让出给更紧急的任务
+constexpr auto SLICE = std::chrono::milliseconds(2);
+// Idle任务的重试间隔，从MIN_BACKOFF开始每次翻倍，直到MAX_BACKOFF
+constexpr auto MIN_BACKOFF = std::chrono::microseconds(250);
+constexpr auto MAX_BACKOFF = std::chrono::microseconds(4000);
+// 没有就绪任务时的最长休眠，期间有任务就绪（包括wake()）会被提前唤醒
+constexpr auto IDLE_WAIT = std::chrono::milliseconds(10);
+}  // namespace
+
+Executor::Executor(int threads)
+    : m_steps(&Metrics::instance().counter("executor_steps"))
+    , m_steals(&Metrics::instance().counter("executor_steals"))
+    , m_idle_polls(&Metrics::instance().counter("executor_idle_polls"))
+    , m_slice_time(&Metrics::instance().histogram("executor_slice_ns"))
+    , m_lateness(&Metrics::instance().histogram("executor_deadline_miss_ns"))
+{
+  const auto count =
+      threads > 0 ? threads
+                  : static_cast<int>(
+                        std::max(1u, std::thread::hardware_concurrency()));
+  for (int i = 0; i < count; i++)
+  {
+    m_workers.push_back(std::make_unique<Worker>());
+  }
+  // 所有Worker创建完之后再启动线程，窃取时会访问其它Worker
+  for (size_t i = 0; i < m_workers.size(); i++)
+  {
+    m_workers[i]->thread =
+        std::jthread([=](std::stop_token token) { run(i, token); });
+  }
+  SPDLOG_INFO("executor: {} workers", m_workers.size());
+}
+
+Executor::~Executor()
+{
+  for (auto &worker : m_workers)
+  {
+    worker->thread.request_stop();
+  }
+  m_idle_cond.notify_all();
+  for (auto &worker : m_workers)
+  {
+    worker->thread.join();
+  }
+}
+
+Executor::JobPtr Executor::submit(std::string name,
+                                  std::function<Status()> step,
+                                  std::function<clock::time_point()> deadline)
+{
+  auto job = std::make_shared<Job>();
+  job->m_name = std::move(name);
+  job->m_step = std::move(step);
+  job->m_deadline = std::move(deadline);
+  job->m_backoff = MIN_BACKOFF;
+
+  const auto index =
+      m_next_worker.fetch_add(1, std::memory_order_relaxed) % m_workers.size();
+  make_ready(index, job);
+  return job;
+}
+
+void Executor::cancel(const JobPtr &job)
+{
+  job->m_cancelled.store(true, std::memory_order_release);
+  // 执行线程在持有任务锁之后检查m_cancelled，拿到锁即说明不会再执行
+  std::lock_guard locker(job->m_run_lock);
+}
+
+void Executor::wake(const JobPtr &job)
+{
+  job->m_wake_pending.store(true);
+  if (!job->m_asleep.load() || job->m_cancelled.load())
+  {  // 正在执行或者已经就绪，Idle时会看到m_wake_pending
+    return;
+  }
+  const auto index = job->m_worker.load();
+  JobPtr woken;
+  {
+    std::lock_guard locker(m_workers[index]->lock);
+    auto &sleeping = m_workers[index]->sleeping;
+    const auto it = std::find(sleeping.begin(), sleeping.end(), job);
+    if (it == sleeping.end())
+    {  // 已经到期被移回就绪队列
+      return;
+    }
+    woken = std::move(*it);
+    *it = std::move(sleeping.back());
+    sleeping.pop_back();
+    woken->m_asleep.store(false);
+  }
+  woken->m_backoff = MIN_BACKOFF;
+  make_ready(index, std::move(woken));
+}
+
+void Executor::make_ready(size_t index, JobPtr job)
+{
+  job->m_priority = job->m_deadline ? job->m_deadline() : clock::now();
+  {
+    std::lock_guard locker(m_workers[index]->lock);
+    m_workers[index]->ready.push_back(std::move(job));
+  }
+  // 与run()中先登记空闲再检查m_ready_epoch配对，两边都用顺序一致的原子操作，
+  // 保证不会出现双方都没看到对方的情况
+  m_ready_epoch.fetch_add(1);
+  if (m_idle_workers.load() > 0)
+  {  // 有空闲的线程，唤醒一个来窃取
+    {
+      std::lock_guard locker(m_idle_lock);
+    }
+    m_idle_cond.notify_one();
+  }
+}
+
+Executor::JobPtr Executor::pop_most_urgent(std::vector<JobPtr> &jobs)
+{
+  if (jobs.empty())
+  {
+    return nullptr;
+  }
+  const auto it =
+      std::min_element(jobs.begin(),
+                       jobs.end(),
+                       [](const JobPtr &a, const JobPtr &b)
+                       { return a->m_priority < b->m_priority; });
+  auto job = std::move(*it);
+  *it = std::move(jobs.back());
+  jobs.pop_back();
+  return job;
+}
+
+Executor::JobPtr Executor::take(size_t index, clock::time_point &next_wake)
+{
+  auto &self = *m_workers[index];
+  const auto now = clock::now();
+  next_wake = clock::time_point::max();
+  std::vector<JobPtr> woken;
+  {
+    std::lock_guard locker(self.lock);
+    for (size_t i = 0; i < self.sleeping.size();)
+    {
+      if (self.sleeping[i]->m_wake_at <= now)
+      {
+        self.sleeping[i]->m_asleep.store(false);
+        woken.push_back(std::move(self.sleeping[i]));
+        self.sleeping[i] = std::move(self.sleeping.back());
+        self.sleeping.pop_back();
+      }
+      else
+      {
+        next_wake = std::min(next_wake, self.sleeping[i]->m_wake_at);
+        i++;
+      }
+    }
+  }
+  // 截止时间在锁外求值，它会读取各个队列的状态
+  for (auto &job : woken)
+  {
+    job->m_priority = job->m_deadline ? job->m_deadline() : now;
+  }
+  {
+    std::lock_guard locker(self.lock);
+    for (auto &job : woken)
+    {
+      self.ready.push_back(std::move(job));
+    }
+    if (auto job = pop_most_urgent(self.ready))
+    {
+      return job;
+    }
+  }
+
+  // 从其它线程窃取最紧急的任务，对方正忙时跳过，不在锁上排队
+  for (size_t i = 1; i < m_workers.size(); i++)
+  {
+    auto &victim = *m_workers[(index + i) % m_workers.size()];
+    std::unique_lock locker(victim.lock, std::try_to_lock);
+    if (!locker.owns_lock())
+    {
+      continue;
+    }
+    if (auto job = pop_most_urgent(victim.ready))
+    {
+      m_steals->add();
+      return job;
+    }
+  }
+  return nullptr;
+}
+
+void Executor::execute(size_t index, JobPtr job)
+{
+  Status status = Status::Progress;
+  bool progressed = false;
+  {
+    std::lock_guard locker(job->m_run_lock);
+    if (job->m_cancelled.load(std::memory_order_acquire))
+    {
+      return;
+    }
+
+    const auto begin = clock::now();
+    if (begin > job->m_priority)
+    {
+      m_lateness->record(begin - job->m_priority);
+    }
+    const auto slice_end = begin + SLICE;
+    const auto cpu_begin = StageStats::thread_cpu_time();
+    // 此后的wake()说明这个时间片开始之后才有新的输入
+    job->m_wake_pending.store(false);
+    do
+    {
+      status = job->m_step();
+      progressed |= status == Status::Progress;
+      m_steps->add();
+    } while (status == Status::Progress && clock::now() < slice_end &&
+             !job->m_cancelled.load(std::memory_order_relaxed));
+    m_slice_time->record(clock::now() - begin);
+    // 工作线程由多个任务共用，按时间片把CPU时间记到任务上
+    job->m_cpu_ns.fetch_add(
+        (StageStats::thread_cpu_time() - cpu_begin).count(),
+        std::memory_order_relaxed);
+    job->m_done.store(status == Status::Done, std::memory_order_relaxed);
+  }
+
+  switch (status)
+  {
+  case Status::Done:
+    SPDLOG_INFO("job {} done", job->m_name);
+    break;
+  case Status::Idle:
+  {
+    m_idle_polls->add();
+    if (progressed)
+    {  // 这个时间片里有过进展，说明只是暂时没有数据，从最短的间隔开始重试
+      job->m_backoff = MIN_BACKOFF;
+    }
+    job->m_wake_at = clock::now() + job->m_backoff;
+    job->m_backoff = std::min(job->m_backoff * 2, MAX_BACKOFF);
+    {
+      // 先登记退避再检查m_wake_pending，与wake()先置位再检查m_asleep配对，
+      // 两边都用顺序一致的原子操作，新数据已到时任务不会仍在退避
+      std::lock_guard locker(m_workers[index]->lock);
+      job->m_worker.store(index);
+      job->m_asleep.store(true);
+      if (!job->m_wake_pending.load())
+      {
+        m_workers[index]->sleeping.push_back(std::move(job));
+        break;
+      }
+      job->m_asleep.store(false);
+    }
+    job->m_backoff = MIN_BACKOFF;
+    make_ready(index, std::move(job));
+    break;
+  }
+  case Status::Progress:
+  default:
+    job->m_backoff = MIN_BACKOFF;
+    make_ready(index, std::move(job));
+    break;
+  }
+}
+
+void Executor::run(size_t index, std::stop_token token)
+{
+  while (!token.stop_requested())
+  {
+    const auto epoch = m_ready_epoch.load();
+    clock::time_point next_wake;
+    if (auto job = take(index, next_wake))
+    {
+      execute(index, std::move(job));
+      continue;
+    }
+
+    // 没有可执行的任务：睡到本线程最早的退避到期，或者其它线程有任务就绪
+    const auto deadline = std::min(next_wake, clock::now() + IDLE_WAIT);
+    std::unique_lock locker(m_idle_lock);
+    m_idle_workers.fetch_add(1);
+    m_idle_cond.wait_until(locker,
+                           token,
+                           deadline,
+                           [&]() { return m_ready_epoch.load() != epoch; });
+    m_idle_workers.fetch_sub(1);
+  }
+}
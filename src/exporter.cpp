@@ -0,0 +1,304 @@
+#include "exporter.h"
+
+#include <spdlog/fmt/fmt.h>
+#include <spdlog/spdlog.h>
+
+#include "benchmark.h"
+#include "ffmpeg_utils.h"
+#include "memorybudget.h"
+#include "probecache.h"
+
+Exporter::Exporter(const PlayerOptions &opts)
+    : m_opts(opts)
+{
+}
+
+Exporter::~Exporter() = default;
+
+int Exporter::init()
+{
+  auto &memory = MemoryBudget::instance();
+  for (auto branch : {&m_audio, &m_video})
+  {
+    branch->packets = std::make_shared<AVPacketQueue>(256);
+    branch->packets->set_memory_account(
+        &memory.account(branch->name, "packets"));
+  }
+
+  m_demux = std::make_shared<Demuxthread>(m_audio.packets, m_video.packets);
+  if (!m_opts.probe_cache.empty())
+  {
+    m_demux->set_probe_cache(
+        std::make_shared<ProbeCache>(m_opts.probe_cache));
+  }
+  m_demux->set_probe_limits(m_opts.probesize, m_opts.analyze_duration);
+  m_demux->set_io_options(m_opts.io);
+  const auto &url = m_opts.urls.front();
+  if (const auto ret = m_demux->init(url); ret < 0)
+  {
+    SPDLOG_ERROR("open {} error: {}", url, Utils::error_stringify(ret));
+    return ret;
+  }
+  if (!m_demux->has_audio())
+  {
+    m_audio.packets.reset();
+  }
+  if (!m_demux->has_video())
+  {
+    m_video.packets.reset();
+  }
+
+  m_mux = std::make_shared<MuxThread>();
+  if (const auto ret = m_mux->init(m_opts.export_path); ret < 0)
+  {
+    SPDLOG_ERROR("create {} error: {}",
+                 m_opts.export_path,
+                 Utils::error_stringify(ret));
+    return ret;
+  }
+
+  if (m_video.packets)
+  {
+    if (const auto ret = open_branch(m_video,
+                                     m_demux->video_codec_params(),
+                                     m_demux->video_stream_time_base(),
+                                     m_demux->video_frame_rate(),
+                                     m_opts.video_threading,
+                                     m_opts.video_encode);
+        ret < 0)
+    {
+      return ret;
+    }
+  }
+  if (m_audio.packets)
+  {
+    if (const auto ret = open_branch(m_audio,
+                                     m_demux->audio_codec_params(),
+                                     m_demux->audio_stream_time_base(),
+                                     av_make_q(0, 1),
+                                     m_opts.audio_threading,
+                                     m_opts.audio_encode);
+        ret < 0)
+    {
+      return ret;
+    }
+  }
+
+  if (const auto ret = m_mux->open(); ret < 0)
+  {
+    SPDLOG_ERROR("open {} error: {}",
+                 m_opts.export_path,
+                 Utils::error_stringify(ret));
+    return ret;
+  }
+  return 0;
+}
+
+int Exporter::open_branch(Branch &branch,
+                          const AVCodecParameters *params,
+                          AVRational time_base,
+                          AVRational frame_rate,
+                          const DecodeThreading &threading,
+                          const EncodeOptions &encode)
+{
+  auto &memory = MemoryBudget::instance();
+  const auto video = params->codec_type == AVMEDIA_TYPE_VIDEO;
+  branch.decoded = std::make_shared<AVFrameQueue>(video ? 16 : 64);
+  branch.encoded = std::make_shared<AVPacketQueue>(256);
+  branch.decoded->set_memory_account(
+      &memory.account(branch.name, "decoded_frames"));
+  branch.encoded->set_memory_account(
+      &memory.account(branch.name, "encoded_packets"));
+  // 全速运行时队列总是满的，上限决定了常驻内存：
+  // 解码后的视频帧最大，只留够编码器的帧级多线程取用
+  branch.packets->set_limits(
+      {.max_bytes = (video ? 32u : 4u) * 1024 * 1024,
+       .max_duration =
+           Utils::to_time_base(std::chrono::seconds(3), time_base)});
+  branch.decoded->set_limits({.max_count = video ? 8u : 64u,
+                              .max_bytes = 256 * 1024 * 1024});
+
+  branch.decode =
+      std::make_shared<CodecThread>(branch.packets, branch.decoded);
+  if (const auto ret = branch.decode->init(params, threading); ret < 0)
+  {
+    SPDLOG_ERROR("{} decoder init error: {}",
+                 branch.name,
+                 Utils::error_stringify(ret));
+    return ret;
+  }
+
+  auto encode_input = branch.decoded;
+  if (video)
+  {
+    branch.frames = std::make_shared<AVFrameQueue>(16);
+    branch.frames->set_memory_account(&memory.account(branch.name, "frames"));
+    branch.frames->set_limits(
+        {.max_count = 8, .max_bytes = 256 * 1024 * 1024});
+    branch.convert =
+        std::make_shared<ConvertThread>(branch.decoded, branch.frames);
+    encode_input = branch.frames;
+  }
+
+  branch.encode =
+      std::make_shared<EncodeThread>(encode_input, branch.encoded);
+  if (const auto ret = branch.encode->init(
+          params, time_base, frame_rate, encode, m_mux->global_header());
+      ret < 0)
+  {
+    SPDLOG_ERROR("{} encoder {} init error: {}",
+                 branch.name,
+                 encode.encoder,
+                 Utils::error_stringify(ret));
+    return ret;
+  }
+
+  if (branch.convert)
+  {  // 尺寸不变，只转换为编码器的像素格式
+    if (const auto ret = branch.convert->init(params->width,
+                                              params->height,
+                                              branch.encode->pixel_format(),
+                                              m_opts.convert_threads);
+        ret < 0)
+    {
+      SPDLOG_ERROR("{} convert init error: {}",
+                   branch.name,
+                   Utils::error_stringify(ret));
+      return ret;
+    }
+  }
+
+  return m_mux->add_stream(branch.encoded, branch.encode->codec_context());
+}
+
+void Exporter::start()
+{
+  m_demux->start();
+  for (auto branch : {&m_audio, &m_video})
+  {
+    if (!branch->encode)
+    {
+      continue;
+    }
+    branch->decode->start();
+    if (branch->convert)
+    {
+      branch->convert->start();
+    }
+    branch->encode->start();
+  }
+  m_mux->start();
+}
+
+void Exporter::stop()
+{
+  m_mux->stop();
+  for (auto branch : {&m_audio, &m_video})
+  {
+    if (!branch->encode)
+    {
+      continue;
+    }
+    branch->encode->stop();
+    if (branch->convert)
+    {
+      branch->convert->stop();
+    }
+    branch->decode->stop();
+  }
+  m_demux->stop();
+}
+
+int Exporter::run()
+{
+  const auto begin = std::chrono::steady_clock::now();
+  const auto cpu_begin = StageStats::process_cpu_time();
+  start();
+  m_mux->wait();
+  const auto elapsed = std::chrono::steady_clock::now() - begin;
+  stop();
+
+  BenchmarkReport report;
+  report.elapsed = elapsed;
+  report.process_cpu = StageStats::process_cpu_time() - cpu_begin;
+  report.media_duration = m_mux->duration();
+  report.end_to_end_frames = (m_video.encode ? m_video : m_audio)
+                                 .encode->stats()
+                                 .frames.load(std::memory_order_relaxed);
+  report.add_stage("demux", m_demux->stats());
+  for (auto branch : {&m_audio, &m_video})
+  {
+    if (!branch->encode)
+    {
+      continue;
+    }
+    const auto &name = branch->name;
+    report.add_stage(name + "_decode", branch->decode->stats());
+    if (branch->convert)
+    {
+      report.add_stage(name + "_convert", branch->convert->stats());
+    }
+    report.add_stage(name + "_encode", branch->encode->stats());
+    report.add_queue(name + "_packets", *branch->packets);
+    report.add_queue(name + "_decoded", *branch->decoded);
+    if (branch->frames)
+    {
+      report.add_queue(name + "_frames", *branch->frames);
+    }
+    report.add_queue(name + "_encoded", *branch->encoded);
+  }
+  report.add_stage("mux", m_mux->stats());
+  report.log();
+  MemoryBudget::instance().log();
+  fmt::print("{}\n", report.to_json());
+
+  // 上游出错时下游只是提前结束（封装照样写完文件尾），按流水线顺序报告错误
+  if (const auto ret = m_demux->error(); ret < 0)
+  {
+    return ret;
+  }
+  for (auto branch : {&m_audio, &m_video})
+  {
+    if (!branch->encode)
+    {
+      continue;
+    }
+    for (const auto ret : {branch->decode->error(),
+                           branch->convert ? branch->convert->error() : 0,
+                           branch->encode->error()})
+    {
+      if (ret < 0)
+      {
+        return ret;
+      }
+    }
+  }
+  return m_mux->error();
+}
+
+void Exporter::deinit()
+{
+  for (auto branch : {&m_audio, &m_video})
+  {
+    if (branch->encode)
+    {
+      branch->encode->deinit();
+    }
+    if (branch->convert)
+    {
+      branch->convert->deinit();
+    }
+    if (branch->decode)
+    {
+      branch->decode->deinit();
+    }
+  }
+  if (m_mux)
+  {
+    m_mux->deinit();
+  }
+  if (m_demux)
+  {
+    m_demux->deinit();
+  }
+}
@@ -0,0 +1,681 @@
+#include "fileio.h"
+
+#include <algorithm>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <spdlog/spdlog.h>
+
+#include "ffmpeg_utils.h"
+
+namespace
+{
+// AVIO缓冲只是从映射或预读缓冲拷贝时的大小
+constexpr size_t COPY_BUFFER_SIZE = 256 * 1024;
+
+// file:前缀的url和普通路径视为本地文件，其余协议交给FFmpeg
+std::optional<std::filesystem::path> local_path(std::string_view url)
+{
+  if (url.starts_with("file:"))
+  {
+    url.remove_prefix(5);
+  }
+  else if (url.find("://") != url.npos || url.starts_with("pipe:"))
+  {
+    return std::nullopt;
+  }
+
+  std::error_code ec;
+  std::filesystem::path path(url);
+  if (!std::filesystem::is_regular_file(path, ec))
+  {
+    return std::nullopt;
+  }
+  return path;
+}
+
+// 整个文件只读映射，按顺序访问提示内核加大预读；
+// 读位置之后的一块提前预取，解复用线程读到时页已经在内存中，不会阻塞在缺页上
+class MmapReader : public FileIO::Reader
+{
+ public:
+  MmapReader(const uint8_t *data, int64_t size, size_t block_size)
+      : m_data(data)
+      , m_size(size)
+      , m_block_size(block_size)
+  {
+#ifndef _WIN32
+    m_page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    madvise(const_cast<uint8_t *>(m_data), size, MADV_SEQUENTIAL);
+#endif
+  }
+
+  ~MmapReader() override
+  {
+#ifdef _WIN32
+    UnmapViewOfFile(m_data);
+#else
+    munmap(const_cast<uint8_t *>(m_data), m_size);
+#endif
+  }
+
+  std::string name() const override { return "mmap"; }
+  int64_t size() const override { return m_size; }
+
+  static std::unique_ptr<FileIO::Reader> open(const std::filesystem::path &path,
+                                      size_t block_size)
+  {
+#ifdef _WIN32
+    const auto file = CreateFileW(path.c_str(),
+                                  GENERIC_READ,
+                                  FILE_SHARE_READ | FILE_SHARE_DELETE,
+                                  nullptr,
+                                  OPEN_EXISTING,
+                                  FILE_ATTRIBUTE_NORMAL,
+                                  nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+      return nullptr;
+    }
+    LARGE_INTEGER file_size{};
+    const auto mapping =
+        GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0
+            ? CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr)
+            : nullptr;
+    CloseHandle(file);
+    if (!mapping)
+    {
+      return nullptr;
+    }
+    const auto view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!view)
+    {
+      return nullptr;
+    }
+    return std::make_unique<MmapReader>(
+        static_cast<const uint8_t *>(view), file_size.QuadPart, block_size);
+#else
+    const auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      return nullptr;
+    }
+    struct stat st{};
+    void *addr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+      addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (addr == MAP_FAILED)
+    {
+      return nullptr;
+    }
+    return std::make_unique<MmapReader>(
+        static_cast<const uint8_t *>(addr), st.st_size, block_size);
+#endif
+  }
+
+  int read_at(int64_t pos, uint8_t *buf, int size) override
+  {
+    const auto n = static_cast<int>(std::min<int64_t>(size, m_size - pos));
+    if (n <= 0)
+    {
+      return 0;
+    }
+
+    // 读到已预取区域的后一半时预取下一块，预取始终领先读位置至少半块
+    if (pos + n + static_cast<int64_t>(m_block_size / 2) > m_prefetched)
+    {
+      prefetch(std::max(pos, m_prefetched));
+    }
+    memcpy(buf, m_data + pos, n);
+    return n;
+  }
+
+  void on_seek(int64_t pos) override
+  {
+    m_prefetched = pos;
+    prefetch(pos);
+  }
+
+ private:
+  void prefetch(int64_t pos)
+  {
+    const auto end =
+        std::min<int64_t>(pos + static_cast<int64_t>(m_block_size), m_size);
+    if (end <= pos)
+    {
+      return;
+    }
+#ifdef _WIN32
+    WIN32_MEMORY_RANGE_ENTRY range{const_cast<uint8_t *>(m_data + pos),
+                                   static_cast<SIZE_T>(end - pos)};
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+    // madvise要求起始地址按页对齐
+    const auto begin = pos / m_page_size * m_page_size;
+    madvise(const_cast<uint8_t *>(m_data + begin), end - begin, MADV_WILLNEED);
+#endif
+    m_prefetched = end;
+  }
+
+ private:
+  const uint8_t *m_data{};
+  int64_t m_size{};
+  size_t m_block_size{};
+  size_t m_page_size{4096};
+  int64_t m_prefetched{};  // 已经发出预取的区域的末尾
+};
+
+// 大块同步读取：AVIO缓冲与块一样大，FFmpeg每次补充缓冲都是一次整块的读
+class BufferedReader : public FileIO::Reader
+{
+ public:
+#ifdef _WIN32
+  using handle_type = HANDLE;
+#else
+  using handle_type = int;
+#endif
+
+  BufferedReader(handle_type file, int64_t size)
+      : m_file(file)
+      , m_size(size)
+  {
+  }
+
+  ~BufferedReader() override
+  {
+#ifdef _WIN32
+    CloseHandle(m_file);
+#else
+    close(m_file);
+#endif
+  }
+
+  std::string name() const override { return "buffered"; }
+  int64_t size() const override { return m_size; }
+
+  static std::unique_ptr<FileIO::Reader> open(
+      const std::filesystem::path &path)
+  {
+#ifdef _WIN32
+    const auto file = CreateFileW(path.c_str(),
+                                  GENERIC_READ,
+                                  FILE_SHARE_READ | FILE_SHARE_DELETE,
+                                  nullptr,
+                                  OPEN_EXISTING,
+                                  FILE_FLAG_SEQUENTIAL_SCAN,
+                                  nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+      return nullptr;
+    }
+    LARGE_INTEGER file_size{};
+    if (!GetFileSizeEx(file, &file_size))
+    {
+      CloseHandle(file);
+      return nullptr;
+    }
+    return std::make_unique<BufferedReader>(file, file_size.QuadPart);
+#else
+    const auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      return nullptr;
+    }
+    struct stat st{};
+    if (fstat(fd, &st) != 0)
+    {
+      close(fd);
+      return nullptr;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    return std::make_unique<BufferedReader>(fd, st.st_size);
+#endif
+  }
+
+  int read_at(int64_t pos, uint8_t *buf, int size) override
+  {
+    // 一次读可能返回的比请求的少，循环读满，减少FFmpeg回调的次数
+    int total = 0;
+    while (total < size)
+    {
+#ifdef _WIN32
+      OVERLAPPED overlapped{};
+      overlapped.Offset = static_cast<DWORD>(pos + total);
+      overlapped.OffsetHigh = static_cast<DWORD>((pos + total) >> 32);
+      DWORD n = 0;
+      if (!ReadFile(m_file, buf + total, size - total, &n, &overlapped))
+      {
+        if (GetLastError() == ERROR_HANDLE_EOF)
+        {
+          break;
+        }
+        return total > 0 ? total : AVERROR(EIO);
+      }
+#else
+      const auto n = pread(m_file, buf + total, size - total, pos + total);
+      if (n < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+        return total > 0 ? total : AVERROR(errno);
+      }
+#endif
+      if (n == 0)
+      {
+        break;
+      }
+      total += static_cast<int>(n);
+    }
+    return total;
+  }
+
+ private:
+  handle_type m_file;
+  int64_t m_size{};
+};
+
+// 测试用的慢速存储：每次读取在真实读取之外增加固定延迟，并按带宽限制补足耗时
+class ThrottledReader : public FileIO::Reader
+{
+ public:
+  ThrottledReader(std::unique_ptr<FileIO::Reader> source,
+                  std::chrono::microseconds latency,
+                  uint64_t bandwidth)
+      : m_source(std::move(source))
+      , m_latency(latency)
+      , m_bandwidth(bandwidth)
+  {
+  }
+
+  std::string name() const override
+  {
+    return "throttled(" + m_source->name() + ")";
+  }
+  int64_t size() const override { return m_source->size(); }
+
+  int read_at(int64_t pos, uint8_t *buf, int size) override
+  {
+    const auto begin = std::chrono::steady_clock::now();
+    const auto n = m_source->read_at(pos, buf, size);
+    auto deadline = begin + m_latency;
+    if (n > 0 && m_bandwidth > 0)
+    {
+      deadline += std::chrono::nanoseconds(
+          av_rescale(n, 1000000000, static_cast<int64_t>(m_bandwidth)));
+    }
+    std::this_thread::sleep_until(deadline);
+    return n;
+  }
+
+  void on_seek(int64_t pos) override { m_source->on_seek(pos); }
+
+ private:
+  std::unique_ptr<FileIO::Reader> m_source;
+  std::chrono::microseconds m_latency;
+  uint64_t m_bandwidth;
+};
+
+// 异步预读：独立的I/O线程把读位置之后的数据读进有界的环形缓冲，
+// 解复用线程只从缓冲拷贝，存储的延迟抖动被缓冲吸收。
+// 文件位置p的数据存放在m_buffer[p % capacity]，缓冲中的有效区间为[m_begin, m_end)
+class ReadAheadReader : public FileIO::Reader
+{
+  using lock_type = std::mutex;
+  using unique_lock = std::unique_lock<lock_type>;
+
+ public:
+  ReadAheadReader(std::unique_ptr<FileIO::Reader> source,
+                  size_t capacity,
+                  size_t block_size)
+      : m_source(std::move(source))
+      , m_buffer(capacity)
+      , m_block_size(std::min(block_size, capacity / 4))
+      , m_fill(&Metrics::instance().gauge("io_readahead_fill_bytes"))
+      , m_stalls(&Metrics::instance().counter("io_readahead_stalls"))
+      , m_stall_time(&Metrics::instance().histogram("io_readahead_stall_ns"))
+  {
+    m_thread = std::jthread([=](std::stop_token token) { run(token); });
+  }
+
+  ~ReadAheadReader() override
+  {
+    m_thread.request_stop();
+    m_thread.join();
+    SPDLOG_INFO("read-ahead: {} stalls", m_stalls->value());
+  }
+
+  std::string name() const override
+  {
+    return "read-ahead(" + m_source->name() + ")";
+  }
+  int64_t size() const override { return m_source->size(); }
+
+  int read_at(int64_t pos, uint8_t *buf, int size) override
+  {
+    unique_lock locker(m_lock);
+    if (pos < m_begin || pos > m_end)
+    {  // 读位置不在缓冲区间内，从pos重新开始预读
+      reposition(pos);
+    }
+
+    if (pos == m_end && !m_eof && m_error == 0)
+    {  // 缓冲已经读空，解复用线程只能等待存储
+      m_stalls->add();
+      ScopedTimer timer(*m_stall_time);
+      m_not_empty.wait(
+          locker,
+          [&]() { return m_end > pos || m_eof || m_error != 0; });
+    }
+    if (pos == m_end)
+    {
+      return m_error != 0 ? m_error : 0;
+    }
+
+    const auto capacity = m_buffer.size();
+    const auto n = static_cast<size_t>(
+        std::min<int64_t>(size, m_end - pos));
+    const auto offset = static_cast<size_t>(pos % capacity);
+    const auto first = std::min(n, capacity - offset);
+    memcpy(buf, m_buffer.data() + offset, first);
+    memcpy(buf + first, m_buffer.data(), n - first);
+
+    // 已读的数据不再保留，腾出空间给I/O线程
+    m_begin = pos + static_cast<int64_t>(n);
+    m_fill->set(m_end - m_begin);
+    locker.unlock();
+    m_not_full.notify_one();
+    return static_cast<int>(n);
+  }
+
+  void on_seek(int64_t pos) override
+  {
+    unique_lock locker(m_lock);
+    if (pos < m_begin || pos > m_end)
+    {  // 提前开始新位置的预读，不等第一次读取
+      reposition(pos);
+    }
+  }
+
+ private:
+  // 调用时持有m_lock
+  void reposition(int64_t pos)
+  {
+    m_begin = m_end = pos;
+    m_eof = false;
+    m_error = 0;
+    m_generation++;
+    m_fill->set(0);
+    m_not_full.notify_one();
+  }
+
+  void run(std::stop_token token)
+  {
+    const auto capacity = static_cast<int64_t>(m_buffer.size());
+    while (!token.stop_requested())
+    {
+      int64_t pos = 0;
+      size_t len = 0;
+      uint64_t generation = 0;
+      {
+        unique_lock locker(m_lock);
+        if (!m_not_full.wait(locker,
+                             token,
+                             [&]()
+                             {
+                               return !m_eof && m_error == 0 &&
+                                      m_end - m_begin < capacity;
+                             }))
+        {
+          break;
+        }
+        // 只写缓冲中的空闲部分，读者只访问[m_begin, m_end)，写入时不需要持锁
+        pos = m_end;
+        const auto offset = static_cast<size_t>(pos % capacity);
+        len = std::min({m_block_size,
+                        static_cast<size_t>(capacity - (m_end - m_begin)),
+                        m_buffer.size() - offset});
+        generation = m_generation;
+      }
+
+      const auto n = m_source->read_at(
+          pos,
+          m_buffer.data() + static_cast<size_t>(pos % capacity),
+          static_cast<int>(len));
+
+      {
+        unique_lock locker(m_lock);
+        if (generation != m_generation)
+        {  // 读取期间发生了seek，结果作废
+          continue;
+        }
+        if (n > 0)
+        {
+          m_end += n;
+          m_fill->set(m_end - m_begin);
+        }
+        else if (n == 0)
+        {
+          m_eof = true;
+        }
+        else
+        {
+          m_error = n;
+        }
+      }
+      m_not_empty.notify_one();
+    }
+  }
+
+ private:
+  std::unique_ptr<FileIO::Reader> m_source;
+  std::vector<uint8_t> m_buffer;
+  size_t m_block_size{};
+
+  lock_type m_lock;
+  std::condition_variable m_not_empty;
+  std::condition_variable_any m_not_full;
+  int64_t m_begin{};
+  int64_t m_end{};
+  bool m_eof{false};
+  int m_error{};
+  uint64_t m_generation{};
+
+  Gauge *m_fill{};
+  Counter *m_stalls{};
+  Histogram *m_stall_time{};
+  std::jthread m_thread;  // 最后声明，先于其它成员析构
+};
+}  // namespace
+
+FileIO::FileIO(std::unique_ptr<Reader> reader, size_t buffer_size)
+    : m_reader(std::move(reader))
+    , m_bytes(&Metrics::instance().counter("io_read_bytes"))
+    , m_seeks(&Metrics::instance().counter("io_seeks"))
+    , m_read_time(&Metrics::instance().histogram("io_read_ns"))
+    , m_throughput(&Metrics::instance().gauge("io_throughput_mbps"))
+{
+  buffer_size = std::min<size_t>(buffer_size, INT_MAX);
+  if (auto buffer = static_cast<unsigned char *>(av_malloc(buffer_size)))
+  {
+    m_avio = avio_alloc_context(buffer,
+                                static_cast<int>(buffer_size),
+                                0,
+                                this,
+                                &FileIO::read_packet,
+                                nullptr,
+                                &FileIO::seek);
+    if (!m_avio)
+    {
+      av_free(buffer);
+    }
+  }
+}
+
+FileIO::~FileIO()
+{
+  if (m_avio)
+  {  // 读的过程中FFmpeg可能重新分配缓冲，释放当前的
+    av_freep(&m_avio->buffer);
+    avio_context_free(&m_avio);
+  }
+}
+
+std::unique_ptr<FileIO> FileIO::open(const std::string &url,
+                                     const Options &opts)
+{
+  const auto throttled = opts.simulated_latency.count() > 0 ||
+                         opts.simulated_bandwidth > 0;
+  if (opts.backend == Backend::Default && !opts.read_ahead && !throttled)
+  {
+    return nullptr;
+  }
+
+  const auto path = local_path(url);
+  if (!path)
+  {
+    SPDLOG_INFO("{} is not a local file, use the default io", url);
+    return nullptr;
+  }
+
+  // 预读和限速需要接管读取，未指定后端时用大块同步读取
+  std::unique_ptr<Reader> reader;
+  switch (opts.backend)
+  {
+  case Backend::Mmap:
+    reader = MmapReader::open(*path, opts.block_size);
+    break;
+  case Backend::Buffered:
+  case Backend::Default:
+  default:
+    reader = BufferedReader::open(*path);
+    break;
+  }
+  if (!reader)
+  {
+    SPDLOG_WARN("open {} with custom io error, use the default io", url);
+    return nullptr;
+  }
+
+  if (throttled)
+  {
+    reader = std::make_unique<ThrottledReader>(std::move(reader),
+                                               opts.simulated_latency,
+                                               opts.simulated_bandwidth);
+  }
+  if (opts.read_ahead)
+  {
+    reader = std::make_unique<ReadAheadReader>(
+        std::move(reader), opts.read_ahead, opts.block_size);
+  }
+
+  // 解复用线程直接读文件时AVIO缓冲就是一块，否则只是内存拷贝，不需要很大
+  const auto buffer_size = opts.backend != Backend::Mmap && !opts.read_ahead
+                               ? opts.block_size
+                               : COPY_BUFFER_SIZE;
+  auto io = std::make_unique<FileIO>(std::move(reader), buffer_size);
+  if (!io->avio())
+  {
+    SPDLOG_WARN("open {} with custom io error, use the default io", url);
+    return nullptr;
+  }
+  SPDLOG_INFO("io {}: {} bytes, block {} bytes, read-ahead {} bytes",
+              io->name(),
+              io->size(),
+              opts.block_size,
+              opts.read_ahead);
+  return io;
+}
+
+uint64_t FileIO::bytes_read() const
+{
+  return m_bytes_read.load(std::memory_order_relaxed);
+}
+
+std::chrono::nanoseconds FileIO::read_time() const
+{
+  return std::chrono::nanoseconds(m_read_ns.load(std::memory_order_relaxed));
+}
+
+int FileIO::read_packet(void *opaque, uint8_t *buf, int size)
+{
+  auto io = static_cast<FileIO *>(opaque);
+  const auto begin = std::chrono::steady_clock::now();
+  const auto n = io->m_reader->read_at(io->m_pos, buf, size);
+  const auto elapsed = std::chrono::steady_clock::now() - begin;
+  if (n <= 0)
+  {
+    return n == 0 ? AVERROR_EOF : n;
+  }
+
+  io->m_pos += n;
+  io->m_read_time->record(elapsed);
+  io->m_bytes->add(n);
+  const auto bytes =
+      io->m_bytes_read.fetch_add(n, std::memory_order_relaxed) + n;
+  const auto ns =
+      io->m_read_ns.fetch_add(elapsed.count(), std::memory_order_relaxed) +
+      elapsed.count();
+  if (ns > 0)
+  {  // 字节/纳秒 * 1000 = MB/s
+    io->m_throughput->set(static_cast<int64_t>(bytes * 1000 / ns));
+  }
+  return n;
+}
+
+int64_t FileIO::seek(void *opaque, int64_t offset, int whence)
+{
+  auto io = static_cast<FileIO *>(opaque);
+  int64_t pos = 0;
+  switch (whence & ~AVSEEK_FORCE)
+  {
+  case AVSEEK_SIZE:
+    return io->m_reader->size();
+  case SEEK_SET:
+    pos = offset;
+    break;
+  case SEEK_CUR:
+    pos = io->m_pos + offset;
+    break;
+  case SEEK_END:
+    pos = io->m_reader->size() + offset;
+    break;
+  default:
+    return AVERROR(EINVAL);
+  }
+  if (pos < 0)
+  {
+    return AVERROR(EINVAL);
+  }
+
+  if (pos != io->m_pos)
+  {
+    io->m_pos = pos;
+    io->m_seeks->add();
+    io->m_reader->on_seek(pos);
+  }
+  return pos;
+}
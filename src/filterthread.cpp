@@ -0,0 +1,556 @@
+#include "filterthread.h"
+
+#include <algorithm>
+#include <cctype>
+#include <format>
+
+#include <spdlog/spdlog.h>
+
+#include "ffmpeg_utils.h"
+
+namespace
+{
+// 把简单滤镜链按顶层的逗号拆成单个滤镜，转义和引号中的逗号不拆；
+// 带标签或分号的滤镜图原样作为一段
+std::vector<std::string> split_chain(const std::string &description)
+{
+  std::vector<std::string> filters;
+  std::string current;
+  bool quoted = false;
+  for (size_t i = 0; i < description.size(); i++)
+  {
+    const auto c = description[i];
+    if (c == '\\' && i + 1 < description.size())
+    {
+      current += c;
+      current += description[++i];
+      continue;
+    }
+    if (c == '\'')
+    {
+      quoted = !quoted;
+    }
+    else if (!quoted && (c == '[' || c == ';'))
+    {
+      return {description};
+    }
+    else if (!quoted && c == ',')
+    {
+      filters.push_back(std::move(current));
+      current.clear();
+      continue;
+    }
+    current += c;
+  }
+  filters.push_back(std::move(current));
+  return filters;
+}
+
+// 段的滤镜名，用作指标名的一部分
+std::string filter_name(const std::string &description, size_t segments)
+{
+  if (segments == 1 && description.find_first_of("[;,") != std::string::npos)
+  {
+    return "graph";
+  }
+  std::string name;
+  for (const auto c : description.substr(0, description.find('=')))
+  {
+    if (std::isalnum(static_cast<unsigned char>(c)) || c == '_')
+    {
+      name += c;
+    }
+  }
+  return name;
+}
+
+// 建立buffer -> description -> buffersink的滤镜图并完成格式协商
+int create_graph(AVFilterGraph *graph,
+                 AVMediaType type,
+                 const std::string &args,
+                 const std::string &description,
+                 AVFilterContext **src,
+                 AVFilterContext **sink)
+{
+  const auto video = type == AVMEDIA_TYPE_VIDEO;
+  if (const auto ret = avfilter_graph_create_filter(
+          src,
+          avfilter_get_by_name(video ? "buffer" : "abuffer"),
+          "in",
+          args.c_str(),
+          nullptr,
+          graph);
+      ret < 0)
+  {
+    return ret;
+  }
+  if (const auto ret = avfilter_graph_create_filter(
+          sink,
+          avfilter_get_by_name(video ? "buffersink" : "abuffersink"),
+          "out",
+          nullptr,
+          nullptr,
+          graph);
+      ret < 0)
+  {
+    return ret;
+  }
+
+  // description的输入接buffer，输出接buffersink
+  auto outputs = avfilter_inout_alloc();
+  auto inputs = avfilter_inout_alloc();
+  int ret = AVERROR(ENOMEM);
+  if (outputs && inputs)
+  {
+    outputs->name = av_strdup("in");
+    outputs->filter_ctx = *src;
+    outputs->pad_idx = 0;
+    outputs->next = nullptr;
+    inputs->name = av_strdup("out");
+    inputs->filter_ctx = *sink;
+    inputs->pad_idx = 0;
+    inputs->next = nullptr;
+    ret = avfilter_graph_parse_ptr(
+        graph, description.c_str(), &inputs, &outputs, nullptr);
+  }
+  avfilter_inout_free(&inputs);
+  avfilter_inout_free(&outputs);
+  if (ret < 0)
+  {
+    return ret;
+  }
+  return avfilter_graph_config(graph, nullptr);
+}
+}  // namespace
+
+FilterThread::FilterThread(std::shared_ptr<AVFrameQueue> in_queue,
+                           std::shared_ptr<AVFrameQueue> out_queue)
+    : m_in_queue(in_queue)
+    , m_out_queue(out_queue)
+    , m_frame_pool(std::make_shared<AVFramePool>())
+{
+}
+
+FilterThread::~FilterThread() { deinit(); }
+
+int FilterThread::init(const std::string &description,
+                       const AVCodecParameters *params,
+                       AVRational time_base,
+                       int threads)
+{
+  m_type = params->codec_type;
+  m_time_base = time_base;
+  m_threads = threads;
+
+  const auto type = av_get_media_type_string(m_type);
+  m_filter_time =
+      &Metrics::instance().histogram(std::format("{}_filter_ns", type));
+  const auto filters = split_chain(description);
+  m_segments.resize(filters.size());
+  for (size_t i = 0; i < filters.size(); i++)
+  {
+    auto &segment = m_segments[i];
+    segment.description = filters[i];
+    segment.time = &Metrics::instance().histogram(
+        std::format("{}_filter_{}_{}_ns",
+                    type,
+                    i,
+                    filter_name(filters[i], filters.size())));
+  }
+
+  // 解码参数描述的格式，第一帧与之相同时不再重建
+  auto props = m_frame_pool->acquire();
+  if (!props)
+  {
+    return AVERROR(ENOMEM);
+  }
+  props->width = params->width;
+  props->height = params->height;
+  props->format = params->format;
+  props->sample_aspect_ratio = params->sample_aspect_ratio;
+  props->sample_rate = params->sample_rate;
+  if (const auto ret =
+          av_channel_layout_copy(&props->ch_layout, &params->ch_layout);
+      ret < 0)
+  {
+    return ret;
+  }
+  return configure(*props);
+}
+
+void FilterThread::start()
+{
+  m_thread = std::jthread([=](std::stop_token token) { run(token); });
+}
+
+void FilterThread::start(Executor &executor,
+                         std::function<Executor::clock::time_point()> deadline)
+{
+  m_executor = &executor;
+  m_job = executor.submit(
+      std::format("{}_filter", av_get_media_type_string(m_type)),
+      [this]()
+      {
+        const auto status = step(std::chrono::milliseconds(0));
+        if (status == Executor::Status::Done)
+        {  // 与线程模式的run()相同，出错时结束下游队列
+          finish();
+        }
+        return status;
+      },
+      std::move(deadline));
+  // 输入队列来了数据时唤醒任务，不等退避到期；任务取消之后不再唤醒
+  m_in_queue->set_not_empty_callback(
+      [&executor, job = std::weak_ptr(m_job)]()
+      {
+        if (const auto locked = job.lock())
+        {
+          executor.wake(locked);
+        }
+      });
+}
+
+void FilterThread::stop()
+{
+  if (m_job)
+  {
+    m_executor->cancel(m_job);
+    m_stats.cpu_ns.store(m_job->cpu_time().count(),
+                         std::memory_order_relaxed);
+    if (!m_job->done())
+    {
+      finish();
+    }
+    m_job.reset();
+    return;
+  }
+  m_thread.request_stop();
+  m_thread.join();
+}
+
+void FilterThread::deinit()
+{
+  reset();
+  av_channel_layout_uninit(&m_src_layout);
+}
+
+const StageStats &FilterThread::stats() const { return m_stats; }
+
+void FilterThread::run(std::stop_token token)
+{
+  while (!token.stop_requested() &&
+         step(std::chrono::milliseconds(10)) != Executor::Status::Done)
+  {
+  }
+  m_stats.cpu_ns.store(StageStats::thread_cpu_time().count(),
+                       std::memory_order_relaxed);
+  finish();
+}
+
+void FilterThread::finish()
+{
+  m_out_queue->finish();
+  SPDLOG_INFO("{} filter output {} frames",
+              av_get_media_type_string(m_type),
+              m_stats.frames.load(std::memory_order_relaxed));
+  for (const auto &segment : m_segments)
+  {
+    SPDLOG_INFO("  {}: {} frames, {:.1f} ms",
+                segment.description,
+                segment.frames,
+                std::chrono::duration<double, std::milli>(segment.elapsed)
+                    .count());
+  }
+}
+
+Executor::Status FilterThread::step(std::chrono::milliseconds wait)
+{
+  if (m_in_queue->flush_pending())
+  {  // 出现了新的seek，积压的帧已经过时
+    m_pending.reset();
+    m_ready.clear();
+  }
+  if (m_pending && !m_out_queue->push(m_pending, wait))
+  {
+    return Executor::Status::Idle;
+  }
+
+  // 一帧输入可能产生多帧输出（如逐场去隔行），逐个送出
+  if (!m_ready.empty())
+  {
+    m_pending = std::move(m_ready.front());
+    m_ready.pop_front();
+    if (!m_out_queue->push(m_pending, wait))
+    {
+      return Executor::Status::Idle;
+    }
+    return Executor::Status::Progress;
+  }
+
+  auto opt = m_in_queue->pop(wait);
+  if (m_in_queue->generation() != m_generation)
+  {  // seek：丢弃滤镜中缓存的旧帧，把输出队列flush到同一代
+    m_generation = m_in_queue->generation();
+    m_out_queue->flush(m_generation, m_in_queue->resume_timestamp());
+    m_ready.clear();
+    reset();
+    m_eof_sent = false;
+    m_finished = false;
+  }
+
+  if (!opt)
+  {
+    if (m_in_queue->finished() && !m_finished)
+    {
+      if (m_configured && !m_eof_sent)
+      {  // 冲刷滤镜中缓存的帧，输出之后再结束输出队列
+        m_eof_sent = true;
+        if (const auto ret = filter(0, nullptr); ret < 0)
+        {
+          SPDLOG_ERROR("flush filter error: {}", Utils::error_stringify(ret));
+          return Executor::Status::Done;
+        }
+        return Executor::Status::Progress;
+      }
+      m_out_queue->finish();
+      m_finished = true;
+    }
+    else if (m_finished && wait.count() > 0)
+    {  // 输入已结束，等待seek或者停止
+      std::this_thread::sleep_for(wait);
+    }
+    return Executor::Status::Idle;
+  }
+
+  auto frame = std::move(*opt);
+  if (!configured(*frame))
+  {
+    if (const auto ret = configure(*frame); ret < 0)
+    {
+      return Executor::Status::Done;
+    }
+  }
+
+  const auto begin = std::chrono::steady_clock::now();
+  const auto ret = filter(0, frame.get());
+  m_filter_time->record(std::chrono::steady_clock::now() - begin);
+  if (ret < 0)
+  {
+    SPDLOG_ERROR("filter error: {}", Utils::error_stringify(ret));
+    return Executor::Status::Done;
+  }
+  return Executor::Status::Progress;
+}
+
+int FilterThread::configure(const AVFrame &src)
+{
+  reset();
+  if (src.time_base.num)
+  {  // 切换流之后帧带着新流的time_base
+    m_time_base = src.time_base;
+  }
+
+  // 每一段的输入格式就是上一段buffersink协商出的输出格式
+  auto width = src.width;
+  auto height = src.height;
+  auto format = src.format;
+  auto sar = src.sample_aspect_ratio;
+  auto sample_rate = src.sample_rate;
+  auto time_base = m_time_base;
+  char layout[64]{};
+  av_channel_layout_describe(&src.ch_layout, layout, sizeof(layout));
+
+  for (auto &segment : m_segments)
+  {
+    const auto args =
+        m_type == AVMEDIA_TYPE_VIDEO
+            ? std::format(
+                  "video_size={}x{}:pix_fmt={}:time_base={}/{}:"
+                  "pixel_aspect={}/{}",
+                  width,
+                  height,
+                  format,
+                  time_base.num,
+                  time_base.den,
+                  sar.num,
+                  std::max(sar.den, 1))
+            : std::format(
+                  "time_base={}/{}:sample_rate={}:sample_fmt={}:"
+                  "channel_layout={}",
+                  time_base.num,
+                  time_base.den,
+                  sample_rate,
+                  av_get_sample_fmt_name(static_cast<AVSampleFormat>(format)),
+                  layout);
+
+    segment.graph = avfilter_graph_alloc();
+    if (!segment.graph)
+    {
+      reset();
+      return AVERROR(ENOMEM);
+    }
+    segment.graph->nb_threads = m_threads;
+    if (const auto ret = create_graph(segment.graph,
+                                      m_type,
+                                      args,
+                                      segment.description,
+                                      &segment.src,
+                                      &segment.sink);
+        ret < 0)
+    {
+      SPDLOG_ERROR("create filter \"{}\" ({}) error: {}",
+                   segment.description,
+                   args,
+                   Utils::error_stringify(ret));
+      reset();
+      return ret;
+    }
+
+    time_base = av_buffersink_get_time_base(segment.sink);
+    format = av_buffersink_get_format(segment.sink);
+    if (m_type == AVMEDIA_TYPE_VIDEO)
+    {
+      width = av_buffersink_get_w(segment.sink);
+      height = av_buffersink_get_h(segment.sink);
+      sar = av_buffersink_get_sample_aspect_ratio(segment.sink);
+    }
+    else
+    {
+      AVChannelLayout ch_layout{};
+      sample_rate = av_buffersink_get_sample_rate(segment.sink);
+      av_buffersink_get_ch_layout(segment.sink, &ch_layout);
+      av_channel_layout_describe(&ch_layout, layout, sizeof(layout));
+      av_channel_layout_uninit(&ch_layout);
+    }
+  }
+
+  m_out_time_base = time_base;
+  m_out_width = width;
+  m_out_height = height;
+  m_src_width = src.width;
+  m_src_height = src.height;
+  m_src_format = src.format;
+  m_src_sample_rate = src.sample_rate;
+  av_channel_layout_uninit(&m_src_layout);
+  av_channel_layout_copy(&m_src_layout, &src.ch_layout);
+  m_configured = true;
+  m_eof_sent = false;
+  if (m_type == AVMEDIA_TYPE_VIDEO)
+  {
+    SPDLOG_INFO("video filter: {} segments, {} threads, {}x{} {} -> {}x{} {}",
+                m_segments.size(),
+                m_threads,
+                src.width,
+                src.height,
+                av_get_pix_fmt_name(static_cast<AVPixelFormat>(src.format)),
+                width,
+                height,
+                av_get_pix_fmt_name(static_cast<AVPixelFormat>(format)));
+  }
+  else
+  {
+    SPDLOG_INFO("audio filter: {} segments, {} Hz {} -> {} Hz {} {}",
+                m_segments.size(),
+                src.sample_rate,
+                av_get_sample_fmt_name(static_cast<AVSampleFormat>(src.format)),
+                sample_rate,
+                av_get_sample_fmt_name(static_cast<AVSampleFormat>(format)),
+                layout);
+  }
+  return 0;
+}
+
+bool FilterThread::configured(const AVFrame &frame) const
+{
+  if (!m_configured || frame.format != m_src_format ||
+      (frame.time_base.num && av_cmp_q(frame.time_base, m_time_base)))
+  {
+    return false;
+  }
+  if (m_type == AVMEDIA_TYPE_VIDEO)
+  {
+    return frame.width == m_src_width && frame.height == m_src_height;
+  }
+  return frame.sample_rate == m_src_sample_rate &&
+         !av_channel_layout_compare(&frame.ch_layout, &m_src_layout);
+}
+
+void FilterThread::reset()
+{
+  for (auto &segment : m_segments)
+  {
+    avfilter_graph_free(&segment.graph);
+    segment.src = nullptr;
+    segment.sink = nullptr;
+    segment.outputs.clear();
+  }
+  m_configured = false;
+}
+
+int FilterThread::filter(size_t index, AVFrame *frame)
+{
+  auto &segment = m_segments[index];
+  const auto begin = std::chrono::steady_clock::now();
+  // 不带KEEP_REF：帧的缓冲区引用直接转给滤镜，不拷贝，frame随之清空
+  auto ret = av_buffersrc_add_frame_flags(segment.src, frame, 0);
+  while (ret >= 0)
+  {
+    auto out = m_frame_pool->acquire();
+    if (!out)
+    {
+      return AVERROR(ENOMEM);
+    }
+    ret = av_buffersink_get_frame(segment.sink, out.get());
+    if (ret >= 0)
+    {
+      segment.outputs.push_back(std::move(out));
+    }
+  }
+  // 只计这一段的耗时，产生的帧送往下一段之前停表
+  const auto elapsed = std::chrono::steady_clock::now() - begin;
+  segment.elapsed += elapsed;
+  segment.time->record(elapsed);
+  if (frame)
+  {
+    segment.frames++;
+  }
+  if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+  {
+    segment.outputs.clear();
+    return ret;
+  }
+
+  const auto last = index + 1 == m_segments.size();
+  for (auto &out : segment.outputs)
+  {
+    if (!last)
+    {
+      if (const auto r = filter(index + 1, out.get()); r < 0)
+      {
+        segment.outputs.clear();
+        return r;
+      }
+      continue;
+    }
+
+    // 时间戳换算回输入的时间基
+    if (out->pts != AV_NOPTS_VALUE)
+    {
+      out->pts = av_rescale_q(out->pts, m_out_time_base, m_time_base);
+    }
+    out->best_effort_timestamp = out->pts;
+    out->duration = av_rescale_q(out->duration, m_out_time_base, m_time_base);
+    out->time_base = m_time_base;
+    m_stats.frames.fetch_add(1, std::memory_order_relaxed);
+    m_stats.bytes.fetch_add(SpscQueueTraits<AVFramePtr>::bytes(out),
+                            std::memory_order_relaxed);
+    m_ready.push_back(std::move(out));
+  }
+  segment.outputs.clear();
+
+  if (ret == AVERROR_EOF && !last)
+  {  // 这一段已经排空，把结束传给下一段
+    return filter(index + 1, nullptr);
+  }
+  return 0;
+}
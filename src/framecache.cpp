@@ -0,0 +1,118 @@
+#include "framecache.h"
+
+#include <spdlog/spdlog.h>
+
+#include "avframequeue.h"
+
+FrameCache::FrameCache(size_t max_bytes)
+    : m_max_bytes(max_bytes)
+    , m_frame_pool(std::make_shared<AVFramePool>())
+    , m_hits(&Metrics::instance().counter("frame_cache_hits"))
+    , m_misses(&Metrics::instance().counter("frame_cache_misses"))
+    , m_evictions(&Metrics::instance().counter("frame_cache_evictions"))
+    , m_cached_bytes(&Metrics::instance().gauge("frame_cache_bytes"))
+    , m_memory(
+          &MemoryBudget::instance().account("video", "frame_cache", false))
+{
+}
+
+FrameCache::~FrameCache() { m_memory->release(m_bytes); }
+
+void FrameCache::insert(int stream, const AVFrame &frame)
+{
+  if (frame.best_effort_timestamp == AV_NOPTS_VALUE)
+  {
+    return;
+  }
+
+  const Key key{stream, frame.best_effort_timestamp};
+  std::lock_guard locker(m_lock);
+  if (const auto it = m_index.find(key); it != m_index.end())
+  {  // 已经缓存，只更新使用顺序
+    m_lru.splice(m_lru.begin(), m_lru, it->second);
+    return;
+  }
+
+  auto copy = ref(frame);
+  if (!copy)
+  {
+    return;
+  }
+  const auto bytes = SpscQueueTraits<AVFramePtr>::bytes(copy);
+  if (bytes > m_max_bytes)
+  {
+    return;
+  }
+
+  m_lru.push_front(Entry{key, std::move(copy), frame.duration, bytes});
+  m_index.emplace(key, m_lru.begin());
+  m_bytes += bytes;
+  m_memory->charge(bytes);
+  evict();
+}
+
+AVFramePtr FrameCache::find(int stream, int64_t ts)
+{
+  std::lock_guard locker(m_lock);
+  // 不晚于ts的最后一帧
+  auto it = m_index.upper_bound(Key{stream, ts});
+  if (it != m_index.begin())
+  {
+    --it;
+    const auto &entry = *it->second;
+    if (entry.key.first == stream &&
+        (entry.key.second == ts || ts < entry.key.second + entry.duration))
+    {
+      m_hits->add();
+      m_lru.splice(m_lru.begin(), m_lru, it->second);
+      return ref(*entry.frame);
+    }
+  }
+  m_misses->add();
+  return {};
+}
+
+void FrameCache::clear()
+{
+  std::lock_guard locker(m_lock);
+  SPDLOG_DEBUG("clear frame cache, {} frames, {} bytes", m_lru.size(), m_bytes);
+  m_memory->release(m_bytes);
+  m_bytes = 0;
+  m_index.clear();
+  m_lru.clear();
+  m_cached_bytes->set(0);
+}
+
+size_t FrameCache::bytes() const
+{
+  std::lock_guard locker(m_lock);
+  return m_bytes;
+}
+
+AVFramePtr FrameCache::ref(const AVFrame &frame)
+{
+  auto dst = m_frame_pool->acquire();
+  if (!dst || av_frame_ref(dst.get(), &frame) < 0)
+  {
+    return {};
+  }
+  return dst;
+}
+
+void FrameCache::evict()
+{
+  while (m_bytes > m_max_bytes && !m_lru.empty())
+  {
+    const auto &entry = m_lru.back();
+    SPDLOG_TRACE("evict frame {}:{}, {} bytes",
+                 entry.key.first,
+                 entry.key.second,
+                 entry.bytes);
+    m_bytes -= entry.bytes;
+    m_memory->release(entry.bytes);
+    m_index.erase(entry.key);
+    m_lru.pop_back();
+    m_evictions->add();
+  }
+  m_cached_bytes->set(static_cast<int64_t>(m_bytes));
+}
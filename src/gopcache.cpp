@@ -0,0 +1,579 @@
+#include "gopcache.h"
+
+#include <algorithm>
+#include <climits>
+#include <utility>
+
+#include <spdlog/fmt/chrono.h>
+#include <spdlog/spdlog.h>
+
+#include "avsync.h"
+#include "ffmpeg_utils.h"
+
+namespace
+{
+// 私有管线seek或解码卡住时放弃本次请求
+constexpr auto DECODE_TIMEOUT = std::chrono::seconds(2);
+constexpr auto POLL_INTERVAL = std::chrono::milliseconds(20);
+
+bool pts_less(const AVFramePtr &frame, int64_t pts)
+{
+  return frame->best_effort_timestamp < pts;
+}
+}  // namespace
+
+GopCache::GopCache(size_t max_bytes)
+    : m_max_bytes(max_bytes)
+    , m_frame_pool(std::make_shared<AVFramePool>())
+    , m_hits(&Metrics::instance().counter("gop_cache_hits"))
+    , m_misses(&Metrics::instance().counter("gop_cache_misses"))
+    , m_prefetches(&Metrics::instance().counter("gop_prefetches"))
+    , m_decode_time(&Metrics::instance().histogram("gop_decode_ns"))
+    , m_cached_bytes(&Metrics::instance().gauge("gop_cache_bytes"))
+    , m_memory(
+          &MemoryBudget::instance().account("gop", "gop_cache", false))
+{
+}
+
+GopCache::~GopCache() = default;
+
+void GopCache::set_probe_cache(std::shared_ptr<ProbeCache> cache)
+{
+  m_probe_cache = std::move(cache);
+}
+
+void GopCache::set_io_options(const FileIO::Options &opts)
+{
+  m_io_options = opts;
+}
+
+void GopCache::init(std::string_view url,
+                    int width,
+                    int height,
+                    AVRational time_base)
+{
+  m_url = url;
+  m_width = width;
+  m_height = height;
+  m_time_base = time_base;
+  m_thread = std::jthread([=](std::stop_token token) { run(token); });
+}
+
+void GopCache::deinit()
+{
+  m_thread.request_stop();
+  if (m_thread.joinable())
+  {
+    m_thread.join();
+  }
+  close();
+
+  std::lock_guard locker(m_lock);
+  SPDLOG_INFO("gop cache: {} gops, {} bytes, {} hits, {} misses",
+              m_gops.size(),
+              m_bytes,
+              m_hits->value(),
+              m_misses->value());
+  m_gops.clear();
+  m_memory->release(m_bytes);
+  m_bytes = 0;
+}
+
+void GopCache::set_ready_callback(std::function<void()> callback)
+{
+  std::lock_guard locker(m_lock);
+  m_ready_callback = std::move(callback);
+}
+
+void GopCache::select_stream(int index, AVRational time_base)
+{
+  std::lock_guard locker(m_lock);
+  m_gops.clear();
+  m_memory->release(m_bytes);
+  m_bytes = 0;
+  m_cached_bytes->set(0);
+  m_stream_begin.reset();
+  m_failed.clear();
+  m_request.reset();
+  m_prefetch.reset();
+  m_next_stream = index;
+  m_next_time_base = time_base;
+  m_epoch++;
+}
+
+bool GopCache::pending() const
+{
+  std::lock_guard locker(m_lock);
+  return m_request.has_value();
+}
+
+AVFramePtr GopCache::frame_before(int64_t pts)
+{
+  std::lock_guard locker(m_lock);
+  const auto gop = acquire(pts - 1);
+  if (!gop)
+  {
+    return {};
+  }
+
+  const auto it =
+      std::lower_bound(gop->frames.begin(), gop->frames.end(), pts, pts_less);
+  if (it == gop->frames.begin())
+  {
+    return {};
+  }
+  auto frame = ref(**std::prev(it));
+  // 倒放方向的下一个GOP
+  prefetch(gop->begin - 1);
+  return frame;
+}
+
+AVFramePtr GopCache::frame_after(int64_t pts)
+{
+  std::lock_guard locker(m_lock);
+  auto gop = acquire(pts);
+  if (!gop)
+  {
+    return {};
+  }
+
+  const auto upper = [pts](const Gop &gop)
+  {
+    return std::upper_bound(gop.frames.begin(),
+                            gop.frames.end(),
+                            pts,
+                            [](int64_t pts, const AVFramePtr &frame)
+                            { return pts < frame->best_effort_timestamp; });
+  };
+  auto it = upper(*gop);
+  if (it == gop->frames.end())
+  {  // 已经是本GOP的最后一帧，取下一个GOP的第一帧
+    if (gop->end == INT64_MAX || !(gop = acquire(gop->end)))
+    {
+      return {};
+    }
+    it = upper(*gop);
+    if (it == gop->frames.end())
+    {
+      return {};
+    }
+  }
+  auto frame = ref(**it);
+  if (gop->end != INT64_MAX)
+  {
+    prefetch(gop->end);
+  }
+  return frame;
+}
+
+const GopCache::Gop *GopCache::find(int64_t ts) const
+{
+  auto it = m_gops.upper_bound(ts);
+  if (it == m_gops.begin())
+  {
+    return nullptr;
+  }
+  --it;
+  return ts < it->second.end ? &it->second : nullptr;
+}
+
+const GopCache::Gop *GopCache::acquire(int64_t ts)
+{
+  if (m_stream_begin && ts < *m_stream_begin)
+  {  // 第一个关键帧之前没有帧
+    return nullptr;
+  }
+  m_position = ts;
+  if (const auto gop = find(ts))
+  {
+    m_hits->add();
+    return gop;
+  }
+  if (m_failed.contains(ts))
+  {  // 这个位置解码失败过，不再重复请求
+    return nullptr;
+  }
+
+  if (m_request != ts)
+  {  // 同一位置重试时不重复计数；新的请求代替尚未开始的旧请求
+    m_misses->add();
+    m_request = ts;
+    m_cond.notify_all();
+  }
+  return nullptr;
+}
+
+void GopCache::prefetch(int64_t ts)
+{
+  if ((m_stream_begin && ts < *m_stream_begin) || find(ts) ||
+      m_failed.contains(ts))
+  {
+    return;
+  }
+  m_prefetch = ts;
+  m_cond.notify_all();
+}
+
+void GopCache::evict()
+{
+  // 淘汰离当前位置最远的GOP，覆盖当前位置的GOP总是保留
+  const auto distance = [this](const Gop &gop)
+  {
+    if (m_position < gop.begin)
+    {
+      return gop.begin - m_position;
+    }
+    return m_position < gop.end ? 0 : m_position - gop.end + 1;
+  };
+  while (m_bytes > m_max_bytes && m_gops.size() > 1)
+  {
+    const auto farthest =
+        std::max_element(m_gops.begin(),
+                         m_gops.end(),
+                         [&](const auto &a, const auto &b)
+                         { return distance(a.second) < distance(b.second); });
+    if (distance(farthest->second) == 0)
+    {
+      break;
+    }
+    SPDLOG_DEBUG("evict gop [{}, {}), {} bytes",
+                 farthest->second.begin,
+                 farthest->second.end,
+                 farthest->second.bytes);
+    m_bytes -= farthest->second.bytes;
+    m_memory->release(farthest->second.bytes);
+    m_gops.erase(farthest);
+  }
+  m_cached_bytes->set(static_cast<int64_t>(m_bytes));
+}
+
+AVFramePtr GopCache::ref(const AVFrame &frame)
+{
+  auto dst = m_frame_pool->acquire();
+  if (!dst || av_frame_ref(dst.get(), &frame) < 0)
+  {
+    return {};
+  }
+  return dst;
+}
+
+void GopCache::run(std::stop_token token)
+{
+  while (!token.stop_requested())
+  {
+    int64_t ts{};
+    bool foreground{};
+    bool cached{};
+    uint64_t epoch{};
+    std::function<void()> ready;
+    {
+      std::unique_lock locker(m_lock);
+      if (!m_cond.wait(
+              locker, token, [this]() { return m_request || m_prefetch; }))
+      {
+        break;
+      }
+      epoch = m_epoch;
+      if (m_next_stream)
+      {  // 请求中的pts已经是新的流的time_base，下一次解码时重新打开私有管线
+        m_stream = std::exchange(m_next_stream, std::nullopt);
+        m_time_base = m_next_time_base;
+      }
+      foreground = m_request.has_value();
+      ts = foreground ? *m_request : *m_prefetch;
+      m_prefetch.reset();
+      cached = find(ts) != nullptr;
+      if (cached && foreground)
+      {  // 已经由之前的请求解码
+        m_request.reset();
+        ready = m_ready_callback;
+      }
+    }
+    if (cached)
+    {
+      if (ready)
+      {
+        ready();
+      }
+      continue;
+    }
+
+    if (!foreground)
+    {
+      m_prefetches->add();
+    }
+    auto gops = decode(ts, token);
+
+    {
+      std::lock_guard locker(m_lock);
+      if (epoch != m_epoch)
+      {  // 解码期间切换了流
+        gops.clear();
+      }
+      if (!gops.empty() && gops.front().begin > ts)
+      {  // seek到了ts之后，ts之前已经没有关键帧
+        m_stream_begin = gops.front().begin;
+      }
+      for (auto &gop : gops)
+      {
+        const auto bytes = gop.bytes;
+        auto [it, inserted] = m_gops.try_emplace(gop.begin);
+        if (!inserted)
+        {  // 同一关键帧开始的部分GOP，保留覆盖范围更大的一个
+          if (it->second.end >= gop.end)
+          {
+            continue;
+          }
+          m_bytes -= it->second.bytes;
+          m_memory->release(it->second.bytes);
+        }
+        it->second = std::move(gop);
+        m_bytes += bytes;
+        m_memory->charge(bytes);
+      }
+      if (epoch == m_epoch && !find(ts) &&
+          !(m_stream_begin && ts < *m_stream_begin))
+      {  // 打开失败、超时或者码流损坏：记下位置，之后的请求直接返回空
+        SPDLOG_WARN("gop cache decode at {} failed", ts);
+        m_failed.insert(ts);
+      }
+      evict();
+      if (foreground)
+      {  // 解码期间前台可能已经换了位置，新的请求留给下一轮
+        if (m_request == ts)
+        {
+          m_request.reset();
+        }
+        ready = m_ready_callback;
+      }
+    }
+    if (ready)
+    {
+      ready();
+    }
+  }
+}
+
+int GopCache::open()
+{
+  m_packets = std::make_shared<AVPacketQueue>(256);
+  m_decoded = std::make_shared<AVFrameQueue>(16);
+  m_frames = std::make_shared<AVFrameQueue>(16);
+  m_demux = std::make_unique<Demuxthread>(nullptr, m_packets);
+  m_decode = std::make_unique<CodecThread>(m_packets, m_decoded);
+  m_convert = std::make_unique<ConvertThread>(m_decoded, m_frames);
+  if (m_probe_cache)
+  {
+    m_demux->set_probe_cache(m_probe_cache);
+  }
+  m_demux->set_io_options(m_io_options);
+  m_demux->set_stream_change_handler(
+      [this](AVMediaType, const AVStream *stream, uint64_t generation)
+      { m_decode->set_codec_params(stream->codecpar, generation); });
+
+  if (const auto ret = m_demux->init(m_url); ret < 0)
+  {
+    SPDLOG_ERROR("gop cache open {} error: {}",
+                 m_url,
+                 Utils::error_stringify(ret));
+    return ret;
+  }
+
+  // 每次只解一个GOP，队列只需要容纳解码到下一个关键帧时已经在途的数据
+  m_packets->set_limits(
+      {.max_bytes = 32 * 1024 * 1024,
+       .max_duration =
+           Utils::to_time_base(std::chrono::seconds(3), m_time_base)});
+  m_decoded->set_limits({.max_count = 4});
+  m_frames->set_limits({.max_count = 4});
+
+  if (const auto ret = m_decode->init(m_demux->video_codec_params()); ret < 0)
+  {
+    SPDLOG_ERROR("gop cache decoder init error: {}",
+                 Utils::error_stringify(ret));
+    m_demux->deinit();
+    return ret;
+  }
+  if (const auto ret =
+          m_convert->init(m_width, m_height, AV_PIX_FMT_YUV420P, 0);
+      ret < 0)
+  {
+    SPDLOG_ERROR("gop cache convert init error: {}",
+                 Utils::error_stringify(ret));
+    m_decode->deinit();
+    m_demux->deinit();
+    return ret;
+  }
+  return 0;
+}
+
+void GopCache::close()
+{
+  if (!m_opened)
+  {
+    return;
+  }
+  m_convert->stop();
+  m_decode->stop();
+  m_demux->stop();
+  m_convert->deinit();
+  m_decode->deinit();
+  m_demux->deinit();
+  m_opened = false;
+}
+
+std::vector<GopCache::Gop> GopCache::decode(int64_t ts, std::stop_token token)
+{
+  std::vector<Gop> gops;
+  if (m_stream && m_opened)
+  {  // 切换了流：重新打开私有管线，启动之前选择新的流
+    close();
+  }
+  const auto first = !m_opened;
+  if (first && !m_open_failed)
+  {
+    m_open_failed = open() < 0;
+    m_opened = !m_open_failed;
+  }
+  if (!m_opened)
+  {
+    return gops;
+  }
+
+  const auto begin = std::chrono::steady_clock::now();
+  const auto deadline = begin + DECODE_TIMEOUT;
+  // 只有这里会seek私有管线，帧队列的代数变化即说明seek已经生效
+  const auto generation = m_frames->generation();
+  const auto target = AVSync::to_duration(ts, m_time_base);
+  if (first && m_stream && m_stream != m_demux->video_stream())
+  {  // 解复用线程启动之前，选择流和下面的seek合并为一次请求
+    m_demux->select_stream(AVMEDIA_TYPE_VIDEO, *m_stream, target);
+  }
+  m_stream.reset();
+  m_demux->seek(target, false);
+  if (first)
+  {
+    m_demux->start();
+    m_decode->start();
+    m_convert->start();
+  }
+
+  Gop current;
+  bool collecting = false;
+  size_t collected = 0;  // gops和current的字节数之和
+  bool trimmed = false;
+  const auto frame_bytes = [](const AVFramePtr &frame)
+  { return SpscQueueTraits<AVFramePtr>::bytes(frame); };
+  while (!token.stop_requested())
+  {
+    auto opt = m_frames->pop(POLL_INTERVAL);
+    const auto flushed = m_frames->generation() != generation;
+    if (!flushed || !opt)
+    {
+      if (flushed && m_frames->finished())
+      {  // 文件尾，最后一个GOP到此结束
+        if (collecting)
+        {
+          current.end = INT64_MAX;
+          gops.push_back(std::move(current));
+        }
+        break;
+      }
+      if (std::chrono::steady_clock::now() > deadline)
+      {
+        SPDLOG_WARN("gop cache decode at {} timed out", ts);
+        break;
+      }
+      continue;
+    }
+
+    auto frame = std::move(*opt);
+    const auto pts = frame->best_effort_timestamp;
+    if (pts == AV_NOPTS_VALUE)
+    {
+      continue;
+    }
+    if (frame->flags & AV_FRAME_FLAG_KEY)
+    {
+      if (collecting)
+      {
+        current.end = pts;
+        gops.push_back(std::move(current));
+        current = Gop{};
+        if (pts > ts)
+        {  // 覆盖ts的GOP已经完整
+          collecting = false;
+          break;
+        }
+      }
+      collecting = true;
+      current.begin = pts;
+    }
+    // 关键帧之前的帧（seek后开放GOP的前导帧）属于上一个GOP
+    if (!collecting || pts < current.begin)
+    {
+      continue;
+    }
+    const auto bytes = frame_bytes(frame);
+    current.bytes += bytes;
+    current.frames.push_back(std::move(frame));
+    collected += bytes;
+    if (collected <= m_max_bytes)
+    {
+      continue;
+    }
+
+    // 超出缓存上限（长GOP、高分辨率）：只保留ts附近的帧。先丢弃ts之前的GOP，
+    // 再丢弃当前GOP中ts之前的帧，已经越过ts时以这一帧为界结束
+    if (!trimmed)
+    {
+      SPDLOG_WARN("gop at {} exceeds gop cache size {}, caching part of it",
+                  ts,
+                  m_max_bytes);
+      trimmed = true;
+    }
+    while (collected > m_max_bytes && !gops.empty())
+    {
+      collected -= gops.front().bytes;
+      gops.erase(gops.begin());
+    }
+    while (collected > m_max_bytes && current.frames.size() > 1 &&
+           current.frames[1]->best_effort_timestamp <= ts)
+    {
+      const auto front = frame_bytes(current.frames.front());
+      current.bytes -= front;
+      collected -= front;
+      current.frames.erase(current.frames.begin());
+    }
+    current.begin = current.frames.front()->best_effort_timestamp;
+    if (collected > m_max_bytes && pts > ts && current.frames.size() > 1)
+    {
+      const auto back = frame_bytes(current.frames.back());
+      current.bytes -= back;
+      collected -= back;
+      current.frames.pop_back();
+      current.end = pts;
+      gops.push_back(std::move(current));
+      collecting = false;
+      break;
+    }
+  }
+
+  size_t frames = 0;
+  for (auto &gop : gops)
+  {
+    std::sort(gop.frames.begin(),
+              gop.frames.end(),
+              [](const AVFramePtr &a, const AVFramePtr &b)
+              { return a->best_effort_timestamp < b->best_effort_timestamp; });
+    frames += gop.frames.size();
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - begin;
+  m_decode_time->record(elapsed);
+  SPDLOG_DEBUG("gop cache decoded {} gops, {} frames at {}: {}",
+               gops.size(),
+               frames,
+               ts,
+               std::chrono::duration_cast<std::chrono::microseconds>(elapsed));
+  return gops;
+}
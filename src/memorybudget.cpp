@@ -0,0 +1,195 @@
+#include "memorybudget.h"
+
+#include <algorithm>
+#include <condition_variable>
+
+#include <spdlog/spdlog.h>
+
+namespace
+{
+void update_peak(std::atomic<size_t> &peak, size_t value)
+{
+  auto old = peak.load(std::memory_order_relaxed);
+  while (value > old &&
+         !peak.compare_exchange_weak(old, value, std::memory_order_relaxed))
+  {
+  }
+}
+
+double to_mib(size_t bytes) { return bytes / (1024.0 * 1024.0); }
+}  // namespace
+
+MemoryBudget::Account::Account(MemoryBudget &budget,
+                               std::string stream,
+                               std::string category,
+                               bool capped,
+                               Gauge *gauge)
+    : m_budget(budget)
+    , m_stream(std::move(stream))
+    , m_category(std::move(category))
+    , m_capped(capped)
+    , m_gauge(gauge)
+{
+}
+
+void MemoryBudget::Account::charge(size_t bytes)
+{
+  if (bytes == 0)
+  {
+    return;
+  }
+  const auto current =
+      m_current.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+  update_peak(m_peak, current);
+  m_gauge->set(static_cast<int64_t>(current));
+  m_budget.charge(bytes, m_capped);
+}
+
+void MemoryBudget::Account::release(size_t bytes)
+{
+  if (bytes == 0)
+  {
+    return;
+  }
+  const auto current =
+      m_current.fetch_sub(bytes, std::memory_order_relaxed) - bytes;
+  m_gauge->set(static_cast<int64_t>(current));
+  m_budget.release(bytes, m_capped);
+}
+
+MemoryBudget &MemoryBudget::instance()
+{
+  static MemoryBudget budget;
+  return budget;
+}
+
+MemoryBudget::MemoryBudget()
+    : m_current_gauge(&Metrics::instance().gauge("memory_bytes"))
+    , m_peak_gauge(&Metrics::instance().gauge("memory_peak_bytes"))
+{
+}
+
+MemoryBudget::~MemoryBudget() { stop_log(); }
+
+MemoryBudget::Account &MemoryBudget::account(const std::string &stream,
+                                             const std::string &category,
+                                             bool capped)
+{
+  lock_guard locker(m_lock);
+  auto &v = m_accounts[{stream, category}];
+  if (!v)
+  {
+    v = std::make_unique<Account>(
+        *this,
+        stream,
+        category,
+        capped,
+        &Metrics::instance().gauge("memory_" + stream + "_" + category +
+                                   "_bytes"));
+  }
+  return *v;
+}
+
+void MemoryBudget::set_cap(size_t bytes)
+{
+  m_cap.store(bytes, std::memory_order_relaxed);
+}
+
+void MemoryBudget::charge(size_t bytes, bool capped)
+{
+  if (capped)
+  {
+    m_capped.fetch_add(bytes, std::memory_order_relaxed);
+  }
+  const auto current =
+      m_current.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+  update_peak(m_peak, current);
+  m_current_gauge->set(static_cast<int64_t>(current));
+  m_peak_gauge->set(static_cast<int64_t>(peak()));
+}
+
+void MemoryBudget::release(size_t bytes, bool capped)
+{
+  if (capped)
+  {
+    m_capped.fetch_sub(bytes, std::memory_order_relaxed);
+  }
+  const auto current =
+      m_current.fetch_sub(bytes, std::memory_order_relaxed) - bytes;
+  m_current_gauge->set(static_cast<int64_t>(current));
+}
+
+MemoryBudget::Snapshot MemoryBudget::snapshot() const
+{
+  Snapshot snapshot;
+  snapshot.current = current();
+  snapshot.peak = peak();
+  snapshot.capped = capped();
+  snapshot.cap = cap();
+
+  lock_guard locker(m_lock);
+  for (const auto &[key, account] : m_accounts)
+  {
+    const auto current = account->current();
+    snapshot.accounts.push_back(
+        {key.first, key.second, current, account->peak(), account->capped()});
+    snapshot.categories[key.second] += current;
+  }
+  return snapshot;
+}
+
+void MemoryBudget::log() const
+{
+  auto snapshot = this->snapshot();
+  SPDLOG_INFO("memory: {:.1f} MiB, peak {:.1f} MiB, cap {}",
+              to_mib(snapshot.current),
+              to_mib(snapshot.peak),
+              snapshot.cap ? fmt::format("{:.1f} of {:.1f} MiB",
+                                         to_mib(snapshot.capped),
+                                         to_mib(snapshot.cap))
+                           : std::string("none"));
+  for (const auto &[category, bytes] : snapshot.categories)
+  {
+    SPDLOG_INFO("  {}: {:.1f} MiB", category, to_mib(bytes));
+  }
+
+  // 按当前用量从大到小，先看到占用最多的流
+  std::sort(snapshot.accounts.begin(),
+            snapshot.accounts.end(),
+            [](const auto &a, const auto &b) { return a.current > b.current; });
+  for (const auto &usage : snapshot.accounts)
+  {
+    SPDLOG_INFO("  {}/{}: {:.1f} MiB, peak {:.1f} MiB{}",
+                usage.stream,
+                usage.category,
+                to_mib(usage.current),
+                to_mib(usage.peak),
+                usage.capped ? "" : ", not capped");
+  }
+}
+
+void MemoryBudget::start_log(std::chrono::milliseconds interval)
+{
+  stop_log();
+  m_log_thread = std::jthread(
+      [this, interval](std::stop_token token)
+      {
+        std::mutex lock;
+        std::condition_variable_any condvar;
+        std::unique_lock locker(lock);
+        while (!token.stop_requested())
+        {
+          condvar.wait_for(locker, token, interval, []() { return false; });
+          log();
+        }
+      });
+}
+
+void MemoryBudget::stop_log()
+{
+  if (m_log_thread.joinable())
+  {
+    m_log_thread.request_stop();
+    m_log_thread.join();
+  }
+}
@@ -0,0 +1,259 @@
+#include "metrics.h"
+
+#include <bit>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+
+#include <spdlog/fmt/fmt.h>
+#include <spdlog/spdlog.h>
+
+namespace
+{
+constexpr auto METRIC_PREFIX = "player_";
+}  // namespace
+
+size_t Histogram::bucket_index(uint64_t v)
+{
+  if (v < SUB_COUNT)
+  {
+    return v;
+  }
+  const auto shift = std::bit_width(v) - 1 - SUB_BITS;
+  const auto sub = (v >> shift) - SUB_COUNT;
+  return (shift + 1) * SUB_COUNT + sub;
+}
+
+uint64_t Histogram::bucket_value(size_t index)
+{
+  if (index < SUB_COUNT)
+  {
+    return index;
+  }
+  // 取档位区间的中点
+  const auto shift = index / SUB_COUNT - 1;
+  const auto sub = index % SUB_COUNT;
+  const auto lower = (SUB_COUNT + sub) << shift;
+  return lower + ((uint64_t{1} << shift) >> 1);
+}
+
+void Histogram::record(uint64_t v)
+{
+  m_buckets[bucket_index(v)].fetch_add(1, std::memory_order_relaxed);
+  m_count.fetch_add(1, std::memory_order_relaxed);
+  m_sum.fetch_add(v, std::memory_order_relaxed);
+
+  auto max = m_max.load(std::memory_order_relaxed);
+  while (v > max &&
+         !m_max.compare_exchange_weak(max, v, std::memory_order_relaxed))
+  {
+  }
+}
+
+Histogram::Snapshot Histogram::snapshot() const
+{
+  std::array<uint64_t, BUCKETS> buckets;
+  uint64_t total = 0;
+  for (size_t i = 0; i < BUCKETS; i++)
+  {
+    buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+    total += buckets[i];
+  }
+
+  Snapshot s;
+  s.count = total;
+  s.sum = m_sum.load(std::memory_order_relaxed);
+  s.max = m_max.load(std::memory_order_relaxed);
+  if (!total)
+  {
+    return s;
+  }
+
+  const auto percentile = [&](double q)
+  {
+    const auto target = std::max<uint64_t>(1, q * total + 0.5);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; i++)
+    {
+      seen += buckets[i];
+      if (seen >= target)
+      {
+        return std::min(bucket_value(i), s.max);
+      }
+    }
+    return s.max;
+  };
+  s.p50 = percentile(0.5);
+  s.p90 = percentile(0.9);
+  s.p99 = percentile(0.99);
+  s.p999 = percentile(0.999);
+  return s;
+}
+
+Metrics &Metrics::instance()
+{
+  static Metrics metrics;
+  return metrics;
+}
+
+Metrics::~Metrics() { stop_dump(); }
+
+Counter &Metrics::counter(const std::string &name)
+{
+  lock_guard locker(m_lock);
+  auto &v = m_counters[name];
+  if (!v)
+  {
+    v = std::make_unique<Counter>();
+  }
+  return *v;
+}
+
+Gauge &Metrics::gauge(const std::string &name)
+{
+  lock_guard locker(m_lock);
+  auto &v = m_gauges[name];
+  if (!v)
+  {
+    v = std::make_unique<Gauge>();
+  }
+  return *v;
+}
+
+Histogram &Metrics::histogram(const std::string &name)
+{
+  lock_guard locker(m_lock);
+  auto &v = m_histograms[name];
+  if (!v)
+  {
+    v = std::make_unique<Histogram>();
+  }
+  return *v;
+}
+
+std::string Metrics::to_prometheus() const
+{
+  lock_guard locker(m_lock);
+  std::string out;
+  for (const auto &[name, counter] : m_counters)
+  {
+    out += fmt::format("# TYPE {0}{1} counter\n{0}{1} {2}\n",
+                       METRIC_PREFIX,
+                       name,
+                       counter->value());
+  }
+  for (const auto &[name, gauge] : m_gauges)
+  {
+    out += fmt::format(
+        "# TYPE {0}{1} gauge\n{0}{1} {2}\n", METRIC_PREFIX, name, gauge->value());
+  }
+  for (const auto &[name, histogram] : m_histograms)
+  {
+    const auto s = histogram->snapshot();
+    out += fmt::format(
+        "# TYPE {0}{1} summary\n"
+        "{0}{1}{{quantile=\"0.5\"}} {2}\n"
+        "{0}{1}{{quantile=\"0.9\"}} {3}\n"
+        "{0}{1}{{quantile=\"0.99\"}} {4}\n"
+        "{0}{1}{{quantile=\"0.999\"}} {5}\n"
+        "{0}{1}{{quantile=\"1\"}} {6}\n"
+        "{0}{1}_sum {7}\n"
+        "{0}{1}_count {8}\n",
+        METRIC_PREFIX,
+        name,
+        s.p50,
+        s.p90,
+        s.p99,
+        s.p999,
+        s.max,
+        s.sum,
+        s.count);
+  }
+  return out;
+}
+
+std::string Metrics::to_json() const
+{
+  lock_guard locker(m_lock);
+  std::string out = R"({"counters":{)";
+  for (const char *sep = ""; const auto &[name, counter] : m_counters)
+  {
+    out += fmt::format(R"({}"{}":{})", sep, name, counter->value());
+    sep = ",";
+  }
+  out += R"(},"gauges":{)";
+  for (const char *sep = ""; const auto &[name, gauge] : m_gauges)
+  {
+    out += fmt::format(R"({}"{}":{})", sep, name, gauge->value());
+    sep = ",";
+  }
+  out += R"(},"histograms":{)";
+  for (const char *sep = ""; const auto &[name, histogram] : m_histograms)
+  {
+    const auto s = histogram->snapshot();
+    out += fmt::format(
+        R"({}"{}":{{"count":{},"sum":{},"max":{},"p50":{},"p90":{},)"
+        R"("p99":{},"p999":{}}})",
+        sep,
+        name,
+        s.count,
+        s.sum,
+        s.max,
+        s.p50,
+        s.p90,
+        s.p99,
+        s.p999);
+    sep = ",";
+  }
+  out += "}}\n";
+  return out;
+}
+
+void Metrics::start_dump(std::string path,
+                         Format format,
+                         std::chrono::milliseconds interval)
+{
+  stop_dump();
+  m_dump_thread = std::jthread(
+      [this, path = std::move(path), format, interval](std::stop_token token)
+      {
+        std::mutex lock;
+        std::condition_variable_any condvar;
+        std::unique_lock locker(lock);
+        while (!token.stop_requested())
+        {
+          condvar.wait_for(locker, token, interval, []() { return false; });
+          dump(path, format);
+        }
+      });
+}
+
+void Metrics::stop_dump()
+{
+  if (m_dump_thread.joinable())
+  {
+    m_dump_thread.request_stop();
+    m_dump_thread.join();
+  }
+}
+
+void Metrics::dump(const std::string &path, Format format) const
+{
+  const auto tmp = path + ".tmp";
+  {
+    std::ofstream file(tmp, std::ios::trunc);
+    if (!file)
+    {
+      SPDLOG_ERROR("open metrics file {} error", tmp);
+      return;
+    }
+    file << (format == Format::Json ? to_json() : to_prometheus());
+  }
+
+  std::error_code ec;
+  std::filesystem::rename(tmp, path, ec);
+  if (ec)
+  {
+    SPDLOG_ERROR("rename metrics file {} error: {}", path, ec.message());
+  }
+}
@@ -0,0 +1,287 @@
+#include "multiview.h"
+
+#include <algorithm>
+#include <future>
+
+#include <spdlog/fmt/fmt.h>
+#include <spdlog/spdlog.h>
+
+#include "benchmark.h"
+#include "ffmpeg_utils.h"
+#include "memorybudget.h"
+#include "probecache.h"
+#include "startup.h"
+
+MultiView::MultiView(const PlayerOptions &opts)
+    : m_opts(opts)
+{
+}
+
+MultiView::~MultiView() = default;
+
+int MultiView::init()
+{
+  m_executor = std::make_unique<Executor>(m_opts.workers);
+
+  std::shared_ptr<ProbeCache> probe_cache;
+  if (!m_opts.probe_cache.empty())
+  {
+    probe_cache = std::make_shared<ProbeCache>(m_opts.probe_cache);
+  }
+  auto &memory = MemoryBudget::instance();
+  for (const auto &url : m_opts.urls)
+  {
+    auto stream = std::make_unique<Stream>();
+    stream->url = url;
+    stream->video_packets = std::make_shared<AVPacketQueue>(256);
+    stream->video_decoded = std::make_shared<AVFrameQueue>(16);
+    stream->video_frames = std::make_shared<AVFrameQueue>(16);
+    // 各路分别记账，超出全局上限时能看出是哪一路占用最多
+    const auto name = fmt::format("stream{}", m_streams.size());
+    stream->video_packets->set_memory_account(
+        &memory.account(name, "packets"));
+    stream->video_decoded->set_memory_account(
+        &memory.account(name, "decoded_frames"));
+    stream->video_frames->set_memory_account(&memory.account(name, "frames"));
+    // 各路的时钟互相独立，从各自的第一帧开始走
+    stream->avsync = std::make_shared<AVSync>(AVSync::Master::External);
+    // 不传音频队列，只解复用视频
+    stream->demux =
+        std::make_shared<Demuxthread>(nullptr, stream->video_packets);
+    stream->decode = std::make_shared<CodecThread>(stream->video_packets,
+                                                   stream->video_decoded);
+    stream->convert = std::make_shared<ConvertThread>(stream->video_decoded,
+                                                      stream->video_frames);
+    if (probe_cache)
+    {
+      stream->demux->set_probe_cache(probe_cache);
+    }
+    stream->demux->set_probe_limits(m_opts.probesize, m_opts.analyze_duration);
+    stream->demux->set_io_options(m_opts.io);
+    m_streams.push_back(std::move(stream));
+  }
+
+  // 各路的探测互不依赖，并行打开
+  std::vector<std::future<int>> opens;
+  for (auto &stream : m_streams)
+  {
+    opens.push_back(std::async(std::launch::async,
+                               [this, s = stream.get()]()
+                               { return open_stream(*s); }));
+  }
+  if (!m_opts.headless)
+  {
+    if (SDL_Init(SDL_INIT_VIDEO) < 0)
+    {
+      SPDLOG_ERROR("SDL_Init error: {}", SDL_GetError());
+      for (auto &open : opens)
+      {
+        open.wait();
+      }
+      return -1;
+    }
+    StartupTimeline::instance().mark("sdl_init");
+  }
+
+  int result = 0;
+  for (size_t i = 0; i < opens.size(); i++)
+  {
+    if (const auto ret = opens[i].get(); ret < 0)
+    {
+      SPDLOG_ERROR(
+          "open {} error: {}", m_streams[i]->url, Utils::error_stringify(ret));
+      result = ret;
+    }
+  }
+  if (result >= 0)
+  {
+    StartupTimeline::instance().mark("demux_open");
+  }
+  return result;
+}
+
+int MultiView::open_stream(Stream &stream)
+{
+  if (const auto ret = stream.demux->init(stream.url); ret < 0)
+  {
+    return ret;
+  }
+
+  const auto params = stream.demux->video_codec_params();
+  stream.time_base = stream.demux->video_stream_time_base();
+
+  // 每一路的内存上限按路数摊薄，比单路播放小
+  const auto tb = stream.time_base;
+  stream.video_packets->set_limits(
+      {.max_bytes = 8 * 1024 * 1024,
+       .max_duration = Utils::to_time_base(std::chrono::seconds(2), tb)});
+  stream.video_decoded->set_limits(
+      {.max_count = 4,
+       .max_bytes = 64 * 1024 * 1024,
+       .max_duration = Utils::to_time_base(std::chrono::seconds(1), tb)});
+  stream.video_frames->set_limits(
+      {.max_count = 8,
+       .max_bytes = 32 * 1024 * 1024,
+       .max_duration = Utils::to_time_base(std::chrono::seconds(1), tb)});
+
+  // 并行度来自路数，每一路的解码器和swscale都只用一个线程，
+  // 否则N路各自创建按核数的线程池，又回到线程数随路数增长
+  if (const auto ret = stream.decode->init(params, {.count = 1}); ret < 0)
+  {
+    return ret;
+  }
+
+  // 按格子的尺寸缩放（只缩小不放大），渲染时只上传格子大小的纹理
+  const auto [cell_width, cell_height] =
+      VideoOutput::grid_cell_size(m_opts.urls.size());
+  const auto scale = std::min({1.0,
+                               1.0 * cell_width / params->width,
+                               1.0 * cell_height / params->height});
+  stream.width = std::max(2, static_cast<int>(params->width * scale) & ~1);
+  stream.height = std::max(2, static_cast<int>(params->height * scale) & ~1);
+  SPDLOG_INFO("{}: {} x {} -> {} x {}",
+              stream.url,
+              params->width,
+              params->height,
+              stream.width,
+              stream.height);
+  return stream.convert->init(
+      stream.width, stream.height, AV_PIX_FMT_YUV420P, 1);
+}
+
+Executor::clock::time_point MultiView::deadline(const Stream &stream)
+{
+  const auto buffered = stream.video_frames->duration() +
+                        stream.video_decoded->duration();
+  return Executor::clock::now() +
+         AVSync::to_duration(buffered, stream.time_base);
+}
+
+void MultiView::start()
+{
+  // 同一路的三个阶段共用一个截止时间：输出见底的那一路整体优先。
+  // 从下游开始启动：start()登记输入队列的唤醒回调，此时生产者还没有开始入队
+  for (auto &stream : m_streams)
+  {
+    const auto stream_deadline = [s = stream.get()]() { return deadline(*s); };
+    stream->convert->start(*m_executor, stream_deadline);
+    stream->decode->start(*m_executor, stream_deadline);
+    stream->demux->start(*m_executor, stream_deadline);
+  }
+}
+
+void MultiView::stop()
+{
+  for (auto &stream : m_streams)
+  {
+    stream->convert->stop();
+    stream->decode->stop();
+    stream->demux->stop();
+  }
+}
+
+int MultiView::run()
+{
+  if (m_opts.headless)
+  {
+    return run_headless();
+  }
+
+  const auto &first = *m_streams.front();
+  m_video_output =
+      std::make_unique<VideoOutput>(first.video_frames, first.avsync);
+  m_video_output->set_drop_threshold(m_opts.drop_threshold);
+  m_video_output->set_seek_handler(
+      [demux = first.demux](std::chrono::nanoseconds target)
+      { demux->seek(target); });
+  for (size_t i = 1; i < m_streams.size(); i++)
+  {
+    const auto &stream = *m_streams[i];
+    m_video_output->add_stream(
+        stream.video_frames,
+        stream.avsync,
+        stream.width,
+        stream.height,
+        stream.time_base,
+        [demux = stream.demux](std::chrono::nanoseconds target)
+        { demux->seek(target); });
+  }
+
+  // 先启动解复用和解码，窗口创建期间首帧已经在队列中等待
+  start();
+  if (const auto ret =
+          m_video_output->init(first.width, first.height, first.time_base);
+      ret < 0)
+  {
+    SPDLOG_ERROR("video_output init error");
+    stop();
+    return ret;
+  }
+  StartupTimeline::instance().mark("video_output_open");
+
+  m_video_output->main_loop();
+
+  stop();
+  m_video_output->deinit();
+  return 0;
+}
+
+int MultiView::run_headless()
+{
+  std::vector<std::unique_ptr<NullOutput>> sinks;
+  for (auto &stream : m_streams)
+  {
+    auto &sink = sinks.emplace_back(
+        std::make_unique<NullOutput>(stream->video_frames, stream->avsync));
+    sink->init(stream->time_base, m_opts.realtime);
+    stream->avsync->external_clock().set(AVSync::duration::zero());
+  }
+
+  const auto begin = std::chrono::steady_clock::now();
+  const auto cpu_begin = StageStats::process_cpu_time();
+  start();
+  for (auto &sink : sinks)
+  {
+    sink->start();
+  }
+  for (auto &sink : sinks)
+  {
+    sink->wait();
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - begin;
+  stop();
+
+  BenchmarkReport report;
+  report.elapsed = elapsed;
+  report.process_cpu = StageStats::process_cpu_time() - cpu_begin;
+  for (size_t i = 0; i < m_streams.size(); i++)
+  {
+    const auto &stream = *m_streams[i];
+    report.end_to_end_frames +=
+        sinks[i]->stats().frames.load(std::memory_order_relaxed);
+    report.add_stage(fmt::format("{}_demux", i), stream.demux->stats());
+    report.add_stage(fmt::format("{}_video_decode", i), stream.decode->stats());
+    report.add_stage(fmt::format("{}_video_convert", i),
+                     stream.convert->stats());
+    report.add_stage(fmt::format("{}_video_output", i), sinks[i]->stats());
+    report.add_queue(fmt::format("{}_video_packets", i),
+                     *stream.video_packets);
+    report.add_queue(fmt::format("{}_video_frames", i), *stream.video_frames);
+  }
+  report.log();
+  MemoryBudget::instance().log();
+  fmt::print("{}\n", report.to_json());
+  return 0;
+}
+
+void MultiView::deinit()
+{
+  for (auto &stream : m_streams)
+  {
+    stream->convert->deinit();
+    stream->decode->deinit();
+    stream->demux->deinit();
+  }
+  // 所有任务都已取消，最后停止工作线程
+  m_executor.reset();
+}
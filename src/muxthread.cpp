@@ -0,0 +1,236 @@
+#include "muxthread.h"
+
+#include <algorithm>
+#include <optional>
+
+#include <spdlog/spdlog.h>
+
+#include "ffmpeg_utils.h"
+
+namespace
+{
+constexpr AVRational NS_TIME_BASE{1, 1000000000};
+}  // namespace
+
+MuxThread::MuxThread() {}
+
+MuxThread::~MuxThread() { deinit(); }
+
+int MuxThread::init(const std::string &path)
+{
+  m_path = path;
+  return avformat_alloc_output_context2(
+      &m_format_ctx, nullptr, nullptr, path.c_str());
+}
+
+bool MuxThread::global_header() const
+{
+  return m_format_ctx->oformat->flags & AVFMT_GLOBALHEADER;
+}
+
+int MuxThread::add_stream(std::shared_ptr<AVPacketQueue> queue,
+                          const AVCodecContext *encoder)
+{
+  auto stream = avformat_new_stream(m_format_ctx, nullptr);
+  if (!stream)
+  {
+    return AVERROR(ENOMEM);
+  }
+  if (const auto ret =
+          avcodec_parameters_from_context(stream->codecpar, encoder);
+      ret < 0)
+  {
+    return ret;
+  }
+  // 只是建议值，封装器在写文件头时可能改成自己的时间基
+  stream->time_base = encoder->time_base;
+  m_inputs.push_back({queue, stream, encoder->time_base});
+  return 0;
+}
+
+int MuxThread::open()
+{
+  av_dump_format(m_format_ctx, 0, m_path.c_str(), 1);
+  if (!(m_format_ctx->oformat->flags & AVFMT_NOFILE))
+  {
+    if (const auto ret =
+            avio_open(&m_format_ctx->pb, m_path.c_str(), AVIO_FLAG_WRITE);
+        ret < 0)
+    {
+      return ret;
+    }
+  }
+  if (const auto ret = avformat_write_header(m_format_ctx, nullptr); ret < 0)
+  {
+    return ret;
+  }
+  m_header_written = true;
+  return 0;
+}
+
+void MuxThread::start()
+{
+  m_thread = std::jthread([=](std::stop_token token) { run(token); });
+}
+
+void MuxThread::wait()
+{
+  if (m_thread.joinable())
+  {
+    m_thread.join();
+  }
+}
+
+void MuxThread::stop()
+{
+  m_thread.request_stop();
+  wait();
+}
+
+void MuxThread::deinit()
+{
+  if (!m_format_ctx)
+  {
+    return;
+  }
+  if (!(m_format_ctx->oformat->flags & AVFMT_NOFILE))
+  {
+    avio_closep(&m_format_ctx->pb);
+  }
+  avformat_free_context(m_format_ctx);
+  m_format_ctx = nullptr;
+}
+
+std::chrono::nanoseconds MuxThread::duration() const
+{
+  return std::chrono::nanoseconds(
+      m_duration_ns.load(std::memory_order_relaxed));
+}
+
+const StageStats &MuxThread::stats() const { return m_stats; }
+
+void MuxThread::run(std::stop_token token)
+{
+  while (!token.stop_requested() &&
+         step(std::chrono::milliseconds(10)) != Executor::Status::Done)
+  {
+  }
+  m_stats.cpu_ns.store(StageStats::thread_cpu_time().count(),
+                       std::memory_order_relaxed);
+  finish();
+}
+
+void MuxThread::finish()
+{
+  if (m_header_written && !m_trailer_written)
+  {
+    if (const auto ret = av_write_trailer(m_format_ctx); ret < 0)
+    {
+      SPDLOG_ERROR("av_write_trailer error: {}", Utils::error_stringify(ret));
+      if (!m_error)
+      {
+        m_error = ret;
+      }
+    }
+    m_trailer_written = true;
+  }
+  SPDLOG_INFO("muxed {} packets, {} bytes, {} ms into {}",
+              m_stats.packets.load(std::memory_order_relaxed),
+              m_stats.bytes.load(std::memory_order_relaxed),
+              std::chrono::duration_cast<std::chrono::milliseconds>(duration())
+                  .count(),
+              m_path);
+}
+
+Executor::Status MuxThread::step(std::chrono::milliseconds wait)
+{
+  Input *next = nullptr;
+  Input *waiting = nullptr;
+  int64_t next_ts = 0;
+  for (auto &input : m_inputs)
+  {
+    const auto pkt = input.queue->peek();
+    if (!pkt)
+    {
+      if (!waiting && !input.queue->finished())
+      {
+        waiting = &input;
+      }
+      continue;
+    }
+    const auto ts =
+        av_rescale_q(SpscQueueTraits<AVPacketPtr>::timestamp(*pkt).value_or(0),
+                     input.time_base,
+                     AV_TIME_BASE_Q);
+    if (!next || ts < next_ts)
+    {
+      next = &input;
+      next_ts = ts;
+    }
+  }
+
+  std::optional<AVPacketPtr> opt;
+  if (next)
+  {
+    opt = next->queue->try_pop();
+  }
+  else if (waiting)
+  {  // 都没有包时等待一路尚未结束的队列
+    next = waiting;
+    opt = next->queue->pop(wait);
+  }
+  else
+  {  // 所有编码器都已结束并且包已写完
+    return Executor::Status::Done;
+  }
+  if (!opt)
+  {
+    return Executor::Status::Idle;
+  }
+  if (const auto ret = write(*next, std::move(*opt)); ret < 0)
+  {  // 写包失败时结束封装，finish()中仍然尝试写文件尾
+    m_error = ret;
+    return Executor::Status::Done;
+  }
+  return Executor::Status::Progress;
+}
+
+int MuxThread::write(Input &input, AVPacketPtr pkt)
+{
+  if (pkt->pts != AV_NOPTS_VALUE)
+  {
+    if (input.start == AV_NOPTS_VALUE)
+    {
+      input.start = pkt->pts;
+    }
+    input.end = std::max(input.end, pkt->pts + pkt->duration);
+
+    // 媒体时长按各路中最早的起点和最晚的终点计算
+    int64_t start = INT64_MAX;
+    int64_t end = INT64_MIN;
+    for (const auto &i : m_inputs)
+    {
+      if (i.start != AV_NOPTS_VALUE)
+      {
+        start =
+            std::min(start, av_rescale_q(i.start, i.time_base, NS_TIME_BASE));
+        end = std::max(end, av_rescale_q(i.end, i.time_base, NS_TIME_BASE));
+      }
+    }
+    m_duration_ns.store(end - start, std::memory_order_relaxed);
+  }
+
+  m_stats.packets.fetch_add(1, std::memory_order_relaxed);
+  m_stats.bytes.fetch_add(pkt->size, std::memory_order_relaxed);
+  pkt->stream_index = input.stream->index;
+  av_packet_rescale_ts(pkt.get(), input.time_base, input.stream->time_base);
+  // 成功与否都会取走包的数据
+  if (const auto ret = av_interleaved_write_frame(m_format_ctx, pkt.get());
+      ret < 0)
+  {
+    SPDLOG_ERROR("av_interleaved_write_frame error: {}",
+                 Utils::error_stringify(ret));
+    return ret;
+  }
+  return 0;
+}
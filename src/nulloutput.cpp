@@ -0,0 +1,79 @@
+#include "nulloutput.h"
+
+#include <optional>
+
+#include <spdlog/spdlog.h>
+
+NullOutput::NullOutput(std::shared_ptr<AVFrameQueue> queue,
+                       std::shared_ptr<AVSync> avsync)
+    : m_queue(queue)
+    , m_avsync(avsync)
+{
+}
+
+NullOutput::~NullOutput() {}
+
+int NullOutput::init(AVRational time_base, bool realtime)
+{
+  m_time_base = time_base;
+  m_realtime = realtime;
+  return 0;
+}
+
+void NullOutput::start()
+{
+  m_thread = std::jthread([=](std::stop_token token) { run(token); });
+}
+
+void NullOutput::wait()
+{
+  if (m_thread.joinable())
+  {
+    m_thread.join();
+  }
+}
+
+void NullOutput::stop()
+{
+  m_thread.request_stop();
+  wait();
+}
+
+const StageStats &NullOutput::stats() const { return m_stats; }
+
+void NullOutput::run(std::stop_token token)
+{
+  std::optional<int64_t> first_pts;
+  while (!token.stop_requested() && !m_queue->finished())
+  {
+    auto opt = m_queue->pop(std::chrono::milliseconds(10));
+    if (!opt)
+    {
+      continue;
+    }
+
+    auto frame = std::move(*opt);
+    const auto pts = SpscQueueTraits<AVFramePtr>::timestamp(frame);
+    if (m_realtime && pts)
+    {  // 以第一帧为起点，按pts等待到播放时刻
+      if (!first_pts)
+      {
+        first_pts = pts;
+      }
+      const auto target = AVSync::to_duration(*pts - *first_pts, m_time_base);
+      const auto wait = target - m_avsync->get_clock().value_or(target);
+      if (wait.count() > 0)
+      {
+        std::this_thread::sleep_for(wait);
+      }
+    }
+
+    m_stats.frames.fetch_add(1, std::memory_order_relaxed);
+    m_stats.bytes.fetch_add(SpscQueueTraits<AVFramePtr>::bytes(frame),
+                            std::memory_order_relaxed);
+  }
+  m_stats.cpu_ns.store(StageStats::thread_cpu_time().count(),
+                       std::memory_order_relaxed);
+  SPDLOG_INFO("null output consumed {} frames",
+              m_stats.frames.load(std::memory_order_relaxed));
+}
@@ -0,0 +1,370 @@
+#include "options.h"
+
+#include <charconv>
+#include <string_view>
+
+#include <spdlog/spdlog.h>
+
+#include "playbackrate.h"
+
+namespace
+{
+template <typename T>
+std::optional<T> parse_number(std::string_view value)
+{
+  T v{};
+  const auto [ptr, ec] =
+      std::from_chars(value.data(), value.data() + value.size(), v);
+  if (ec != std::errc() || ptr != value.data() + value.size())
+  {
+    return std::nullopt;
+  }
+  return v;
+}
+
+std::optional<DecodeThreading::Type> parse_thread_type(std::string_view value)
+{
+  if (value == "auto")
+  {
+    return DecodeThreading::Type::Auto;
+  }
+  if (value == "frame")
+  {
+    return DecodeThreading::Type::Frame;
+  }
+  if (value == "slice")
+  {
+    return DecodeThreading::Type::Slice;
+  }
+  return std::nullopt;
+}
+}  // namespace
+
+std::optional<PlayerOptions> PlayerOptions::parse(int ac, char **av)
+{
+  PlayerOptions opts;
+  std::optional<int> threads;
+  std::optional<DecodeThreading::Type> thread_type;
+  std::optional<int> audio_threads;
+  std::optional<DecodeThreading::Type> audio_thread_type;
+  std::optional<int> video_threads;
+  std::optional<DecodeThreading::Type> video_thread_type;
+
+  for (int i = 1; i < ac; i++)
+  {
+    const std::string_view arg = av[i];
+    if (!arg.starts_with("--"))
+    {
+      opts.urls.emplace_back(arg);
+      continue;
+    }
+
+    const auto eq = arg.find('=');
+    const auto key = arg.substr(2, eq == arg.npos ? arg.npos : eq - 2);
+    const auto value =
+        eq == arg.npos ? std::string_view{} : arg.substr(eq + 1);
+
+    bool ok = true;
+    if (key == "threads")
+    {
+      ok = (threads = parse_number<int>(value)) && *threads >= 0;
+    }
+    else if (key == "thread-type")
+    {
+      ok = (thread_type = parse_thread_type(value)).has_value();
+    }
+    else if (key == "audio-threads")
+    {
+      ok = (audio_threads = parse_number<int>(value)) && *audio_threads >= 0;
+    }
+    else if (key == "audio-thread-type")
+    {
+      ok = (audio_thread_type = parse_thread_type(value)).has_value();
+    }
+    else if (key == "video-threads")
+    {
+      ok = (video_threads = parse_number<int>(value)) && *video_threads >= 0;
+    }
+    else if (key == "video-thread-type")
+    {
+      ok = (video_thread_type = parse_thread_type(value)).has_value();
+    }
+    else if (key == "convert-threads")
+    {
+      const auto n = parse_number<int>(value);
+      ok = n && *n >= 0;
+      opts.convert_threads = n.value_or(0);
+    }
+    else if (key == "video-filter")
+    {
+      ok = !value.empty();
+      opts.video_filter = value;
+    }
+    else if (key == "audio-filter")
+    {
+      ok = !value.empty();
+      opts.audio_filter = value;
+    }
+    else if (key == "filter-threads")
+    {
+      const auto n = parse_number<int>(value);
+      ok = n && *n >= 0;
+      opts.filter_threads = n.value_or(0);
+    }
+    else if (key == "sync")
+    {
+      ok = value == "audio" || value == "video" || value == "external";
+      opts.sync_master = value == "video"      ? AVSync::Master::Video
+                         : value == "external" ? AVSync::Master::External
+                                               : AVSync::Master::Audio;
+    }
+    else if (key == "drop-threshold")
+    {
+      const auto ms = parse_number<int>(value);
+      ok = ms && *ms >= 0;
+      opts.drop_threshold = std::chrono::milliseconds(ms.value_or(0));
+    }
+    else if (key == "headless")
+    {
+      ok = value.empty();
+      opts.headless = true;
+    }
+    else if (key == "realtime")
+    {
+      ok = value.empty();
+      opts.realtime = true;
+    }
+    else if (key == "fixed-quality")
+    {
+      ok = value.empty();
+      opts.adaptive_quality = false;
+    }
+    else if (key == "metrics-file")
+    {
+      ok = !value.empty();
+      opts.metrics_file = value;
+    }
+    else if (key == "metrics-format")
+    {
+      ok = value == "prometheus" || value == "json";
+      opts.metrics_format = value == "json" ? Metrics::Format::Json
+                                            : Metrics::Format::Prometheus;
+    }
+    else if (key == "metrics-interval")
+    {
+      const auto ms = parse_number<int>(value);
+      ok = ms && *ms > 0;
+      opts.metrics_interval = std::chrono::milliseconds(ms.value_or(0));
+    }
+    else if (key == "probe-cache")
+    {
+      ok = !value.empty();
+      opts.probe_cache = value;
+    }
+    else if (key == "probesize")
+    {
+      const auto n = parse_number<int64_t>(value);
+      ok = n && *n >= 32;  // FFmpeg要求的最小值
+      opts.probesize = n.value_or(0);
+    }
+    else if (key == "analyzeduration")
+    {
+      const auto ms = parse_number<int>(value);
+      ok = ms && *ms > 0;
+      opts.analyze_duration = std::chrono::milliseconds(ms.value_or(0));
+    }
+    else if (key == "io")
+    {
+      ok = value == "default" || value == "mmap" || value == "buffered";
+      opts.io.backend = value == "mmap"       ? FileIO::Backend::Mmap
+                        : value == "buffered" ? FileIO::Backend::Buffered
+                                              : FileIO::Backend::Default;
+    }
+    else if (key == "io-block-size")
+    {
+      const auto n = parse_number<size_t>(value);
+      ok = n && *n >= 4096;
+      opts.io.block_size = n.value_or(0);
+    }
+    else if (key == "io-read-ahead")
+    {
+      const auto n = parse_number<size_t>(value);
+      ok = n && (*n == 0 || *n >= 64 * 1024);
+      opts.io.read_ahead = n.value_or(0);
+    }
+    else if (key == "io-latency")
+    {
+      const auto ms = parse_number<int>(value);
+      ok = ms && *ms >= 0;
+      opts.io.simulated_latency = std::chrono::milliseconds(ms.value_or(0));
+    }
+    else if (key == "io-bandwidth")
+    {
+      const auto n = parse_number<uint64_t>(value);
+      ok = n.has_value();
+      opts.io.simulated_bandwidth = n.value_or(0);
+    }
+    else if (key == "gop-cache")
+    {
+      const auto n = parse_number<size_t>(value);
+      ok = n.has_value();
+      opts.gop_cache = n.value_or(0);
+    }
+    else if (key == "frame-cache")
+    {
+      const auto n = parse_number<size_t>(value);
+      ok = n.has_value();
+      opts.frame_cache = n.value_or(0);
+    }
+    else if (key == "memory-limit")
+    {
+      const auto n = parse_number<size_t>(value);
+      ok = n.has_value();
+      opts.memory_limit = n.value_or(0);
+    }
+    else if (key == "memory-log-interval")
+    {
+      const auto ms = parse_number<int>(value);
+      ok = ms && *ms >= 0;
+      opts.memory_log_interval = std::chrono::milliseconds(ms.value_or(0));
+    }
+    else if (key == "export")
+    {
+      ok = !value.empty();
+      opts.export_path = value;
+    }
+    else if (key == "video-encoder")
+    {
+      ok = !value.empty();
+      opts.video_encode.encoder = value;
+    }
+    else if (key == "audio-encoder")
+    {
+      ok = !value.empty();
+      opts.audio_encode.encoder = value;
+    }
+    else if (key == "video-bitrate")
+    {
+      const auto n = parse_number<int64_t>(value);
+      ok = n && *n >= 0;
+      opts.video_encode.bit_rate = n.value_or(0);
+    }
+    else if (key == "audio-bitrate")
+    {
+      const auto n = parse_number<int64_t>(value);
+      ok = n && *n >= 0;
+      opts.audio_encode.bit_rate = n.value_or(0);
+    }
+    else if (key == "encode-threads")
+    {
+      const auto n = parse_number<int>(value);
+      ok = n && *n >= 0;
+      opts.video_encode.threads = n.value_or(0);
+    }
+    else if (key == "rate")
+    {
+      const auto r = parse_number<double>(value);
+      ok = r && *r >= PlaybackRate::MIN_RATE && *r <= PlaybackRate::MAX_RATE;
+      opts.rate = r.value_or(1.0);
+    }
+    else if (key == "workers")
+    {
+      const auto n = parse_number<int>(value);
+      ok = n && *n >= 0;
+      opts.workers = n.value_or(0);
+    }
+    else
+    {
+      ok = false;
+    }
+
+    if (!ok)
+    {
+      SPDLOG_ERROR("invalid option: {}", arg);
+      print_usage(av[0]);
+      return std::nullopt;
+    }
+  }
+
+  if (opts.urls.empty())
+  {
+    print_usage(av[0]);
+    return std::nullopt;
+  }
+
+  // 按流的设置优先于通用设置
+  opts.audio_threading.count =
+      audio_threads.value_or(threads.value_or(opts.audio_threading.count));
+  opts.audio_threading.type = audio_thread_type.value_or(
+      thread_type.value_or(opts.audio_threading.type));
+  opts.video_threading.count =
+      video_threads.value_or(threads.value_or(opts.video_threading.count));
+  opts.video_threading.type = video_thread_type.value_or(
+      thread_type.value_or(opts.video_threading.type));
+
+  return opts;
+}
+
+void PlayerOptions::print_usage(const char *prog)
+{
+  SPDLOG_ERROR(
+      "usage: {} [options] <url> [url...], such as: {} time.mp4\n"
+      "  more than one url plays the videos in a grid, without audio\n"
+      "  --threads=N                     decode threads for all streams, "
+      "0 = auto\n"
+      "  --thread-type=auto|frame|slice  decode threading for all streams\n"
+      "  --audio-threads=N, --audio-thread-type=...  audio override\n"
+      "  --video-threads=N, --video-thread-type=...  video override\n"
+      "  --convert-threads=N             pixel format conversion threads, "
+      "0 = auto\n"
+      "  --video-filter=GRAPH            libavfilter graph for video, "
+      "such as yadif\n"
+      "  --audio-filter=GRAPH            libavfilter graph for audio\n"
+      "  --filter-threads=N              threads per filter graph, "
+      "0 = auto\n"
+      "  --sync=audio|video|external     master clock, default audio\n"
+      "  --drop-threshold=MS             drop video frames later than MS, "
+      "0 = never, default 40\n"
+      "  --headless                      no window/audio device, print a "
+      "throughput report\n"
+      "  --realtime                      headless output paced by pts\n"
+      "  --fixed-quality                 never lower decode quality when "
+      "the decoder falls behind\n"
+      "  --metrics-file=PATH             periodically dump metrics to PATH\n"
+      "  --metrics-format=prometheus|json\n"
+      "  --metrics-interval=MS           metrics dump interval, default 1000\n"
+      "  --probe-cache=DIR               cache probe results and keyframe "
+      "index in DIR\n"
+      "  --probesize=BYTES               max bytes read while probing\n"
+      "  --analyzeduration=MS            max duration analyzed while probing\n"
+      "  --io=default|mmap|buffered      local file reader, default ffmpeg's\n"
+      "  --io-block-size=BYTES           read/prefetch block size, "
+      "default 4194304\n"
+      "  --io-read-ahead=BYTES           read ahead on an io thread, "
+      "0 = off\n"
+      "  --io-latency=MS                 simulated latency per read, testing\n"
+      "  --io-bandwidth=BYTES            simulated bytes per second, testing\n"
+      "  --gop-cache=BYTES               decoded gop cache for frame "
+      "stepping/reverse (unfiltered, so off with --video-filter), "
+      "0 = off, default 268435456\n"
+      "  --frame-cache=BYTES             LRU cache of displayed frames for "
+      "stepping/scrubbing, 0 = off\n"
+      "  --memory-limit=BYTES            cap on all queued packets and "
+      "frames (not the frame/gop caches), 0 = none\n"
+      "  --memory-log-interval=MS        log memory usage every MS, "
+      "0 = off, default 10000\n"
+      "  --export=PATH                   re-encode to PATH at full speed "
+      "instead of playing\n"
+      "  --video-encoder=NAME            export video encoder, default "
+      "libx264\n"
+      "  --audio-encoder=NAME            export audio encoder, default aac\n"
+      "  --video-bitrate=BPS, --audio-bitrate=BPS  0 = encoder default\n"
+      "  --encode-threads=N              export video encoder frame threads, "
+      "0 = auto\n"
+      "  --rate=R                        initial playback rate, 0.25 to 16; "
+      "[ ] and backspace change it while playing\n"
+      "  --workers=N                     shared decode workers for multiple "
+      "urls, 0 = auto",
+      prog,
+      prog);
+}
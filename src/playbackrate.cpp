@@ -0,0 +1,163 @@
+#include "playbackrate.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+#include <spdlog/fmt/chrono.h>
+#include <spdlog/fmt/std.h>
+#include <spdlog/spdlog.h>
+
+namespace
+{
+// faster()/slower()的档位
+constexpr std::array RATES{
+    0.25, 0.5, 0.75, 1.0, 1.25, 1.5, 2.0, 4.0, 8.0, 16.0};
+}  // namespace
+
+PlaybackRate::PlaybackRate(std::shared_ptr<AVSync> avsync,
+                           std::shared_ptr<Demuxthread> demux,
+                           std::shared_ptr<CodecThread> video_decoder,
+                           std::shared_ptr<AudioOutput> audio_output)
+    : m_avsync(std::move(avsync))
+    , m_demux(std::move(demux))
+    , m_video_decoder(std::move(video_decoder))
+    , m_audio_output(std::move(audio_output))
+    , m_master(m_avsync->master())
+    , m_demux_discarded(&Metrics::instance().counter("video_packets_discarded"))
+    , m_rate_gauge(&Metrics::instance().gauge("playback_rate_percent"))
+    , m_discard_gauge(&Metrics::instance().gauge("video_discard_percent"))
+{
+  m_rate_gauge->set(100);
+}
+
+void PlaybackRate::set(double rate)
+{
+  rate = std::clamp(rate, MIN_RATE, MAX_RATE);
+  if (rate == m_rate)
+  {
+    return;
+  }
+  log();
+
+  // 切换之前主时钟的位置，静音/恢复声音时从这里接着走
+  const auto position = m_avsync->get_clock();
+  const auto generation = m_avsync->master_clock().generation();
+  const auto was_audible = audible(m_rate);
+  const auto is_audible = audible(rate);
+
+  m_avsync->set_rate(rate);
+  const auto discard = video_discard(rate);
+  m_demux->set_discard(rate <= AudioOutput::MAX_TEMPO ? AVDISCARD_DEFAULT
+                                                      : AVDISCARD_ALL,
+                       discard);
+  if (m_video_decoder)
+  {
+    m_video_decoder->set_skip_frame(discard);
+  }
+  if (m_audio_output)
+  {
+    m_audio_output->set_rate(rate);
+  }
+
+  if (was_audible && !is_audible && m_master == AVSync::Master::Audio)
+  {  // 音频静音期间改以外部时钟为准，从音频播放到的位置继续
+    if (position)
+    {
+      m_avsync->external_clock().set(*position, generation);
+    }
+    m_avsync->set_master(AVSync::Master::External);
+  }
+  else if (!was_audible && is_audible)
+  {  // 静音期间的音频包已经丢弃，从当前位置seek，音视频一起重新开始
+    m_avsync->set_master(m_master);
+    if (position)
+    {
+      m_demux->seek(*position);
+    }
+  }
+
+  SPDLOG_INFO("playback rate {} -> {} at {}, audio {}, video discard {}",
+              m_rate,
+              rate,
+              position,
+              is_audible ? "on" : "off",
+              static_cast<int>(discard));
+  m_rate = rate;
+  m_rate_gauge->set(std::lround(rate * 100));
+  m_base_discarded = m_demux_discarded->value();
+  if (m_video_decoder)
+  {
+    m_base_packets =
+        m_video_decoder->stats().packets.load(std::memory_order_relaxed);
+    m_base_frames =
+        m_video_decoder->stats().frames.load(std::memory_order_relaxed);
+  }
+}
+
+void PlaybackRate::faster()
+{
+  const auto it = std::upper_bound(RATES.begin(), RATES.end(), m_rate);
+  if (it != RATES.end())
+  {
+    set(*it);
+  }
+}
+
+void PlaybackRate::slower()
+{
+  const auto it = std::lower_bound(RATES.begin(), RATES.end(), m_rate);
+  if (it != RATES.begin())
+  {
+    set(*std::prev(it));
+  }
+}
+
+double PlaybackRate::discard_ratio() const
+{
+  if (!m_video_decoder)
+  {
+    return 0.0;
+  }
+  // 读到的视频帧 = 解复用丢弃的 + 送入解码器的，其中解出的帧之外都被丢弃了
+  const auto &stats = m_video_decoder->stats();
+  const auto discarded = m_demux_discarded->value() - m_base_discarded;
+  const auto packets =
+      stats.packets.load(std::memory_order_relaxed) - m_base_packets;
+  const auto frames = stats.frames.load(std::memory_order_relaxed) -
+                      m_base_frames;
+  const auto total = discarded + packets;
+  return total > 0 ? 1.0 - 1.0 * std::min(frames, total) / total : 0.0;
+}
+
+void PlaybackRate::update_metrics()
+{
+  m_discard_gauge->set(std::lround(discard_ratio() * 100));
+}
+
+void PlaybackRate::log()
+{
+  const auto ratio = discard_ratio();
+  m_discard_gauge->set(std::lround(ratio * 100));
+  SPDLOG_INFO("playback rate {}: {:.1f}% video frames discarded",
+              m_rate,
+              ratio * 100);
+}
+
+AVDiscard PlaybackRate::video_discard(double rate)
+{
+  if (rate >= KEYFRAME_RATE)
+  {
+    return AVDISCARD_NONKEY;
+  }
+  if (rate > NONREF_RATE)
+  {
+    return AVDISCARD_NONREF;
+  }
+  return AVDISCARD_DEFAULT;
+}
+
+bool PlaybackRate::audible(double rate) const
+{
+  return m_audio_output && rate <= AudioOutput::MAX_TEMPO;
+}
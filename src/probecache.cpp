@@ -0,0 +1,545 @@
+#include "probecache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <ffmpeg/avcodec>
+#include <spdlog/fmt/fmt.h>
+#include <spdlog/fmt/std.h>
+#include <spdlog/spdlog.h>
+
+namespace
+{
+constexpr char MAGIC[4] = {'P', 'L', 'P', 'C'};
+constexpr uint32_t VERSION = 1;
+constexpr size_t FORMAT_NAME_SIZE = 32;
+// 参与校验的文件头长度，覆盖容器的头部信息
+constexpr size_t HEADER_HASH_BYTES = 64 * 1024;
+
+// 文件布局：FileHeader | StreamRecord[] | KeyframeRecord[] | extradata
+// 各部分都按8字节对齐，映射之后可以直接按结构体访问
+struct FileHeader
+{
+  char magic[4];
+  uint32_t version;
+  uint64_t file_size;
+  int64_t mtime;
+  uint64_t header_hash;
+  char format_name[FORMAT_NAME_SIZE];
+  int64_t start_time;
+  int64_t duration;
+  int64_t bit_rate;
+  uint32_t stream_count;
+  uint32_t keyframe_count;
+  uint64_t streams_offset;
+  uint64_t keyframes_offset;
+  uint64_t extradata_offset;
+  uint64_t total_size;
+};
+
+struct StreamRecord
+{
+  int32_t codec_type;
+  int32_t codec_id;
+  uint32_t codec_tag;
+  int32_t format;
+  int64_t bit_rate;
+  int32_t bits_per_coded_sample;
+  int32_t bits_per_raw_sample;
+  int32_t profile;
+  int32_t level;
+  int32_t width;
+  int32_t height;
+  int32_t sample_aspect_num;
+  int32_t sample_aspect_den;
+  int32_t field_order;
+  int32_t color_range;
+  int32_t color_primaries;
+  int32_t color_trc;
+  int32_t color_space;
+  int32_t chroma_location;
+  int32_t video_delay;
+  int32_t ch_order;
+  uint64_t ch_mask;
+  int32_t nb_channels;
+  int32_t sample_rate;
+  int32_t block_align;
+  int32_t frame_size;
+  int32_t initial_padding;
+  int32_t trailing_padding;
+  int32_t seek_preroll;
+  int32_t time_base_num;
+  int32_t time_base_den;
+  int32_t avg_frame_rate_num;
+  int32_t avg_frame_rate_den;
+  int32_t r_frame_rate_num;
+  int32_t r_frame_rate_den;
+  int32_t reserved;
+  int64_t start_time;
+  int64_t duration;
+  int64_t nb_frames;
+  uint64_t extradata_offset;  // 相对于extradata区域
+  uint64_t extradata_size;
+};
+
+struct KeyframeRecord
+{
+  int32_t stream_index;
+  int32_t reserved;
+  int64_t pts;
+  int64_t pos;
+};
+
+static_assert(sizeof(FileHeader) % 8 == 0);
+static_assert(sizeof(StreamRecord) % 8 == 0);
+static_assert(sizeof(KeyframeRecord) % 8 == 0);
+
+uint64_t fnv1a(const void *data, size_t size)
+{
+  uint64_t hash = 14695981039346656037ull;
+  const auto bytes = static_cast<const uint8_t *>(data);
+  for (size_t i = 0; i < size; i++)
+  {
+    hash = (hash ^ bytes[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+// 只读映射整个文件，返回的指针析构时解除映射
+std::shared_ptr<const uint8_t> map_file(const std::filesystem::path &path,
+                                        size_t &size)
+{
+#ifdef _WIN32
+  const auto file = CreateFileW(path.c_str(),
+                                GENERIC_READ,
+                                FILE_SHARE_READ | FILE_SHARE_DELETE,
+                                nullptr,
+                                OPEN_EXISTING,
+                                FILE_ATTRIBUTE_NORMAL,
+                                nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+  {
+    return nullptr;
+  }
+  LARGE_INTEGER file_size{};
+  const auto mapping =
+      GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0
+          ? CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr)
+          : nullptr;
+  CloseHandle(file);
+  if (!mapping)
+  {
+    return nullptr;
+  }
+  const auto view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  if (!view)
+  {
+    return nullptr;
+  }
+  size = static_cast<size_t>(file_size.QuadPart);
+  return std::shared_ptr<const uint8_t>(static_cast<const uint8_t *>(view),
+                                        [](const uint8_t *p)
+                                        { UnmapViewOfFile(p); });
+#else
+  const auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    return nullptr;
+  }
+  struct stat st{};
+  void *addr = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+  {
+    addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (addr == MAP_FAILED)
+  {
+    return nullptr;
+  }
+  size = static_cast<size_t>(st.st_size);
+  return std::shared_ptr<const uint8_t>(
+      static_cast<const uint8_t *>(addr),
+      [size](const uint8_t *p) { munmap(const_cast<uint8_t *>(p), size); });
+#endif
+}
+
+template <typename T>
+void append(std::vector<uint8_t> &buf, const T &v)
+{
+  const auto p = reinterpret_cast<const uint8_t *>(&v);
+  buf.insert(buf.end(), p, p + sizeof(T));
+}
+}  // namespace
+
+ProbeCache::Entry::Entry(std::shared_ptr<const uint8_t> data)
+    : m_data(std::move(data))
+{
+}
+
+std::string ProbeCache::Entry::format_name() const
+{
+  const auto &header = *at<FileHeader>(0);
+  return std::string(header.format_name,
+                     strnlen(header.format_name, FORMAT_NAME_SIZE));
+}
+
+bool ProbeCache::Entry::apply(AVFormatContext *ctx) const
+{
+  const auto &header = *at<FileHeader>(0);
+  const auto records = at<StreamRecord>(header.streams_offset);
+  if (ctx->nb_streams != header.stream_count)
+  {
+    return false;
+  }
+  for (unsigned i = 0; i < ctx->nb_streams; i++)
+  {
+    const auto par = ctx->streams[i]->codecpar;
+    if ((par->codec_type != AVMEDIA_TYPE_UNKNOWN &&
+         par->codec_type != records[i].codec_type) ||
+        (par->codec_id != AV_CODEC_ID_NONE &&
+         par->codec_id != records[i].codec_id))
+    {
+      return false;
+    }
+  }
+
+  for (unsigned i = 0; i < ctx->nb_streams; i++)
+  {
+    const auto &r = records[i];
+    const auto st = ctx->streams[i];
+    const auto par = st->codecpar;
+    par->codec_type = static_cast<AVMediaType>(r.codec_type);
+    par->codec_id = static_cast<AVCodecID>(r.codec_id);
+    par->codec_tag = r.codec_tag;
+    par->format = r.format;
+    par->bit_rate = r.bit_rate;
+    par->bits_per_coded_sample = r.bits_per_coded_sample;
+    par->bits_per_raw_sample = r.bits_per_raw_sample;
+    par->profile = r.profile;
+    par->level = r.level;
+    par->width = r.width;
+    par->height = r.height;
+    par->sample_aspect_ratio = {r.sample_aspect_num, r.sample_aspect_den};
+    par->field_order = static_cast<AVFieldOrder>(r.field_order);
+    par->color_range = static_cast<AVColorRange>(r.color_range);
+    par->color_primaries = static_cast<AVColorPrimaries>(r.color_primaries);
+    par->color_trc = static_cast<AVColorTransferCharacteristic>(r.color_trc);
+    par->color_space = static_cast<AVColorSpace>(r.color_space);
+    par->chroma_location = static_cast<AVChromaLocation>(r.chroma_location);
+    par->video_delay = r.video_delay;
+    av_channel_layout_uninit(&par->ch_layout);
+    if (r.ch_order == AV_CHANNEL_ORDER_NATIVE)
+    {
+      av_channel_layout_from_mask(&par->ch_layout, r.ch_mask);
+    }
+    else
+    {
+      par->ch_layout.order = AV_CHANNEL_ORDER_UNSPEC;
+      par->ch_layout.nb_channels = r.nb_channels;
+    }
+    par->sample_rate = r.sample_rate;
+    par->block_align = r.block_align;
+    par->frame_size = r.frame_size;
+    par->initial_padding = r.initial_padding;
+    par->trailing_padding = r.trailing_padding;
+    par->seek_preroll = r.seek_preroll;
+
+    if (r.extradata_size && !par->extradata)
+    {
+      par->extradata = static_cast<uint8_t *>(
+          av_mallocz(r.extradata_size + AV_INPUT_BUFFER_PADDING_SIZE));
+      if (!par->extradata)
+      {
+        return false;
+      }
+      memcpy(par->extradata,
+             at<uint8_t>(header.extradata_offset + r.extradata_offset),
+             r.extradata_size);
+      par->extradata_size = static_cast<int>(r.extradata_size);
+    }
+
+    st->time_base = {r.time_base_num, r.time_base_den};
+    st->start_time = r.start_time;
+    st->duration = r.duration;
+    st->nb_frames = r.nb_frames;
+    st->avg_frame_rate = {r.avg_frame_rate_num, r.avg_frame_rate_den};
+    st->r_frame_rate = {r.r_frame_rate_num, r.r_frame_rate_den};
+  }
+
+  ctx->start_time = header.start_time;
+  ctx->duration = header.duration;
+  ctx->bit_rate = header.bit_rate;
+  return true;
+}
+
+std::map<int64_t, int64_t> ProbeCache::Entry::keyframes(int stream_index) const
+{
+  const auto &header = *at<FileHeader>(0);
+  const auto records = at<KeyframeRecord>(header.keyframes_offset);
+  std::map<int64_t, int64_t> keyframes;
+  for (uint32_t i = 0; i < header.keyframe_count; i++)
+  {
+    if (records[i].stream_index == stream_index)
+    {  // 记录按pts有序，从尾部插入是常数时间
+      keyframes.emplace_hint(keyframes.end(), records[i].pts, records[i].pos);
+    }
+  }
+  return keyframes;
+}
+
+size_t ProbeCache::Entry::keyframe_count() const
+{
+  return at<FileHeader>(0)->keyframe_count;
+}
+
+ProbeCache::ProbeCache(std::filesystem::path dir)
+    : m_dir(std::move(dir))
+{
+}
+
+std::optional<ProbeCache::Key> ProbeCache::make_key(const std::string &url)
+{
+  std::string_view path = url;
+  if (path.starts_with("file:"))
+  {
+    path.remove_prefix(5);
+  }
+
+  std::error_code ec;
+  Key key;
+  key.path = std::filesystem::absolute(std::filesystem::path(path), ec);
+  if (ec || !std::filesystem::is_regular_file(key.path, ec))
+  {  // 网络流等非本地文件不缓存
+    return std::nullopt;
+  }
+  key.file_size = std::filesystem::file_size(key.path, ec);
+  if (ec)
+  {
+    return std::nullopt;
+  }
+  key.mtime = std::filesystem::last_write_time(key.path, ec)
+                  .time_since_epoch()
+                  .count();
+  if (ec)
+  {
+    return std::nullopt;
+  }
+
+  std::ifstream file(key.path, std::ios::binary);
+  std::vector<char> head(
+      std::min<uint64_t>(key.file_size, HEADER_HASH_BYTES));
+  if (!file.read(head.data(), head.size()))
+  {
+    return std::nullopt;
+  }
+  key.header_hash = fnv1a(head.data(), head.size());
+  return key;
+}
+
+std::filesystem::path ProbeCache::cache_path(const Key &key) const
+{
+  const auto name = key.path.generic_u8string();
+  return m_dir / fmt::format("{:016x}.probe", fnv1a(name.data(), name.size()));
+}
+
+std::optional<ProbeCache::Entry> ProbeCache::load(const std::string &url) const
+{
+  const auto key = make_key(url);
+  if (!key)
+  {
+    return std::nullopt;
+  }
+
+  size_t size = 0;
+  auto data = map_file(cache_path(*key), size);
+  if (!data || size < sizeof(FileHeader))
+  {
+    return std::nullopt;
+  }
+
+  // 校验文件身份和各区域的边界，之后的访问不再检查
+  const auto &header = *reinterpret_cast<const FileHeader *>(data.get());
+  if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      header.version != VERSION || header.total_size != size ||
+      header.file_size != key->file_size || header.mtime != key->mtime ||
+      header.header_hash != key->header_hash)
+  {
+    SPDLOG_INFO("probe cache of {} is stale", key->path);
+    return std::nullopt;
+  }
+  if (header.streams_offset + uint64_t{header.stream_count} *
+                                  sizeof(StreamRecord) >
+          header.keyframes_offset ||
+      header.keyframes_offset + uint64_t{header.keyframe_count} *
+                                    sizeof(KeyframeRecord) >
+          header.extradata_offset ||
+      header.extradata_offset > size)
+  {
+    SPDLOG_WARN("probe cache of {} is corrupted", key->path);
+    return std::nullopt;
+  }
+  const auto records = reinterpret_cast<const StreamRecord *>(
+      data.get() + header.streams_offset);
+  for (uint32_t i = 0; i < header.stream_count; i++)
+  {
+    if (header.extradata_offset + records[i].extradata_offset +
+            records[i].extradata_size >
+        size)
+    {
+      SPDLOG_WARN("probe cache of {} is corrupted", key->path);
+      return std::nullopt;
+    }
+  }
+
+  return Entry(std::move(data));
+}
+
+bool ProbeCache::store(const std::string &url,
+                       const AVFormatContext &ctx,
+                       int keyframe_stream,
+                       const std::map<int64_t, int64_t> &keyframes) const
+{
+  const auto key = make_key(url);
+  if (!key)
+  {
+    return false;
+  }
+
+  FileHeader header{};
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.file_size = key->file_size;
+  header.mtime = key->mtime;
+  header.header_hash = key->header_hash;
+  // 只保存第一个名字，如"mov,mp4,m4a"中的"mov"，av_find_input_format()才能找到
+  const std::string_view names = ctx.iformat->name;
+  const auto name = names.substr(0, names.find(','));
+  memcpy(header.format_name,
+         name.data(),
+         std::min(name.size(), FORMAT_NAME_SIZE - 1));
+  header.start_time = ctx.start_time;
+  header.duration = ctx.duration;
+  header.bit_rate = ctx.bit_rate;
+  header.stream_count = ctx.nb_streams;
+  header.keyframe_count = static_cast<uint32_t>(keyframes.size());
+  header.streams_offset = sizeof(FileHeader);
+  header.keyframes_offset =
+      header.streams_offset + header.stream_count * sizeof(StreamRecord);
+  header.extradata_offset =
+      header.keyframes_offset + header.keyframe_count * sizeof(KeyframeRecord);
+
+  std::vector<uint8_t> extradata;
+  std::vector<uint8_t> buf;
+  buf.reserve(header.extradata_offset);
+  buf.resize(sizeof(FileHeader));
+  for (unsigned i = 0; i < ctx.nb_streams; i++)
+  {
+    const auto st = ctx.streams[i];
+    const auto par = st->codecpar;
+    StreamRecord r{};
+    r.codec_type = par->codec_type;
+    r.codec_id = par->codec_id;
+    r.codec_tag = par->codec_tag;
+    r.format = par->format;
+    r.bit_rate = par->bit_rate;
+    r.bits_per_coded_sample = par->bits_per_coded_sample;
+    r.bits_per_raw_sample = par->bits_per_raw_sample;
+    r.profile = par->profile;
+    r.level = par->level;
+    r.width = par->width;
+    r.height = par->height;
+    r.sample_aspect_num = par->sample_aspect_ratio.num;
+    r.sample_aspect_den = par->sample_aspect_ratio.den;
+    r.field_order = par->field_order;
+    r.color_range = par->color_range;
+    r.color_primaries = par->color_primaries;
+    r.color_trc = par->color_trc;
+    r.color_space = par->color_space;
+    r.chroma_location = par->chroma_location;
+    r.video_delay = par->video_delay;
+    // 自定义/Ambisonic声道布局只保存声道数
+    r.ch_order = par->ch_layout.order == AV_CHANNEL_ORDER_NATIVE
+                     ? AV_CHANNEL_ORDER_NATIVE
+                     : AV_CHANNEL_ORDER_UNSPEC;
+    r.ch_mask = par->ch_layout.order == AV_CHANNEL_ORDER_NATIVE
+                    ? par->ch_layout.u.mask
+                    : 0;
+    r.nb_channels = par->ch_layout.nb_channels;
+    r.sample_rate = par->sample_rate;
+    r.block_align = par->block_align;
+    r.frame_size = par->frame_size;
+    r.initial_padding = par->initial_padding;
+    r.trailing_padding = par->trailing_padding;
+    r.seek_preroll = par->seek_preroll;
+    r.time_base_num = st->time_base.num;
+    r.time_base_den = st->time_base.den;
+    r.avg_frame_rate_num = st->avg_frame_rate.num;
+    r.avg_frame_rate_den = st->avg_frame_rate.den;
+    r.r_frame_rate_num = st->r_frame_rate.num;
+    r.r_frame_rate_den = st->r_frame_rate.den;
+    r.start_time = st->start_time;
+    r.duration = st->duration;
+    r.nb_frames = st->nb_frames;
+    r.extradata_offset = extradata.size();
+    r.extradata_size = par->extradata_size > 0 ? par->extradata_size : 0;
+    extradata.insert(
+        extradata.end(), par->extradata, par->extradata + r.extradata_size);
+    append(buf, r);
+  }
+  for (const auto &[pts, pos] : keyframes)
+  {
+    append(buf, KeyframeRecord{keyframe_stream, 0, pts, pos});
+  }
+  buf.insert(buf.end(), extradata.begin(), extradata.end());
+  header.total_size = buf.size();
+  memcpy(buf.data(), &header, sizeof(header));
+
+  std::error_code ec;
+  std::filesystem::create_directories(m_dir, ec);
+  const auto path = cache_path(*key);
+  // 多个进程/线程可能同时写同一个缓存，临时文件名各不相同
+  auto tmp = path;
+  tmp += fmt::format(
+      ".{:x}.{:x}.tmp",
+      std::hash<std::thread::id>{}(std::this_thread::get_id()),
+      std::chrono::steady_clock::now().time_since_epoch().count());
+  {
+    std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+    if (!file ||
+        !file.write(reinterpret_cast<const char *>(buf.data()), buf.size()))
+    {
+      SPDLOG_ERROR("write probe cache {} error", tmp);
+      return false;
+    }
+  }
+
+  std::filesystem::rename(tmp, path, ec);
+  if (ec)
+  {
+    SPDLOG_ERROR("rename probe cache {} error: {}", path, ec.message());
+    std::filesystem::remove(tmp, ec);
+    return false;
+  }
+
+  SPDLOG_INFO("probe cache {} stored: {} streams, {} keyframes, {} bytes",
+              path,
+              header.stream_count,
+              header.keyframe_count,
+              header.total_size);
+  return true;
+}
@@ -0,0 +1,115 @@
+#include "qualitycontroller.h"
+
+#include <array>
+
+#include <spdlog/spdlog.h>
+
+namespace
+{
+// 从完整质量开始，每一级在前一级的基础上多跳过一些工作
+constexpr std::array<DecodeSkip, 5> LEVELS{{
+    {},
+    {.loop_filter = AVDISCARD_NONREF},
+    {.loop_filter = AVDISCARD_ALL},
+    {.loop_filter = AVDISCARD_ALL, .idct = AVDISCARD_NONREF},
+    {.loop_filter = AVDISCARD_ALL,
+     .idct = AVDISCARD_NONREF,
+     .frame = AVDISCARD_NONREF},
+}};
+
+constexpr auto WINDOW = std::chrono::milliseconds(500);
+// 晚于目标时刻超过该值的帧算作迟到
+constexpr auto LATE_THRESHOLD = std::chrono::milliseconds(20);
+// 一个窗口内迟到的帧超过该比例并且队列平均深度低于LOW_DEPTH时降级
+constexpr double DEGRADE_LATE_RATIO = 0.1;
+constexpr double LOW_DEPTH = 2.0;
+// 连续RECOVER_WINDOWS个窗口没有迟到并且队列平均深度不低于HEADROOM_DEPTH时升级
+constexpr int RECOVER_WINDOWS = 4;
+constexpr double HEADROOM_DEPTH = 3.0;
+// 窗口内帧数太少时不做判断
+constexpr size_t MIN_FRAMES = 5;
+}  // namespace
+
+QualityController::QualityController(std::shared_ptr<CodecThread> decoder)
+    : m_decoder(std::move(decoder))
+    , m_window_begin(std::chrono::steady_clock::now())
+    , m_transitions(
+          &Metrics::instance().counter("decode_quality_transitions"))
+    , m_level_gauge(&Metrics::instance().gauge("decode_quality_level"))
+{
+}
+
+void QualityController::record(std::chrono::nanoseconds lateness,
+                               bool dropped,
+                               size_t depth)
+{
+  m_frames++;
+  if (dropped || lateness > LATE_THRESHOLD)
+  {
+    m_late++;
+  }
+  m_depth_sum += depth;
+
+  if (std::chrono::steady_clock::now() - m_window_begin >= WINDOW)
+  {
+    evaluate();
+  }
+}
+
+void QualityController::evaluate()
+{
+  const auto frames = m_frames;
+  const auto late_ratio = frames > 0 ? 1.0 * m_late / frames : 0.0;
+  const auto depth = frames > 0 ? 1.0 * m_depth_sum / frames : 0.0;
+  m_window_begin = std::chrono::steady_clock::now();
+  m_frames = 0;
+  m_late = 0;
+  m_depth_sum = 0;
+  if (frames < MIN_FRAMES)
+  {
+    return;
+  }
+
+  SPDLOG_DEBUG("decode quality window: {} frames, {:.1f}% late, depth {:.1f}",
+               frames,
+               late_ratio * 100,
+               depth);
+  if (late_ratio > DEGRADE_LATE_RATIO && depth < LOW_DEPTH)
+  {
+    m_good_windows = 0;
+    if (m_level + 1 < static_cast<int>(LEVELS.size()))
+    {
+      set_level(m_level + 1, "decoder falling behind");
+    }
+    return;
+  }
+
+  if (late_ratio == 0 && depth >= HEADROOM_DEPTH)
+  {
+    if (++m_good_windows >= RECOVER_WINDOWS && m_level > 0)
+    {
+      m_good_windows = 0;
+      set_level(m_level - 1, "headroom recovered");
+    }
+    return;
+  }
+  m_good_windows = 0;
+}
+
+void QualityController::set_level(int level, const char *reason)
+{
+  const auto &skip = LEVELS[level];
+  SPDLOG_INFO(
+      "decode quality level {} -> {} ({}): skip_loop_filter {}, skip_idct {}, "
+      "skip_frame {}",
+      m_level,
+      level,
+      reason,
+      static_cast<int>(skip.loop_filter),
+      static_cast<int>(skip.idct),
+      static_cast<int>(skip.frame));
+  m_level = level;
+  m_decoder->set_degradation(skip);
+  m_transitions->add();
+  m_level_gauge->set(level);
+}
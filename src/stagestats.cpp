@@ -0,0 +1,55 @@
+#include "stagestats.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#include <time.h>
+#endif
+
+std::chrono::nanoseconds StageStats::thread_cpu_time()
+{
+#ifdef _WIN32
+  FILETIME creation, exit, kernel, user;
+  if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+  {
+    return std::chrono::nanoseconds(0);
+  }
+  const auto to_100ns = [](const FILETIME &t)
+  { return (static_cast<int64_t>(t.dwHighDateTime) << 32) | t.dwLowDateTime; };
+  return std::chrono::nanoseconds((to_100ns(kernel) + to_100ns(user)) * 100);
+#else
+  timespec ts{};
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+  {
+    return std::chrono::nanoseconds(0);
+  }
+  return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+#endif
+}
+
+std::chrono::nanoseconds StageStats::process_cpu_time()
+{
+#ifdef _WIN32
+  FILETIME creation, exit, kernel, user;
+  if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+  {
+    return std::chrono::nanoseconds(0);
+  }
+  const auto to_100ns = [](const FILETIME &t)
+  { return (static_cast<int64_t>(t.dwHighDateTime) << 32) | t.dwLowDateTime; };
+  return std::chrono::nanoseconds((to_100ns(kernel) + to_100ns(user)) * 100);
+#else
+  rusage usage{};
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+  {
+    return std::chrono::nanoseconds(0);
+  }
+  const auto to_ns = [](const timeval &t)
+  {
+    return std::chrono::seconds(t.tv_sec) +
+           std::chrono::microseconds(t.tv_usec);
+  };
+  return to_ns(usage.ru_utime) + to_ns(usage.ru_stime);
+#endif
+}
@@ -0,0 +1,66 @@
+#include "startup.h"
+
+#include <algorithm>
+
+#include <spdlog/fmt/chrono.h>
+#include <spdlog/spdlog.h>
+
+#include "metrics.h"
+
+StartupTimeline &StartupTimeline::instance()
+{
+  static StartupTimeline timeline;
+  return timeline;
+}
+
+void StartupTimeline::start(clock::time_point begin)
+{
+  lock_guard locker(m_lock);
+  m_begin = begin;
+  m_phases.clear();
+}
+
+void StartupTimeline::mark(const std::string &phase, clock::time_point t)
+{
+  std::chrono::nanoseconds elapsed;
+  {
+    lock_guard locker(m_lock);
+    if (std::any_of(m_phases.begin(),
+                    m_phases.end(),
+                    [&](const auto &p) { return p.first == phase; }))
+    {
+      return;
+    }
+    elapsed = t - m_begin;
+    m_phases.emplace_back(phase, elapsed);
+  }
+
+  const auto us =
+      std::chrono::duration_cast<std::chrono::microseconds>(elapsed);
+  Metrics::instance().gauge("startup_" + phase + "_us").set(us.count());
+  SPDLOG_INFO("startup: {} at {}", phase, us);
+}
+
+void StartupTimeline::log() const
+{
+  auto phases = [this]()
+  {
+    lock_guard locker(m_lock);
+    return m_phases;
+  }();
+  std::stable_sort(phases.begin(),
+                   phases.end(),
+                   [](const auto &a, const auto &b)
+                   { return a.second < b.second; });
+
+  std::chrono::nanoseconds prev{};
+  for (const auto &[phase, elapsed] : phases)
+  {
+    SPDLOG_INFO(
+        "  {:<24} {:>10} (+{})",
+        phase,
+        std::chrono::duration_cast<std::chrono::microseconds>(elapsed),
+        std::chrono::duration_cast<std::chrono::microseconds>(elapsed - prev));
+    prev = elapsed;
+  }
+}
@@ -1,33 +1,132 @@
 #include "videooutput.h"
 
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+#include <spdlog/fmt/chrono.h>
 #include <spdlog/fmt/std.h>
 #include <spdlog/spdlog.h>
 
 #include "ffmpeg_utils.h"
+#include "startup.h"
 
 namespace
 {
-constexpr auto MS_PER_S = std::chrono::milliseconds::period::den /
-                          std::chrono::milliseconds::period::num;
 constexpr auto REST_DURATION = std::chrono::milliseconds(10);
+// 队列为空时的最长等待，正常情况下由新帧事件提前唤醒
+constexpr auto IDLE_DURATION = std::chrono::milliseconds(100);
+// 距离目标时刻不足该值时不再等SDL事件，直接用高精度定时器睡眠
+constexpr auto PRECISE_WINDOW = std::chrono::milliseconds(2);
+constexpr auto SEEK_STEP = std::chrono::seconds(10);
+constexpr auto SEEK_STEP_LARGE = std::chrono::seconds(60);
+// 多路时与最早到期的一路相差不足该值的几路合并为一次present
+constexpr auto PRESENT_BATCH = std::chrono::milliseconds(4);
+// 多路网格的画布尺寸
+constexpr int GRID_WIDTH = 1920;
+constexpr int GRID_HEIGHT = 1080;
+// 倒放时相邻两帧的显示间隔，pts间隔异常时限制在此范围内
+constexpr auto MIN_REVERSE_INTERVAL = std::chrono::milliseconds(1);
+constexpr auto MAX_REVERSE_INTERVAL = std::chrono::milliseconds(200);
+
+// 帧上带有time_base时以帧为准，切换视频流之后可能与初始化时的不同
+AVRational frame_time_base(const AVFrame &frame, AVRational fallback)
+{
+  return frame.time_base.num ? frame.time_base : fallback;
+}
 }  // namespace
 
 VideoOutput::VideoOutput(std::shared_ptr<AVFrameQueue> queue,
                          std::shared_ptr<AVSync> avsync)
-    : m_queue(queue)
-    , m_avsync(avsync)
+    : m_render_time(&Metrics::instance().histogram("video_render_ns"))
+    , m_av_offset(&Metrics::instance().gauge("av_offset_us"))
+    , m_frames(&Metrics::instance().counter("video_frames_rendered"))
+    , m_dropped(&Metrics::instance().counter("video_frames_dropped"))
+    , m_present_error(&Metrics::instance().histogram("video_present_error_ns"))
+    , m_present_offset(&Metrics::instance().gauge("video_present_offset_us"))
+    , m_seek_time(&Metrics::instance().histogram("seek_to_first_frame_ns"))
+    , m_step_time(&Metrics::instance().histogram("video_step_ns"))
+    , m_scrub_time(&Metrics::instance().histogram("video_scrub_ns"))
+{
+  m_tiles.emplace_back();
+  m_tiles.back().queue = std::move(queue);
+  m_tiles.back().avsync = std::move(avsync);
+}
+
+void VideoOutput::add_stream(
+    std::shared_ptr<AVFrameQueue> queue,
+    std::shared_ptr<AVSync> avsync,
+    int width,
+    int height,
+    AVRational time_base,
+    std::function<void(std::chrono::nanoseconds)> seek_handler)
 {
+  auto &tile = m_tiles.emplace_back();
+  tile.queue = std::move(queue);
+  tile.avsync = std::move(avsync);
+  tile.width = width;
+  tile.height = height;
+  tile.time_base = time_base;
+  tile.seek_handler = std::move(seek_handler);
+}
+
+std::pair<int, int> VideoOutput::grid_cell_size(size_t count)
+{
+  const auto cols =
+      std::max(1, static_cast<int>(std::ceil(std::sqrt(count))));
+  const auto rows = static_cast<int>((count + cols - 1) / cols);
+  // 宽高取偶数，YUV420P的色度平面是半尺寸
+  return {GRID_WIDTH / cols & ~1, GRID_HEIGHT / std::max(rows, 1) & ~1};
+}
+
+void VideoOutput::layout(int &window_width, int &window_height)
+{
+  if (m_tiles.size() == 1)
+  {  // 单路：窗口即视频尺寸
+    auto &tile = m_tiles.front();
+    tile.rect = {0, 0, tile.width, tile.height};
+    window_width = tile.width;
+    window_height = tile.height;
+    return;
+  }
+
+  const auto [cell_width, cell_height] = grid_cell_size(m_tiles.size());
+  const auto cols = GRID_WIDTH / cell_width;
+  const auto rows = static_cast<int>((m_tiles.size() + cols - 1) / cols);
+  window_width = cols * cell_width;
+  window_height = rows * cell_height;
+  for (size_t i = 0; i < m_tiles.size(); i++)
+  {
+    // 保持宽高比放进格子，居中留黑边
+    auto &tile = m_tiles[i];
+    const auto scale = std::min(1.0 * cell_width / tile.width,
+                                1.0 * cell_height / tile.height);
+    tile.rect.w = static_cast<int>(tile.width * scale);
+    tile.rect.h = static_cast<int>(tile.height * scale);
+    tile.rect.x = static_cast<int>(i % cols) * cell_width +
+                  (cell_width - tile.rect.w) / 2;
+    tile.rect.y = static_cast<int>(i / cols) * cell_height +
+                  (cell_height - tile.rect.h) / 2;
+  }
 }
 
 int VideoOutput::init(int width, int height, AVRational time_base)
 {
-  m_width = width;
-  m_height = height;
-  m_time_base = time_base;
+  m_tiles.front().width = width;
+  m_tiles.front().height = height;
+  m_tiles.front().time_base = time_base;
 
-  SPDLOG_INFO("wh: {} x {}", width, height);
+  int window_width = 0;
+  int window_height = 0;
+  layout(window_width, window_height);
+  SPDLOG_INFO("wh: {} x {}, {} streams",
+              window_width,
+              window_height,
+              m_tiles.size());
 
-  if (const auto ret = SDL_Init(SDL_INIT_VIDEO); ret < 0)
+  if (const auto ret =
+          SDL_WasInit(SDL_INIT_VIDEO) ? 0 : SDL_Init(SDL_INIT_VIDEO);
+      ret < 0)
   {
     SPDLOG_ERROR("SDL_Init(SDL_INIT_VIDEO) error: {}", SDL_GetError());
     return ret;
@@ -36,8 +135,8 @@ int VideoOutput::init(int width, int height, AVRational time_base)
   m_window = SDL_CreateWindow("player",
                               SDL_WINDOWPOS_UNDEFINED,
                               SDL_WINDOWPOS_UNDEFINED,
-                              width,
-                              height,
+                              window_width,
+                              window_height,
                               SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE);
   if (!m_window)
   {
@@ -52,23 +151,37 @@ int VideoOutput::init(int width, int height, AVRational time_base)
     return -1;
   }
 
-  m_texture = SDL_CreateTexture(m_renderer,
-                                SDL_PIXELFORMAT_IYUV,
-                                SDL_TEXTUREACCESS_STREAMING,
-                                width,
-                                height);
-  if (!m_texture)
+  for (auto &tile : m_tiles)
   {
-    SPDLOG_ERROR("SDL_CreateTexture() error: {}", SDL_GetError());
-    return -1;
+    tile.texture = SDL_CreateTexture(m_renderer,
+                                     SDL_PIXELFORMAT_IYUV,
+                                     SDL_TEXTUREACCESS_STREAMING,
+                                     tile.width,
+                                     tile.height);
+    if (!tile.texture)
+    {
+      SPDLOG_ERROR("SDL_CreateTexture() error: {}", SDL_GetError());
+      return -1;
+    }
   }
 
-  m_yuv_buf_size = width * height * 3 / 2;
-  m_yuv_buf = (uint8_t *)malloc(m_yuv_buf_size);
-  if (!m_yuv_buf)
+  // 新帧到达时投递一个SDL事件，唤醒等待在SDL_WaitEventTimeout上的渲染循环
+  if (const auto type = SDL_RegisterEvents(1); type != (Uint32)-1)
   {
-    SPDLOG_ERROR("malloc({}) error: {}", m_yuv_buf_size, SDL_GetError());
-    return -1;
+    m_wakeup = [type]()
+    {
+      SDL_Event event{};
+      event.type = type;
+      SDL_PushEvent(&event);
+    };
+    for (auto &tile : m_tiles)
+    {
+      tile.queue->set_not_empty_callback(m_wakeup);
+    }
+  }
+  else
+  {
+    SPDLOG_WARN("SDL_RegisterEvents() error: {}", SDL_GetError());
   }
 
   return 0;
@@ -76,81 +189,569 @@ int VideoOutput::init(int width, int height, AVRational time_base)
 
 void VideoOutput::deinit()
 {
-  SDL_DestroyTexture(m_texture);
+  if (m_gop_cache)
+  {
+    m_gop_cache->set_ready_callback({});
+  }
+  for (auto &tile : m_tiles)
+  {
+    tile.queue->set_not_empty_callback({});
+    SDL_DestroyTexture(tile.texture);
+    tile.texture = nullptr;
+  }
   SDL_DestroyRenderer(m_renderer);
   SDL_DestroyWindow(m_window);
 }
 
 void VideoOutput::main_loop()
 {
+  // 多路时把即将到期的几路合并到同一次present，单路时只刷新已到期的帧
+  const auto batch = m_tiles.size() > 1 ? PRESENT_BATCH : AVSync::duration{};
+  std::vector<std::optional<std::chrono::nanoseconds>> durations(
+      m_tiles.size());
   int frames = 0;
+  if (m_gop_cache)
+  {  // GOP缓存在后台解码完成时同样唤醒渲染循环
+    m_gop_cache->set_ready_callback(m_wakeup);
+  }
   while (true)
   {
-    if (const auto &event_opt = pop_user_event();
-        event_opt && handle_user_event(*event_opt))
+    // 先处理已经到达的事件，画面持续落后时也不会饿死用户操作
+    if (handle_pending_events())
     {
       SPDLOG_INFO("break main loop");
       break;
     }
 
-    const auto &duration_opt = get_next_refresh_duration();
-    if (!duration_opt)
+    if (m_mode != Mode::Play)
+    {  // 画面来自GOP缓存，倒放时按帧间隔刷新，暂停时只等待按键
+      if (m_retry && !m_gop_cache->pending())
+      {  // 未命中的GOP已经解码完成，重做步进/拖动
+        const auto retry = std::move(m_retry);
+        m_retry = {};
+        retry();
+      }
+      const auto deadline = m_mode == Mode::Reverse
+                                ? refresh_reverse()
+                                : std::chrono::steady_clock::now() +
+                                      IDLE_DURATION;
+      if (wait_until(deadline))
+      {
+        SPDLOG_INFO("break main loop");
+        break;
+      }
+      continue;
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    bool due = false;
+    bool dropped = false;
+    for (size_t i = 0; i < m_tiles.size(); i++)
     {
-      SPDLOG_TRACE("get_next_refresh_duration: {}, take a rest: {}",
-                   duration_opt,
-                   REST_DURATION);
-      std::this_thread::sleep_for(REST_DURATION);
+      durations[i] = get_next_refresh_duration(m_tiles[i]);
+      if (!durations[i] || durations[i]->count() > 0)
+      {
+        continue;
+      }
+      if (should_drop(m_tiles[i], -*durations[i]))
+      {  // 已经来不及显示，并且后面还有帧可以显示，直接丢弃，不上传纹理
+        SPDLOG_DEBUG("drop late frame: {}", -*durations[i]);
+        if (m_quality && i == 0)
+        {
+          m_quality->record(-*durations[i], true, m_tiles[i].queue->size());
+        }
+        m_tiles[i].queue->pop();
+        m_dropped->add();
+        dropped = true;
+        continue;
+      }
+      due = true;
+    }
+    if (dropped)
+    {  // 重新计算丢帧之后的下一帧
       continue;
     }
 
-    if (const auto &duration = *duration_opt; duration.count() > 0)
-    {  // 距离下一帧画面还有duration时长，休息至多REST_DURATION(不能影响用户操作)
-      auto d = std::min(duration, REST_DURATION);
-      SPDLOG_TRACE(
-          "get_next_refresh_duration: {}, take a rest: {}", duration_opt, d);
-      std::this_thread::sleep_for(d);
+    if (!due)
+    {
+      // 没有帧时等到新帧或事件；有帧但音频还没开始时定期检查；
+      // 否则睡到最早的目标显示时刻
+      std::optional<std::chrono::nanoseconds> timeout;
+      bool waiting = false;
+      for (size_t i = 0; i < m_tiles.size(); i++)
+      {
+        if (durations[i])
+        {
+          timeout = timeout ? std::min(*timeout, *durations[i]) : *durations[i];
+        }
+        else if (m_tiles[i].queue->peek())
+        {
+          waiting = true;
+        }
+      }
+      if (!timeout)
+      {
+        timeout = waiting ? REST_DURATION : IDLE_DURATION;
+      }
+      else if (waiting)
+      {
+        timeout = std::min<std::chrono::nanoseconds>(*timeout, REST_DURATION);
+      }
+      SPDLOG_TRACE("wait: {}", *timeout);
+      if (wait_until(now + *timeout))
+      {
+        SPDLOG_INFO("break main loop");
+        break;
+      }
       continue;
     }
 
     // 刷新画面
-    SPDLOG_DEBUG("get_next_refresh_duration: {}, refreshing", duration_opt);
-    refresh_video();
-    frames++;
+    ScopedTimer timer(*m_render_time);
+    auto target = std::chrono::steady_clock::time_point::max();
+    for (size_t i = 0; i < m_tiles.size(); i++)
+    {
+      if (durations[i] && *durations[i] <= batch)
+      {
+        SPDLOG_DEBUG("get_next_refresh_duration: {}, refreshing",
+                     durations[i]);
+        if (m_quality && i == 0)
+        {
+          m_quality->record(
+              -*durations[i], false, m_tiles[i].queue->size());
+        }
+        refresh_video(m_tiles[i]);
+        target = std::min(target, now + *durations[i]);
+        frames++;
+      }
+    }
+    present();
+
+    // 实际显示时刻与目标时刻的偏差，正值表示晚于目标
+    const auto error = std::chrono::steady_clock::now() - target;
+    m_present_error->record(error < error.zero() ? -error : error);
+    m_present_offset->set(
+        std::chrono::duration_cast<std::chrono::microseconds>(error).count());
+    if (m_playback_rate)
+    {
+      m_playback_rate->update_metrics();
+    }
   }
-  SPDLOG_INFO("played {} frames", frames);
+  SPDLOG_INFO("played {} frames, dropped {} late frames",
+              frames,
+              m_dropped->value());
 }
 
-std::optional<SDL_Event> VideoOutput::pop_user_event()
+void VideoOutput::set_drop_threshold(std::chrono::milliseconds threshold)
 {
-  SDL_PumpEvents();
-  if (!SDL_HasEvents(SDL_FIRSTEVENT, SDL_LASTEVENT))
+  m_drop_threshold = threshold;
+}
+
+bool VideoOutput::should_drop(const Tile &tile,
+                              std::chrono::nanoseconds lateness) const
+{
+  // 视频为主时钟时视频本身决定进度，不存在落后
+  return m_drop_threshold.count() > 0 &&
+         tile.avsync->master() != AVSync::Master::Video &&
+         lateness > m_drop_threshold && tile.queue->size() > 1;
+}
+
+void VideoOutput::set_seek_handler(
+    std::function<void(std::chrono::nanoseconds)> handler)
+{
+  m_tiles.front().seek_handler = std::move(handler);
+}
+
+void VideoOutput::seek(std::chrono::nanoseconds target)
+{
+  for (auto &tile : m_tiles)
   {
-    SPDLOG_TRACE("SDL_PeepEvents no user event");
-    return std::nullopt;
+    seek(tile, target);
+  }
+}
+
+void VideoOutput::seek(Tile &tile, std::chrono::nanoseconds target)
+{
+  if (!tile.seek_handler)
+  {
+    SPDLOG_WARN("seek to {} ignored, no seek handler", target);
+    return;
+  }
+
+  target = std::max(target, std::chrono::nanoseconds::zero());
+  SPDLOG_INFO("seek to {}", target);
+  tile.seek_begin = std::chrono::steady_clock::now();
+  tile.seek_generation = tile.generation;
+  tile.seek_handler(target);
+}
+
+void VideoOutput::seek_relative(std::chrono::nanoseconds offset)
+{
+  // 步进/倒放时主时钟没有跟随画面，以当前显示的帧为准
+  const auto paused = m_mode != Mode::Play;
+  set_mode(Mode::Play);
+  // 每一路按自己的时钟跳转相同的偏移
+  for (auto &tile : m_tiles)
+  {
+    const auto now_pts =
+        paused ? tile.last_pts
+               : tile.avsync->get_clock(tile.generation).value_or(tile.last_pts);
+    seek(tile, now_pts + offset);
+  }
+}
+
+void VideoOutput::set_gop_cache(std::shared_ptr<GopCache> cache)
+{
+  m_gop_cache = std::move(cache);
+}
+
+void VideoOutput::set_frame_cache(std::shared_ptr<FrameCache> cache)
+{
+  m_frame_cache = std::move(cache);
+}
+
+void VideoOutput::set_playback_rate(std::shared_ptr<PlaybackRate> rate)
+{
+  m_playback_rate = std::move(rate);
+}
+
+void VideoOutput::set_quality_controller(
+    std::shared_ptr<QualityController> controller)
+{
+  m_quality = std::move(controller);
+}
+
+void VideoOutput::set_track_handler(
+    std::function<void(AVMediaType, std::chrono::nanoseconds)> handler)
+{
+  m_track_handler = std::move(handler);
+}
+
+void VideoOutput::set_pause_handler(std::function<void(bool)> handler)
+{
+  m_pause_handler = std::move(handler);
+}
+
+void VideoOutput::set_mode(Mode mode)
+{
+  if (mode != m_mode)
+  {  // 换了模式，不再显示等待中的缓存帧
+    m_retry = {};
+  }
+  const auto playing = m_mode == Mode::Play;
+  m_mode = mode;
+  if (m_pause_handler && playing != (mode == Mode::Play))
+  {
+    m_pause_handler(mode != Mode::Play);
+  }
+}
+
+void VideoOutput::switch_track(AVMediaType type)
+{
+  if (!m_track_handler || m_tiles.size() > 1 || m_mode != Mode::Play)
+  {
+    return;
+  }
+  // 切换后从当前位置重新seek，和seek一样计时到新位置的第一帧
+  auto &tile = m_tiles.front();
+  const auto position =
+      tile.avsync->get_clock(tile.generation).value_or(tile.last_pts);
+  SPDLOG_INFO(
+      "switch {} track at {}", av_get_media_type_string(type), position);
+  tile.seek_begin = std::chrono::steady_clock::now();
+  tile.seek_generation = tile.generation;
+  if (type == AVMEDIA_TYPE_VIDEO && m_frame_cache)
+  {  // 缓存按(路, pts)索引，不区分流，旧流的帧不能用于步进和拖动
+    m_frame_cache->clear();
+    tile.track_switched = true;
+  }
+  m_track_handler(type, position);
+}
+
+void VideoOutput::change_rate(int direction)
+{
+  if (!m_playback_rate || m_tiles.size() > 1)
+  {
+    return;
+  }
+  if (direction > 0)
+  {
+    m_playback_rate->faster();
+  }
+  else if (direction < 0)
+  {
+    m_playback_rate->slower();
+  }
+  else
+  {
+    m_playback_rate->set(1.0);
+  }
+}
+
+bool VideoOutput::show_cached(Tile &tile, bool forward)
+{
+  if (tile.last_ts == AV_NOPTS_VALUE)
+  {
+    return false;
   }
 
+  // 先查已解码帧缓存：相邻帧是当前帧结束时刻/开始前一刻所在的帧
+  AVFramePtr frame;
+  if (m_frame_cache && (!forward || tile.last_duration > 0))
+  {
+    frame = m_frame_cache->find(
+        index(tile),
+        forward ? tile.last_ts + tile.last_duration : tile.last_ts - 1);
+  }
+  if (!frame && m_gop_cache)
+  {
+    frame = forward ? m_gop_cache->frame_after(tile.last_ts)
+                    : m_gop_cache->frame_before(tile.last_ts);
+  }
+  if (!frame)
+  {
+    return false;
+  }
+  upload(tile, *frame);
+  present();
+  return true;
+}
+
+void VideoOutput::step(bool forward)
+{
+  if ((!m_gop_cache && !m_frame_cache) || m_tiles.size() > 1)
+  {
+    return;
+  }
+
+  // 等待后台解码之后的重试从第一次按键开始计时
+  const auto begin =
+      m_retry_begin.value_or(std::chrono::steady_clock::now());
+  m_retry = {};
+  m_retry_begin.reset();
+  set_mode(Mode::Step);
+  auto &tile = m_tiles.front();
+  if (!show_cached(tile, forward))
+  {
+    if (m_gop_cache && m_gop_cache->pending())
+    {  // 不阻塞事件循环，解码完成唤醒后重试
+      m_retry = [this, forward, begin]()
+      {
+        m_retry_begin = begin;
+        step(forward);
+      };
+      return;
+    }
+    SPDLOG_INFO("step {}: no frame", forward ? "forward" : "backward");
+    return;
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - begin;
+  m_step_time->record(elapsed);
+  SPDLOG_INFO("step {} to {}: {}",
+              forward ? "forward" : "backward",
+              tile.last_pts,
+              std::chrono::duration_cast<std::chrono::microseconds>(elapsed));
+}
+
+void VideoOutput::toggle_reverse()
+{
+  if (!m_gop_cache || m_tiles.size() > 1)
+  {
+    return;
+  }
+  if (m_mode == Mode::Reverse)
+  {
+    set_mode(Mode::Step);
+    return;
+  }
+  SPDLOG_INFO("reverse playback from {}", m_tiles.front().last_pts);
+  set_mode(Mode::Reverse);
+  m_reverse_next = std::chrono::steady_clock::now();
+}
+
+std::chrono::steady_clock::time_point VideoOutput::refresh_reverse()
+{
+  const auto now = std::chrono::steady_clock::now();
+  if (now < m_reverse_next)
+  {
+    return m_reverse_next;
+  }
+
+  auto &tile = m_tiles.front();
+  const auto prev_pts = tile.last_pts;
+  const auto begin = now;
+  if (!show_cached(tile, false))
+  {
+    if (m_gop_cache->pending())
+    {  // 前一个GOP还在后台解码，完成时唤醒渲染循环再取
+      return now + IDLE_DURATION;
+    }
+    // 到达文件头
+    SPDLOG_INFO("reverse playback reached {}", tile.last_pts);
+    set_mode(Mode::Step);
+    return now + IDLE_DURATION;
+  }
+  m_step_time->record(std::chrono::steady_clock::now() - begin);
+
+  // 按相邻两帧的pts间隔倒着走，落后时从当前时刻重新计时
+  const auto interval = std::clamp<std::chrono::nanoseconds>(
+      prev_pts - tile.last_pts, MIN_REVERSE_INTERVAL, MAX_REVERSE_INTERVAL);
+  m_reverse_next = std::max(m_reverse_next + interval, now);
+  return m_reverse_next;
+}
+
+void VideoOutput::toggle_pause()
+{
+  if (m_mode == Mode::Play)
+  {
+    if (m_tiles.size() == 1)
+    {
+      SPDLOG_INFO("pause at {}", m_tiles.front().last_pts);
+      set_mode(Mode::Step);
+    }
+    return;
+  }
+  set_mode(Mode::Play);
+  auto &tile = m_tiles.front();
+  SPDLOG_INFO("resume playback at {}", tile.last_pts);
+  seek(tile, tile.last_pts);
+}
+
+void VideoOutput::seek_or_scrub(std::chrono::nanoseconds offset)
+{
+  if (m_mode == Mode::Play)
+  {
+    seek_relative(offset);
+    return;
+  }
+
+  // 暂停时只移动画面，不恢复播放：先查已解码帧缓存，再让GOP缓存解码
+  const auto begin =
+      m_retry_begin.value_or(std::chrono::steady_clock::now());
+  m_retry = {};
+  m_retry_begin.reset();
+  auto &tile = m_tiles.front();
+  const auto target =
+      std::max(tile.last_pts + offset, std::chrono::nanoseconds::zero());
+  const auto ts =
+      av_rescale_q(target.count(), AVRational{1, 1000000000}, tile.time_base);
+  AVFramePtr frame;
+  if (m_frame_cache)
+  {
+    frame = m_frame_cache->find(index(tile), ts);
+  }
+  if (!frame && m_gop_cache)
+  {
+    frame = m_gop_cache->frame_before(ts + 1);
+    if (!frame && m_gop_cache->pending())
+    {  // 不阻塞事件循环，解码完成唤醒后重试
+      m_retry = [this, offset, begin]()
+      {
+        m_retry_begin = begin;
+        seek_or_scrub(offset);
+      };
+      return;
+    }
+  }
+  if (!frame)
+  {  // 没有可用的缓存，恢复播放并seek
+    seek_relative(offset);
+    return;
+  }
+
+  set_mode(Mode::Step);
+  upload(tile, *frame);
+  present();
+  const auto elapsed = std::chrono::steady_clock::now() - begin;
+  m_scrub_time->record(elapsed);
+  SPDLOG_INFO("scrub to {}: {}",
+              tile.last_pts,
+              std::chrono::duration_cast<std::chrono::microseconds>(elapsed));
+}
+
+bool VideoOutput::handle_pending_events()
+{
   SDL_Event event;
-  if (const auto ret = SDL_PeepEvents(
-          &event, 1, SDL_GETEVENT, SDL_FIRSTEVENT, SDL_LASTEVENT);
-      ret < 0)
+  while (SDL_PollEvent(&event))
   {
-    SPDLOG_ERROR("SDL_PeepEvents error: {}", SDL_GetError());
-    return std::nullopt;
+    if (handle_user_event(event))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool VideoOutput::wait_until(std::chrono::steady_clock::time_point deadline)
+{
+  // SDL_WaitEventTimeout只有毫秒精度并且唤醒有抖动，
+  // 留出PRECISE_WINDOW交给高精度定时器睡到deadline
+  const auto coarse = std::chrono::floor<std::chrono::milliseconds>(
+      deadline - PRECISE_WINDOW - std::chrono::steady_clock::now());
+  if (coarse.count() > 0)
+  {
+    SDL_Event event;
+    if (SDL_WaitEventTimeout(&event, static_cast<int>(coarse.count())))
+    {  // 新帧到达或用户事件，由调用者重新计算
+      return handle_user_event(event);
+    }
   }
 
-  SPDLOG_INFO("SDL_PeepEvents 1 user event");
-  return event;
+  std::this_thread::sleep_until(deadline);
+  return false;
 }
 
-bool VideoOutput::handle_user_event(const SDL_Event &event) const
+bool VideoOutput::handle_user_event(const SDL_Event &event)
 {
   switch (event.type)
   {
   case SDL_KEYDOWN:
-    if (event.key.keysym.sym == SDLK_ESCAPE)
+    switch (event.key.keysym.sym)
     {
+    case SDLK_ESCAPE:
       SPDLOG_INFO("ESC key down, quit");
       return true;
+    case SDLK_LEFT:
+      seek_or_scrub(-SEEK_STEP);
+      break;
+    case SDLK_RIGHT:
+      seek_or_scrub(SEEK_STEP);
+      break;
+    case SDLK_DOWN:
+      seek_or_scrub(-SEEK_STEP_LARGE);
+      break;
+    case SDLK_UP:
+      seek_or_scrub(SEEK_STEP_LARGE);
+      break;
+    case SDLK_PERIOD:
+      step(true);
+      break;
+    case SDLK_COMMA:
+      step(false);
+      break;
+    case SDLK_r:
+      toggle_reverse();
+      break;
+    case SDLK_SPACE:
+      toggle_pause();
+      break;
+    case SDLK_RIGHTBRACKET:
+      change_rate(1);
+      break;
+    case SDLK_LEFTBRACKET:
+      change_rate(-1);
+      break;
+    case SDLK_BACKSPACE:
+      change_rate(0);
+      break;
+    case SDLK_a:
+      switch_track(AVMEDIA_TYPE_AUDIO);
+      break;
+    case SDLK_v:
+      switch_track(AVMEDIA_TYPE_VIDEO);
+      break;
+    default:
+      break;
     }
     break;
   case SDL_QUIT:
@@ -162,49 +763,129 @@ bool VideoOutput::handle_user_event(const SDL_Event &event) const
   return false;
 }
 
-std::optional<std::chrono::milliseconds>
-VideoOutput::get_next_refresh_duration() const
+std::optional<std::chrono::nanoseconds>
+VideoOutput::get_next_refresh_duration(Tile &tile)
 {
-  if (m_queue->empty())
+  const auto frame_ptr = tile.queue->peek();
+  if (tile.queue->generation() != tile.generation)
+  {  // seek之后旧的时钟不再有效，按新一代的数据重新同步
+    tile.generation = tile.queue->generation();
+    SPDLOG_INFO("video output flushed, generation {}", tile.generation);
+    if (tile.track_switched && m_frame_cache)
+    {
+      m_frame_cache->clear();
+    }
+    tile.track_switched = false;
+  }
+  if (!frame_ptr)
   {
     return std::nullopt;
   }
 
-  auto &frame = m_queue->front();
+  const auto &frame = *frame_ptr;
   assert(frame);
 
-  auto next_frame_pts = std::chrono::milliseconds(
-      MS_PER_S * frame->pts * m_time_base.num / m_time_base.den);
-  const auto now_pts = std::chrono::duration_cast<std::chrono::milliseconds>(
-      m_avsync->get_clock());
+  const auto next_frame_pts =
+      AVSync::to_duration(frame->best_effort_timestamp,
+                          frame_time_base(*frame, tile.time_base));
+  const auto now_pts = tile.avsync->get_clock(tile.generation);
+  if (!now_pts)
+  {
+    if (tile.avsync->master() == AVSync::Master::Audio)
+    {  // 等待音频开始播放
+      return std::nullopt;
+    }
+    // 视频/外部时钟从第一帧开始走
+    tile.avsync->master_clock().set(next_frame_pts, tile.generation);
+    return AVSync::duration::zero();
+  }
 
-  return next_frame_pts - now_pts;
+  return next_frame_pts - *now_pts;
 }
 
-void VideoOutput::refresh_video()
+void VideoOutput::refresh_video(Tile &tile)
 {
-  auto frame_opt = m_queue->pop();
+  auto frame_opt = tile.queue->pop();
   assert(frame_opt);
-  auto frame = *frame_opt;
+  auto frame = std::move(*frame_opt);
   assert(frame);
 
-  auto pts = std::chrono::milliseconds(MS_PER_S * frame->pts * m_time_base.num /
-                                       m_time_base.den);
+  const auto pts =
+      AVSync::to_duration(frame->best_effort_timestamp,
+                          frame_time_base(*frame, tile.time_base));
   SPDLOG_DEBUG("video pts: {}", pts);
 
-  m_rect.x = 0;
-  m_rect.y = 0;
-  m_rect.w = m_width;
-  m_rect.h = m_height;
-  SDL_UpdateYUVTexture(m_texture,
-                       &m_rect,
-                       frame->data[0],
-                       frame->linesize[0],
-                       frame->data[1],
-                       frame->linesize[1],
-                       frame->data[2],
-                       frame->linesize[2]);
+  // 正值表示视频落后于主时钟
+  if (const auto now_pts = tile.avsync->get_clock(tile.generation))
+  {
+    m_av_offset->set(
+        std::chrono::duration_cast<std::chrono::microseconds>(*now_pts - pts)
+            .count());
+  }
+  tile.avsync->video_clock().set(pts, tile.generation);
+  m_frames->add();
+  upload(tile, *frame);
+}
+
+void VideoOutput::upload(Tile &tile, const AVFrame &frame)
+{
+  // last_ts/last_duration以及步进、拖动时查缓存的时间戳都按当前帧的time_base
+  tile.time_base = frame_time_base(frame, tile.time_base);
+  tile.last_pts =
+      AVSync::to_duration(frame.best_effort_timestamp, tile.time_base);
+  tile.last_ts = frame.best_effort_timestamp;
+  tile.last_duration = frame.duration;
+  if (m_frame_cache)
+  {  // 只增加缓冲的引用，不拷贝
+    m_frame_cache->insert(index(tile), frame);
+  }
+
+  // 帧已由ConvertThread转换为纹理的尺寸和YUV420P格式，这里只做上传
+  SDL_UpdateYUVTexture(tile.texture,
+                       nullptr,
+                       frame.data[0],
+                       frame.linesize[0],
+                       frame.data[1],
+                       frame.linesize[1],
+                       frame.data[2],
+                       frame.linesize[2]);
+  tile.has_frame = true;
+  tile.updated = true;
+}
+
+void VideoOutput::present()
+{
   SDL_RenderClear(m_renderer);
-  SDL_RenderCopy(m_renderer, m_texture, nullptr, &m_rect);
+  for (const auto &tile : m_tiles)
+  {
+    if (tile.has_frame)
+    {
+      SDL_RenderCopy(m_renderer, tile.texture, nullptr, &tile.rect);
+    }
+  }
   SDL_RenderPresent(m_renderer);
+  const auto now = std::chrono::steady_clock::now();
+
+  if (!m_presented)
+  {  // 起播的第一帧
+    m_presented = true;
+    StartupTimeline::instance().mark("first_video_present");
+    StartupTimeline::instance().log();
+  }
+
+  for (auto &tile : m_tiles)
+  {
+    if (tile.updated && tile.seek_begin &&
+        tile.generation != tile.seek_generation)
+    {  // seek之后新位置的第一帧
+      const auto elapsed = now - *tile.seek_begin;
+      m_seek_time->record(elapsed);
+      SPDLOG_INFO(
+          "seek to first frame: {}, pts {}",
+          std::chrono::duration_cast<std::chrono::microseconds>(elapsed),
+          tile.last_pts);
+      tile.seek_begin.reset();
+    }
+    tile.updated = false;
+  }
 }